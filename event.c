@@ -19,13 +19,28 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <string.h>
 
 static void DestroySelector(EventSelector *es);
-static void DestroyHandler(EventHandler *eh);
+static void DestroyHandler(EventSelector *es, EventHandler *eh);
+static void DrainPool(EventPool *pool);
 static void DoPendingChanges(EventSelector *es);
+static int LinkHandler(EventSelector *es, EventHandler *eh);
+static void UnlinkHandler(EventSelector *es, EventHandler *eh);
+static void MarkDeleted(EventSelector *es, EventHandler *eh);
+static int TimerHeapInsert(EventSelector *es, EventHandler *eh);
+static void TimerHeapRemove(EventSelector *es, EventHandler *eh);
+static int TimeUntilNextTimer(EventSelector *es, struct timeval *timeout);
+static EventHandler *PopExpiredTimer(EventSelector *es,
+				     struct timeval const *now);
+static void RearmTimeout(EventSelector *es, EventHandler *eh);
+#ifndef EVENT_USE_EPOLL
+static void RunExpiredTimers(EventSelector *es, EventHandler *timers);
+#endif
 
 #ifdef DEBUG_EVENT
-#ifndef EVENT_USE_POLL
+#if !defined(EVENT_USE_POLL) && !defined(EVENT_USE_EPOLL)
 static void print_select_sets(char const *tag,
 			      int maxfdp1, fd_set *rd, fd_set *wr);
 #endif
@@ -52,6 +67,617 @@ static int adjust_pollfds(int num) {
 }
 #endif
 
+#ifdef EVENT_USE_EPOLL
+#define EPOLL_INITIAL_EVENTS 64
+#define EPOLL_MAX_EVENTS 4096
+
+/**********************************************************************
+* %FUNCTION: epoll_grow_fd_table
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- descriptor which must fit in the table
+* %RETURNS:
+*  0 on success, -1 if out of memory
+* %DESCRIPTION:
+*  Makes sure es->fdTable has a slot for fd.
+***********************************************************************/
+static int
+epoll_grow_fd_table(EventSelector *es, int fd)
+{
+    EventFdEntry *table;
+    int new_size = es->fdTableSize * 2;
+    int i;
+
+    if (fd < es->fdTableSize) return 0;
+    if (new_size <= fd) new_size = fd + 1;
+    if (new_size < 64) new_size = 64;
+    table = realloc(es->fdTable, (size_t) new_size * sizeof(EventFdEntry));
+    if (!table) {
+	errno = ENOMEM;
+	return -1;
+    }
+    for (i=es->fdTableSize; i<new_size; i++) {
+	table[i].handlers = NULL;
+	table[i].events = 0;
+    }
+    es->fdTable = table;
+    es->fdTableSize = new_size;
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: epoll_update_fd
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- descriptor whose registration should be brought up-to-date
+*  force -- if non-zero, re-register even if the event mask is unchanged
+* %RETURNS:
+*  0 on success, -1 on failure (errno set by epoll_ctl)
+* %DESCRIPTION:
+*  Computes the union of events wanted by all live handlers on fd and
+*  tells the kernel about it with a single epoll_ctl call.  "force" is
+*  used when a handler is added, because the descriptor may have been
+*  closed and re-opened since we last registered it, in which case the
+*  kernel has silently dropped the old registration.
+***********************************************************************/
+static int
+epoll_update_fd(EventSelector *es, int fd, int force)
+{
+    EventFdEntry *entry = &es->fdTable[fd];
+    EventHandler *eh;
+    struct epoll_event ev;
+    unsigned int events = 0;
+    int r;
+
+    for (eh=entry->handlers; eh; eh=eh->fdNext) {
+	if (eh->flags & EVENT_FLAG_DELETED) continue;
+	if (eh->flags & EVENT_FLAG_READABLE) events |= EPOLLIN;
+	if (eh->flags & EVENT_FLAG_WRITEABLE) events |= EPOLLOUT;
+    }
+
+    if (events == entry->events && !force) return 0;
+
+    if (!events) {
+	if (entry->events) {
+	    /* May fail harmlessly if fd has already been closed */
+	    ev.events = 0;
+	    ev.data.fd = fd;
+	    epoll_ctl(es->epfd, EPOLL_CTL_DEL, fd, &ev);
+	    entry->events = 0;
+	    es->numRegistered--;
+	}
+	return 0;
+    }
+
+    ev.events = events;
+    ev.data.fd = fd;
+    if (entry->events) {
+	r = epoll_ctl(es->epfd, EPOLL_CTL_MOD, fd, &ev);
+	if (r < 0 && errno == ENOENT) {
+	    r = epoll_ctl(es->epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+    } else {
+	r = epoll_ctl(es->epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (r < 0 && errno == EEXIST) {
+	    r = epoll_ctl(es->epfd, EPOLL_CTL_MOD, fd, &ev);
+	}
+    }
+    if (r < 0) {
+	EVENT_DEBUG(("epoll_ctl(fd=%d, events=%u) failed: errno=%d\n", fd, events, errno));
+	return -1;
+    }
+    if (!entry->events) es->numRegistered++;
+    entry->events = events;
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: epoll_add_ready
+* %ARGUMENTS:
+*  es -- event selector
+*  eh -- handler which has an event pending
+*  flags -- EVENT_FLAG_* bits to deliver
+*  nready -- number of entries in es->ready; incremented if eh is added
+* %RETURNS:
+*  0 on success, -1 if the ready array could not be grown
+* %DESCRIPTION:
+*  Queues eh for dispatch in this iteration.  If we cannot grow the
+*  ready array, a descriptor event is simply delivered next time since
+*  descriptors are level-triggered; the caller must put an expired
+*  timer back on the heap.
+***********************************************************************/
+static int
+epoll_add_ready(EventSelector *es, EventHandler *eh, unsigned int flags,
+		int *nready)
+{
+    EventHandler **ready;
+    int new_size;
+
+    if (!eh->pollflags) {
+	if (*nready >= es->readySize) {
+	    new_size = es->readySize * 2;
+	    if (new_size < 64) new_size = 64;
+	    ready = realloc(es->ready, (size_t) new_size * sizeof(EventHandler *));
+	    if (!ready) return -1;
+	    es->ready = ready;
+	    es->readySize = new_size;
+	}
+	es->ready[(*nready)++] = eh;
+    }
+    eh->pollflags |= flags;
+    return 0;
+}
+#endif
+
+
+/**********************************************************************
+* %FUNCTION: PoolGet
+* %ARGUMENTS:
+*  pool -- a free list
+*  size -- size of objects kept in this pool
+* %RETURNS:
+*  A block of at least "size" bytes, or NULL if out of memory
+* %DESCRIPTION:
+*  Takes a block from the free list, falling back to malloc().
+***********************************************************************/
+static void *
+PoolGet(EventPool *pool, size_t size)
+{
+    EventPoolBlock *b = pool->free;
+
+    if (b) {
+	pool->free = b->next;
+	pool->numFree--;
+	pool->reused++;
+	return b;
+    }
+    b = malloc(size);
+    if (b) pool->allocated++;
+    return b;
+}
+
+/**********************************************************************
+* %FUNCTION: PoolPut
+* %ARGUMENTS:
+*  pool -- a free list
+*  ptr -- block previously returned by PoolGet on the same pool
+*  maxFree -- maximum number of blocks to keep cached
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Returns a block to the free list, or to malloc() if the list is full.
+***********************************************************************/
+static void
+PoolPut(EventPool *pool, void *ptr, int maxFree)
+{
+    EventPoolBlock *b = (EventPoolBlock *) ptr;
+
+    if (pool->numFree >= maxFree) {
+	free(ptr);
+	return;
+    }
+    b->next = pool->free;
+    pool->free = b;
+    pool->numFree++;
+}
+
+/**********************************************************************
+* %FUNCTION: DrainPool
+* %ARGUMENTS:
+*  pool -- a free list
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Frees every cached block.
+***********************************************************************/
+static void
+DrainPool(EventPool *pool)
+{
+    EventPoolBlock *b, *next;
+
+    for (b=pool->free; b; b=next) {
+	next = b->next;
+	free(b);
+    }
+    pool->free = NULL;
+    pool->numFree = 0;
+}
+
+/**********************************************************************
+* %FUNCTION: AllocHandler
+* %ARGUMENTS:
+*  es -- event selector
+* %RETURNS:
+*  An uninitialized EventHandler, or NULL if out of memory
+***********************************************************************/
+static EventHandler *
+AllocHandler(EventSelector *es)
+{
+    return (EventHandler *) PoolGet(&es->handlerPool, sizeof(EventHandler));
+}
+
+/**********************************************************************
+* %FUNCTION: PoolClass
+* %ARGUMENTS:
+*  size -- requested allocation size
+* %RETURNS:
+*  Index of the smallest size class which holds "size" bytes, or -1
+*  if "size" is too big to be pooled.
+***********************************************************************/
+static int
+PoolClass(size_t size)
+{
+    int i;
+    size_t class_size = ((size_t) 1) << EVENT_POOL_MIN_SHIFT;
+
+    for (i=0; i<EVENT_POOL_CLASSES; i++) {
+	if (size <= class_size) return i;
+	class_size <<= 1;
+    }
+    return -1;
+}
+
+/**********************************************************************
+* %FUNCTION: Event_Alloc
+* %ARGUMENTS:
+*  es -- event selector
+*  size -- number of bytes wanted
+* %RETURNS:
+*  A block of at least "size" bytes, or NULL if out of memory
+* %DESCRIPTION:
+*  Allocates memory from the selector's size-class pools.  Blocks freed
+*  with Event_Free are cached and handed out again, so code which
+*  allocates per-request state and buffers does not go to malloc() in
+*  steady state.  The block must be released with Event_Free on the
+*  same selector, passing the same size.
+***********************************************************************/
+void *
+Event_Alloc(EventSelector *es, size_t size)
+{
+    int c = PoolClass(size);
+
+    if (c < 0) return malloc(size);
+    return PoolGet(&es->pools[c], ((size_t) 1) << (c + EVENT_POOL_MIN_SHIFT));
+}
+
+/**********************************************************************
+* %FUNCTION: Event_Free
+* %ARGUMENTS:
+*  es -- event selector
+*  ptr -- block returned by Event_Alloc (may be NULL)
+*  size -- the size which was passed to Event_Alloc
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Returns a block to the selector's pools.
+***********************************************************************/
+void
+Event_Free(EventSelector *es, void *ptr, size_t size)
+{
+    int c;
+
+    if (!ptr) return;
+    c = PoolClass(size);
+    if (c < 0) {
+	free(ptr);
+	return;
+    }
+    PoolPut(&es->pools[c], ptr, EVENT_POOL_MAX_FREE);
+}
+
+/**********************************************************************
+* %FUNCTION: Event_GetPoolStats
+* %ARGUMENTS:
+*  es -- event selector
+*  handlers -- filled in with statistics for the EventHandler pool
+*  objects -- filled in with totals over the Event_Alloc size classes
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  "allocated" counts calls to malloc(); "reused" counts allocations
+*  satisfied from a pool instead; "cached" is the number of blocks
+*  currently sitting in the pools.
+***********************************************************************/
+void
+Event_GetPoolStats(EventSelector *es,
+		   EventPoolStats *handlers,
+		   EventPoolStats *objects)
+{
+    int i;
+
+    handlers->allocated = es->handlerPool.allocated;
+    handlers->reused = es->handlerPool.reused;
+    handlers->cached = es->handlerPool.numFree;
+
+    objects->allocated = 0;
+    objects->reused = 0;
+    objects->cached = 0;
+    for (i=0; i<EVENT_POOL_CLASSES; i++) {
+	objects->allocated += es->pools[i].allocated;
+	objects->reused += es->pools[i].reused;
+	objects->cached += es->pools[i].numFree;
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: Event_GetTime
+* %ARGUMENTS:
+*  tv -- filled in with the current time
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Reads the clock used for timeouts.  This is CLOCK_MONOTONIC where
+*  available so that stepping the system clock does not fire (or
+*  indefinitely postpone) pending timeouts.  The value is only
+*  meaningful relative to other values returned by this function.
+***********************************************************************/
+void
+Event_GetTime(struct timeval *tv)
+{
+#ifdef HAVE_CLOCK_MONOTONIC
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+	return;
+    }
+#endif
+    gettimeofday(tv, NULL);
+}
+
+/**********************************************************************
+* %FUNCTION: TimerBefore
+* %ARGUMENTS:
+*  a, b -- event handlers with timeouts
+* %RETURNS:
+*  Non-zero if a's timeout is strictly earlier than b's
+***********************************************************************/
+static int
+TimerBefore(EventHandler const *a, EventHandler const *b)
+{
+    return (a->tmout.tv_sec < b->tmout.tv_sec ||
+	    (a->tmout.tv_sec == b->tmout.tv_sec &&
+	     a->tmout.tv_usec < b->tmout.tv_usec));
+}
+
+/**********************************************************************
+* %FUNCTION: TimerSiftUp
+* %ARGUMENTS:
+*  es -- event selector
+*  i -- index of an entry in the timer heap
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Moves entry i towards the root until the heap property holds.
+***********************************************************************/
+static void
+TimerSiftUp(EventSelector *es, int i)
+{
+    EventHandler *eh = es->timers[i];
+    int parent;
+
+    while (i > 0) {
+	parent = (i - 1) / 2;
+	if (!TimerBefore(eh, es->timers[parent])) break;
+	es->timers[i] = es->timers[parent];
+	es->timers[i]->heapIndex = i;
+	i = parent;
+    }
+    es->timers[i] = eh;
+    eh->heapIndex = i;
+}
+
+/**********************************************************************
+* %FUNCTION: TimerSiftDown
+* %ARGUMENTS:
+*  es -- event selector
+*  i -- index of an entry in the timer heap
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Moves entry i towards the leaves until the heap property holds.
+***********************************************************************/
+static void
+TimerSiftDown(EventSelector *es, int i)
+{
+    EventHandler *eh = es->timers[i];
+    int child;
+
+    for (;;) {
+	child = 2 * i + 1;
+	if (child >= es->numTimers) break;
+	if (child + 1 < es->numTimers &&
+	    TimerBefore(es->timers[child+1], es->timers[child])) {
+	    child++;
+	}
+	if (!TimerBefore(es->timers[child], eh)) break;
+	es->timers[i] = es->timers[child];
+	es->timers[i]->heapIndex = i;
+	i = child;
+    }
+    es->timers[i] = eh;
+    eh->heapIndex = i;
+}
+
+/**********************************************************************
+* %FUNCTION: TimerHeapInsert
+* %ARGUMENTS:
+*  es -- event selector
+*  eh -- handler with EVENT_FLAG_TIMER or EVENT_FLAG_TIMEOUT set
+* %RETURNS:
+*  0 on success, -1 if out of memory
+* %DESCRIPTION:
+*  Adds eh to the selector's timer heap, which is ordered on eh->tmout.
+***********************************************************************/
+static int
+TimerHeapInsert(EventSelector *es, EventHandler *eh)
+{
+    EventHandler **timers;
+    int new_size;
+
+    if (es->numTimers >= es->timersSize) {
+	new_size = es->timersSize * 2;
+	if (new_size < 64) new_size = 64;
+	timers = realloc(es->timers, (size_t) new_size * sizeof(EventHandler *));
+	if (!timers) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	es->timers = timers;
+	es->timersSize = new_size;
+    }
+    es->timers[es->numTimers] = eh;
+    TimerSiftUp(es, es->numTimers++);
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: TimerHeapRemove
+* %ARGUMENTS:
+*  es -- event selector
+*  eh -- a handler
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Removes eh from the timer heap if it is on it.
+***********************************************************************/
+static void
+TimerHeapRemove(EventSelector *es, EventHandler *eh)
+{
+    int i = eh->heapIndex;
+    EventHandler *last;
+
+    if (i < 0) return;
+    eh->heapIndex = -1;
+    last = es->timers[--es->numTimers];
+    if (last == eh) return;
+
+    es->timers[i] = last;
+    last->heapIndex = i;
+    if (i > 0 && TimerBefore(last, es->timers[(i - 1) / 2])) {
+	TimerSiftUp(es, i);
+    } else {
+	TimerSiftDown(es, i);
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: TimeUntilNextTimer
+* %ARGUMENTS:
+*  es -- event selector
+*  timeout -- filled in with the time until the earliest timeout
+* %RETURNS:
+*  1 if there is a pending timeout, 0 otherwise
+* %DESCRIPTION:
+*  Looks at the top of the timer heap.  Past-due timeouts give a
+*  zero timeout.
+***********************************************************************/
+static int
+TimeUntilNextTimer(EventSelector *es, struct timeval *timeout)
+{
+    struct timeval now;
+    struct timeval const *abs_timeout;
+
+    if (!es->numTimers) return 0;
+
+    abs_timeout = &es->timers[0]->tmout;
+    Event_GetTime(&now);
+
+    /* Convert absolute timeout to relative timeout */
+    timeout->tv_usec = abs_timeout->tv_usec - now.tv_usec;
+    timeout->tv_sec = abs_timeout->tv_sec - now.tv_sec;
+    if (timeout->tv_usec < 0) {
+	timeout->tv_usec += 1000000;
+	timeout->tv_sec--;
+    }
+    if (timeout->tv_sec < 0) {
+	timeout->tv_sec = 0;
+	timeout->tv_usec = 0;
+    }
+    return 1;
+}
+
+/**********************************************************************
+* %FUNCTION: PopExpiredTimer
+* %ARGUMENTS:
+*  es -- event selector
+*  now -- current time, from Event_GetTime
+* %RETURNS:
+*  A handler whose timeout is at or before "now", removed from the
+*  timer heap and flagged EVENT_FLAG_EXPIRED, or NULL if there is none.
+***********************************************************************/
+static EventHandler *
+PopExpiredTimer(EventSelector *es, struct timeval const *now)
+{
+    EventHandler *eh;
+
+    if (!es->numTimers) return NULL;
+    eh = es->timers[0];
+    if (eh->tmout.tv_sec > now->tv_sec ||
+	(eh->tmout.tv_sec == now->tv_sec &&
+	 eh->tmout.tv_usec > now->tv_usec)) {
+	return NULL;
+    }
+    TimerHeapRemove(es, eh);
+    eh->flags |= EVENT_FLAG_EXPIRED;
+    return eh;
+}
+
+/**********************************************************************
+* %FUNCTION: RearmTimeout
+* %ARGUMENTS:
+*  es -- event selector
+*  eh -- a handler whose timeout has just been delivered
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  A read/write handler with a timeout stays past due until it is
+*  deleted, so if the callback left it in place, put it back on the
+*  heap; it will be called again next time, just as before.
+***********************************************************************/
+static void
+RearmTimeout(EventSelector *es, EventHandler *eh)
+{
+    if (eh->flags & EVENT_FLAG_DELETED) return;
+    if (!(eh->flags & EVENT_FLAG_TIMEOUT)) return;
+    if (eh->heapIndex >= 0) return;
+    (void) TimerHeapInsert(es, eh);
+}
+
+#ifndef EVENT_USE_EPOLL
+/**********************************************************************
+* %FUNCTION: RunExpiredTimers
+* %ARGUMENTS:
+*  es -- event selector
+*  timers -- expired timer handlers, linked through their "next" field
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Calls each expired timer once and marks it for deletion.  Timers
+*  live only on the heap, not on the handler list, so the select and
+*  poll loops do not have to walk them.
+***********************************************************************/
+static void
+RunExpiredTimers(EventSelector *es, EventHandler *timers)
+{
+    EventHandler *eh, *next;
+
+    for (eh=timers; eh; eh=next) {
+	next = eh->next;
+	eh->next = NULL;
+	eh->flags &= ~EVENT_FLAG_EXPIRED;
+
+	/* Deleted by an earlier callback?  Ignore it */
+	if (eh->flags & EVENT_FLAG_DELETED) continue;
+
+	/* Timer events are only called once */
+	MarkDeleted(es, eh);
+	EVENT_DEBUG(("Enter callback: eh=%p flags=%u\n", eh, EVENT_TIMER_BITS));
+	eh->fn(es, eh->fd, EVENT_TIMER_BITS, eh->data);
+	EVENT_DEBUG(("Leave callback: eh=%p flags=%u\n", eh, EVENT_TIMER_BITS));
+    }
+}
+#endif
 
 /**********************************************************************
 * %FUNCTION: set_cloexec
@@ -114,9 +740,34 @@ Event_CreateSelector(void)
     EventSelector *es = malloc(sizeof(EventSelector));
     if (!es) return NULL;
     es->handlers = NULL;
+    es->deleted = NULL;
+    es->timers = NULL;
+    es->numTimers = 0;
+    es->timersSize = 0;
+    memset(&es->handlerPool, 0, sizeof(es->handlerPool));
+    memset(es->pools, 0, sizeof(es->pools));
     es->nestLevel = 0;
     es->destroyPending = 0;
     es->opsPending = 0;
+#ifdef EVENT_USE_EPOLL
+    es->numRegistered = 0;
+    es->fdTable = NULL;
+    es->fdTableSize = 0;
+    es->ready = NULL;
+    es->readySize = 0;
+    es->maxEpollEvents = EPOLL_INITIAL_EVENTS;
+    es->epollEvents = malloc(EPOLL_INITIAL_EVENTS * sizeof(struct epoll_event));
+    if (!es->epollEvents) {
+	free(es);
+	return NULL;
+    }
+    es->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (es->epfd < 0) {
+	free(es->epollEvents);
+	free(es);
+	return NULL;
+    }
+#endif
     EVENT_DEBUG(("CreateSelector() -> %p\n", (void *) es));
     return es;
 }
@@ -142,7 +793,7 @@ Event_DestroySelector(EventSelector *es)
     DestroySelector(es);
 }
 
-#ifndef EVENT_USE_POLL
+#if !defined(EVENT_USE_POLL) && !defined(EVENT_USE_EPOLL)
 /**********************************************************************
 * %FUNCTION: Event_HandleEventUsingSelect
 * %ARGUMENTS:
@@ -159,10 +810,11 @@ Event_HandleEventUsingSelect(EventSelector *es)
     fd_set *rd, *wr;
     unsigned int flags;
 
-    struct timeval abs_timeout, now;
+    struct timeval now;
     struct timeval timeout;
     struct timeval *tm;
     EventHandler *eh;
+    EventHandler *timers = NULL, *timersTail = NULL;
 
     int r = 0;
     int errno_save = 0;
@@ -170,14 +822,9 @@ Event_HandleEventUsingSelect(EventSelector *es)
     int foundReadEvent = 0;
     int foundWriteEvent = 0;
     int maxfd = -1;
-    int pastDue;
 
     EVENT_DEBUG(("Enter Event_HandleEvent(es=%p)\n", (void *) es));
 
-    /* Silence stupid compiler warning */
-    abs_timeout.tv_sec = 0;
-    abs_timeout.tv_usec = 0;
-
     /* Build the select sets */
     FD_ZERO(&readfds);
     FD_ZERO(&writefds);
@@ -194,18 +841,6 @@ Event_HandleEventUsingSelect(EventSelector *es)
 	    FD_SET(eh->fd, &writefds);
 	    if (eh->fd > maxfd) maxfd = eh->fd;
 	}
-	if (eh->flags & EVENT_TIMER_BITS) {
-	    if (!foundTimeoutEvent) {
-		abs_timeout = eh->tmout;
-		foundTimeoutEvent = 1;
-	    } else {
-		if (eh->tmout.tv_sec < abs_timeout.tv_sec ||
-		    (eh->tmout.tv_sec == abs_timeout.tv_sec &&
-		     eh->tmout.tv_usec < abs_timeout.tv_usec)) {
-		    abs_timeout = eh->tmout;
-		}
-	    }
-	}
     }
     if (foundReadEvent) {
 	rd = &readfds;
@@ -218,21 +853,8 @@ Event_HandleEventUsingSelect(EventSelector *es)
 	wr = NULL;
     }
 
+    foundTimeoutEvent = TimeUntilNextTimer(es, &timeout);
     if (foundTimeoutEvent) {
-	gettimeofday(&now, NULL);
-
-	/* Convert absolute timeout to relative timeout for select */
-	timeout.tv_usec = abs_timeout.tv_usec - now.tv_usec;
-	timeout.tv_sec = abs_timeout.tv_sec - now.tv_sec;
-	if (timeout.tv_usec < 0) {
-	    timeout.tv_usec += 1000000;
-	    timeout.tv_sec--;
-	}
-	if (timeout.tv_sec < 0 ||
-	    (timeout.tv_sec == 0 && timeout.tv_usec < 0)) {
-	    timeout.tv_sec = 0;
-	    timeout.tv_usec = 0;
-	}
 	tm = &timeout;
     } else {
 	tm = NULL;
@@ -254,14 +876,23 @@ Event_HandleEventUsingSelect(EventSelector *es)
 	}
     }
 
-    if (foundTimeoutEvent) {
-	gettimeofday(&now, NULL);
-    }
-
     errno_save = errno;
     es->nestLevel++;
 
     if (r >= 0) {
+	/* Collect expired timers; PopExpiredTimer flags expired timeouts */
+	if (foundTimeoutEvent) {
+	    Event_GetTime(&now);
+	    while ((eh = PopExpiredTimer(es, &now)) != NULL) {
+		if (eh->flags & EVENT_FLAG_TIMER) {
+		    eh->next = NULL;
+		    if (timersTail) timersTail->next = eh;
+		    else            timers = eh;
+		    timersTail = eh;
+		}
+	    }
+	}
+
 	/* Call handlers */
 	for (eh=es->handlers; eh; eh=eh->next) {
 
@@ -277,26 +908,19 @@ Event_HandleEventUsingSelect(EventSelector *es)
 		FD_ISSET(eh->fd, &writefds)) {
 		flags |= EVENT_FLAG_WRITEABLE;
 	    }
-	    if (eh->flags & EVENT_TIMER_BITS) {
-		pastDue = (eh->tmout.tv_sec < now.tv_sec ||
-			   (eh->tmout.tv_sec == now.tv_sec &&
-			    eh->tmout.tv_usec <= now.tv_usec));
-		if (pastDue) {
-		    flags |= EVENT_TIMER_BITS;
-		    if (eh->flags & EVENT_FLAG_TIMER) {
-			/* Timer events are only called once */
-			es->opsPending = 1;
-			eh->flags |= EVENT_FLAG_DELETED;
-		    }
-		}
+	    if (eh->flags & EVENT_FLAG_EXPIRED) {
+		eh->flags &= ~EVENT_FLAG_EXPIRED;
+		flags |= EVENT_TIMER_BITS;
 	    }
 	    /* Do callback */
 	    if (flags) {
 		EVENT_DEBUG(("Enter callback: eh=%p flags=%u\n", eh, flags));
 		eh->fn(es, eh->fd, flags, eh->data);
 		EVENT_DEBUG(("Leave callback: eh=%p flags=%u\n", eh, flags));
+		if (flags & EVENT_TIMER_BITS) RearmTimeout(es, eh);
 	    }
 	}
+	RunExpiredTimers(es, timers);
     }
 
     es->nestLevel--;
@@ -322,25 +946,22 @@ Event_HandleEventUsingSelect(EventSelector *es)
 int
 Event_HandleEventUsingPoll(EventSelector *es)
 {
-    struct timeval abs_timeout, now;
+    struct timeval now;
     struct timeval timeout;
     int tm;
     EventHandler *eh;
+    EventHandler *timers = NULL, *timersTail = NULL;
+    unsigned int flags;
 
     int r = 0;
     int errno_save = 0;
     int foundTimeoutEvent = 0;
-    int pastDue;
     int num_handlers = 0;
     int nfds;
     int i;
 
     EVENT_DEBUG(("Enter Event_HandleEventUsingPoll(es=%p)\n", (void *) es));
 
-    /* Silence stupid compiler warning */
-    abs_timeout.tv_sec = 0;
-    abs_timeout.tv_usec = 0;
-
     /* Build the pollfds array */
     eh = es->handlers;
     while(eh) {
@@ -371,34 +992,10 @@ Event_HandleEventUsingPoll(EventSelector *es)
 	    }
 	    nfds++;
 	}
-	if (eh->flags & EVENT_TIMER_BITS) {
-	    if (!foundTimeoutEvent) {
-		abs_timeout = eh->tmout;
-		foundTimeoutEvent = 1;
-	    } else {
-		if (eh->tmout.tv_sec < abs_timeout.tv_sec ||
-		    (eh->tmout.tv_sec == abs_timeout.tv_sec &&
-		     eh->tmout.tv_usec < abs_timeout.tv_usec)) {
-		    abs_timeout = eh->tmout;
-		}
-	    }
-	}
     }
-    if (foundTimeoutEvent) {
-	gettimeofday(&now, NULL);
 
-	/* Convert absolute timeout to relative timeout for poll */
-	timeout.tv_usec = abs_timeout.tv_usec - now.tv_usec;
-	timeout.tv_sec = abs_timeout.tv_sec - now.tv_sec;
-	if (timeout.tv_usec < 0) {
-	    timeout.tv_usec += 1000000;
-	    timeout.tv_sec--;
-	}
-	if (timeout.tv_sec < 0 ||
-	    (timeout.tv_sec == 0 && timeout.tv_usec < 0)) {
-	    timeout.tv_sec = 0;
-	    timeout.tv_usec = 0;
-	}
+    foundTimeoutEvent = TimeUntilNextTimer(es, &timeout);
+    if (foundTimeoutEvent) {
 	tm = (timeout.tv_sec * 1000) + (timeout.tv_usec / 1000);
     } else {
 	tm = -1;
@@ -414,10 +1011,6 @@ Event_HandleEventUsingPoll(EventSelector *es)
 	}
     }
 
-    if (foundTimeoutEvent) {
-	gettimeofday(&now, NULL);
-    }
-
     errno_save = errno;
     es->nestLevel++;
 
@@ -437,29 +1030,162 @@ Event_HandleEventUsingPoll(EventSelector *es)
 	    }
 	}
 
+	/* Flag expired timeouts; collect expired timers */
+	if (foundTimeoutEvent) {
+	    Event_GetTime(&now);
+	    while ((eh = PopExpiredTimer(es, &now)) != NULL) {
+		if (eh->flags & EVENT_FLAG_TIMER) {
+		    eh->next = NULL;
+		    if (timersTail) timersTail->next = eh;
+		    else            timers = eh;
+		    timersTail = eh;
+		} else {
+		    eh->pollflags |= EVENT_TIMER_BITS;
+		}
+	    }
+	}
+
 	/* Call handlers */
 	for (eh=es->handlers; eh; eh=eh->next) {
 	    /* Pending delete for this handler?  Ignore it */
 	    if (eh->flags & EVENT_FLAG_DELETED) continue;
 
-	    if (eh->flags & EVENT_TIMER_BITS) {
-		pastDue = (eh->tmout.tv_sec < now.tv_sec ||
-			   (eh->tmout.tv_sec == now.tv_sec &&
-			    eh->tmout.tv_usec <= now.tv_usec));
-		if (pastDue) {
-		    eh->pollflags |= EVENT_TIMER_BITS;
-		    if (eh->flags & EVENT_FLAG_TIMER) {
-			/* Timer events are only called once */
-			es->opsPending = 1;
-			eh->flags |= EVENT_FLAG_DELETED;
-		    }
+	    flags = eh->pollflags;
+	    eh->pollflags = 0;
+	    eh->flags &= ~EVENT_FLAG_EXPIRED;
+	    /* Do callback */
+	    if (flags) {
+		EVENT_DEBUG(("Enter callback: eh=%p flags=%u\n", eh, flags));
+		eh->fn(es, eh->fd, flags, eh->data);
+		EVENT_DEBUG(("Leave callback: eh=%p flags=%u\n", eh, flags));
+		if (flags & EVENT_TIMER_BITS) RearmTimeout(es, eh);
+	    }
+	}
+	RunExpiredTimers(es, timers);
+    }
+
+    es->nestLevel--;
+
+    if (!es->nestLevel && es->opsPending) {
+	DoPendingChanges(es);
+    }
+    errno = errno_save;
+    return r;
+}
+#endif
+
+#ifdef EVENT_USE_EPOLL
+/**********************************************************************
+* %FUNCTION: Event_HandleEventUsingEpoll
+* %ARGUMENTS:
+*  es -- EventSelector
+* %RETURNS:
+*  0 if OK, non-zero on error.  errno is set appropriately.
+* %DESCRIPTION:
+*  Handles a single event (uses epoll_wait() to wait for an event.)
+*  Descriptors are registered incrementally as handlers are added and
+*  deleted, so only descriptors which are actually ready are visited.
+***********************************************************************/
+int
+Event_HandleEventUsingEpoll(EventSelector *es)
+{
+    struct timeval now;
+    struct timeval timeout;
+    int tm;
+    EventHandler *eh;
+    struct epoll_event *ev;
+    struct epoll_event *new_events;
+    unsigned int flags;
+
+    int r = 0;
+    int errno_save = 0;
+    int foundTimeoutEvent = 0;
+    int nready = 0;
+    int fd;
+    int i;
+
+    EVENT_DEBUG(("Enter Event_HandleEventUsingEpoll(es=%p)\n", (void *) es));
+
+    foundTimeoutEvent = TimeUntilNextTimer(es, &timeout);
+    if (foundTimeoutEvent) {
+	tm = (timeout.tv_sec * 1000) + (timeout.tv_usec / 1000);
+    } else {
+	tm = -1;
+    }
+
+    if (es->numRegistered || foundTimeoutEvent) {
+	for(;;) {
+	    r = epoll_wait(es->epfd, es->epollEvents, es->maxEpollEvents, tm);
+	    if (r < 0) {
+		if (errno == EINTR) continue;
+	    }
+	    break;
+	}
+    }
+
+    errno_save = errno;
+    es->nestLevel++;
+
+    if (r >= 0) {
+	/* Map ready descriptors to the handlers interested in them */
+	for (i=0; i<r; i++) {
+	    ev = &es->epollEvents[i];
+	    fd = ev->data.fd;
+	    if (fd < 0 || fd >= es->fdTableSize) continue;
+	    for (eh=es->fdTable[fd].handlers; eh; eh=eh->fdNext) {
+		if (eh->flags & EVENT_FLAG_DELETED) continue;
+		flags = 0;
+		if ((eh->flags & EVENT_FLAG_READABLE) &&
+		    (ev->events & (EPOLLIN|EPOLLHUP|EPOLLERR))) {
+		    flags |= EVENT_FLAG_READABLE;
 		}
+		if ((eh->flags & EVENT_FLAG_WRITEABLE) &&
+		    (ev->events & (EPOLLOUT|EPOLLHUP|EPOLLERR))) {
+		    flags |= EVENT_FLAG_WRITEABLE;
+		}
+		if (flags) (void) epoll_add_ready(es, eh, flags, &nready);
 	    }
-	    /* Do callback */
-	    if (eh->pollflags) {
-		EVENT_DEBUG(("Enter callback: eh=%p flags=%u\n", eh, eh->pollflags));
-		eh->fn(es, eh->fd, eh->pollflags, eh->data);
-		EVENT_DEBUG(("Leave callback: eh=%p flags=%u\n", eh, eh->pollflags));
+	}
+
+	/* Add expired timers */
+	if (foundTimeoutEvent) {
+	    Event_GetTime(&now);
+	    while ((eh = PopExpiredTimer(es, &now)) != NULL) {
+		if (epoll_add_ready(es, eh, EVENT_TIMER_BITS, &nready) < 0) {
+		    eh->flags &= ~EVENT_FLAG_EXPIRED;
+		    TimerHeapInsert(es, eh);
+		    break;
+		}
+	    }
+	}
+
+	/* Call handlers */
+	for (i=0; i<nready; i++) {
+	    eh = es->ready[i];
+	    flags = eh->pollflags;
+	    eh->pollflags = 0;
+	    eh->flags &= ~EVENT_FLAG_EXPIRED;
+
+	    /* Deleted by an earlier callback?  Ignore it */
+	    if (eh->flags & EVENT_FLAG_DELETED) continue;
+
+	    if ((flags & EVENT_TIMER_BITS) && (eh->flags & EVENT_FLAG_TIMER)) {
+		/* Timer events are only called once */
+		MarkDeleted(es, eh);
+	    }
+	    EVENT_DEBUG(("Enter callback: eh=%p flags=%u\n", eh, flags));
+	    eh->fn(es, eh->fd, flags, eh->data);
+	    EVENT_DEBUG(("Leave callback: eh=%p flags=%u\n", eh, flags));
+	    if (flags & EVENT_TIMER_BITS) RearmTimeout(es, eh);
+	}
+
+	/* If we filled the buffer, there may be more; ask for more next time */
+	if (r == es->maxEpollEvents && es->maxEpollEvents < EPOLL_MAX_EVENTS) {
+	    new_events = realloc(es->epollEvents,
+				 (size_t) es->maxEpollEvents * 2 * sizeof(struct epoll_event));
+	    if (new_events) {
+		es->epollEvents = new_events;
+		es->maxEpollEvents *= 2;
 	    }
 	}
     }
@@ -495,7 +1221,8 @@ Event_AddHandler(EventSelector *es,
     EventHandler *eh;
 
     /* Specifically disable timer and deleted flags */
-    flags &= (~(EVENT_TIMER_BITS | EVENT_FLAG_DELETED));
+    flags &= (~(EVENT_TIMER_BITS | EVENT_FLAG_DELETED | EVENT_FLAG_EXPIRED |
+		EVENT_FLAG_LINKED));
 
     /* Bad file descriptor */
     if (fd < 0) {
@@ -503,7 +1230,7 @@ Event_AddHandler(EventSelector *es,
 	return NULL;
     }
 
-    eh = malloc(sizeof(EventHandler));
+    eh = AllocHandler(es);
     if (!eh) return NULL;
     eh->fd = fd;
     eh->flags = flags;
@@ -513,8 +1240,10 @@ Event_AddHandler(EventSelector *es,
     eh->data = data;
 
     /* Add immediately.  This is safe even if we are in a handler. */
-    eh->next = es->handlers;
-    es->handlers = eh;
+    if (LinkHandler(es, eh) < 0) {
+	DestroyHandler(es, eh);
+	return NULL;
+    }
 
     EVENT_DEBUG(("Event_AddHandler(es=%p, fd=%d, flags=%u) -> %p\n", es, fd, flags, eh));
     return eh;
@@ -550,7 +1279,8 @@ Event_AddHandlerWithTimeout(EventSelector *es,
     }
 
     /* Specifically disable timer and deleted flags */
-    flags &= (~(EVENT_FLAG_TIMER | EVENT_FLAG_DELETED));
+    flags &= (~(EVENT_FLAG_TIMER | EVENT_FLAG_DELETED | EVENT_FLAG_EXPIRED |
+		EVENT_FLAG_LINKED));
     flags |= EVENT_FLAG_TIMEOUT;
 
     /* Bad file descriptor? */
@@ -565,11 +1295,11 @@ Event_AddHandlerWithTimeout(EventSelector *es,
 	return NULL;
     }
 
-    eh = malloc(sizeof(EventHandler));
+    eh = AllocHandler(es);
     if (!eh) return NULL;
 
     /* Convert time interval to absolute time */
-    gettimeofday(&now, NULL);
+    Event_GetTime(&now);
 
     t.tv_sec += now.tv_sec;
     t.tv_usec += now.tv_usec;
@@ -585,8 +1315,10 @@ Event_AddHandlerWithTimeout(EventSelector *es,
     eh->data = data;
 
     /* Add immediately.  This is safe even if we are in a handler. */
-    eh->next = es->handlers;
-    es->handlers = eh;
+    if (LinkHandler(es, eh) < 0) {
+	DestroyHandler(es, eh);
+	return NULL;
+    }
 
     EVENT_DEBUG(("Event_AddHandlerWithTimeout(es=%p, fd=%d, flags=%u, t=%d/%d) -> %p\n", es, fd, flags, t.tv_sec, t.tv_usec, eh));
     return eh;
@@ -618,11 +1350,11 @@ Event_AddTimerHandler(EventSelector *es,
 	return NULL;
     }
 
-    eh = malloc(sizeof(EventHandler));
+    eh = AllocHandler(es);
     if (!eh) return NULL;
 
     /* Convert time interval to absolute time */
-    gettimeofday(&now, NULL);
+    Event_GetTime(&now);
 
     t.tv_sec += now.tv_sec;
     t.tv_usec += now.tv_usec;
@@ -638,8 +1370,10 @@ Event_AddTimerHandler(EventSelector *es,
     eh->data = data;
 
     /* Add immediately.  This is safe even if we are in a handler. */
-    eh->next = es->handlers;
-    es->handlers = eh;
+    if (LinkHandler(es, eh) < 0) {
+	DestroyHandler(es, eh);
+	return NULL;
+    }
 
     EVENT_DEBUG(("Event_AddTimerHandler(es=%p, t=%d/%d) -> %p\n", es, t.tv_sec,t.tv_usec, eh));
     return eh;
@@ -659,27 +1393,35 @@ int
 Event_DelHandler(EventSelector *es,
 		 EventHandler *eh)
 {
-    /* Scan the handlers list */
-    EventHandler *cur, *prev;
     EVENT_DEBUG(("Event_DelHandler(es=%p, eh=%p)\n", es, eh));
-    for (cur=es->handlers, prev=NULL; cur; prev=cur, cur=cur->next) {
-	if (cur == eh) {
-	    if (es->nestLevel) {
-		eh->flags |= EVENT_FLAG_DELETED;
-		es->opsPending = 1;
-		return 0;
-	    } else {
-		if (prev) prev->next = cur->next;
-		else      es->handlers = cur->next;
-
-		DestroyHandler(cur);
-		return 0;
-	    }
+
+    /* Timers are only on the timer heap, or about to be dispatched */
+    if (eh->flags & EVENT_FLAG_TIMER) {
+	if (eh->flags & EVENT_FLAG_DELETED) return 0;
+	if (!(eh->flags & EVENT_FLAG_EXPIRED) &&
+	    (eh->heapIndex < 0 || eh->heapIndex >= es->numTimers ||
+	     es->timers[eh->heapIndex] != eh)) {
+	    return 1;
 	}
+	if (es->nestLevel) {
+	    MarkDeleted(es, eh);
+	} else {
+	    UnlinkHandler(es, eh);
+	    DestroyHandler(es, eh);
+	}
+	return 0;
     }
 
-    /* Handler not found */
-    return 1;
+    /* Other handlers are on the doubly-linked handler list until they
+       are destroyed */
+    if (!(eh->flags & EVENT_FLAG_LINKED)) return 1;
+    if (es->nestLevel) {
+	MarkDeleted(es, eh);
+    } else {
+	UnlinkHandler(es, eh);
+	DestroyHandler(es, eh);
+    }
+    return 0;
 }
 
 /**********************************************************************
@@ -695,28 +1437,55 @@ static void
 DestroySelector(EventSelector *es)
 {
     EventHandler *cur, *next;
+    int i;
+
     for (cur=es->handlers; cur; cur=next) {
 	next = cur->next;
-	DestroyHandler(cur);
+	DestroyHandler(es, cur);
     }
 
+    /* Timers are not on the handler list */
+    for (i=0; i<es->numTimers; i++) {
+	if (es->timers[i]->flags & EVENT_FLAG_TIMER) {
+	    DestroyHandler(es, es->timers[i]);
+	}
+    }
+    for (cur=es->deleted; cur; cur=next) {
+	next = cur->nextDeleted;
+	if (cur->flags & EVENT_FLAG_TIMER) DestroyHandler(es, cur);
+    }
+
+    /* Handlers went back to the pool above; now release the pools */
+    DrainPool(&es->handlerPool);
+    for (i=0; i<EVENT_POOL_CLASSES; i++) {
+	DrainPool(&es->pools[i]);
+    }
+
+    free(es->timers);
+#ifdef EVENT_USE_EPOLL
+    close(es->epfd);
+    free(es->fdTable);
+    free(es->epollEvents);
+    free(es->ready);
+#endif
     free(es);
 }
 
 /**********************************************************************
 * %FUNCTION: DestroyHandler
 * %ARGUMENTS:
+*  es -- the event selector which owns eh
 *  eh -- an event handler
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Destroys handler
+*  Destroys handler, returning its memory to the selector's pool
 ***********************************************************************/
 static void
-DestroyHandler(EventHandler *eh)
+DestroyHandler(EventSelector *es, EventHandler *eh)
 {
     EVENT_DEBUG(("DestroyHandler(eh=%p)\n", eh));
-    free(eh);
+    PoolPut(&es->handlerPool, eh, EVENT_POOL_MAX_HANDLERS);
 }
 
 /**********************************************************************
@@ -731,7 +1500,7 @@ DestroyHandler(EventHandler *eh)
 static void
 DoPendingChanges(EventSelector *es)
 {
-    EventHandler *cur, *prev, *next;
+    EventHandler *cur, *next;
 
     es->opsPending = 0;
 
@@ -742,25 +1511,138 @@ DoPendingChanges(EventSelector *es)
     }
 
     /* Do deletions */
-    cur = es->handlers;
-    prev = NULL;
+    cur = es->deleted;
+    es->deleted = NULL;
     while(cur) {
-	if (!(cur->flags & EVENT_FLAG_DELETED)) {
-	    prev = cur;
-	    cur = cur->next;
-	    continue;
+	next = cur->nextDeleted;
+	UnlinkHandler(es, cur);
+	DestroyHandler(es, cur);
+	cur = next;
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: LinkHandler
+* %ARGUMENTS:
+*  es -- an event selector
+*  eh -- a newly-created handler
+* %RETURNS:
+*  0 on success, -1 on failure
+* %DESCRIPTION:
+*  Links eh into the selector's handler list, puts it on the timer heap
+*  if it has a timeout and, for epoll, registers its descriptor with
+*  the kernel.
+***********************************************************************/
+static int
+LinkHandler(EventSelector *es, EventHandler *eh)
+{
+    eh->nextDeleted = NULL;
+    eh->heapIndex = -1;
+#if defined(EVENT_USE_POLL) || defined(EVENT_USE_EPOLL)
+    eh->pollflags = 0;
+#endif
+
+    if (eh->flags & EVENT_TIMER_BITS) {
+	if (TimerHeapInsert(es, eh) < 0) return -1;
+    }
+
+    /* Timers live only on the heap */
+    if (eh->flags & EVENT_FLAG_TIMER) {
+	eh->next = NULL;
+	eh->prev = NULL;
+	return 0;
+    }
+
+#ifdef EVENT_USE_EPOLL
+    eh->fdNext = NULL;
+    if (eh->fd >= 0) {
+	if (epoll_grow_fd_table(es, eh->fd) < 0) {
+	    TimerHeapRemove(es, eh);
+	    return -1;
+	}
+	eh->fdNext = es->fdTable[eh->fd].handlers;
+	es->fdTable[eh->fd].handlers = eh;
+	if (epoll_update_fd(es, eh->fd, 1) < 0) {
+	    es->fdTable[eh->fd].handlers = eh->fdNext;
+	    TimerHeapRemove(es, eh);
+	    return -1;
 	}
+    }
+#endif
 
-	/* Unlink from list */
-	if (prev) {
-	    prev->next = cur->next;
-	} else {
-	    es->handlers = cur->next;
+    eh->prev = NULL;
+    eh->next = es->handlers;
+    if (es->handlers) es->handlers->prev = eh;
+    es->handlers = eh;
+    eh->flags |= EVENT_FLAG_LINKED;
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: UnlinkHandler
+* %ARGUMENTS:
+*  es -- an event selector
+*  eh -- a handler
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Removes eh from the selector's handler list and the timer heap and,
+*  for epoll, from its descriptor's handler list, updating the kernel
+*  registration.
+***********************************************************************/
+static void
+UnlinkHandler(EventSelector *es, EventHandler *eh)
+{
+#ifdef EVENT_USE_EPOLL
+    EventHandler **link;
+#endif
+
+    TimerHeapRemove(es, eh);
+    if (eh->flags & EVENT_FLAG_TIMER) return;
+
+#ifdef EVENT_USE_EPOLL
+    if (eh->fd >= 0 && eh->fd < es->fdTableSize) {
+	for (link = &es->fdTable[eh->fd].handlers; *link; link = &(*link)->fdNext) {
+	    if (*link == eh) {
+		*link = eh->fdNext;
+		break;
+	    }
 	}
-	next = cur->next;
-	DestroyHandler(cur);
-	cur = next;
+	epoll_update_fd(es, eh->fd, 0);
+    }
+#endif
+
+    if (eh->prev) eh->prev->next = eh->next;
+    else          es->handlers = eh->next;
+    if (eh->next) eh->next->prev = eh->prev;
+    eh->flags &= ~EVENT_FLAG_LINKED;
+}
+
+/**********************************************************************
+* %FUNCTION: MarkDeleted
+* %ARGUMENTS:
+*  es -- an event selector
+*  eh -- a handler
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Flags eh for deletion once we are no longer dispatching events.
+***********************************************************************/
+static void
+MarkDeleted(EventSelector *es, EventHandler *eh)
+{
+    if (eh->flags & EVENT_FLAG_DELETED) return;
+    eh->flags |= EVENT_FLAG_DELETED;
+    eh->nextDeleted = es->deleted;
+    es->deleted = eh;
+    es->opsPending = 1;
+    TimerHeapRemove(es, eh);
+#ifdef EVENT_USE_EPOLL
+    /* Stop watching the descriptor right away */
+    if (eh->fd >= 0 && eh->fd < es->fdTableSize) {
+	epoll_update_fd(es, eh->fd, 0);
     }
+#endif
 }
 
 /**********************************************************************
@@ -809,6 +1691,25 @@ Event_SetCallbackAndData(EventHandler *eh,
     eh->data = data;
 }
 
+/**********************************************************************
+* %FUNCTION: Event_GetSelectorFd
+* %ARGUMENTS:
+*  es -- an event selector
+* %RETURNS:
+*  The descriptor the selector itself holds open (the epoll instance),
+*  or -1 if the backend does not use one.  Callers which close all
+*  descriptors must leave this one alone.
+***********************************************************************/
+int
+Event_GetSelectorFd(EventSelector *es)
+{
+#ifdef EVENT_USE_EPOLL
+    return es->epfd;
+#else
+    return -1;
+#endif
+}
+
 #ifdef DEBUG_EVENT
 #include <stdarg.h>
 #include <stdio.h>
@@ -841,7 +1742,7 @@ Event_DebugMsg(char const *fmt, ...)
     fflush(Event_DebugFP);
 }
 
-#ifndef EVENT_USE_POLL
+#if !defined(EVENT_USE_POLL) && !defined(EVENT_USE_EPOLL)
 static void
 print_select_sets(char const *tag, int maxfdp1, fd_set *rd, fd_set *wr)
 {
@@ -26,6 +26,13 @@ typedef void (*EventCallbackFunc)(struct EventSelector_t *es,
 
 #include "eventpriv.h"
 
+/* Memory pool statistics */
+typedef struct EventPoolStats_t {
+    unsigned long allocated;	/* Blocks obtained from malloc()           */
+    unsigned long reused;	/* Allocations served from a pool instead  */
+    int cached;			/* Blocks currently held in the pool       */
+} EventPoolStats;
+
 /* Create an event selector */
 extern EventSelector *Event_CreateSelector(void);
 
@@ -33,7 +40,10 @@ extern EventSelector *Event_CreateSelector(void);
 extern void Event_DestroySelector(EventSelector *es);
 
 /* Handle one event */
-#ifdef EVENT_USE_POLL
+#if defined(EVENT_USE_EPOLL)
+extern int Event_HandleEventUsingEpoll(EventSelector *es);
+#define Event_HandleEvent Event_HandleEventUsingEpoll
+#elif defined(EVENT_USE_POLL)
 extern int Event_HandleEventUsingPoll(EventSelector *es);
 #define Event_HandleEvent Event_HandleEventUsingPoll
 #else
@@ -77,6 +87,19 @@ extern void Event_SetCallbackAndData(EventHandler *eh,
 				     EventCallbackFunc fn,
 				     void *data);
 
+/* Allocate and free memory from the selector's pools */
+extern void *Event_Alloc(EventSelector *es, size_t size);
+extern void Event_Free(EventSelector *es, void *ptr, size_t size);
+extern void Event_GetPoolStats(EventSelector *es,
+			       EventPoolStats *handlers,
+			       EventPoolStats *objects);
+
+/* Current time on the clock used for timeouts */
+extern void Event_GetTime(struct timeval *tv);
+
+/* Descriptor used internally by the selector, or -1 if none */
+extern int Event_GetSelectorFd(EventSelector *es);
+
 extern int Event_EnableDebugging(char const *fname);
 
 extern int set_cloexec(int fd);
@@ -19,12 +19,18 @@
 #include <string.h>
 
 static void free_state(EventTcpState *state);
+static void handle_writeable(EventSelector *, int, unsigned int, void *);
+static void handle_writev(EventSelector *, int, unsigned int, void *);
 static void finish_netstring(EventSelector *, int, char *, int, int, void *);
+static void finish_frame(EventSelector *, int, char *, int, int, void *);
+static EventTcpState *start_write(EventSelector *, int, char *, int, int, int,
+				  EventTcpIOFinishedFunc, int, void *);
 
-/* Extra chunk of data for reading netstrings */
+/* Extra chunk of data for reading netstrings and frames */
 typedef struct netstring_extra_t {
     EventTcpIOFinishedFunc f;
     int timeout;
+    int maxlen;
     void *data;
 } netstring_extra;
 
@@ -113,7 +119,7 @@ handle_connect(EventSelector *es,
 	} else {
 	    close(fd);
 	}
-	free(state);
+	Event_Free(es, state, sizeof(*state));
 	return;
     }
 
@@ -124,7 +130,7 @@ handle_connect(EventSelector *es,
 	} else {
 	    close(fd);
 	}
-	free(state);
+	Event_Free(es, state, sizeof(*state));
 	return;
     }
     if (error) {
@@ -134,7 +140,7 @@ handle_connect(EventSelector *es,
 	} else {
 	    close(fd);
 	}
-	free(state);
+	Event_Free(es, state, sizeof(*state));
 	return;
     }
 
@@ -144,7 +150,7 @@ handle_connect(EventSelector *es,
     } else {
 	close(fd);
     }
-    free(state);
+    Event_Free(es, state, sizeof(*state));
 }
 
 /**********************************************************************
@@ -190,9 +196,17 @@ free_state(EventTcpState *state)
 {
     if (!state) return;
     EVENT_DEBUG(("tcp_free_state(state=%p)\n", state));
-    if (state->buf) free(state->buf);
     if (state->eh) Event_DelHandler(state->es, state->eh);
-    free(state);
+    if (state->bufOwned) {
+	free(state->buf);
+    } else {
+	Event_Free(state->es, state->buf, state->bufsize);
+    }
+    if (state->iov) {
+	Event_Free(state->es, state->iov,
+		   state->iovcnt * sizeof(struct iovec));
+    }
+    Event_Free(state->es, state, sizeof(EventTcpState));
 }
 
 /**********************************************************************
@@ -433,6 +447,91 @@ handle_writeable(EventSelector *es,
 
 }
 
+/**********************************************************************
+* %FUNCTION: handle_writev
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- the writeable socket
+*  flags -- ignored
+*  data -- the EventTcpState object
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Continues to fill socket from the segments of an EventTcp_WriteV
+*  operation.
+***********************************************************************/
+static void
+handle_writev(EventSelector *es,
+	      int fd,
+	      unsigned int flags,
+	      void *data)
+{
+    EventTcpState *state = (EventTcpState *) data;
+    struct iovec *iov;
+    int n, done;
+
+    EVENT_DEBUG(("tcp_handle_writev(es=%p, fd=%d, flags=%u, data=%p)\n", es, fd, flags, data));
+    done = state->len;
+    for (iov = state->iov + state->iovpos;
+	 iov < state->iov + state->iovcnt; iov++) {
+	done -= (int) iov->iov_len;
+    }
+
+    /* Timed out? */
+    if (flags & EVENT_FLAG_TIMEOUT) {
+	errno = ETIMEDOUT;
+	if (state->f) {
+	    (state->f)(es, state->socket, NULL, done, EVENT_TCP_FLAG_TIMEOUT,
+		       state->data);
+	} else {
+	    close(state->socket);
+	}
+	free_state(state);
+	return;
+    }
+
+    n = writev(fd, state->iov + state->iovpos,
+	       state->iovcnt - state->iovpos);
+    if (n < 0 && errno == EINTR) return;
+
+    if (n <= 0) {
+	/* error */
+	if (state->f) {
+	    (state->f)(es, state->socket, NULL, done,
+		       EVENT_TCP_FLAG_IOERROR,
+		       state->data);
+	} else {
+	    close(state->socket);
+	}
+	free_state(state);
+	return;
+    }
+
+    /* Step over the segments which went out completely */
+    done += n;
+    while (n > 0 && state->iovpos < state->iovcnt) {
+	iov = &state->iov[state->iovpos];
+	if ((size_t) n < iov->iov_len) {
+	    iov->iov_base = (char *) iov->iov_base + n;
+	    iov->iov_len -= n;
+	    break;
+	}
+	n -= (int) iov->iov_len;
+	state->iovpos++;
+    }
+
+    if (done >= state->len) {
+	/* Written enough! */
+	if (state->f) {
+	    (state->f)(es, state->socket, NULL, done,
+		       EVENT_TCP_FLAG_COMPLETE, state->data);
+	} else {
+	    close(state->socket);
+	}
+	free_state(state);
+    }
+}
+
 /**********************************************************************
 * %FUNCTION: EventTcp_ReadNetstring
 * %ARGUMENTS:
@@ -457,7 +556,7 @@ EventTcp_ReadNetstring(EventSelector *es,
 		       void *data)
 {
     EventTcpState *s;
-    netstring_extra *e = malloc(sizeof(netstring_extra));
+    netstring_extra *e = Event_Alloc(es, sizeof(netstring_extra));
     if (!e) return NULL;
 
     e->f = f;
@@ -468,7 +567,7 @@ EventTcp_ReadNetstring(EventSelector *es,
     s = EventTcp_ReadBuf(es, socket, 16, ':', finish_netstring,
 			 timeout, 0, e);
     if (!s) {
-	free(e);
+	Event_Free(es, e, sizeof(netstring_extra));
 	return NULL;
     }
     return s;
@@ -508,7 +607,7 @@ finish_netstring(EventSelector *es,
 	} else {
 	    close(fd);
 	}
-	free(e);
+	Event_Free(es, e, sizeof(netstring_extra));
 	return;
     }
 
@@ -521,7 +620,7 @@ finish_netstring(EventSelector *es,
 	} else {
 	    close(fd);
 	}
-	free(e);
+	Event_Free(es, e, sizeof(netstring_extra));
 	return;
     }
 
@@ -536,10 +635,106 @@ finish_netstring(EventSelector *es,
 	    close(fd);
 	}
     }
-    free(e);
+    Event_Free(es, e, sizeof(netstring_extra));
     return;
 }
 
+/**********************************************************************
+* %FUNCTION: EventTcp_ReadFrame
+* %ARGUMENTS:
+*  es -- event selector
+*  socket -- socket to read from
+*  maxlen -- longest frame we accept
+*  f -- function to call on EOF or when the frame has been read
+*  timeout -- if non-zero, timeout in seconds after which we cancel
+*             operation.
+*  data -- extra data to pass to function f
+* %RETURNS:
+*  A new EventTcpState token or NULL on error
+* %DESCRIPTION:
+*  Sets up a handler to read a length-prefixed frame: a four-byte
+*  big-endian length followed by that many bytes.  f gets the bytes
+*  after the length.  A frame longer than maxlen is an I/O error.
+***********************************************************************/
+EventTcpState *
+EventTcp_ReadFrame(EventSelector *es,
+		   int socket,
+		   int maxlen,
+		   EventTcpIOFinishedFunc f,
+		   int timeout,
+		   void *data)
+{
+    EventTcpState *s;
+    netstring_extra *e = Event_Alloc(es, sizeof(netstring_extra));
+    if (!e) return NULL;
+
+    e->f = f;
+    e->timeout = timeout;
+    e->maxlen = maxlen;
+    e->data = data;
+
+    s = EventTcp_ReadBuf(es, socket, 4, -1, finish_frame, timeout, 1, e);
+    if (!s) {
+	Event_Free(es, e, sizeof(netstring_extra));
+	return NULL;
+    }
+    return s;
+}
+
+/**********************************************************************
+* %FUNCTION: finish_frame (static function)
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- descriptor we've read from
+*  buf -- buffer containing the length
+*  len -- number of chars read
+*  flag -- result flag
+*  data -- extra data to pass along
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Processes the second part of reading a frame
+***********************************************************************/
+static void
+finish_frame(EventSelector *es,
+	     int fd,
+	     char *buf,
+	     int len,
+	     int flag,
+	     void *data)
+{
+    netstring_extra *e = (netstring_extra *) data;
+    unsigned char *u = (unsigned char *) buf;
+    unsigned long readlen;
+    EventTcpState *state;
+
+    if (flag != EVENT_TCP_FLAG_COMPLETE) {
+	if (e->f) {
+	    e->f(es, fd, buf, len, flag, e->data);
+	} else {
+	    close(fd);
+	}
+	Event_Free(es, e, sizeof(netstring_extra));
+	return;
+    }
+
+    readlen = ((unsigned long) u[0] << 24) | ((unsigned long) u[1] << 16) |
+	((unsigned long) u[2] << 8) | (unsigned long) u[3];
+    state = NULL;
+    if (readlen > 0 && readlen <= (unsigned long) e->maxlen) {
+	state = EventTcp_ReadBuf(es, fd, (int) readlen, -1, e->f, e->timeout,
+				 1, e->data);
+    }
+    if (!state) {
+	if (e->f) {
+	    e->f(es, fd, "", 0, EVENT_TCP_FLAG_IOERROR, e->data);
+	} else {
+	    close(fd);
+	}
+    }
+    Event_Free(es, e, sizeof(netstring_extra));
+}
+
 /**********************************************************************
 * %FUNCTION: EventTcp_WriteNetstring
 *  es -- event selector
@@ -565,23 +760,21 @@ EventTcp_WriteNetstring(EventSelector *es,
 {
     char *mybuf;
     int extralen;
-    EventTcpState *state;
 
     if (len < 0 || len > NETSTRING_MAX) {
 	return NULL;
     }
 
-    mybuf = malloc(18+len);
+    if (socket < 0) return NULL;
+    mybuf = Event_Alloc(es, 18+len);
     if (!mybuf) return NULL;
 
     sprintf(mybuf, "%d:", len);
     extralen = strlen(mybuf);
     memcpy(mybuf+extralen, buf, len);
     mybuf[extralen+len] = ',';
-    state = EventTcp_WriteBuf(es, socket, mybuf,
-			      len+extralen+1, f, timeout, data);
-    free(mybuf);
-    return state;
+    return start_write(es, socket, mybuf, len+extralen+1, 18+len, 0,
+		       f, timeout, data);
 }
 
 /**********************************************************************
@@ -620,21 +813,22 @@ EventTcp_ReadBuf(EventSelector *es,
     if (len <= 0) return NULL;
     if (socket < 0) return NULL;
 
-    state = malloc(sizeof(EventTcpState));
+    state = Event_Alloc(es, sizeof(EventTcpState));
     if (!state) return NULL;
     memset(state, 0, sizeof(EventTcpState));
 
     state->socket = socket;
+    state->es = es;
 
-    state->buf = malloc(len+1);
+    state->buf = Event_Alloc(es, len+1);
     if (!state->buf) {
 	free_state(state);
 	return NULL;
     }
+    state->bufsize = len+1;
     state->cur = state->buf;
     state->len = len;
     state->f = f;
-    state->es = es;
     state->chunked = chunked;
     state->got_delim = 0;
 
@@ -660,6 +854,99 @@ EventTcp_ReadBuf(EventSelector *es,
     return state;
 }
 
+/**********************************************************************
+* %FUNCTION: arm_writer (static function)
+* %ARGUMENTS:
+*  es -- event selector
+*  state -- a filled-in EventTcpState
+*  handler -- handle_writeable or handle_writev
+*  timeout -- timeout after which to cancel operation
+* %RETURNS:
+*  state, or NULL on error (in which case state has been freed)
+* %DESCRIPTION:
+*  Registers the handler which drives a write operation.
+***********************************************************************/
+static EventTcpState *
+arm_writer(EventSelector *es,
+	   EventTcpState *state,
+	   EventCallbackFunc handler,
+	   int timeout)
+{
+    struct timeval t;
+
+    if (timeout <= 0) {
+	t.tv_sec = -1;
+	t.tv_usec = -1;
+    } else {
+	t.tv_sec = timeout;
+	t.tv_usec = 0;
+    }
+
+    state->eh = Event_AddHandlerWithTimeout(es, state->socket,
+					    EVENT_FLAG_WRITEABLE,
+					    t, handler, (void *) state);
+    if (!state->eh) {
+	if (!state->f) close(state->socket);
+	free_state(state);
+	return NULL;
+    }
+    state->delim = -1;
+    return state;
+}
+
+/**********************************************************************
+* %FUNCTION: start_write (static function)
+* %ARGUMENTS:
+*  es -- event selector
+*  socket -- socket to write to
+*  buf -- buffer to write; ownership passes to this function
+*  len -- number of bytes to write
+*  bufsize -- size passed to Event_Alloc when buf was allocated
+*  owned -- if non-zero, buf came from malloc() rather than Event_Alloc
+*  f -- function to call when all bytes have been written
+*  timeout -- timeout after which to cancel operation
+*  data -- extra data to pass to function f.
+* %RETURNS:
+*  A new EventTcpState token or NULL on error
+* %DESCRIPTION:
+*  Common code for the single-buffer write functions.  buf is released
+*  when the operation finishes, or immediately on error.
+***********************************************************************/
+static EventTcpState *
+start_write(EventSelector *es,
+	    int socket,
+	    char *buf,
+	    int len,
+	    int bufsize,
+	    int owned,
+	    EventTcpIOFinishedFunc f,
+	    int timeout,
+	    void *data)
+{
+    EventTcpState *state;
+
+    state = Event_Alloc(es, sizeof(EventTcpState));
+    if (!state) {
+	if (owned) free(buf);
+	else Event_Free(es, buf, bufsize);
+	if (!f) close(socket);
+	return NULL;
+    }
+    memset(state, 0, sizeof(EventTcpState));
+
+    state->socket = socket;
+    state->es = es;
+    state->buf = buf;
+    state->bufsize = bufsize;
+    state->bufOwned = owned;
+    state->cur = state->buf;
+    state->len = len;
+    state->f = f;
+    state->data = data;
+
+    return arm_writer(es, state, handle_writeable, timeout);
+}
+
 /**********************************************************************
 * %FUNCTION: EventTcp_WriteBuf
 * %ARGUMENTS:
@@ -673,7 +960,8 @@ EventTcp_ReadBuf(EventSelector *es,
 * %RETURNS:
 *  A new EventTcpState token or NULL on error
 * %DESCRIPTION:
-*  Sets up a handler to write a buffer to a socket.
+*  Sets up a handler to write a buffer to a socket.  The buffer is
+*  copied, so the caller may reuse it as soon as this function returns.
 ***********************************************************************/
 EventTcpState *
 EventTcp_WriteBuf(EventSelector *es,
@@ -684,8 +972,8 @@ EventTcp_WriteBuf(EventSelector *es,
 		  int timeout,
 		  void *data)
 {
+    char *mybuf;
     EventTcpState *state;
-    struct timeval t;
 
     EVENT_DEBUG(("EventTcp_WriteBuf(es=%p, socket=%d, len=%d, timeout=%d)\n", es, socket, len, timeout));
     if (socket < 0) return NULL;
@@ -694,48 +982,126 @@ EventTcp_WriteBuf(EventSelector *es,
 	return NULL;
     }
 
-    state = malloc(sizeof(EventTcpState));
-    if (!state) {
+    mybuf = Event_Alloc(es, len);
+    if (!mybuf) {
 	if (!f) close(socket);
 	return NULL;
     }
-    memset(state, 0, sizeof(EventTcpState));
+    memcpy(mybuf, buf, len);
 
-    state->socket = socket;
+    state = start_write(es, socket, mybuf, len, len, 0, f, timeout, data);
+    EVENT_DEBUG(("EventTcp_WriteBuf() -> %p\n", state));
+    return state;
+}
 
-    state->buf = malloc(len);
-    if (!state->buf) {
-	free_state(state);
+/**********************************************************************
+* %FUNCTION: EventTcp_WriteBufOwned
+* %ARGUMENTS:
+*  es -- event selector
+*  socket -- socket to write to
+*  buf -- buffer obtained from malloc()
+*  len -- number of bytes to write
+*  f -- function to call on EOF or when all bytes have been written
+*  timeout -- timeout after which to cancel operation
+*  data -- extra data to pass to function f.
+* %RETURNS:
+*  A new EventTcpState token or NULL on error
+* %DESCRIPTION:
+*  Like EventTcp_WriteBuf, but takes over buf instead of copying it.
+*  buf is passed to free() once the write completes or is cancelled.
+*  Ownership passes even if this function fails, so the caller must not
+*  touch buf after calling it.
+***********************************************************************/
+EventTcpState *
+EventTcp_WriteBufOwned(EventSelector *es,
+		       int socket,
+		       char *buf,
+		       int len,
+		       EventTcpIOFinishedFunc f,
+		       int timeout,
+		       void *data)
+{
+    EVENT_DEBUG(("EventTcp_WriteBufOwned(es=%p, socket=%d, len=%d, timeout=%d)\n", es, socket, len, timeout));
+    if (socket < 0) {
+	free(buf);
+	return NULL;
+    }
+    if (len <= 0) {
+	free(buf);
 	if (!f) close(socket);
 	return NULL;
     }
-    memcpy(state->buf, buf, len);
+    return start_write(es, socket, buf, len, 0, 1, f, timeout, data);
+}
 
-    state->cur = state->buf;
-    state->len = len;
-    state->f = f;
-    state->es = es;
+/**********************************************************************
+* %FUNCTION: EventTcp_WriteV
+* %ARGUMENTS:
+*  es -- event selector
+*  socket -- socket to write to
+*  iov -- segments to write, in order
+*  iovcnt -- number of segments (at most EVENT_TCP_MAX_IOV)
+*  f -- function to call on EOF or when all bytes have been written
+*  timeout -- timeout after which to cancel operation
+*  data -- extra data to pass to function f.
+* %RETURNS:
+*  A new EventTcpState token or NULL on error
+* %DESCRIPTION:
+*  Gathers the segments onto the socket with writev().  The iovec array
+*  is copied but the data it points to is not: each segment must stay
+*  valid until f is called or the operation is cancelled.  f receives a
+*  NULL buffer and the number of bytes written.
+***********************************************************************/
+EventTcpState *
+EventTcp_WriteV(EventSelector *es,
+		int socket,
+		struct iovec const *iov,
+		int iovcnt,
+		EventTcpIOFinishedFunc f,
+		int timeout,
+		void *data)
+{
+    EventTcpState *state;
+    int i, len = 0;
 
-    if (timeout <= 0) {
-	t.tv_sec = -1;
-	t.tv_usec = -1;
-    } else {
-	t.tv_sec = timeout;
-	t.tv_usec = 0;
+    EVENT_DEBUG(("EventTcp_WriteV(es=%p, socket=%d, iovcnt=%d, timeout=%d)\n", es, socket, iovcnt, timeout));
+    if (socket < 0) return NULL;
+    if (iovcnt <= 0 || iovcnt > EVENT_TCP_MAX_IOV) {
+	errno = EINVAL;
+	if (!f) close(socket);
+	return NULL;
+    }
+    for (i=0; i<iovcnt; i++) {
+	len += (int) iov[i].iov_len;
+    }
+    if (len <= 0) {
+	if (!f) close(socket);
+	return NULL;
     }
 
-    state->eh = Event_AddHandlerWithTimeout(es, socket, EVENT_FLAG_WRITEABLE,
-					    t, handle_writeable,
-					    (void *) state);
-    if (!state->eh) {
-	free_state(state);
+    state = Event_Alloc(es, sizeof(EventTcpState));
+    if (!state) {
 	if (!f) close(socket);
 	return NULL;
     }
+    memset(state, 0, sizeof(EventTcpState));
 
+    state->socket = socket;
+    state->es = es;
+    state->iov = Event_Alloc(es, iovcnt * sizeof(struct iovec));
+    if (!state->iov) {
+	if (!f) close(socket);
+	free_state(state);
+	return NULL;
+    }
+    memcpy(state->iov, iov, iovcnt * sizeof(struct iovec));
+    state->iovcnt = iovcnt;
+    state->len = len;
+    state->f = f;
     state->data = data;
-    state->delim = -1;
-    EVENT_DEBUG(("EventTcp_WriteBuf() -> %p\n", state));
+
+    state = arm_writer(es, state, handle_writev, timeout);
+    EVENT_DEBUG(("EventTcp_WriteV() -> %p\n", state));
     return state;
 }
 
@@ -785,7 +1151,7 @@ EventTcp_Connect(EventSelector *es,
 	return;
     }
 
-    state = malloc(sizeof(*state));
+    state = Event_Alloc(es, sizeof(*state));
     if (!state) {
 	f(es, fd, EVENT_TCP_FLAG_IOERROR, data);
 	return;
@@ -806,7 +1172,7 @@ EventTcp_Connect(EventSelector *es,
 					      t, handle_connect,
 					      (void *) state);
     if (!state->conn) {
-	free(state);
+	Event_Free(es, state, sizeof(*state));
 	f(es, fd, EVENT_TCP_FLAG_IOERROR, data);
 	return;
     }
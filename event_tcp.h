@@ -17,6 +17,7 @@
 
 #include "event.h"
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #ifndef HAVE_SOCKLEN_T
 typedef int socklen_t;
@@ -43,11 +44,19 @@ typedef void (*EventTcpIOFinishedFunc)(EventSelector *es,
 #define EVENT_TCP_FLAG_EOF      2
 #define EVENT_TCP_FLAG_TIMEOUT  3
 
+/* Maximum number of segments accepted by EventTcp_WriteV */
+#define EVENT_TCP_MAX_IOV 16
+
 typedef struct EventTcpState_t {
     int socket;
     char *buf;
     char *cur;
     int len;
+    int bufsize;		/* Size passed to Event_Alloc for buf */
+    int bufOwned;		/* buf came from malloc(), not Event_Alloc */
+    struct iovec *iov;		/* Segments for EventTcp_WriteV */
+    int iovcnt;
+    int iovpos;			/* First segment not yet fully written */
     int chunked;
     int delim;
     int got_delim;
@@ -93,6 +102,22 @@ extern EventTcpState *EventTcp_WriteBuf(EventSelector *es,
 					int timeout,
 					void *data);
 
+extern EventTcpState *EventTcp_WriteBufOwned(EventSelector *es,
+					     int socket,
+					     char *buf,
+					     int len,
+					     EventTcpIOFinishedFunc f,
+					     int timeout,
+					     void *data);
+
+extern EventTcpState *EventTcp_WriteV(EventSelector *es,
+				      int socket,
+				      struct iovec const *iov,
+				      int iovcnt,
+				      EventTcpIOFinishedFunc f,
+				      int timeout,
+				      void *data);
+
 extern EventTcpState *
 EventTcp_ReadNetstring(EventSelector *es,
 		       int socket,
@@ -100,6 +125,14 @@ EventTcp_ReadNetstring(EventSelector *es,
 		       int timeout,
 		       void *data);
 
+extern EventTcpState *
+EventTcp_ReadFrame(EventSelector *es,
+		   int socket,
+		   int maxlen,
+		   EventTcpIOFinishedFunc f,
+		   int timeout,
+		   void *data);
+
 extern EventTcpState *
 EventTcp_WriteNetstring(EventSelector *es,
 			int socket,
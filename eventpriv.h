@@ -23,6 +23,12 @@
 #include <unistd.h>
 #endif
 
+/* epoll takes precedence if both are requested */
+#ifdef EVENT_USE_EPOLL
+#undef EVENT_USE_POLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef EVENT_USE_POLL
 #include <poll.h>
 #endif
@@ -30,24 +36,76 @@
 /* Handler structure */
 typedef struct EventHandler_t {
     struct EventHandler_t *next; /* Link in list                           */
+    struct EventHandler_t *prev; /* Back-link in list                      */
+    struct EventHandler_t *nextDeleted; /* Link in pending-deletion list   */
     int fd;			/* File descriptor for select              */
     unsigned int flags;		/* Select on read or write; enable timeout */
-#ifdef EVENT_USE_POLL
+#if defined(EVENT_USE_POLL) || defined(EVENT_USE_EPOLL)
     unsigned int pollflags;     /* Flags returned by poll()                */
+#endif
+#ifdef EVENT_USE_EPOLL
+    struct EventHandler_t *fdNext; /* Next handler on the same descriptor  */
 #endif
     struct timeval tmout;	/* Absolute time for timeout               */
+    int heapIndex;		/* Position in timer heap, or -1           */
     EventCallbackFunc fn;	/* Callback function                       */
     void *data;			/* Extra data to pass to callback          */
 } EventHandler;
 
+#ifdef EVENT_USE_EPOLL
+/* Per-descriptor registration state, indexed by fd */
+typedef struct EventFdEntry_t {
+    EventHandler *handlers;	/* Handlers watching this descriptor       */
+    unsigned int events;	/* EPOLL* mask registered with the kernel  */
+} EventFdEntry;
+#endif
+
+/* Memory pools: a free list of same-sized blocks */
+typedef struct EventPoolBlock_t {
+    struct EventPoolBlock_t *next;
+} EventPoolBlock;
+
+typedef struct EventPool_t {
+    EventPoolBlock *free;	/* Cached blocks                           */
+    int numFree;		/* Number of cached blocks                 */
+    unsigned long allocated;	/* Blocks obtained from malloc()           */
+    unsigned long reused;	/* Allocations served from the free list   */
+} EventPool;
+
+/* Event_Alloc size classes: 32 bytes up to 16kB in powers of two */
+#define EVENT_POOL_MIN_SHIFT 5
+#define EVENT_POOL_CLASSES 10
+
+/* Upper bounds on cached blocks, so a burst does not pin memory */
+#define EVENT_POOL_MAX_FREE 64
+#define EVENT_POOL_MAX_HANDLERS 1024
+
 /* Selector structure */
 typedef struct EventSelector_t {
     EventHandler *handlers;	/* Linked list of EventHandlers            */
+    EventHandler *deleted;	/* Handlers awaiting deferred deletion     */
+    EventHandler **timers;	/* Binary min-heap of handlers by tmout    */
+    int numTimers;		/* Number of handlers in timers            */
+    int timersSize;		/* Number of slots in timers               */
+    EventPool handlerPool;	/* Recycled EventHandlers                  */
+    EventPool pools[EVENT_POOL_CLASSES]; /* Event_Alloc size classes       */
     int nestLevel;		/* Event-handling nesting level            */
     int opsPending;		/* True if operations are pending          */
     int destroyPending;		/* If true, a destroy is pending           */
+#ifdef EVENT_USE_EPOLL
+    int epfd;			/* epoll instance                          */
+    int numRegistered;		/* Descriptors registered with epfd        */
+    EventFdEntry *fdTable;	/* fd -> handlers and registered events    */
+    int fdTableSize;		/* Number of slots in fdTable              */
+    struct epoll_event *epollEvents; /* Buffer for epoll_wait()            */
+    int maxEpollEvents;		/* Number of slots in epollEvents          */
+    EventHandler **ready;	/* Handlers to dispatch this iteration     */
+    int readySize;		/* Number of slots in ready                */
+#endif
 } EventSelector;
 
 /* Private flags */
 #define EVENT_FLAG_DELETED 256
+#define EVENT_FLAG_EXPIRED 512
+#define EVENT_FLAG_LINKED  1024	/* On the handler list                 */
 #endif
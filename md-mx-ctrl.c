@@ -33,6 +33,8 @@
 #include <getopt.h>
 #endif
 
+#include "mx_board.h"
+
 #ifndef AF_LOCAL
 #define AF_LOCAL AF_UNIX
 #endif
@@ -260,7 +262,7 @@ doStatus(char const *sock)
     if (MXCommand(sock, "status\n", ans, sizeof(ans)) < 0) {
 	return EXIT_FAILURE;
     }
-    if (*ans != 'I' && *ans != 'K' && *ans != 'S' && *ans != 'B') {
+    if (*ans != 'I' && *ans != 'K' && *ans != 'S' && *ans != 'B' && *ans != 'W') {
 	fprintf(errfp, "ERROR %s", ans);
 	return EXIT_FAILURE;
     }
@@ -287,6 +289,9 @@ doStatus(char const *sock)
 	case 'B':
 	    printf("busy\n");
 	    break;
+	case 'W':
+	    printf("starting\n");
+	    break;
 	default:
 	    printf("unknown state '%c'\n", ans[i]);
 	}
@@ -294,6 +299,54 @@ doStatus(char const *sock)
     return EXIT_SUCCESS;
 }
 
+static int
+doBoard(char const *sock)
+{
+    char path[4096];
+    char tag[MX_BOARD_TAG_LEN];
+    char *ptr;
+    MXBoardValues v;
+    unsigned int seq;
+    time_t now;
+    int i, n;
+
+    snprintf(path, sizeof(path), "%s.board", sock);
+    n = MXBoardOpen(path);
+    if (n < 0) {
+	fprintf(errfp, "ERROR No status board at %s: Is multiplexor running with -Z?\n", path);
+	return EXIT_FAILURE;
+    }
+
+    now = time(NULL);
+    for (i=0; i<n; i++) {
+	if (MXBoardRead(i, &v) < 0) {
+	    fprintf(errfp, "ERROR Status board at %s is no longer valid\n", path);
+	    return EXIT_FAILURE;
+	}
+	printf("%d %c", i, v.state);
+	if (v.state != 'S') {
+	    printf(" %ld requests=%d scans=%d age=%ld", v.pid,
+		   v.numRequests, v.numScans, (long) now - v.started);
+	}
+	printf(" ago=%ld", (long) now - v.stateChange);
+	if (v.state == 'B') {
+	    if (v.command[0]) {
+		printf(" (%s)", v.command);
+	    }
+	    /* Only show a tag written since the command started */
+	    if (MXBoardReadTag(i, &seq, tag) == 0 && seq != v.tagSeq && tag[0]) {
+		/* Sanitize tag -- ASCII-centric! */
+		for (ptr = tag; *ptr; ptr++) {
+		    if (*ptr < ' ' || *ptr > '~') *ptr = ' ';
+		}
+		printf(" [%s]", tag);
+	    }
+	}
+	printf("\n");
+    }
+    return EXIT_SUCCESS;
+}
+
 static int
 doJsonStatus(char const *sock)
 {
@@ -311,7 +364,7 @@ doJsonStatus(char const *sock)
     if (MXCommand(sock, "status\n", ans, sizeof(ans)) < 0) {
 	return EXIT_FAILURE;
     }
-    if (*ans != 'I' && *ans != 'K' && *ans != 'S' && *ans != 'B') {
+    if (*ans != 'I' && *ans != 'K' && *ans != 'S' && *ans != 'B' && *ans != 'W') {
 	fprintf(errfp, "ERROR %s", ans);
 	return EXIT_FAILURE;
     }
@@ -344,6 +397,9 @@ doJsonStatus(char const *sock)
 	case 'B':
 	    printf("\"busy\"");
 	    break;
+	case 'W':
+	    printf("\"starting\"");
+	    break;
 	default:
 	    printf("\"unknown state '%c'\"", ans[i]);
 	}
@@ -368,7 +424,7 @@ doBarStatus(char const *sock)
     if (MXCommand(sock, "status\n", ans, sizeof(ans)) < 0) {
 	return EXIT_FAILURE;
     }
-    if (*ans != 'I' && *ans != 'K' && *ans != 'S' && *ans != 'B') {
+    if (*ans != 'I' && *ans != 'K' && *ans != 'S' && *ans != 'B' && *ans != 'W') {
 	fprintf(errfp, "ERROR %s", ans);
 	return EXIT_FAILURE;
     }
@@ -526,6 +582,45 @@ doLoad1(char const *sock,
     return EXIT_SUCCESS;
 }
 
+static int
+doLatency(char const *sock,
+	  char const *cmd)
+{
+    char ans[8192];
+    char kind[16], measure[16];
+    char *line, *next;
+    unsigned int count;
+    double mean, p50, p90, p95, p99, p999, max;
+
+    if (MXCommand(sock, cmd, ans, sizeof(ans)) < 0) {
+	return EXIT_FAILURE;
+    }
+    if (strncmp(ans, "scan ", 5)) {
+	printf("Could not interpret response: %s", ans);
+	return EXIT_FAILURE;
+    }
+
+    printf("%-8s %-7s %8s %10s %10s %10s %10s %10s %10s %10s\n",
+	   "Kind", "Measure", "Count", "MeanMS", "P50", "P90", "P95", "P99", "P99.9", "MaxMS");
+    for (line = ans; *line; line = next) {
+	next = strchr(line, '\n');
+	if (next) {
+	    *next++ = 0;
+	} else {
+	    next = line + strlen(line);
+	}
+	if (sscanf(line, "%15s %15s count=%u mean_ms=%lf p50_ms=%lf p90_ms=%lf p95_ms=%lf p99_ms=%lf p999_ms=%lf max_ms=%lf",
+		   kind, measure, &count, &mean, &p50, &p90, &p95, &p99, &p999, &max) != 10) {
+	    printf("Could not interpret response: %s\n", line);
+	    return EXIT_FAILURE;
+	}
+	if (!count) continue;
+	printf("%-8s %-7s %8u %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+	       kind, measure, count, mean, p50, p90, p95, p99, p999, max);
+    }
+    return EXIT_SUCCESS;
+}
+
 static int
 doJsonLoad1(char const *sock,
 	char const *cmd)
@@ -690,6 +785,12 @@ process(char const *sock, char const *cmd) {
 	return doBarStatus(sock);
     } else if (!strcmp(cmd, "jsonstatus\n")) {
 	return doJsonStatus(sock);
+    } else if (!strcmp(cmd, "board\n")) {
+	return doBoard(sock);
+    } else if (!strcmp(cmd, "latency\n") || !strncmp(cmd, "latency ", 8)) {
+	return doLatency(sock, cmd);
+    } else if (!strcmp(cmd, "rawlatency\n") || !strncmp(cmd, "rawlatency ", 11)) {
+	return doCmd(sock, cmd+3, 0);
     } else if (!strcmp(cmd, "reread\n")) {
 	return doCmd(sock, "reread\n", 0);
     } else if (!strcmp(cmd, "rawstatus\n")) {
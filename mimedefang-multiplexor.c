@@ -15,6 +15,9 @@
 #include "config.h"
 #include "event_tcp.h"
 #include "mimedefang.h"
+#include "mx_board.h"
+#include "mx_state.h"
+#include "mx_zygote.h"
 
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
@@ -44,6 +47,8 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <signal.h>
 #include <fcntl.h>
@@ -67,6 +72,32 @@ static char *lockfile = NULL;
 #include <sys/resource.h>
 #endif
 
+/* Supervise workers through pidfds where the system supports them */
+#if defined(HAVE_SYS_PIDFD_H) && defined(HAVE_PIDFD_OPEN)
+#define USE_PIDFD 1
+#include <sys/pidfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#endif
+
+/* Start non-embedded workers with posix_spawn where the file actions
+   can close every inherited descriptor */
+#if defined(HAVE_SPAWN_H) && defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP)
+#define USE_POSIX_SPAWN 1
+#include <spawn.h>
+extern char **environ;
+#endif
+
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+/* Rebuild the embedded interpreter in a zygote process, off the
+   multiplexor's event loop, where the interpreter can be recreated */
+#if defined(EMBED_PERL) && defined(SAFE_EMBED_PERL)
+#define USE_ZYGOTE 1
+#endif
+
 #define STR(x) STR2(x)
 #define STR2(x) #x
 #define MAX_CMD_LEN 4096	/* Maximum length of command from mimedefang */
@@ -79,17 +110,43 @@ static char *lockfile = NULL;
 
 #define WORKERNO(s) ((int) ((s) - AllWorkers))
 
-/* A worker can be in one of four states:
-   Stopped -- Worker has no associated Perl process
-   Idle    -- Worker has an associated process, but is not doing work
-   Busy    -- Worker is processing a command
-   Killed  -- Worker has been killed, but we're waiting for it to exit */
+/* A worker can be in one of five states:
+   Stopped  -- Worker has no associated Perl process
+   Idle     -- Worker has an associated process, but is not doing work
+   Busy     -- Worker is processing a command
+   Killed   -- Worker has been killed, but we're waiting for it to exit
+   Starting -- Worker has a process which has not yet answered the
+               "ping" it was sent on startup, so it is still reading
+               the filter and running filter_initialize */
 
 #define STATE_STOPPED    0
 #define STATE_IDLE       1
 #define STATE_BUSY       2
 #define STATE_KILLED     3
-#define NUM_WORKER_STATES 4
+#define STATE_STARTING   4
+#define NUM_WORKER_STATES 5
+/* Number of recipok commands in flight for one recipient domain */
+typedef struct DomainCount_t {
+    struct DomainCount_t *next; /* Hash chain, or free list                  */
+    int count;                  /* Busy workers doing recipok for domain     */
+    struct Request_t *waitHead; /* Recipoks queued until the count drops     */
+    struct Request_t *waitTail;
+    int numWaiting;             /* Number of requests on that queue          */
+    int ready;                  /* Is the entry on the ReadyDomains list?    */
+    struct DomainCount_t *nextReady; /* Links in ReadyDomains list           */
+    struct DomainCount_t *prevReady;
+    char domain[MAX_DOMAIN_LEN]; /* Lower-cased domain                       */
+} DomainCount;
+
+/* A worker reserved for one mimedefang connection */
+typedef struct Lease_t {
+    unsigned int id;            /* Lease ID, or 0 if the slot is free        */
+    EventSelector *es;          /* Event selector                            */
+    EventHandler *timer;        /* Fires when the lease expires              */
+    struct Worker_t *worker;    /* Worker running a command under the lease  */
+    int nextFree;               /* Next free slot, or -1                     */
+} Lease;
+
 /* Structure of a worker process */
 typedef struct Worker_t {
     struct Worker_t *next;	/* Link in free/busy list                    */
@@ -112,33 +169,67 @@ typedef struct Worker_t {
     EventHandler *errHandler;	/* Read handler for stderr                   */
     EventHandler *statusHandler; /* Read handler for status descriptor       */
     EventHandler *termHandler;  /* Timer after which we send SIGTERM         */
+    int pidfd;			/* pidfd for worker process, or -1           */
+    EventHandler *pidfdHandler; /* Read handler for pidfd (worker exit)      */
     char workdir[MAX_DIR_LEN+1]; /* Working directory for current scan       */
     char qid[MAX_QID_LEN+1];    /* Current Sendmail queue ID                 */
     char status_tag[MAX_STATUS_LEN]; /* Status tag                           */
+    unsigned int boardSeq;      /* Last tag sequence seen on status board    */
     char domain[MAX_DOMAIN_LEN]; /* Current domain for recipok               */
+    DomainCount *recipokDomain; /* Counter we hold while doing recipok       */
+    Lease *lease;               /* Lease the current command runs under      */
     int generation;		/* Worker's generation                       */
     int state;			/* Worker's state                            */
     unsigned int histo;         /* Kind of double-duty as histogram value    */
     int tick_no;                /* Which tick are we handling?               */
     struct timeval start_cmd;   /* Time when current command started         */
+    long queueWaitUs;           /* Time current command spent queued (us)    */
     int cmd;                    /* Which of the 4 commands with history?     */
     int last_cmd;               /* Last command executed                     */
+    int idleBucket;             /* Idle bucket we are on, or -1              */
+    int idleSlot;               /* Position in that bucket's heap            */
+    struct timeval startTime;   /* Time when worker process was started      */
+    long startupUs;             /* Time it took to become ready (us), or -1  */
+    long warmupUs;              /* Time its warm-up scan took (us), or -1    */
+    struct Zygote_t *zygote;    /* Zygote that forked the worker, or NULL    */
 } Worker;
 
 /* A queued request */
 typedef struct Request_t {
-    struct Request_t *next;     /* Next request in linked list               */
+    struct Request_t *next;     /* Next request in its queue, or free list   */
+    struct Request_t *prev;     /* Previous request in its queue             */
     EventSelector *es;		/* Event selector                            */
     EventHandler *timeoutHandler; /* Time out if we're queued too long       */
     int fd;                     /* File descriptor for client communication  */
     char *cmd;                  /* Command to send to worker                 */
+    int map;                    /* Is this a Sendmail map request?           */
+    int cls;                    /* Priority class                            */
+    DomainCount *domain;        /* Domain queue we wait on, or NULL          */
+    unsigned int lease;         /* ID of the lease it runs under, or 0       */
+    struct timeval queued;      /* Time when the request was queued          */
 } Request;
 
-#define MAX_QUEUE_SIZE 128      /* Hard-coded limit                          */
-Request RequestQueue[MAX_QUEUE_SIZE];
+/* Queued requests wait in one FIFO per priority class.  Lower classes
+   are served first. */
+#define NUM_QUEUE_CLASSES 3
+
+/* Queue statistics for one priority class */
+typedef struct QueueStats_t {
+    int depth;                  /* Requests waiting now                      */
+    unsigned long queued;       /* Requests queued since startup             */
+    unsigned long dispatched;   /* ... handed to a worker                    */
+    unsigned long timedOut;     /* ... failed by the queue timeout           */
+    double waitTotalMs;         /* Total wait of dispatched requests         */
+    double waitMaxMs;           /* Longest wait of a dispatched request      */
+} QueueStats;
+
+Request *RequestQueue;          /* Settings.requestQueueSize request slots   */
+Request *FreeRequests;          /* Unused slots                              */
 int NumQueuedRequests = 0;
-Request *RequestHead;
-Request *RequestTail;
+static int NumQueuedLeased = 0; /* ... of which carry a lease ID             */
+Request *RequestHead[NUM_QUEUE_CLASSES];
+Request *RequestTail[NUM_QUEUE_CLASSES];
+static QueueStats ClassStats[NUM_QUEUE_CLASSES];
 
 Worker *AllWorkers;		/* Array of all workers                      */
 Worker *Workers[NUM_WORKER_STATES]; /* Lists of workers in each state           */
@@ -149,11 +240,144 @@ int NumMsgsProcessed = 0;	/* Number of messages processed since last
 unsigned int Activations = 0;	/* Incremented when a worker is activated    */
 static int Old_NumFreeWorkers = -1;
 int NumUnprivConnections = 0;
+static int StatusBoard = 0;	/* Status reports go through sockName.board  */
+
+/* Leases.  A lease holds back one free worker for a mimedefang
+   connection until it is consumed by a scan, released or expires.
+   While a command runs under a lease, its worker is busy and the lease
+   holds nothing back. */
+static Lease *Leases;           /* Settings.maxWorkers lease slots           */
+static int FreeLease = -1;      /* First free slot                           */
+static int NumLeases = 0;       /* Leases outstanding                        */
+static int NumActiveLeases = 0; /* ... with a command running                */
+static unsigned int LeaseSerial = 0;
+static unsigned long LeasesGranted = 0;
+static unsigned long LeasesDenied = 0;
+static unsigned long LeasesConsumed = 0;
+static unsigned long LeasesReleased = 0;
+static unsigned long LeasesExpired = 0;
+#define NUM_RESERVED_WORKERS (NumLeases - NumActiveLeases)
+#define MAX_LEASE_TTL 3600
+
+/* A persistent connection from mimedefang carrying many requests.
+   Requests and replies are netstrings of the form "id command" and
+   "id reply"; replies may come back in any order. */
+typedef struct MuxReply_t {
+    struct MuxReply_t *next;    /* Next reply waiting to be written          */
+    char hdr[64];               /* Netstring length and ID, or frame header  */
+    int hlen;
+    char *buf;                  /* The reply itself                          */
+    int len;
+    int tail;                   /* Does a netstring's "," follow?            */
+} MuxReply;
+
+typedef struct MuxConn_t {
+    EventSelector *es;		/* Event selector                            */
+    int fd;                     /* The connection                            */
+    int inflight;               /* Requests we have not answered yet         */
+    int readDone;               /* Client has closed its side                */
+    int dead;                   /* Write failed; discard replies             */
+    MuxReply *writing;          /* Reply being written, or NULL              */
+    int binary;                 /* Requests and replies are binary frames    */
+    MuxReply *outHead;          /* Replies waiting for the writer            */
+    MuxReply *outTail;
+} MuxConn;
+
+/* Each request in flight on a MuxConn gets a "client handle" which
+   stands in for a client file descriptor in Worker.clientFD,
+   Request.fd and the reply functions. */
+typedef struct MuxRequest_t {
+    MuxConn *conn;              /* Connection, or NULL if slot is free       */
+    unsigned long id;           /* Client's request ID                       */
+    int nextFree;               /* Next free slot, or -1                     */
+} MuxRequest;
+
+#define MUX_HANDLE_BASE 0x40000000
+#define IS_MUX_HANDLE(fd) ((fd) >= MUX_HANDLE_BASE)
+static MuxRequest *MuxRequests = NULL;
+static int NumMuxRequests = 0;
+static int FreeMuxRequest = -1;
+static int NumMuxConns = 0;
+
+/* A binary request, decoded */
+typedef struct FrameRequest_t {
+    unsigned int leaseId;       /* Lease ID from the header                  */
+    Lease *lease;               /* ... the lease itself, if it can be used   */
+    MXFrameFields f;            /* The fields                                */
+} FrameRequest;
+
+struct FrameOp_t;
+typedef void (*FrameHandler)(EventSelector *es, int fd,
+			     struct FrameOp_t const *op, FrameRequest *req);
+
+/* Opcode dispatch table entry */
+typedef struct FrameOp_t {
+    char const *name;           /* Command the opcode stands for             */
+    int minFields;              /* Fields the request must have              */
+    int maxFields;              /* ... and may have (ESMTP arguments)        */
+    int qidField;               /* Field holding the queue ID, or -1         */
+    FrameHandler handler;
+} FrameOp;
+
+/* Decoded string fields live here; we only decode one request at a time */
+static char FrameText[MX_FRAME_TEXT];
 
 /* Autoscaling state */
 static time_t LastScaleOut = 0;
 static time_t LastScaleIn  = 0;
 static double EMABusyRatio = 0.0;
+static unsigned long AutoscaleOuts = 0;
+static unsigned long AutoscaleIns = 0;
+
+/* Requests turned away for want of a worker: no free worker, a worker
+   that could not be started, or a queue timeout */
+static unsigned long Rejections = 0;
+
+/* Backlog signal which called for a scale-out at the last check */
+#define SCALE_SIGNAL_NONE       0
+#define SCALE_SIGNAL_BUSY       1
+#define SCALE_SIGNAL_QUEUED     2
+#define SCALE_SIGNAL_REJECTS    3
+#define SCALE_SIGNAL_QUEUE_WAIT 4
+#define NUM_SCALE_SIGNALS       5
+
+static char const *ScaleSignalName[NUM_SCALE_SIGNALS] = {
+    "none",
+    "busy",
+    "queued",
+    "rejects",
+    "queue_wait"
+};
+
+/* Inputs to the last autoscale decision, for the autoscale command */
+static int AutoscaleQueued = 0;
+static unsigned long AutoscaleRejections = 0;
+static unsigned long RejectionsSeen = 0;
+static double AutoscaleQueueWait = 0.0;
+static int AutoscaleSignal = SCALE_SIGNAL_NONE;
+
+/* Predictive autoscaling (-K predict).  The peak demand (busy and
+   leased workers plus queued requests) seen in each hour of the week
+   is kept as a moving average over weeks.  Enough workers are kept
+   running for the peak expected in the current hour and, from
+   predictLead seconds before it starts, the next one. */
+#define PROFILE_HOURS (7*24)
+#define PROFILE_ALPHA 0.3	/* Weight of the latest week */
+
+typedef struct {
+    double peak;		/* Moving average of the hour's peak demand */
+    int weeks;			/* Weeks seen */
+} ProfileSlot;
+
+static ProfileSlot AutoscaleProfile[PROFILE_HOURS];
+static long ProfileHour = -1;	/* Hour since epoch being observed */
+static int ProfileSlotNow = -1;	/* ... and its hour of the week */
+static int ProfilePeak = 0;	/* ... and its peak demand so far */
+static int DailyPeak[24];	/* Peak demand of each of the last 24 hours */
+static long DailyPeakHour[24];	/* ... and the hour since epoch it is for */
+static double PredictedDemand = 0.0; /* At the last autoscale check */
+static int PredictedWorkers = 0;     /* Workers wanted for it */
+static int ReportedTarget = 0;       /* Last target logged in a dry run */
 
 static pid_t ParentPid = (pid_t) -1;
 
@@ -184,11 +408,14 @@ struct Settings_t {
     unsigned long maxAS;        /* Maximum address space for workers         */
     int logStatusInterval;      /* How often to log status to syslog        */
     char const *mapSock;        /* Socket for Sendmail TCP map requests     */
+    char const *metricsSock;    /* Socket for HTTP metrics scrapes          */
+    char const *stateFile;      /* File keeping statistics across restarts  */
     int requestQueueSize;
     int requestQueueTimeout;
     int listenBacklog;		/* Listen backlog                           */
     int useEmbeddedPerl;	/* Use embedded Perl interpreter            */
     char const *notifySock;     /* Socket for notifications                 */
+    int publishGauge;           /* Publish worker counts in sockName.gauge  */
     int tick_interval;		/* Do "tick" request every tick_interval s  */
     int num_ticks;              /* How many tick types to cycle through     */
     char const *syslog_label;   /* Syslog label                             */
@@ -201,6 +428,13 @@ struct Settings_t {
     int    scaleOutCooldown;     /* Min seconds between consecutive scale-outs*/
     int    scaleInCooldown;      /* Min seconds between consecutive scale-ins */
     double emaAlpha;             /* EMA smoothing factor (0,1)                */
+    int    predictive;           /* Pre-spawn workers from the weekly profile */
+    int    predictLead;          /* Seconds ahead of an hour to prepare for it*/
+    int    autoscaleDryRun;      /* Log autoscale decisions but don't act     */
+    int    scaleOutQueued;       /* Queued requests that trigger scale-out    */
+    int    scaleOutRejections;   /* Rejections per check that trigger it      */
+    int    scaleOutQueueWaitMs;  /* p95 queue wait that triggers scale-out    */
+    int    scaleInQueueWaitMs;   /* p95 queue wait that blocks scale-in       */
 } Settings;
 
 /* Structure for keeping statistics on number of messages processed in
@@ -222,6 +456,52 @@ static char *CmdName[] = {
     "recipok"
 };
 
+/* Priority class of queued requests for each command, for other
+   commands and for map requests.  Set with -C; by default everything
+   is in class 0, which gives a single FIFO. */
+#define QUEUE_KIND_OTHER NUM_CMDS
+#define QUEUE_KIND_MAP   (NUM_CMDS+1)
+#define NUM_QUEUE_KINDS  (NUM_CMDS+2)
+static int QueueClass[NUM_QUEUE_KINDS];
+static char const *QueueKindName[NUM_QUEUE_KINDS] = {
+    "scan",
+    "relayok",
+    "senderok",
+    "recipok",
+    "other",
+    "map"
+};
+
+/* Idle workers are also kept in one bucket per value of last_cmd
+   (NO_CMD, OTHER_CMD, SCAN_CMD ... RECIPOK_CMD).  Each bucket is a
+   min-heap on the activation order, so the oldest worker that last ran
+   a given command is always at the top. */
+#define NUM_IDLE_BUCKETS (NUM_CMDS - NO_CMD)
+#define IDLE_BUCKET(cmd) ((cmd) - NO_CMD)
+static Worker **IdleHeap[NUM_IDLE_BUCKETS];
+static int IdleHeapSize[NUM_IDLE_BUCKETS];
+
+/* Hash table of domain -> number of busy workers doing recipok for it.
+   An entry lives while it has busy workers or queued requests, so there
+   can be no more than maxWorkers + requestQueueSize of them; entries
+   come from a preallocated array. */
+static DomainCount *DomainCounts;
+static int NumDomainCounts;
+static DomainCount *FreeDomainCounts;
+static DomainCount **DomainHash;
+static unsigned int DomainHashMask;
+
+/* Domains whose count has dropped below the limit while recipoks
+   are waiting for them; served before the main request queue */
+static DomainCount *ReadyDomains = NULL;
+
+/* Statistics for recipoks queued by the per-domain limit */
+static unsigned long DomainQueued = 0;
+static unsigned long DomainDispatched = 0;
+static unsigned long DomainTimedOut = 0;
+static double DomainWaitTotalMs = 0.0;
+static double DomainWaitMaxMs = 0.0;
+
 /* Not real commands */
 
 #define HISTORY_SECONDS (10*60)
@@ -237,9 +517,127 @@ typedef struct {
     int reaped;         /* Number of workers reaped */
 } HistoryBucket;
 
-static HistoryBucket history[NUM_CMDS][HISTORY_SECONDS];
 static HistoryBucket hourly_history[NUM_CMDS][HISTORY_HOURS];
 
+/* Per-second history is kept as running totals.  history_total[cmd]
+   holds the totals since startup and history_mark[cmd][t % HISTORY_SECONDS]
+   the totals as they stood at the start of second t, so the totals
+   for any window in the last HISTORY_SECONDS are the difference of two
+   entries.  Marks are filled in as time advances.  Unsigned arithmetic
+   keeps differences right when the totals wrap. */
+typedef struct {
+    unsigned long count;	/* Number of messages processed */
+    unsigned long workers;	/* TOTAL number of workers (active workers * count) */
+    unsigned long ms;		/* TOTAL scan time in milliseconds */
+    unsigned long activated;	/* Number of workers activated */
+    unsigned long reaped;	/* Number of workers reaped */
+} HistoryTotals;
+
+static HistoryTotals history_total[NUM_CMDS];
+static HistoryTotals history_mark[NUM_CMDS][HISTORY_SECONDS];
+static int history_mark_time[HISTORY_SECONDS];
+static int history_now = 0;	/* Latest second with a mark */
+
+/* Sub-second history for looking at bursts: requests completed in each
+   HISTORY_FINE_MS interval of the last HISTORY_FINE_SLOTS intervals. */
+#define HISTORY_FINE_MS    100
+#define HISTORY_FINE_SLOTS 100
+typedef struct {
+    long elapsed;		/* Intervals since epoch for this slot */
+    unsigned int count[NUM_CMDS];
+} FineBucket;
+
+static FineBucket fine_history[HISTORY_FINE_SLOTS];
+
+/* Latency histograms, one per kind of request (as for queueing) and
+   measure: time spent queued, time the worker took, and the sum.
+   Values are microseconds in log-linear buckets: values below
+   2*LAT_SUB_BUCKETS have a bucket each, and every power of two above
+   that is split into LAT_SUB_BUCKETS equal buckets, so a bucket is
+   never wider than 1/LAT_SUB_BUCKETS of its values.  Histograms are
+   kept in LAT_SLOT_SECONDS slots for the last HISTORY_SECONDS. */
+#define LAT_SUB_BITS      3
+#define LAT_SUB_BUCKETS   (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS      32	/* Values up to about 71 minutes */
+#define LAT_BUCKETS       ((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS)
+#define LAT_QUEUE         0
+#define LAT_SERVICE       1
+#define LAT_TOTAL         2
+#define NUM_LAT_MEASURES  3
+#define LAT_SLOT_SECONDS  10
+#define LAT_SLOTS         (HISTORY_SECONDS / LAT_SLOT_SECONDS)
+
+static char const *LatMeasureName[NUM_LAT_MEASURES] = {
+    "queue",
+    "service",
+    "total"
+};
+
+typedef struct {
+    unsigned int counts[LAT_BUCKETS];
+    unsigned int count;		/* Number of values */
+    double sum;			/* Sum of values */
+    unsigned long max;		/* Largest value */
+} LatencyHisto;
+
+typedef struct {
+    int elapsed;		/* Slots since epoch for this slot */
+    LatencyHisto h[NUM_QUEUE_KINDS][NUM_LAT_MEASURES];
+} LatencySlot;
+
+static LatencySlot latency[LAT_SLOTS];
+
+/* What the state file (-j) keeps across restarts.  Bump STATE_VERSION
+   when the layout changes; the file is also ignored if its size differs. */
+#define STATE_VERSION       3
+#define STATE_SAVE_INTERVAL 10
+
+typedef struct {
+    time_t saved;		/* When this state was saved */
+    HistoryTotals total[NUM_CMDS];
+    HistoryTotals mark[NUM_CMDS][HISTORY_SECONDS];
+    int markTime[HISTORY_SECONDS];
+    int now;
+    HistoryBucket hourly[NUM_CMDS][HISTORY_HOURS];
+    LatencySlot latency[LAT_SLOTS];
+    double emaBusyRatio;
+    time_t lastScaleOut;
+    time_t lastScaleIn;
+    ProfileSlot profile[PROFILE_HOURS];
+    long profileHour;
+    int profileSlot;
+    int profilePeak;
+    int dailyPeak[24];
+    long dailyPeakHour[24];
+} PersistState;
+
+static PersistState StateBuf;
+
+/* Queue wait of the request handle_queued_request is dispatching */
+static long DispatchWaitUs = 0;
+
+/* Counters for the metrics exporter, kept since startup.  Latencies
+   go into a few fixed buckets (upper bounds in microseconds, plus one
+   for larger values) so a scrape is cheap and buckets never change. */
+#define NUM_METRIC_BOUNDS 14
+static long const MetricBoundUs[NUM_METRIC_BOUNDS] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+    500000, 1000000, 2500000, 5000000, 10000000, 30000000
+};
+
+typedef struct {
+    unsigned long counts[NUM_METRIC_BOUNDS+1];
+    unsigned long count;
+    double sum;			/* Microseconds */
+} MetricHisto;
+
+static MetricHisto MetricLatency[NUM_QUEUE_KINDS][NUM_LAT_MEASURES];
+static MetricHisto StartupHisto;	/* Worker start to ready */
+static char *WarmupCmd = NULL;		/* "warmup" command for -B, or NULL */
+static unsigned long KindFailures[NUM_QUEUE_KINDS]; /* No answer or timeout */
+static unsigned long NumReaps = 0;	/* Worker processes reaped */
+static unsigned long NumOOMs = 0;	/* ... of which ran out of memory */
+
 /* Pipe written on reception of SIGCHLD */
 static int Pipe[2] = {-1, -1};
 
@@ -252,6 +650,52 @@ static volatile sig_atomic_t HupPending = 0;
 static volatile sig_atomic_t IntPending = 0;
 static volatile sig_atomic_t CharPending = 0;
 
+/* Non-zero if worker exits are delivered through pidfds rather than
+   SIGCHLD */
+static int UsePidfd = 0;
+
+/* Syslog facility, for processes that have to reopen the log */
+static int LogFacility = LOG_MAIL;
+
+#ifdef USE_ZYGOTE
+/* Milliseconds to wait for a zygote to fork a worker */
+#define ZYGOTE_SPAWN_TIMEOUT_MS 250
+
+/* Seconds between attempts to replace a lost zygote */
+#define ZYGOTE_RETRY_SECONDS 10
+
+/* A process that builds the embedded interpreter after a reread and
+   forks workers from it */
+typedef struct Zygote_t {
+    struct Zygote_t *next;	/* Link in list of zygotes                   */
+    EventSelector *es;		/* Event selector                            */
+    pid_t pid;			/* Process ID of zygote                      */
+    int ctl;			/* Spawn requests; -1 once retired           */
+    int events;			/* Readiness and worker exits                */
+    EventHandler *eventHandler; /* Read handler for events                   */
+    struct timeval started;	/* Time when zygote was started              */
+} Zygote;
+
+static Zygote *Zygotes = NULL;	/* All zygotes still running                 */
+static Zygote *CurZygote = NULL; /* Forks new workers, or NULL              */
+static Zygote *NewZygote = NULL; /* Building the interpreter, or NULL       */
+
+/* Set once a reread has gone through a zygote.  Our own interpreter
+   then has stale rules, so workers must not be forked from it. */
+static int ZygoteRules = 0;
+static int rereadScheduled = 0;
+
+static int startZygote(EventSelector *es);
+static void retireZygote(Zygote *z);
+static void scheduleReread(EventSelector *es, int secs);
+static void doScheduledReread(EventSelector *es, int fd, unsigned int flags,
+			      void *data);
+static void pollZygotes(int killed);
+static int buildZygoteInterpreter(void);
+static void handleZygoteEvents(EventSelector *es, int fd, unsigned int flags,
+			       void *data);
+#endif
+
 static int DebugEvents = 0;
 static time_t LastWorkerActivation = (time_t) 0;
 static time_t TimeOfProgramStart = (time_t) 0;
@@ -276,11 +720,37 @@ extern void notify_worker_state_change(EventSelector *es,
 static Worker *findFreeWorker(int cmdno);
 static void shutDescriptors(Worker *s);
 static void reapTerminatedWorkers(int killed);
+#ifdef USE_POSIX_SPAWN
+static int canSpawnWorker(void);
+static pid_t spawnWorker(int pin[2], int pout[2], int perr[2], int pstatus[2]);
+#endif
+static void workerReaped(Worker *s, int status, struct rusage *resource, int killed);
+#ifdef USE_PIDFD
+static int superviseWorker(Worker *s);
+static int reapWorkerByPidfd(Worker *s, int killed);
+static void handleWorkerExit(EventSelector *es, int fd, unsigned int flags, void *data);
+#endif
 static Worker *findWorkerByPid(pid_t pid);
 
 static int update_worker_status(Worker *s, char const *buf);
+static int refreshWorkerStatus(Worker *s);
+static void publishWorkerSlot(Worker *s);
 static void set_worker_status_from_command(Worker *s, char const *buf);
+static void countRecipokDomain(Worker *s);
+static void releaseRecipokDomain(Worker *s);
 static pid_t activateWorker(Worker *s, char const *reason);
+static pid_t launchWorker(Worker *s, char const *reason, int state);
+static pid_t startWorker(Worker *s, char const *reason);
+static int queueWhileStarting(EventSelector *es, int fd, char *cmd, int map,
+			      Worker *s, int queueable);
+static EventTcpState *reply_to_map(EventSelector *es, int fd, char const *msg);
+static void handleWorkerStartupSent(EventSelector *es, int fd,
+				    char *buf, int len, int flag, void *data);
+static void handleWorkerReady(EventSelector *es, int fd,
+			      char *buf, int len, int flag, void *data);
+static void handleWorkerWarmedUp(EventSelector *es, int fd,
+				 char *buf, int len, int flag, void *data);
+static void workerReady(Worker *s);
 static void killWorker(Worker *s, char const *reason);
 static void terminateWorker(EventSelector *es, int fd, unsigned int flags,
 			   void *data);
@@ -292,6 +762,16 @@ static void unlinkFromList(Worker *s);
 static void putOnList(Worker *s, int state);
 
 static void handleAccept(EventSelector *es, int fd);
+static void startMuxConnection(EventSelector *es, int fd, int binary);
+static void mux_reply(int handle, char const *msg, int len);
+static void got_mux_frame(EventSelector *es, int fd, char *buf, int len,
+			  int flag, void *data);
+static void frameText(EventSelector *es, int fd, FrameOp const *op, FrameRequest *req);
+static void frameFree(EventSelector *es, int fd, FrameOp const *op, FrameRequest *req);
+static void frameWorkerCommand(EventSelector *es, int fd, FrameOp const *op, FrameRequest *req);
+static void frameLease(EventSelector *es, int fd, FrameOp const *op, FrameRequest *req);
+static void frameUnlease(EventSelector *es, int fd, FrameOp const *op, FrameRequest *req);
+static void close_client(int fd);
 static void handleUnprivAccept(EventSelector *es, int fd);
 static void handleCommand(EventSelector *es, int fd,
 			  char *buf, int len, int flag, void *data);
@@ -307,11 +787,26 @@ static void handleWorkerReceivedAnswer(EventSelector *es, int fd,
 static void handleWorkerReceivedAnswerFromTick(EventSelector *es, int fd,
 					      char *buf, int len, int flag,
 					      void *data);
-static void doScan(EventSelector *es, int fd, char *cmd);
+static void doScan(EventSelector *es, int fd, char *cmd, Lease *lease);
 static void doWorkerInfo(EventSelector *es, int fd, char *cmd);
-static void doScanAux(EventSelector *es, int fd, char *cmd, int queueable);
+static void doScanAux(EventSelector *es, int fd, char *cmd, int queueable, char **cmdbuf, Lease *lease, char const *qid, char const *dir);
 static void doStatus(EventSelector *es, int fd);
 static void doAutoscaleStatus(EventSelector *es, int fd);
+static void doMemoryReport(EventSelector *es, int fd);
+static void doPoolStatus(EventSelector *es, int fd);
+static void doHotDomains(EventSelector *es, int fd, char const *cmd);
+static void doDomainQueueStatus(EventSelector *es, int fd);
+static void doQueueStatus(EventSelector *es, int fd);
+static void doLatency(EventSelector *es, int fd, char const *buf);
+static void doLatencyHisto(EventSelector *es, int fd, char const *buf);
+static void doLease(EventSelector *es, int fd, int ttl, int required);
+static void doUnlease(EventSelector *es, int fd, unsigned int id);
+static void doLeaseStatus(EventSelector *es, int fd);
+static void releaseWorkerLease(Worker *s);
+static Lease *findLease(unsigned int id);
+static Lease *requestLease(unsigned int id);
+static void useLease(Worker *s, Lease *l, int consume);
+static Worker *findAdmittedWorker(int cmdno, Lease *l);
 static void doHelp(EventSelector *es, int fd, int unpriv);
 static void doWorkerReport(EventSelector *es, int fd, int only_busy);
 static void doLoad(EventSelector *es, int fd, int cmd);
@@ -319,8 +814,8 @@ static void doLoad1(EventSelector *es, int fd, int back);
 static void doHourlyLoad(EventSelector *es, int fd, int cmd);
 static void doHistogram(EventSelector *es, int fd);
 
-static void doWorkerCommand(EventSelector *es, int fd, char *cmd);
-static void doWorkerCommandAux(EventSelector *es, int fd, char *cmd, int queueable);
+static void doWorkerCommand(EventSelector *es, int fd, char *cmd, Lease *lease);
+static void doWorkerCommandAux(EventSelector *es, int fd, char *cmd, int queueable, char **cmdbuf, Lease *lease, char const *qid);
 static void checkWorkerForExpiry(Worker *s);
 static void handlePipe(EventSelector *es,
 		       int fd, unsigned int flags, void *data);
@@ -336,17 +831,29 @@ static void childHandler(int sig);
 static void hupHandler(int sig);
 static void intHandler(int sig);
 static void sigterm(int sig);
-static void newGeneration(void);
+static void newGeneration(EventSelector *es);
+static void runWorker(int const fds[MX_ZYGOTE_FDS]);
 static void handleAutoscale(EventSelector *es,
 				int fd, unsigned int flags, void *data);
 
 static void handleIdleTimeout(EventSelector *es, int fd, unsigned int flags,
 			      void *data);
+static void publishGauge(void);
+static void gaugeHeartbeat(EventSelector *es, int fd, unsigned int flags,
+			   void *data);
+static void pollStatusBoard(EventSelector *es, int fd, unsigned int flags,
+			    void *data);
 static void doStatusLog(EventSelector *es, int fd, unsigned int flags,
 			void *data);
 
 static void logWorkerReaped(Worker *s, int status);
-static int queue_request(EventSelector *es, int fd, char *cmd);
+static int queue_request(EventSelector *es, int fd, char *cmd, int map, DomainCount *d, Lease *lease);
+static void doMapRequest(EventSelector *es, int fd, char *cmd, int queueable);
+static int parse_queue_classes(char const *spec);
+static int parse_autoscale_modes(char const *spec);
+static void doAutoscaleProfile(EventSelector *es, int fd);
+static void observeDemand(time_t now, int demand);
+static int mainQueueDepth(void);
 static int handle_queued_request(void);
 
 static void handleRequestQueueTimeout(EventSelector *es, int fd,
@@ -360,15 +867,32 @@ static int minScheduled = 0;
 static void schedule_tick(EventSelector *es, int tick_no);
 
 static void handleMapAccept(EventSelector *es, int fd);
+static void handleMetricsAccept(EventSelector *es, int fd);
+static void handleMetricsRequest(EventSelector *es, int fd, char *buf,
+				 int len, int flag, void *data);
+static void metricsWritten(EventSelector *es, int fd, char *buf,
+			   int len, int flag, void *data);
+static char *buildMetrics(void);
 
 static void init_history(void);
-static HistoryBucket *get_history_bucket(int cmd);
+static HistoryTotals *get_history_bucket(int cmd);
+static void record_fine_history(int cmd, struct timeval const *now);
+static void restoreState(void);
+static void saveState(void);
+static void saveStateTimer(EventSelector *es, int fd, unsigned int flags,
+			   void *data);
+static void doBurst(EventSelector *es, int fd);
+static void record_latency(int kind, long queueUs, long serviceUs);
+static double recent_queue_wait(int minutes, double p);
 static HistoryBucket *get_hourly_history_bucket(int cmd);
 static int get_history_totals(int cmd, time_t now, int back, int *total, int *workers, BIG_INT *ms, int *activated, int *reaped);
 static int get_hourly_history_totals(int cmd, time_t now, int hours, int *total, int *workers, BIG_INT *ms, int *secs);
 
 #define NUM_FREE_WORKERS    (WorkerCount[STATE_IDLE] + WorkerCount[STATE_STOPPED])
-#define NUM_RUNNING_WORKERS (WorkerCount[STATE_IDLE] + WorkerCount[STATE_BUSY] + WorkerCount[STATE_KILLED])
+/* Free workers not held back by leases */
+#define NUM_UNRESERVED_WORKERS (NUM_FREE_WORKERS > NUM_RESERVED_WORKERS ? \
+				NUM_FREE_WORKERS - NUM_RESERVED_WORKERS : 0)
+#define NUM_RUNNING_WORKERS (WorkerCount[STATE_IDLE] + WorkerCount[STATE_BUSY] + WorkerCount[STATE_KILLED] + WorkerCount[STATE_STARTING])
 #define REPORT_FAILURE(msg) do { if (kidpipe[1] >= 0) { write(kidpipe[1], "E" msg, strlen(msg)+1); } else { fprintf(stderr, "%s\n", msg); } } while(0)
 
 /**********************************************************************
@@ -386,6 +910,7 @@ state_name(int state)
     case STATE_IDLE:    return "Idle";
     case STATE_BUSY:    return "Busy";
     case STATE_KILLED:  return "Killed";
+    case STATE_STARTING: return "Starting";
     }
     return "Unknown";
 }
@@ -405,6 +930,7 @@ state_name_lc(int state)
     case STATE_IDLE:    return "idle";
     case STATE_BUSY:    return "busy";
     case STATE_KILLED:  return "killed";
+    case STATE_STARTING: return "starting";
     }
     return "unknown";
 }
@@ -430,6 +956,10 @@ reply_to_mimedefang_with_len(EventSelector *es,
 {
     EventTcpState *e;
 
+    if (IS_MUX_HANDLE(fd)) {
+	mux_reply(fd, msg, len);
+	return NULL;
+    }
     if (len == 0) {
 	/* Nothing to say. */
 	close(fd);
@@ -446,6 +976,47 @@ reply_to_mimedefang_with_len(EventSelector *es,
     return e;
 }
 
+/**********************************************************************
+* %FUNCTION: reply_to_mimedefang_owned
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- file descriptor
+*  msg -- malloc'd message to send back; freed by this function
+* %RETURNS:
+*  The event associated with the reply, or NULL.
+* %DESCRIPTION:
+*  Like reply_to_mimedefang, but hands msg to the writer instead of
+*  copying it.
+***********************************************************************/
+static EventTcpState *
+reply_to_mimedefang_owned(EventSelector *es,
+			  int fd,
+			  char *msg)
+{
+    EventTcpState *e;
+    int len = strlen(msg);
+
+    if (IS_MUX_HANDLE(fd)) {
+	mux_reply(fd, msg, len);
+	free(msg);
+	return NULL;
+    }
+    if (len == 0) {
+	/* Nothing to say. */
+	free(msg);
+	close(fd);
+	return NULL;
+    }
+    e = EventTcp_WriteBufOwned(es, fd, msg, len, NULL,
+			       Settings.clientTimeout, NULL);
+    if (!e) {
+	if (DOLOG) {
+	    syslog(LOG_ERR, "reply_to_mimedefang: EventTcp_WriteBufOwned failed: %m");
+	}
+    }
+    return e;
+}
+
 /**********************************************************************
 * %FUNCTION: reply_to_mimedefang
 * %ARGUMENTS:
@@ -472,7 +1043,7 @@ reply_to_mimedefang(EventSelector *es,
 * %RETURNS:
 *  The worker with given pid, or NULL if not found
 * %DESCRIPTION:
-*  Searches the killed, idle and busy lists for specified worker.
+*  Searches the killed, idle, busy and starting lists for specified worker.
 ***********************************************************************/
 static Worker *
 findWorkerByPid(pid_t pid)
@@ -498,6 +1069,12 @@ findWorkerByPid(pid_t pid)
 	s = s->next;
     }
 
+    s = Workers[STATE_STARTING];
+    while(s) {
+	if (s->pid == pid) return s;
+	s = s->next;
+    }
+
     return NULL;
 }
 
@@ -549,8 +1126,13 @@ usage(void)
     fprintf(stderr, "  -S facility       -- Set syslog(3) facility\n");
     fprintf(stderr, "  -N sock           -- Listen for Sendmail map requests on sock\n");
     fprintf(stderr, "  -O sock           -- Listen for notification requests on sock\n");
+    fprintf(stderr, "  -H sock           -- Serve OpenMetrics over HTTP on sock\n");
+    fprintf(stderr, "  -j file           -- Keep statistics and autoscale state in file across restarts\n");
+    fprintf(stderr, "  -B dir            -- Warm new workers up by scanning the sample message in dir\n");
+    fprintf(stderr, "  -g                -- Publish worker counts in shared memory for mimedefang\n");
     fprintf(stderr, "  -q size           -- Size of request queue (default 0)\n");
     fprintf(stderr, "  -Q timeout        -- Timeout for queued requests\n");
+    fprintf(stderr, "  -C cmd=n,...      -- Priority class (0-%d) of queued requests by command\n", NUM_QUEUE_CLASSES-1);
     fprintf(stderr, "  -I backlog        -- 'backlog' argument for listen on multiplexor socket\n");
     fprintf(stderr, "  -D                -- Do not become a daemon (stay in foreground)\n");
     fprintf(stderr, "  -X interval       -- Run a 'tick' request every interval seconds\n");
@@ -558,6 +1140,8 @@ usage(void)
     fprintf(stderr, "  -Y label          -- Set syslog label to 'label'\n");
     fprintf(stderr, "  -G                -- Make sockets group-writable\n");
     fprintf(stderr, "  -k                -- Enable adaptive autoscaling of the worker pool\n");
+    fprintf(stderr, "  -K mode,...       -- Autoscale modes: predict, dryrun, lead=minutes (implies -k)\n");
+    fprintf(stderr, "                       and thresholds: queued=n, rejects=n, outwait=ms, inwait=ms\n");
 #ifdef EMBED_PERL
     fprintf(stderr, "  -E                -- Use embedded Perl interpreter\n");
 #endif
@@ -569,8 +1153,14 @@ set_sigchld_handler(void)
 {
     struct sigaction act;
 
-    /* Set signal handler for SIGCHLD */
-    act.sa_handler = childHandler;
+    /* Set signal handler for SIGCHLD.  When workers are supervised
+       through pidfds, leave SIGCHLD at its default so that the
+       SIGCHLD-driven waitpid(-1) never steals a worker's exit status. */
+    if (UsePidfd) {
+	act.sa_handler = SIG_DFL;
+    } else {
+	act.sa_handler = childHandler;
+    }
     sigemptyset(&act.sa_mask);
     act.sa_flags = SA_NOCLDSTOP | SA_RESTART;
     return sigaction(SIGCHLD, &act, NULL);
@@ -663,8 +1253,11 @@ main(int argc, char *argv[], char **env)
     Settings.tick_interval = 0;
     Settings.num_ticks = 1;
     Settings.mapSock       = NULL;
+    Settings.metricsSock   = NULL;
+    Settings.stateFile     = NULL;
     Settings.wantStatusReports = 0;
     Settings.debugWorkerScheduling = 0;
+    Settings.publishGauge = 0;
     Settings.autoscaling       = 0;
     Settings.autoscaleInterval = 15;
     Settings.scaleOutBusyRatio = 0.80;
@@ -672,11 +1265,18 @@ main(int argc, char *argv[], char **env)
     Settings.scaleOutCooldown  = 5;
     Settings.scaleInCooldown   = 30;
     Settings.emaAlpha          = 0.25;
+    Settings.predictive        = 0;
+    Settings.predictLead       = 600;
+    Settings.autoscaleDryRun   = 0;
+    Settings.scaleOutQueued    = 1;
+    Settings.scaleOutRejections = 1;
+    Settings.scaleOutQueueWaitMs = 1000;
+    Settings.scaleInQueueWaitMs = 10;
 
 #ifndef HAVE_SETRLIMIT
-    options = "GAa:Tt:um:x:y:r:i:b:c:s:hdlf:p:o:w:F:W:U:S:q:Q:I:DEO:X:Y:N:vZP:z:V:k";
+    options = "GAa:Tt:um:x:y:r:i:b:c:s:hdlf:p:o:w:F:W:U:S:q:Q:C:I:DEO:X:Y:N:H:j:vZP:z:V:kK:gB:";
 #else
-    options = "GAa:Tt:um:x:y:r:i:b:c:s:hdlf:p:o:w:F:W:U:S:q:Q:L:R:M:I:DEO:X:Y:N:vZP:z:V:k";
+    options = "GAa:Tt:um:x:y:r:i:b:c:s:hdlf:p:o:w:F:W:U:S:q:Q:C:L:R:M:I:DEO:X:Y:N:H:j:vZP:z:V:kK:gB:";
 #endif
     while((c = getopt(argc, argv, options)) != -1) {
 	switch(c) {
@@ -691,6 +1291,14 @@ main(int argc, char *argv[], char **env)
 	case 'k':
 	    Settings.autoscaling = 1;
 	    break;
+	case 'K':
+	    if (parse_autoscale_modes(optarg) < 0) {
+		fprintf(stderr, "%s: Invalid autoscale modes '%s'\n",
+			argv[0], optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    Settings.autoscaling = 1;
+	    break;
 	case 'z':
 	    Settings.spoolDir = strdup(optarg);
 	    if (!Settings.spoolDir) {
@@ -745,14 +1353,22 @@ main(int argc, char *argv[], char **env)
 	    if (sscanf(optarg, "%d", &n) != 1) usage();
 	    if (n <= 0) {
 		n = 0;
-	    } else if (n > MAX_QUEUE_SIZE) {
-		fprintf(stderr, "%s: Request queue size %d too big (%d max)\n",
-			argv[0], n, MAX_QUEUE_SIZE);
-		exit(EXIT_FAILURE);
 	    }
 	    Settings.requestQueueSize = n;
 	    break;
 
+	case 'g':
+	    Settings.publishGauge = 1;
+	    break;
+
+	case 'C':
+	    if (parse_queue_classes(optarg) < 0) {
+		fprintf(stderr, "%s: Invalid priority classes '%s'\n",
+			argv[0], optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+
 	case 'X':
 	    if (sscanf(optarg, "%d", &n) != 1) usage();
 	    if (n < 0) {
@@ -773,6 +1389,7 @@ main(int argc, char *argv[], char **env)
 
 	case 'S':
 	    facility = find_syslog_facility(optarg);
+	    LogFacility = facility;
 	    if (facility < 0) {
 		fprintf(stderr, "%s: Unknown syslog facility %s\n",
 			argv[0], optarg);
@@ -821,6 +1438,37 @@ main(int argc, char *argv[], char **env)
 		exit(EXIT_FAILURE);
 	    }
 	    break;
+	case 'H':
+	    Settings.metricsSock = strdup(optarg);
+	    if (!Settings.metricsSock) {
+		fprintf(stderr, "%s: Out of memory\n", argv[0]);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'B':
+	    /* Sample message for warm-up scans */
+	    if (optarg[0] != '/') {
+		fprintf(stderr, "%s: -B: You must supply an absolute path for the warm-up directory\n", argv[0]);
+		exit(EXIT_FAILURE);
+	    }
+	    n = strlen(optarg) * 3 + 1;
+	    free(WarmupCmd);
+	    WarmupCmd = malloc(n + 8);
+	    if (!WarmupCmd) {
+		fprintf(stderr, "%s: Out of memory\n", argv[0]);
+		exit(EXIT_FAILURE);
+	    }
+	    strcpy(WarmupCmd, "warmup ");
+	    n = percent_encode(optarg, WarmupCmd + 7, n);
+	    strcpy(WarmupCmd + 7 + n, "\n");
+	    break;
+	case 'j':
+	    Settings.stateFile = strdup(optarg);
+	    if (!Settings.stateFile) {
+		fprintf(stderr, "%s: Out of memory\n", argv[0]);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
 	case 'U':
 	    /* User to run as */
 	    if (user) {
@@ -1091,29 +1739,81 @@ main(int argc, char *argv[], char **env)
 
     /* Initialize history buckets */
     init_history();
+    if (Settings.stateFile) {
+	restoreState();
+    }
 
     /* Initialize queue */
-    for (i=0; i<Settings.requestQueueSize; i++) {
-	RequestQueue[i].next = NULL;
-	RequestQueue[i].es   = NULL;
-	RequestQueue[i].timeoutHandler = NULL;
-	RequestQueue[i].fd   = -1;
-	RequestQueue[i].cmd  = NULL;
+    RequestQueue = NULL;
+    if (Settings.requestQueueSize > 0) {
+	RequestQueue = calloc(Settings.requestQueueSize, sizeof(Request));
+	if (!RequestQueue) {
+	    REPORT_FAILURE("Unable to allocate memory for request queue");
+	    if (pidfile) unlink(pidfile);
+	    if (lockfile) unlink(lockfile);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    FreeRequests = NULL;
+    for (i=Settings.requestQueueSize-1; i>=0; i--) {
+	RequestQueue[i].fd = -1;
+	RequestQueue[i].next = FreeRequests;
+	FreeRequests = &RequestQueue[i];
     }
     NumQueuedRequests = 0;
-    RequestHead = NULL;
-    RequestTail = NULL;
+    for (i=0; i<NUM_QUEUE_CLASSES; i++) {
+	RequestHead[i] = NULL;
+	RequestTail[i] = NULL;
+    }
 
     /* Allocate workers and place them on the free list */
     AllWorkers = calloc(Settings.maxWorkers, sizeof(Worker));
 
-    if (!AllWorkers) {
+    IdleHeap[0] = malloc(NUM_IDLE_BUCKETS * Settings.maxWorkers * sizeof(Worker *));
+
+    if (!AllWorkers || !IdleHeap[0]) {
 	REPORT_FAILURE("Unable to allocate memory for workers");
 	if (pidfile) unlink(pidfile);
 	if (lockfile) unlink(lockfile);
 	exit(EXIT_FAILURE);
     }
 
+    for (i=1; i<NUM_IDLE_BUCKETS; i++) {
+	IdleHeap[i] = IdleHeap[i-1] + Settings.maxWorkers;
+    }
+
+    /* Size the domain hash table to at least twice the number of workers */
+    DomainHashMask = 63;
+    while (DomainHashMask < 2 * (unsigned int) Settings.maxWorkers) {
+	DomainHashMask = (DomainHashMask << 1) | 1;
+    }
+    DomainHash = calloc(DomainHashMask + 1, sizeof(DomainCount *));
+    NumDomainCounts = Settings.maxWorkers + Settings.requestQueueSize;
+    DomainCounts = calloc(NumDomainCounts, sizeof(DomainCount));
+    if (!DomainHash || !DomainCounts) {
+	REPORT_FAILURE("Unable to allocate memory for domain table");
+	if (pidfile) unlink(pidfile);
+	if (lockfile) unlink(lockfile);
+	exit(EXIT_FAILURE);
+    }
+    FreeDomainCounts = NULL;
+    for (i=NumDomainCounts-1; i>=0; i--) {
+	DomainCounts[i].next = FreeDomainCounts;
+	FreeDomainCounts = &DomainCounts[i];
+    }
+
+    Leases = calloc(Settings.maxWorkers, sizeof(Lease));
+    if (!Leases) {
+	REPORT_FAILURE("Unable to allocate memory for leases");
+	if (pidfile) unlink(pidfile);
+	if (lockfile) unlink(lockfile);
+	exit(EXIT_FAILURE);
+    }
+    for (i=Settings.maxWorkers-1; i>=0; i--) {
+	Leases[i].nextFree = FreeLease;
+	FreeLease = i;
+    }
+
     /* Make an event selector */
     es = Event_CreateSelector();
     if (!es) {
@@ -1127,11 +1827,13 @@ main(int argc, char *argv[], char **env)
     WorkerCount[STATE_IDLE]    = 0;
     WorkerCount[STATE_BUSY]    = 0;
     WorkerCount[STATE_KILLED]  = 0;
+    WorkerCount[STATE_STARTING] = 0;
 
     Workers[STATE_STOPPED] = &AllWorkers[0];
     Workers[STATE_IDLE]    = NULL;
     Workers[STATE_BUSY]    = NULL;
     Workers[STATE_KILLED]  = NULL;
+    Workers[STATE_STARTING] = NULL;
 
     now = time(NULL);
     /* Set some fields in workers */
@@ -1149,15 +1851,26 @@ main(int argc, char *argv[], char **env)
 	s->errHandler = NULL;
 	s->statusHandler = NULL;
 	s->termHandler = NULL;
+	s->pidfd = -1;
+	s->pidfdHandler = NULL;
+	s->zygote = NULL;
 	s->workdir[0] = 0;
 	s->status_tag[0] = 0;
+	s->boardSeq = 0;
+	s->queueWaitUs = 0;
 	s->domain[0] = 0;
+	s->recipokDomain = NULL;
+	s->lease = NULL;
 	s->generation = Generation;
 	s->state = STATE_STOPPED;
 	s->activationTime = (time_t) -1;
 	s->firstReqTime = (time_t) -1;
 	s->lastStateChange = now;
 	s->last_cmd = NO_CMD;
+	s->idleBucket = -1;
+	s->idleSlot = -1;
+	s->startupUs = -1;
+	s->warmupUs = -1;
     }
 
     /* Set up the linked list */
@@ -1177,6 +1890,45 @@ main(int argc, char *argv[], char **env)
     sock = make_listening_socket(Settings.sockName, Settings.listenBacklog, 1);
     umask(file_umask);
 
+    if (Settings.publishGauge) {
+	char *gaugeFile = malloc(strlen(Settings.sockName) + strlen(".gauge") + 1);
+	if (!gaugeFile) {
+	    REPORT_FAILURE("Out of memory");
+	    if (pidfile) unlink(pidfile);
+	    if (lockfile) unlink(lockfile);
+	    exit(EXIT_FAILURE);
+	}
+	strcpy(gaugeFile, Settings.sockName);
+	strcat(gaugeFile, ".gauge");
+	if (MXGaugeCreate(gaugeFile) < 0) {
+	    REPORT_FAILURE("Unable to create shared worker gauge.");
+	    if (pidfile) unlink(pidfile);
+	    if (lockfile) unlink(lockfile);
+	    exit(EXIT_FAILURE);
+	}
+	free(gaugeFile);
+    }
+
+    /* Status reports go through the shared status board if we can make
+       one, and through a pipe per worker otherwise. */
+    if (Settings.wantStatusReports) {
+	char *boardFile = malloc(strlen(Settings.sockName) + strlen(".board") + 1);
+	if (boardFile) {
+	    strcpy(boardFile, Settings.sockName);
+	    strcat(boardFile, ".board");
+	    if (MXBoardCreate(boardFile, Settings.maxWorkers) == 0) {
+		StatusBoard = 1;
+		for (i=0; i<Settings.maxWorkers; i++) {
+		    publishWorkerSlot(&AllWorkers[i]);
+		}
+	    }
+	    free(boardFile);
+	}
+	if (!StatusBoard) {
+	    syslog(LOG_WARNING, "Could not create status board; using status pipes");
+	}
+    }
+
     if (sock < 0) {
 	if (sock == -2) {
 	    REPORT_FAILURE("Argument to -s option must be a UNIX-domain socket, not a TCP socket.");
@@ -1262,7 +2014,7 @@ main(int argc, char *argv[], char **env)
 	if (nodaemon && i < 3) {
 	    continue;
 	}
-	if (i == kidpipe[0] || i == kidpipe[1] || i == lockfile_fd || i == unpriv_sock || i == sock || i == Pipe[0] || i == Pipe[1]) continue;
+	if (i == kidpipe[0] || i == kidpipe[1] || i == lockfile_fd || i == unpriv_sock || i == sock || i == Pipe[0] || i == Pipe[1] || i == Event_GetSelectorFd(es)) continue;
 	(void) close(i);
     }
 
@@ -1332,6 +2084,15 @@ main(int argc, char *argv[], char **env)
     }
 #endif
 
+#ifdef USE_PIDFD
+    /* Probe for kernel support; pidfd_open needs Linux 5.3 */
+    i = pidfd_open(getpid(), 0);
+    if (i >= 0) {
+	close(i);
+	UsePidfd = 1;
+    }
+#endif
+
     /* Set signal handler for SIGCHLD */
     if (set_sigchld_handler() < 0) {
 	REPORT_FAILURE("sigaction failed - exiting.");
@@ -1369,6 +2130,29 @@ main(int argc, char *argv[], char **env)
 	       Settings.scaleInBusyRatio  * 100.0);
     }
 
+    /* Save statistics every so often in case we die without warning */
+    if (Settings.stateFile) {
+	t.tv_usec = 0;
+	t.tv_sec = STATE_SAVE_INTERVAL;
+	Event_AddTimerHandler(es, t, saveStateTimer, NULL);
+    }
+
+    /* Keep the shared gauge's heartbeat going */
+    if (Settings.publishGauge) {
+	publishGauge();
+	t.tv_usec = 0;
+	t.tv_sec = 1;
+	Event_AddTimerHandler(es, t, gaugeHeartbeat, NULL);
+    }
+
+    /* Nothing tells us when a worker updates its tag on the status
+       board, so look for changes to pass on to listeners */
+    if (StatusBoard && Settings.notifySock) {
+	t.tv_usec = 0;
+	t.tv_sec = 1;
+	Event_AddTimerHandler(es, t, pollStatusBoard, NULL);
+    }
+
     /* Set up a timer handler to log status, if desired */
     if (Settings.logStatusInterval) {
 	t.tv_usec = 0;
@@ -1405,6 +2189,21 @@ main(int argc, char *argv[], char **env)
 	}
     }
 
+    if (Settings.metricsSock) {
+	umask(socket_umask);
+	sock = make_listening_socket(Settings.metricsSock, Settings.listenBacklog, 0);
+	umask(file_umask);
+	if (sock >= 0) {
+	    if(set_cloexec(sock) < 0) {
+		syslog(LOG_ERR, "Could not set FD_CLOEXEC option on socket");
+		close(sock);
+	    } else if (!EventTcp_CreateAcceptor(es, sock, handleMetricsAccept)) {
+		syslog(LOG_ERR, "Could not listen for metrics scrapes: EventTcp_CreateAcceptor: %m");
+		close(sock);
+	    }
+	}
+    }
+
     /* Start the tick handler.  All ticks start off at the same time,
        but should soon get out of sync.
     */
@@ -1613,6 +2412,106 @@ update_worker_status(Worker *s, char const *buf)
     return 1;
 }
 
+/**********************************************************************
+* %FUNCTION: refreshWorkerStatus
+* %ARGUMENTS:
+*  s -- a worker
+* %RETURNS:
+*  True if status was changed; false otherwise.
+* %DESCRIPTION:
+*  Copies the latest tag a busy worker wrote to the status board into
+*  its status area.  The board is only read when somebody wants the
+*  tag, so this must be called before looking at status_tag.
+***********************************************************************/
+static int
+refreshWorkerStatus(Worker *s)
+{
+    char tag[MX_BOARD_TAG_LEN];
+    unsigned int seq;
+    char *ptr;
+
+    if (!StatusBoard) return 0;
+    if (MXBoardReadTag(WORKERNO(s), &seq, tag) < 0) return 0;
+    if (seq == s->boardSeq) return 0;
+    s->boardSeq = seq;
+
+    /* As with the status pipe, only a busy worker's tag counts */
+    if (s->state != STATE_BUSY || !tag[0]) return 0;
+
+    /* Sanitize tag -- ASCII-centric! */
+    for (ptr = tag; *ptr; ptr++) {
+	if (*ptr < ' ' || *ptr > '~') *ptr = ' ';
+    }
+    snprintf(s->status_tag, sizeof(s->status_tag), "%s", tag);
+    return 1;
+}
+
+/**********************************************************************
+* %FUNCTION: publishWorkerSlot
+* %ARGUMENTS:
+*  s -- a worker
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Publishes the worker's state, counters and current command in its
+*  status board slot for md-mx-ctrl.
+***********************************************************************/
+static void
+publishWorkerSlot(Worker *s)
+{
+    MXBoardValues v;
+
+    if (!StatusBoard) return;
+
+    switch (s->state) {
+    case STATE_STOPPED: v.state = 'S'; break;
+    case STATE_IDLE:    v.state = 'I'; break;
+    case STATE_BUSY:    v.state = 'B'; break;
+    case STATE_KILLED:  v.state = 'K'; break;
+    case STATE_STARTING: v.state = 'W'; break;
+    default:            v.state = '?'; break;
+    }
+    v.pid = (long) s->pid;
+    v.generation = s->generation;
+    v.numRequests = s->numRequests;
+    v.numScans = s->numScans;
+    v.stateChange = (long) s->lastStateChange;
+    v.started = (s->activationTime == (time_t) -1) ? 0 : (long) s->activationTime;
+    v.tagSeq = s->boardSeq;
+    snprintf(v.command, sizeof(v.command), "%s", s->status_tag);
+    MXBoardPublish(WORKERNO(s), &v);
+}
+
+/**********************************************************************
+* %FUNCTION: pollStatusBoard
+* %ARGUMENTS:
+*  es -- event selector
+*  fd, flags, data -- ignored
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Passes tags which busy workers wrote to the status board on to
+*  listeners.  Runs once a second.
+***********************************************************************/
+static void
+pollStatusBoard(EventSelector *es,
+		int fd,
+		unsigned int flags,
+		void *data)
+{
+    struct timeval t;
+    Worker *s;
+
+    for (s = Workers[STATE_BUSY]; s; s = s->next) {
+	if (refreshWorkerStatus(s)) {
+	    notify_worker_status(es, WORKERNO(s), s->status_tag);
+	}
+    }
+    t.tv_usec = 0;
+    t.tv_sec = 1;
+    Event_AddTimerHandler(es, t, pollStatusBoard, NULL);
+}
+
 /**********************************************************************
 * %FUNCTION: cmd_to_number
 * %ARGUMENTS:
@@ -1671,10 +2570,11 @@ set_worker_status_from_command(Worker *s, char const *buf)
 
     *out = 0;
 
-    /* If it was "recipok", set the domain appropriately
-       if we have specified a limit on concurrent recipoks
-       per domain */
-    if ((s->cmd == RECIPOK_CMD) && (Settings.maxRecipokPerDomain > 0)) {
+    /* If it was "recipok", set the domain appropriately and count
+       the worker against it.  The counts enforce the per-domain
+       recipok limit and are shown by the "hotdomains" command. */
+    releaseRecipokDomain(s);
+    if (s->cmd == RECIPOK_CMD) {
 	int len = 0;
 	s->domain[0] = 0;
 	out = s->domain;
@@ -1689,6 +2589,9 @@ set_worker_status_from_command(Worker *s, char const *buf)
 	    }
 	    *out = 0;
 	}
+	if (s->state == STATE_BUSY) {
+	    countRecipokDomain(s);
+	}
     }
 
     percent_decode(s->status_tag);
@@ -1698,6 +2601,7 @@ set_worker_status_from_command(Worker *s, char const *buf)
 	if (*out < ' ' || *out > '~') *out = ' ';
 	++out;
     }
+    publishWorkerSlot(s);
     notify_worker_status(s->es, WORKERNO(s), s->status_tag);
 }
 
@@ -1754,3383 +2658,7653 @@ handleUnprivAccept(EventSelector *es, int fd)
 }
 
 /**********************************************************************
-* %FUNCTION: handleCommand
+* %FUNCTION: close_client
 * %ARGUMENTS:
-*  es -- event selector
-*  fd -- connection to MIMEDefang
-*  buf -- buffer of data read from MIMEDefang
-*  len -- amount of data read from MIMEDefang
-*  flag -- flag from reader
-*  data -- if non-NULL, command came from unprivileged socket -- restrict
-*          what we can do.
+*  fd -- client file descriptor or mux client handle
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Handles a MIMEDefang command.
+*  Drops a client without replying.  A mux client gets an empty reply,
+*  which is what a one-shot client sees when its connection is closed.
 ***********************************************************************/
 static void
-handleCommand(EventSelector *es,
-	      int fd,
-	      char *buf,
-	      int len,
-	      int flag,
-	      void *data)
+close_client(int fd)
 {
-    char answer[MAX_CMD_LEN];
-
-    if (data) {
-	NumUnprivConnections--;
-    }
-    if (flag == EVENT_TCP_FLAG_TIMEOUT || flag == EVENT_TCP_FLAG_IOERROR) {
-	if (DOLOG) {
-	    syslog(LOG_ERR, "handleCommand: Timeout or error: Flag = %d: %m",
-		   flag);
-	}
-	/* Client timeout or error */
-	close(fd);
-	return;
+    if (IS_MUX_HANDLE(fd)) {
+	mux_reply(fd, "", 0);
+    } else {
+	close(fd);
     }
+}
 
-    /* Null-terminate buffer */
-    if (len) {
-	len--;
-	buf[len] = 0;
-    }
+/**********************************************************************
+* %FUNCTION: mux_try_free
+* %ARGUMENTS:
+*  conn -- a mux connection
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Closes and frees conn once the client is gone, every request has
+*  been answered and nothing is being written.
+***********************************************************************/
+static void
+mux_try_free(MuxConn *conn)
+{
+    if (!conn->readDone || conn->writing || conn->inflight) return;
+    close(conn->fd);
+    free(conn);
+    NumMuxConns--;
+}
 
-    /* Remove cr so we can use telnet for unpriv socket */
-    if (len && (buf[len-1] == '\r')) {
-	len--;
-	buf[len] = 0;
+static void mux_write_next(MuxConn *conn);
+
+/* Binary frames are big-endian */
+static void
+put_u32(unsigned char *p, unsigned long v)
+{
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+static unsigned long
+get_u32(unsigned char const *p)
+{
+    return ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16) |
+	((unsigned long) p[2] << 8) | (unsigned long) p[3];
+}
+
+/**********************************************************************
+* %FUNCTION: mux_write_done
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- the connection
+*  buf, len -- ignored
+*  flag -- result of the write
+*  data -- the MuxConn
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called when a reply has been written; starts on the next one.
+***********************************************************************/
+static void
+mux_write_done(EventSelector *es, int fd, char *buf, int len, int flag,
+	       void *data)
+{
+    MuxConn *conn = (MuxConn *) data;
+
+    if (conn->writing) {
+	free(conn->writing->buf);
+	free(conn->writing);
+	conn->writing = NULL;
     }
-    if (len == 4 && !strcmp(buf, "help")) {
-	if (data) {
-	    doHelp(es, fd, 1);
-	} else {
-	    doHelp(es, fd, 0);
+    if (flag != EVENT_TCP_FLAG_COMPLETE) {
+	MuxReply *r;
+
+	if (DOLOG) {
+	    syslog(LOG_WARNING, "mux: Could not write reply: Flag = %d: %m", flag);
 	}
-	return;
+	/* Throw away pending replies and wake up the reader */
+	conn->dead = 1;
+	while ((r = conn->outHead) != NULL) {
+	    conn->outHead = r->next;
+	    free(r->buf);
+	    free(r);
+	}
+	conn->outTail = NULL;
+	shutdown(conn->fd, SHUT_RDWR);
     }
+    mux_write_next(conn);
+    mux_try_free(conn);
+}
 
-    if (len == 4 && !strcmp(buf, "free")) {
-	snprintf(answer, sizeof(answer), "%d\n",
-		 NUM_FREE_WORKERS);
-	reply_to_mimedefang(es, fd, answer);
-	return;
-    }
+/**********************************************************************
+* %FUNCTION: mux_write_next
+* %ARGUMENTS:
+*  conn -- a mux connection
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Starts writing the next queued reply, if there is one and no write
+*  is in progress.  Replies are written one at a time so they cannot
+*  interleave on the socket.  The header, reply and trailing comma go
+*  out with a single writev() rather than being copied together.
+***********************************************************************/
+static void
+mux_write_next(MuxConn *conn)
+{
+    MuxReply *r = conn->outHead;
+    struct iovec iov[3];
+    int n = 0;
 
-    if (len == 7 && !strcmp(buf, "version")) {
-	reply_to_mimedefang(es, fd, VERSION);
-	return;
+    if (conn->writing || conn->dead || !r) return;
+    conn->outHead = r->next;
+    if (!conn->outHead) conn->outTail = NULL;
+
+    if (r->hlen) {
+	iov[n].iov_base = r->hdr;
+	iov[n++].iov_len = r->hlen;
     }
-    /* "tick" command must ONLY be internally-generated to guarantee
-       that two tick handlers won't be running simultaneously */
-    if (len == 4 && !strcmp(buf, "tick")) {
-	snprintf(answer, sizeof(answer), "error: External agents may not invoke 'tick'\n");
-	reply_to_mimedefang(es, fd, answer);
-	return;
+    if (r->len) {
+	iov[n].iov_base = r->buf;
+	iov[n++].iov_len = r->len;
     }
-
-    if (len == 6 && !strcmp(buf, "status")) {
-	doStatus(es, fd);
-	return;
+    if (r->tail) {
+	iov[n].iov_base = (void *) ",";
+	iov[n++].iov_len = 1;
     }
 
-    /* We have to keep the old command for backward-compatibility */
-    if (len == 6 && !strcmp(buf, "slaves")) {
-	doWorkerReport(es, fd, 0);
-	return;
+    conn->writing = r;
+    if (!n || !EventTcp_WriteV(conn->es, conn->fd, iov, n,
+			       mux_write_done, Settings.clientTimeout, conn)) {
+	mux_write_done(conn->es, conn->fd, NULL, 0,
+		       n ? EVENT_TCP_FLAG_IOERROR : EVENT_TCP_FLAG_COMPLETE, conn);
     }
+}
 
-    if (len == 7 && !strcmp(buf, "workers")) {
-	doWorkerReport(es, fd, 0);
+/**********************************************************************
+* %FUNCTION: mux_send
+* %ARGUMENTS:
+*  conn -- a mux connection
+*  tagged -- if false, msg is the handshake reply and is sent as is
+*  id -- request ID
+*  msg -- reply
+*  len -- length of reply
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Queues msg on conn, encoded as the netstring "id msg" or as a reply
+*  frame.
+***********************************************************************/
+static void
+mux_send(MuxConn *conn, int tagged, unsigned long id, char const *msg, int len)
+{
+    MuxReply *r;
+
+    if (conn->dead) return;
+    r = malloc(sizeof(MuxReply));
+    if (!r) return;
+    r->hlen = 0;
+    r->tail = 0;
+    if (tagged && conn->binary) {
+	/* Length, request ID, status */
+	put_u32((unsigned char *) r->hdr, 4 + 1 + len);
+	put_u32((unsigned char *) r->hdr + 4, id);
+	r->hdr[8] = 0;
+	r->hlen = 9;
+    } else if (tagged) {
+	char idbuf[32];
+	int idlen = snprintf(idbuf, sizeof(idbuf), "%lu", id);
+	r->hlen = snprintf(r->hdr, sizeof(r->hdr), "%d:%s ",
+			   idlen + 1 + len, idbuf);
+	r->tail = 1;
+    }
+    r->len = len;
+    r->buf = malloc(len ? len : 1);
+    if (!r->buf) {
+	free(r);
 	return;
     }
+    memcpy(r->buf, msg, len);
 
-    /* We have to keep the old command for backward-compatibility */
-    if (len == 10 && !strcmp(buf, "busyslaves")) {
-	doWorkerReport(es, fd, 1);
-	return;
-    }
-    if (len == 11 && !strcmp(buf, "busyworkers")) {
-	doWorkerReport(es, fd, 1);
-	return;
+    r->next = NULL;
+    if (conn->outTail) {
+	conn->outTail->next = r;
+    } else {
+	conn->outHead = r;
     }
+    conn->outTail = r;
+    mux_write_next(conn);
+}
 
-    if (len == 4 && !strcmp(buf, "load")) {
-	doLoad(es, fd, SCAN_CMD);
+/**********************************************************************
+* %FUNCTION: mux_reply
+* %ARGUMENTS:
+*  handle -- mux client handle
+*  msg -- reply
+*  len -- length of reply
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Sends the reply for the request behind handle and frees the handle.
+***********************************************************************/
+static void
+mux_reply(int handle, char const *msg, int len)
+{
+    int slot = handle - MUX_HANDLE_BASE;
+    MuxRequest *req;
+    MuxConn *conn;
+    unsigned long id;
+
+    if (slot < 0 || slot >= NumMuxRequests || !MuxRequests[slot].conn) {
+	syslog(LOG_CRIT, "mux: Reply for unknown request handle %d", handle);
 	return;
     }
+    req = &MuxRequests[slot];
+    conn = req->conn;
+    id = req->id;
+    req->conn = NULL;
+    req->nextFree = FreeMuxRequest;
+    FreeMuxRequest = slot;
 
-    if (len > 6 && !strncmp(buf, "load1 ", 6)) {
-	int back;
-	if (sscanf(buf+6, "%d", &back) != 1 ||
-	    back < 10 || back > 600) {
-	    reply_to_mimedefang(es, fd, "error: Invalid 'back' amount (must be 10-600)\n");
-	    return;
+    conn->inflight--;
+    mux_send(conn, 1, id, msg, len);
+    mux_try_free(conn);
+}
+
+/**********************************************************************
+* %FUNCTION: alloc_mux_handle
+* %ARGUMENTS:
+*  conn -- a mux connection
+*  id -- client's request ID
+* %RETURNS:
+*  A client handle for the request, or -1 if out of memory.
+***********************************************************************/
+static int
+alloc_mux_handle(MuxConn *conn, unsigned long id)
+{
+    int slot;
+
+    if (FreeMuxRequest < 0) {
+	int n = NumMuxRequests ? NumMuxRequests * 2 : 64;
+	MuxRequest *r = realloc(MuxRequests, n * sizeof(MuxRequest));
+	if (!r) return -1;
+	MuxRequests = r;
+	for (slot = n-1; slot >= NumMuxRequests; slot--) {
+	    MuxRequests[slot].conn = NULL;
+	    MuxRequests[slot].nextFree = FreeMuxRequest;
+	    FreeMuxRequest = slot;
 	}
-	doLoad1(es, fd, back);
-	return;
-    }
-    if (len == 12 && !strcmp(buf, "load-relayok")) {
-	doLoad(es, fd, RELAYOK_CMD);
-	return;
-    }
+	NumMuxRequests = n;
+    }
+    slot = FreeMuxRequest;
+    FreeMuxRequest = MuxRequests[slot].nextFree;
+    MuxRequests[slot].conn = conn;
+    MuxRequests[slot].id = id;
+    conn->inflight++;
+    return MUX_HANDLE_BASE + slot;
+}
 
-    if (len == 13 && !strcmp(buf, "load-senderok")) {
-	doLoad(es, fd, SENDEROK_CMD);
-	return;
-    }
+/**********************************************************************
+* %FUNCTION: mux_text_command
+* %ARGUMENTS:
+*  es -- event selector
+*  handle -- mux client handle
+*  cmd -- text command without its newline
+*  len -- length of cmd
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Runs a text command which arrived on a mux connection.
+***********************************************************************/
+static void
+mux_text_command(EventSelector *es, int handle, char const *cmd, int len)
+{
+    char buf[MAX_CMD_LEN];
 
-    if (len == 12 && !strcmp(buf, "load-recipok")) {
-	doLoad(es, fd, RECIPOK_CMD);
+    if (len >= MAX_CMD_LEN - 2) {
+	reply_to_mimedefang(es, handle, "error: Command too long\n");
 	return;
     }
 
-    if (len == 5 && !strcmp(buf, "hload")) {
-	doHourlyLoad(es, fd, SCAN_CMD);
-	return;
-    }
+    /* handleCommand expects a newline-terminated command in a
+       buffer with room to spare */
+    memcpy(buf, cmd, len);
+    buf[len] = '\n';
+    buf[len+1] = 0;
+    handleCommand(es, handle, buf, len+1, EVENT_TCP_FLAG_COMPLETE, NULL);
+}
 
-    if (len == 13 && !strcmp(buf, "hload-relayok")) {
-	doHourlyLoad(es, fd, RELAYOK_CMD);
+/**********************************************************************
+* %FUNCTION: got_mux_request
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- the connection
+*  buf -- netstring contents plus trailing comma
+*  len -- length of buf
+*  flag -- result of the read
+*  data -- the MuxConn
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Handles one request on a mux connection.  Reading resumes at once,
+*  so the client can have several requests in flight.
+***********************************************************************/
+static void
+got_mux_request(EventSelector *es, int fd, char *buf, int len, int flag,
+		void *data)
+{
+    MuxConn *conn = (MuxConn *) data;
+    unsigned long id;
+    char *ptr;
+    int handle;
+
+    if (flag != EVENT_TCP_FLAG_COMPLETE) {
+	conn->readDone = 1;
+	mux_try_free(conn);
 	return;
     }
 
-    if (len == 14 && !strcmp(buf, "hload-senderok")) {
-	doHourlyLoad(es, fd, SENDEROK_CMD);
+    /* Chop off comma and split off the request ID */
+    if (!len || buf[len-1] != ',') {
+	conn->readDone = 1;
+	shutdown(fd, SHUT_RDWR);
+	mux_try_free(conn);
 	return;
     }
-
-    if (len == 13 && !strcmp(buf, "hload-recipok")) {
-	doHourlyLoad(es, fd, RECIPOK_CMD);
+    buf[--len] = 0;
+    id = strtoul(buf, &ptr, 10);
+    if (ptr == buf || *ptr != ' ') {
+	conn->readDone = 1;
+	shutdown(fd, SHUT_RDWR);
+	mux_try_free(conn);
 	return;
     }
+    ptr++;
+    len -= (ptr - buf);
 
-    if (len == 5 && !strcmp(buf, "histo")) {
-      doHistogram(es, fd);
-      return;
+    /* Read the next request */
+    if (!EventTcp_ReadNetstring(es, fd, got_mux_request, 0, conn)) {
+	syslog(LOG_ERR, "got_mux_request: EventTcp_ReadNetstring failed: %m");
+	conn->readDone = 1;
     }
 
-    if (len == 4 && !strcmp(buf, "msgs")) {
-	snprintf(answer, sizeof(answer), "%d\n", NumMsgsProcessed);
-	reply_to_mimedefang(es, fd, answer);
+    handle = alloc_mux_handle(conn, id);
+    if (handle < 0) {
+	mux_send(conn, 1, id, "error: Out of memory\n", 21);
+	mux_try_free(conn);
 	return;
     }
+    mux_text_command(es, handle, ptr, len);
+}
 
-    /* We have to keep the old command for backward-compatibility */
-    if (len > 10 && !strncmp(buf, "slaveinfo ", 10)) {
-	doWorkerInfo(es, fd, buf);
-	return;
-    }
+/* Indexed by opcode; see mimedefang.h for the fields */
+static FrameOp const FrameOps[MXOP_MAX+1] = {
+    /* MXOP_TEXT */     { NULL,        1, 1,               -1, frameText },
+    /* MXOP_FREE */     { "free",      0, 0,               -1, frameFree },
+    /* MXOP_SCAN */     { "scan",      2, 2,                0, frameWorkerCommand },
+    /* MXOP_RELAYOK */  { "relayok",   6, 6,               -1, frameWorkerCommand },
+    /* MXOP_HELOOK */   { "helook",    7, 7,               -1, frameWorkerCommand },
+    /* MXOP_SENDEROK */ { "senderok",  6, MX_FRAME_FIELDS,  5, frameWorkerCommand },
+    /* MXOP_RECIPOK */  { "recipok",  11, MX_FRAME_FIELDS,  7, frameWorkerCommand },
+    /* MXOP_LEASE */    { "lease",     2, 2,               -1, frameLease },
+    /* MXOP_UNLEASE */  { "unlease",   0, 0,               -1, frameUnlease }
+};
 
-    if (len > 11 && !strncmp(buf, "workerinfo ", 11)) {
-	doWorkerInfo(es, fd, buf);
+/**********************************************************************
+* %FUNCTION: got_mux_frame
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- the connection
+*  buf -- frame contents after the length
+*  len -- length of buf
+*  flag -- result of the read
+*  data -- the MuxConn
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Handles one binary request: decodes the header and fields and calls
+*  the opcode's handler.  Reading resumes at once, as for netstrings.
+***********************************************************************/
+static void
+got_mux_frame(EventSelector *es, int fd, char *buf, int len, int flag,
+	      void *data)
+{
+    MuxConn *conn = (MuxConn *) data;
+    unsigned char const *u = (unsigned char const *) buf;
+    FrameRequest req;
+    FrameOp const *op;
+    unsigned long id;
+    int opcode;
+    int handle;
+
+    if (flag != EVENT_TCP_FLAG_COMPLETE) {
+	conn->readDone = 1;
+	mux_try_free(conn);
 	return;
     }
 
-    /* This is an awful hack used by watch-multiple-mimedefangs.tcl.
-       We handle it here so we don't have to waste a worker */
-    if (len == 19 && !strcmp(buf, "foo_no_such_command")) {
-	reply_to_mimedefang(es, fd, "error: Unknown command\n");
+    /* ID, opcode, lease, field count */
+    if (len < 10) {
+	conn->readDone = 1;
+	shutdown(fd, SHUT_RDWR);
+	mux_try_free(conn);
 	return;
     }
+    id = get_u32(u);
+    opcode = u[4];
+    req.leaseId = (unsigned int) get_u32(u + 5);
+    req.f.nfields = u[9];
 
-    /* Remaining commands are privileged */
-    if (data) {
-	reply_to_mimedefang(es, fd, "error: Attempt to use privileged command on unprivileged socket\n");
-	return;
+    /* Read the next request */
+    if (!EventTcp_ReadFrame(es, fd, MX_FRAME_MAX, got_mux_frame, 0, conn)) {
+	syslog(LOG_ERR, "got_mux_frame: EventTcp_ReadFrame failed: %m");
+	conn->readDone = 1;
     }
 
-    if (len == 6 && !strcmp(buf, "reread")) {
-	newGeneration();
-	notify_listeners(es, "R\n");
-#ifndef SAFE_EMBED_PERL
-	if (Settings.useEmbeddedPerl) {
-	    reply_to_mimedefang(es, fd, "Cannot destroy and recreate an embedded Perl interpreter safely on this platform.  Filter rules will NOT be reread\n");
-	    return;
-	}
-#endif
-	reply_to_mimedefang(es, fd, "Forced reread of filter rules\n");
+    handle = alloc_mux_handle(conn, id);
+    if (handle < 0) {
+	mux_send(conn, 1, id, "error: Out of memory\n", 21);
+	mux_try_free(conn);
 	return;
     }
 
-    if (len == 9 && !strcmp(buf, "autoscale")) {
-	doAutoscaleStatus(es, fd);
+    if (opcode > MXOP_MAX) {
+	reply_to_mimedefang(es, handle, "error: Unknown opcode\n");
 	return;
     }
-
-    if (len > 5 && !strncmp(buf, "scan ", 5)) {
-	doScan(es, fd, buf);
+    op = &FrameOps[opcode];
+    if (req.f.nfields < op->minFields || req.f.nfields > op->maxFields ||
+	decode_frame_fields(u + 10, u + len, &req.f, FrameText) < 0) {
+	reply_to_mimedefang(es, handle, "error: Malformed request\n");
 	return;
     }
-
-    /* Any command other than "scan" is handled generically. */
-    doWorkerCommand(es, fd, buf);
-    return;
-}
-
-static int
-worker_request_age(Worker *s) {
-    if (s->firstReqTime == (time_t) -1) {
-	return -1;
-    }
-    return (int) (time(NULL) - s->firstReqTime);
+    req.lease = requestLease(req.leaseId);
+    op->handler(es, handle, op, &req);
 }
 
-static int
-worker_age(Worker *s) {
-    if (s->activationTime == (time_t) -1) {
-	return -1;
-    }
-    return (int) (time(NULL) - s->activationTime);
+/**********************************************************************
+* %FUNCTION: frameText
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- client handle
+*  op -- dispatch table entry
+*  req -- the request
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  MXOP_TEXT: runs the text command in the only field.
+***********************************************************************/
+static void
+frameText(EventSelector *es, int fd, FrameOp const *op, FrameRequest *req)
+{
+    mux_text_command(es, fd, req->f.str[0], strlen(req->f.str[0]));
 }
 
 /**********************************************************************
-* %FUNCTION: doWorkerInfo
+* %FUNCTION: frameFree
 * %ARGUMENTS:
 *  es -- event selector
-*  fd -- connection to MIMEDefang
-*  cmd -- workerinfo command
+*  fd -- client handle
+*  op -- dispatch table entry
+*  req -- the request
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Returns detailed information about a specific worker
+*  MXOP_FREE: like "free".
 ***********************************************************************/
 static void
-doWorkerInfo(EventSelector *es, int fd, char *cmd)
+frameFree(EventSelector *es, int fd, FrameOp const *op, FrameRequest *req)
 {
-    int workerno;
-    char buf[1024];
-    Worker *s;
+    char answer[32];
 
-    if (sscanf(cmd+10, "%d", &workerno) != 1) {
-	reply_to_mimedefang(es, fd, "error: Invalid worker number\n");
-	return;
-    }
-    if (workerno < 0 || workerno >= Settings.maxWorkers) {
-	reply_to_mimedefang(es, fd, "error: Worker number out of range\n");
-	return;
-    }
-    s = &AllWorkers[workerno];
-    snprintf(buf, sizeof(buf), "Worker %d\nState %s\nPID %d\nNumRequests %d\nNumScans %d\nAge %d\nFirstReqAge %d\nLastStateChangeAge %d\nStatusTag %s\n",
-	     workerno,
-	     state_name(s->state),
-	     (int) s->pid,
-	     s->numRequests,
-	     s->numScans,
-	     worker_age(s),
-	     worker_request_age(s),
-	     (int) (time(NULL) - s->lastStateChange),
-	     s->status_tag);
-    reply_to_mimedefang(es, fd, buf);
+    snprintf(answer, sizeof(answer), "%d\n", NUM_UNRESERVED_WORKERS);
+    reply_to_mimedefang(es, fd, answer);
 }
 
 /**********************************************************************
-* %FUNCTION: doScan
+* %FUNCTION: frameLease
 * %ARGUMENTS:
 *  es -- event selector
-*  fd -- connection to MIMEDefang
-*  cmd -- scan command
+*  fd -- client handle
+*  op -- dispatch table entry
+*  req -- the request
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Sends the scan command to the worker and arranges for answer to be
-*  sent back when scanning is complete.
+*  MXOP_LEASE: like "lease ttl required".
 ***********************************************************************/
 static void
-doScan(EventSelector *es, int fd, char *cmd)
+frameLease(EventSelector *es, int fd, FrameOp const *op, FrameRequest *req)
 {
-    int len;
-
-    /* Add newline back to command */
-    len = strlen(cmd);
-    if (len < MAX_CMD_LEN-1) {
-	cmd[len+1] = 0;
-	cmd[len] = '\n';
-    } else {
-	char *answer = "error: Command too long\n";
-	reply_to_mimedefang(es, fd, answer);
-	if (DOLOG) {
-	    syslog(LOG_DEBUG, "doScan: Command too long");
-	}
+    if (!req->f.isnum[0] || !req->f.isnum[1] ||
+	req->f.num[0] > MAX_LEASE_TTL || req->f.num[1] > INT_MAX) {
+	reply_to_mimedefang(es, fd, "error: Invalid lease request\n");
 	return;
     }
-
-    doScanAux(es, fd, cmd, 1);
+    doLease(es, fd, (int) req->f.num[0], (int) req->f.num[1]);
 }
 
+/**********************************************************************
+* %FUNCTION: frameUnlease
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- client handle
+*  op -- dispatch table entry
+*  req -- the request
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  MXOP_UNLEASE: releases the lease named in the header.
+***********************************************************************/
 static void
-doScanAux(EventSelector *es, int fd, char *cmd, int queueable)
+frameUnlease(EventSelector *es, int fd, FrameOp const *op, FrameRequest *req)
 {
-    Worker *s;
+    doUnlease(es, fd, req->leaseId);
+}
 
-    /* Find a free worker */
-    s = findFreeWorker(SCAN_CMD);
-    if (!s) {
-	char *answer = "error: No free workers\n";
-	if (queueable && Settings.requestQueueSize > 0) {
-	    if (queue_request(es, fd, cmd)) {
-		/* Successfully queued */
+/**********************************************************************
+* %FUNCTION: frameWorkerCommand
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- client handle
+*  op -- dispatch table entry
+*  req -- the request
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Scans and filter callbacks.  Workers speak the text protocol, so we
+*  build the command line for the worker here, percent-encoding each
+*  field.  We already know the queue ID and directory, so doScanAux
+*  and doWorkerCommandAux need not parse them back out.  ESMTP
+*  arguments that don't fit are dropped, as the text client does.
+***********************************************************************/
+static void
+frameWorkerCommand(EventSelector *es, int fd, FrameOp const *op, FrameRequest *req)
+{
+    char cmd[MAX_CMD_LEN];
+    int len = strlen(op->name);
+    int room, n, i;
+
+    memcpy(cmd, op->name, len);
+    for (i=0; i<req->f.nfields; i++) {
+	/* Leave room for the space, the newline and the NUL.  Since
+	   percent_encode truncates silently, treat a field which comes
+	   close to filling the buffer as not fitting. */
+	room = MAX_CMD_LEN - len - 2;
+	n = percent_encode(req->f.str[i], cmd + len + 1, room);
+	if (n >= room - 3) {
+	    if (i < op->minFields) {
+		reply_to_mimedefang(es, fd, "error: Command too long\n");
 		return;
 	    }
+	    break;
 	}
-
-	if (DOLOG) {
-	    syslog(LOG_WARNING, "No free workers");
-	}
-	reply_to_mimedefang(es, fd, answer);
-	return;
+	cmd[len] = ' ';
+	len += n + 1;
     }
+    cmd[len++] = '\n';
+    cmd[len] = 0;
 
-    if (activateWorker(s, "About to perform scan") == (pid_t) -1) {
-	char *answer = "error: Unable to activate worker\n";
-	if (DOLOG) {
-	    syslog(LOG_ERR, "Unable to activate worker %d",
-		   WORKERNO(s));
-	}
-	reply_to_mimedefang(es, fd, answer);
-	return;
+    if (op == &FrameOps[MXOP_SCAN]) {
+	doScanAux(es, fd, cmd, 1, NULL, req->lease, req->f.str[0], req->f.str[1]);
+    } else {
+	doWorkerCommandAux(es, fd, cmd, 1, NULL, req->lease,
+			   (op->qidField >= 0) ? req->f.str[op->qidField] : NULL);
     }
+}
 
-    /* Put the worker on the busy list */
-    putOnList(s, STATE_BUSY);
-
-    /* Set last_cmd field */
-    s->last_cmd = SCAN_CMD;
-
-    /* Update worker status */
-    set_worker_status_from_command(s, cmd);
-
-    /* Set worker's clientFD so we can reply */
-    s->clientFD = fd;
-
-    /* Set worker's queue ID and working directory */
-    sscanf(cmd, "scan %" STR(MAX_QID_LEN) "s %" STR(MAX_DIR_LEN) "s", s->qid, s->workdir);
-    s->workdir[MAX_DIR_LEN] = 0;
-    s->qid[MAX_QID_LEN] = 0;
-
-    /* Set worker's start-of-command time */
-    gettimeofday(&(s->start_cmd), NULL);
+/**********************************************************************
+* %FUNCTION: startMuxConnection
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- connection which sent the "mux" command
+*  binary -- if true, the client asked for binary frames
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Turns fd into a persistent multiplexed connection.  We acknowledge
+*  with "ok mux" or "ok mux binary"; after that, requests and replies
+*  are netstrings or frames.
+***********************************************************************/
+static void
+startMuxConnection(EventSelector *es, int fd, int binary)
+{
+    MuxConn *conn = calloc(1, sizeof(MuxConn));
+    EventTcpState *st;
 
-    /* And tell the worker to go ahead... */
-    s->event = EventTcp_WriteBuf(es, s->workerStdin, cmd, strlen(cmd),
-				 handleWorkerReceivedCommand,
-				 Settings.clientTimeout, s);
-    if (!s->event) {
-	if (DOLOG) syslog(LOG_ERR, "doScan: EventTcp_WriteBuf failed: %m");
-	killWorker(s, "EventTcp_WriteBuf failed");
+    if (!conn) {
+	reply_to_mimedefang(es, fd, "error: Out of memory\n");
+	return;
+    }
+    conn->es = es;
+    conn->fd = fd;
+    conn->binary = binary;
+    NumMuxConns++;
+    if (binary) {
+	mux_send(conn, 0, 0, "ok mux binary\n", 14);
+	st = EventTcp_ReadFrame(es, fd, MX_FRAME_MAX, got_mux_frame, 0, conn);
     } else {
-	statsLog("StartFilter", WORKERNO(s), NULL);
+	mux_send(conn, 0, 0, "ok mux\n", 7);
+	st = EventTcp_ReadNetstring(es, fd, got_mux_request, 0, conn);
+    }
+    if (!st) {
+	syslog(LOG_ERR, "startMuxConnection: Could not start reading: %m");
+	conn->readDone = 1;
+	mux_try_free(conn);
     }
 }
 
 /**********************************************************************
-* %FUNCTION: doWorkerCommand
+* %FUNCTION: handleCommand
 * %ARGUMENTS:
 *  es -- event selector
 *  fd -- connection to MIMEDefang
-*  cmd -- command
+*  buf -- buffer of data read from MIMEDefang
+*  len -- amount of data read from MIMEDefang
+*  flag -- flag from reader
+*  data -- if non-NULL, command came from unprivileged socket -- restrict
+*          what we can do.
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Sends the command to the worker and arranges for answer to be
-*  sent back when command finishes.
+*  Handles a MIMEDefang command.
 ***********************************************************************/
 static void
-doWorkerCommand(EventSelector *es, int fd, char *cmd)
+handleCommand(EventSelector *es,
+	      int fd,
+	      char *buf,
+	      int len,
+	      int flag,
+	      void *data)
 {
-    int len;
+    char answer[MAX_CMD_LEN];
+    Lease *lease = NULL;
 
-    /* Add newline back to command */
-    len = strlen(cmd);
-    if (len < MAX_CMD_LEN-1) {
-	cmd[len+1] = 0;
-	cmd[len] = '\n';
-    } else {
-	char *answer = "error: Command too long\n";
-	reply_to_mimedefang(es, fd, answer);
+    if (data) {
+	NumUnprivConnections--;
+    }
+    if (flag == EVENT_TCP_FLAG_TIMEOUT || flag == EVENT_TCP_FLAG_IOERROR) {
 	if (DOLOG) {
-	    syslog(LOG_DEBUG, "doWorkerCommand: Command too long");
+	    syslog(LOG_ERR, "handleCommand: Timeout or error: Flag = %d: %m",
+		   flag);
 	}
+	/* Client timeout or error */
+	close(fd);
 	return;
     }
 
-    doWorkerCommandAux(es, fd, cmd, 1);
-}
-
-static int
-at_recipok_limit(char *cmd)
-{
-    char domain_buf[MAX_DOMAIN_LEN];
-    char const *ptr = cmd;
-    char *out = domain_buf;
-    int len = 0;
-    int count = 0;
-    Worker *s;
-
-    while(*ptr && (*ptr != '@')) ptr++;
-
-    /* No domain?  Punt! */
-    if (*ptr != '@') return 0;
-
-    ptr++;
-    while(*ptr && *ptr != '>' && *ptr != ' ') {
-	len++;
-	*out++ = *ptr++;
-	if (len >= MAX_DOMAIN_LEN - 1) break;
+    /* Null-terminate buffer */
+    if (len) {
+	len--;
+	buf[len] = 0;
     }
-    *out = 0;
 
-    /* Search active workers doing recipok */
-    s = Workers[STATE_BUSY];
-    while(s) {
-	if (s->cmd == RECIPOK_CMD &&
-	    !strcasecmp(s->domain, domain_buf)) {
-	    count++;
-	    if (count >= Settings.maxRecipokPerDomain) {
-		if (DOLOG) {
-		    syslog(LOG_WARNING, "Hit per-domain recipok limit (%d) for domain %s", Settings.maxRecipokPerDomain, domain_buf);
-		}
-		return 1;
-	    }
-	}
-	s = s->next;
+    /* Remove cr so we can use telnet for unpriv socket */
+    if (len && (buf[len-1] == '\r')) {
+	len--;
+	buf[len] = 0;
     }
-    return 0;
-}
-
-static void
-doWorkerCommandAux(EventSelector *es, int fd, char *cmd, int queueable)
-{
-    Worker *s;
-    char reason[200];
-    int cmdno;
-
-    sprintf(reason, "About to execute command '%.100s'", cmd);
-
-    cmdno = cmd_to_number(cmd);
-
-    /* If cmdno is RECIPOK_CMD, make
-       sure we are not at per-domain limit */
-    if ((cmdno == RECIPOK_CMD) && (Settings.maxRecipokPerDomain > 0)) {
-	if (at_recipok_limit(cmd)) {
-	    /* TODO: Should we queue?
-	       Can't right now because queue-removal logic knows nothing
-	       about per-domain recipok limit. */
-	    reply_to_mimedefang(es, fd, "ok -1 Per-domain%20recipok%20limit%20hit;%20please%20try%20again%20later\n");
-	    return;
+    if (len == 4 && !strcmp(buf, "help")) {
+	if (data) {
+	    doHelp(es, fd, 1);
+	} else {
+	    doHelp(es, fd, 0);
 	}
+	return;
     }
 
-    /* Find a free worker */
-    s = findFreeWorker(cmdno);
-    if (!s) {
-	char *answer = "error: No free workers\n";
-	if (queueable && Settings.requestQueueSize > 0) {
-	    if (queue_request(es, fd, cmd)) {
-		/* Successfully queued */
-		return;
-	    }
+    /* Switch to a persistent multiplexed connection */
+    if ((len == 3 && !strcmp(buf, "mux")) ||
+	(len == 10 && !strcmp(buf, "mux binary"))) {
+	if (data || IS_MUX_HANDLE(fd)) {
+	    reply_to_mimedefang(es, fd, "error: mux not allowed here\n");
+	} else {
+	    startMuxConnection(es, fd, len == 10);
 	}
+	return;
+    }
 
-	if (DOLOG) {
-	    syslog(LOG_WARNING, "No free workers");
-	}
+    if (len == 4 && !strcmp(buf, "free")) {
+	/* Workers held back by leases are not free to anyone else */
+	snprintf(answer, sizeof(answer), "%d\n", NUM_UNRESERVED_WORKERS);
 	reply_to_mimedefang(es, fd, answer);
 	return;
     }
 
-    if (activateWorker(s, reason) == (pid_t) -1) {
-	char *answer = "error: Unable to activate worker\n";
-	if (DOLOG) {
-	    syslog(LOG_ERR, "Unable to activate worker %d",
-		   WORKERNO(s));
-	}
+    if (len == 7 && !strcmp(buf, "version")) {
+	reply_to_mimedefang(es, fd, VERSION);
+	return;
+    }
+    /* "tick" command must ONLY be internally-generated to guarantee
+       that two tick handlers won't be running simultaneously */
+    if (len == 4 && !strcmp(buf, "tick")) {
+	snprintf(answer, sizeof(answer), "error: External agents may not invoke 'tick'\n");
 	reply_to_mimedefang(es, fd, answer);
 	return;
     }
 
-    /* Put the worker on the busy list */
-    putOnList(s, STATE_BUSY);
-
-    /* Update last_cmd */
-    if (cmdno >= 0) {
-	s->last_cmd = cmdno;
+    if (len == 6 && !strcmp(buf, "status")) {
+	doStatus(es, fd);
+	return;
     }
 
-    /* Update worker's status tag */
-    set_worker_status_from_command(s, cmd);
+    /* We have to keep the old command for backward-compatibility */
+    if (len == 6 && !strcmp(buf, "slaves")) {
+	doWorkerReport(es, fd, 0);
+	return;
+    }
 
-    /* Set worker's clientFD so we can reply */
-    s->clientFD = fd;
+    if (len == 7 && !strcmp(buf, "workers")) {
+	doWorkerReport(es, fd, 0);
+	return;
+    }
 
-    /* Null workdir signals not to log EndFilter event */
-    s->workdir[0] = 0;
-
-    /* Set the qid */
-    switch(cmdno) {
-    case SENDEROK_CMD:
-	/* senderok sender ip name helo dir qid */
-	sscanf(cmd, "senderok %*s %*s %*s %*s %*s %" STR(MAX_QID_LEN)  "s", s->qid);
-	s->qid[MAX_QID_LEN] = 0;
-	break;
-    case RECIPOK_CMD:
-	/* recipok recipient sender ip name firstrecip helo dir qid junk */
-	sscanf(cmd, "recipok %*s %*s %*s %*s %*s %*s %*s %" STR(MAX_QID_LEN) "s", s->qid);
-	s->qid[MAX_QID_LEN] = 0;
-	break;
-    default:
-	s->qid[0]     = 0;
-	break;
+    /* We have to keep the old command for backward-compatibility */
+    if (len == 10 && !strcmp(buf, "busyslaves")) {
+	doWorkerReport(es, fd, 1);
+	return;
+    }
+    if (len == 11 && !strcmp(buf, "busyworkers")) {
+	doWorkerReport(es, fd, 1);
+	return;
     }
 
-    /* Set worker's start-of-command time */
-    gettimeofday(&(s->start_cmd), NULL);
-
-    /* And tell the worker to go ahead... */
-    s->event = EventTcp_WriteBuf(es, s->workerStdin, cmd, strlen(cmd),
-				 handleWorkerReceivedCommand,
-				 Settings.clientTimeout, s);
-    if (!s->event) {
-	if (DOLOG) syslog(LOG_ERR, "doWorkerCommand: EventTcp_WriteBuf failed: %m");
-	killWorker(s, "EventTcp_WriteBuf failed");
+    if (len == 4 && !strcmp(buf, "load")) {
+	doLoad(es, fd, SCAN_CMD);
+	return;
     }
-}
 
-/**********************************************************************
-* %FUNCTION: handleWorkerReceivedCommand
-* %ARGUMENTS:
-*  es -- event selector
-*  fd -- connection to MIMEDefang
-*  buf -- buffer of data read from MIMEDefang
-*  len -- amount of data read from MIMEDefang
-*  flag -- flag from reader
-*  data -- the worker
-* %RETURNS:
-*  Nothing
-* %DESCRIPTION:
-*  Called when command has been written to worker.  Sets up an event handler
-*  to read the worker's reply
-***********************************************************************/
-static void
-handleWorkerReceivedCommand(EventSelector *es,
-			   int fd,
-			   char *buf,
-			   int len,
-			   int flag,
-			   void *data)
-{
-    Worker *s = (Worker *) data;
+    if (len > 6 && !strncmp(buf, "load1 ", 6)) {
+	int back;
+	if (sscanf(buf+6, "%d", &back) != 1 ||
+	    back < 10 || back > 600) {
+	    reply_to_mimedefang(es, fd, "error: Invalid 'back' amount (must be 10-600)\n");
+	    return;
+	}
+	doLoad1(es, fd, back);
+	return;
+    }
+    if (len == 12 && !strcmp(buf, "load-relayok")) {
+	doLoad(es, fd, RELAYOK_CMD);
+	return;
+    }
 
-    /* Event was triggered */
-    s->event = NULL;
+    if (len == 13 && !strcmp(buf, "load-senderok")) {
+	doLoad(es, fd, SENDEROK_CMD);
+	return;
+    }
 
-    if (flag == EVENT_TCP_FLAG_TIMEOUT || flag == EVENT_TCP_FLAG_IOERROR) {
-	/* Error writing to worker */
-	char *answer = "error: Error talking to worker process\n";
-	if (DOLOG) {
-	    syslog(LOG_ERR, "handleWorkerReceivedCommand(%d): Timeout or error: Flag = %d: %m",
-		   WORKERNO(s),
-		   flag);
-	}
-	reply_to_mimedefang(es, s->clientFD, answer);
-	/* The reply_to_mimedefang will close clientFD when it's done */
-	s->clientFD = -1;
+    if (len == 12 && !strcmp(buf, "load-recipok")) {
+	doLoad(es, fd, RECIPOK_CMD);
+	return;
+    }
 
-	/* Kill the worker process */
-	killWorker(s, "Error talking to worker process");
+    if (len == 5 && !strcmp(buf, "hload")) {
+	doHourlyLoad(es, fd, SCAN_CMD);
 	return;
     }
 
-    /* Worker has been given the command; now wait for it to reply */
-    s->event = EventTcp_ReadBuf(es, s->workerStdout, MAX_CMD_LEN, '\n',
-				handleWorkerReceivedAnswer,
-				Settings.busyTimeout, 1, s);
-    if (!s->event) {
-	if (DOLOG) syslog(LOG_ERR, "handleWorkerReceivedCommand: EventTcp_ReadBuf failed: %m");
-	killWorker(s, "EventTcp_ReadBuf failed");
+    if (len == 13 && !strcmp(buf, "hload-relayok")) {
+	doHourlyLoad(es, fd, RELAYOK_CMD);
+	return;
     }
-}
 
-/**********************************************************************
-* %FUNCTION: handleWorkerReceivedAnswer
-* %ARGUMENTS:
-*  es -- event selector
-*  fd -- connection to MIMEDefang
-*  buf -- buffer of data read from MIMEDefang
-*  len -- amount of data read from MIMEDefang
-*  flag -- flag from reader
-*  data -- the worker
-* %RETURNS:
-*  Nothing
-* %DESCRIPTION:
-*  Called when the worker's answer comes back.
-***********************************************************************/
-static void
-handleWorkerReceivedAnswer(EventSelector *es,
-			  int fd,
-			  char *buf,
-			  int len,
-			  int flag,
-			  void *data)
-{
-    Worker *s = (Worker *) data;
-    struct timeval now;
-    HistoryBucket *b;
+    if (len == 14 && !strcmp(buf, "hload-senderok")) {
+	doHourlyLoad(es, fd, SENDEROK_CMD);
+	return;
+    }
 
-    /* Event was triggered */
-    s->event = NULL;
+    if (len == 13 && !strcmp(buf, "hload-recipok")) {
+	doHourlyLoad(es, fd, RECIPOK_CMD);
+	return;
+    }
 
-    /* If nothing was received from worker, send error message back */
-    if (!len || (flag == EVENT_TCP_FLAG_TIMEOUT)) {
-	if (flag == EVENT_TCP_FLAG_TIMEOUT) {
-	    /* Heuristic... */
-	    if (WorkerCount[STATE_BUSY] > 3) {
-		reply_to_mimedefang(es, s->clientFD,
-				    "ERR Filter timed out - system may be overloaded "
-				    "(consider increasing busy timeout)\n");
-		/* The reply_to_mimedefang will close clientFD when it's done */
-		s->clientFD = -1;
-	    } else {
-		reply_to_mimedefang(es, s->clientFD,
-				    "ERR Filter timed out - check filter rules or system load\n");
-		/* The reply_to_mimedefang will close clientFD when it's done */
-		s->clientFD = -1;
-	    }
-	} else {
-	    if (DOLOG) {
-		if (s->oom) {
-		    syslog(LOG_ERR, "Worker %d ran out of memory -- possible DoS attack due to complex MIME?", WORKERNO(s));
-		} else {
-		    syslog(LOG_ERR, "Worker %d died prematurely -- check your filter rules", WORKERNO(s));
-		}
-	    } else {
-		if (s->oom) {
-		    syslog(LOG_ERR, "Worker %d ran out of memory -- possible DoS attack due to complex MIME?", WORKERNO(s));
-		} else {
-		    syslog(LOG_ERR, "Worker %d died prematurely -- check your filter rules and use the '-l' flag on mimedefang-multiplexor to see Perl error messages", WORKERNO(s));
-		}
-	    }
-	    reply_to_mimedefang(es, s->clientFD, "ERR No response from worker\n");
-	    /* The reply_to_mimedefang will close clientFD when it's done */
-	    s->clientFD = -1;
-	}
-    } else {
-	/* Write the worker's answer back to the client */
-	reply_to_mimedefang_with_len(es, s->clientFD, buf, len);
-	/* The reply_to_mimedefang will close clientFD when it's done */
-	s->clientFD = -1;
+    if (len == 5 && !strcmp(buf, "histo")) {
+      doHistogram(es, fd);
+      return;
     }
 
-    s->numRequests++;
+    if (len == 5 && !strcmp(buf, "burst")) {
+	doBurst(es, fd);
+	return;
+    }
 
-    if (s->cmd >= 0 && s->cmd < NUM_CMDS) {
-	long sec_diff, usec_diff;
-	int ms;
+    if (len == 4 && !strcmp(buf, "msgs")) {
+	snprintf(answer, sizeof(answer), "%d\n", NumMsgsProcessed);
+	reply_to_mimedefang(es, fd, answer);
+	return;
+    }
 
+    /* We have to keep the old command for backward-compatibility */
+    if (len > 10 && !strncmp(buf, "slaveinfo ", 10)) {
+	doWorkerInfo(es, fd, buf);
+	return;
+    }
 
-	/* Calculate how many milliseconds the command took */
-	gettimeofday(&now, NULL);
-	sec_diff = now.tv_sec - s->start_cmd.tv_sec;
-	usec_diff = now.tv_usec - s->start_cmd.tv_usec;
-	if (usec_diff < 0) {
-	    usec_diff += 1000000;
-	    sec_diff--;
-	}
-	ms = (int) (sec_diff * 1000 + usec_diff / 1000);
-	b = get_history_bucket(s->cmd);
-	b->count++;
-	b->workers += WorkerCount[STATE_BUSY];
-	b->ms += ms;
+    if (len > 11 && !strncmp(buf, "workerinfo ", 11)) {
+	doWorkerInfo(es, fd, buf);
+	return;
+    }
 
-	b = get_hourly_history_bucket(s->cmd);
-	b->count++;
-	b->workers += WorkerCount[STATE_BUSY];
-	b->ms += ms;
+    if (len == 5 && !strcmp(buf, "pools")) {
+	doPoolStatus(es, fd);
+	return;
+    }
 
-	/* Only increment NumMsgsProcessed for a "scan" command */
-	if (s->cmd == SCAN_CMD) {
-	    s->numScans++;
-	    NumMsgsProcessed++;
-	}
+    if (len == 6 && !strcmp(buf, "memory")) {
+	doMemoryReport(es, fd);
+	return;
     }
 
-    /* If we had a busy timeout, kill the worker */
-    if (flag == EVENT_TCP_FLAG_TIMEOUT) {
-	notify_listeners(es, "B\n");
-	killWorker(s, "Busy timeout");
-    } else {
-	/* Put worker on free list */
-	putOnList(s, STATE_IDLE);
+    if ((len == 10 && !strcmp(buf, "hotdomains")) ||
+	(len > 11 && !strncmp(buf, "hotdomains ", 11))) {
+	doHotDomains(es, fd, buf);
+	return;
+    }
 
-	/* Nuke cmd field, just in case */
-	s->cmd = -1;
+    if (len == 11 && !strcmp(buf, "domainqueue")) {
+	doDomainQueueStatus(es, fd);
+	return;
+    }
 
-	/* Record time when this worker became idle */
-	s->idleTime = time(NULL);
+    if (len == 11 && !strcmp(buf, "queuestatus")) {
+	doQueueStatus(es, fd);
+	return;
+    }
 
-	/* Check worker for expiry */
-	checkWorkerForExpiry(s);
+    if ((len == 7 && !strcmp(buf, "latency")) ||
+	(len > 8 && !strncmp(buf, "latency ", 8))) {
+	doLatency(es, fd, buf);
+	return;
     }
-    if (s->workdir[0]) {
-	statsLog("EndFilter", WORKERNO(s), "numRequests=%d", s->numRequests);
+
+    if (len > 13 && !strncmp(buf, "latencyhisto ", 13)) {
+	doLatencyHisto(es, fd, buf);
+	return;
     }
-}
 
-/**********************************************************************
-* %FUNCTION: unlinkFromList
-* %ARGUMENTS:
-*  s -- a worker
-* %RETURNS:
-*  Nothing
-* %DESCRIPTION:
-*  Unlinks "s" from the list it is currently on.
-***********************************************************************/
-static void
-unlinkFromList(Worker *s)
-{
-    int state = s->state;
-    Worker *prev = NULL;
+    if (len == 7 && !strcmp(buf, "metrics")) {
+	char *ans = buildMetrics();
+	if (!ans) {
+	    reply_to_mimedefang(es, fd, "error: Out of memory\n");
+	} else {
+	    reply_to_mimedefang_owned(es, fd, ans);
+	}
+	return;
+    }
 
-    if (!Workers[state]) {
-	/* Panic... worker not on this list */
-	syslog(LOG_CRIT, "%s worker %d not found on its list!",
-	       state_name(s->state), WORKERNO(s));
+    /* This is an awful hack used by watch-multiple-mimedefangs.tcl.
+       We handle it here so we don't have to waste a worker */
+    if (len == 19 && !strcmp(buf, "foo_no_such_command")) {
+	reply_to_mimedefang(es, fd, "error: Unknown command\n");
 	return;
     }
 
-    /* If it's the first on the list, simple */
-    if (Workers[state] == s) {
-	Workers[state] = s->next;
-	s->next = NULL;
+    /* Remaining commands are privileged */
+    if (data) {
+	reply_to_mimedefang(es, fd, "error: Attempt to use privileged command on unprivileged socket\n");
 	return;
     }
 
-    /* Somewhere in the middle of the list */
-    prev = Workers[state];
-    while (prev->next != s) {
-	if (!prev->next) {
-	    /* Panic... worker not on this list */
-	    syslog(LOG_CRIT, "%s worker %d not found on its list!",
-		   state_name(s->state), WORKERNO(s));
+    if (len == 6 && !strcmp(buf, "leases")) {
+	doLeaseStatus(es, fd);
+	return;
+    }
+
+    if (len > 6 && !strncmp(buf, "lease ", 6)) {
+	int ttl, required = 0;
+	if (sscanf(buf+6, "%d %d", &ttl, &required) < 1) {
+	    reply_to_mimedefang(es, fd, "error: Invalid lease request\n");
 	    return;
 	}
-	prev = prev->next;
+	doLease(es, fd, ttl, required);
+	return;
     }
 
-    prev->next = s->next;
-    s->next = NULL;
+    if (len > 8 && !strncmp(buf, "unlease ", 8)) {
+	doUnlease(es, fd, (unsigned int) strtoul(buf+8, NULL, 10));
+	return;
+    }
+
+    /* "@id command" runs command under lease id.  An unknown or
+       expired lease is ignored. */
+    if (*buf == '@') {
+	char *ptr;
+	unsigned long id = strtoul(buf+1, &ptr, 10);
+	if (ptr == buf+1 || *ptr != ' ') {
+	    reply_to_mimedefang(es, fd, "error: Invalid lease\n");
+	    return;
+	}
+	lease = requestLease((unsigned int) id);
+	ptr++;
+	len -= (ptr - buf);
+	buf = ptr;
+    }
+
+    if (len == 6 && !strcmp(buf, "reread")) {
+	newGeneration(es);
+	notify_listeners(es, "R\n");
+#ifndef SAFE_EMBED_PERL
+	if (Settings.useEmbeddedPerl) {
+	    reply_to_mimedefang(es, fd, "Cannot destroy and recreate an embedded Perl interpreter safely on this platform.  Filter rules will NOT be reread\n");
+	    return;
+	}
+#endif
+	reply_to_mimedefang(es, fd, "Forced reread of filter rules\n");
+	return;
+    }
+
+    if (len == 9 && !strcmp(buf, "autoscale")) {
+	doAutoscaleStatus(es, fd);
+	return;
+    }
+
+    if (len == 16 && !strcmp(buf, "autoscaleprofile")) {
+	doAutoscaleProfile(es, fd);
+	return;
+    }
+
+    if (len > 5 && !strncmp(buf, "scan ", 5)) {
+	doScan(es, fd, buf, lease);
+	return;
+    }
+
+    /* Any command other than "scan" is handled generically. */
+    doWorkerCommand(es, fd, buf, lease);
+    return;
+}
+
+static int
+worker_request_age(Worker *s) {
+    if (s->firstReqTime == (time_t) -1) {
+	return -1;
+    }
+    return (int) (time(NULL) - s->firstReqTime);
+}
+
+static int
+worker_age(Worker *s) {
+    if (s->activationTime == (time_t) -1) {
+	return -1;
+    }
+    return (int) (time(NULL) - s->activationTime);
 }
 
 /**********************************************************************
-* %FUNCTION: putOnList
+* %FUNCTION: doWorkerInfo
 * %ARGUMENTS:
-*  s -- a worker
-*  state -- state to change to.
+*  es -- event selector
+*  fd -- connection to MIMEDefang
+*  cmd -- workerinfo command
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Sets s->state to state, and moves s to the Workers[state] list.
+*  Returns detailed information about a specific worker
 ***********************************************************************/
 static void
-putOnList(Worker *s, int state)
+doWorkerInfo(EventSelector *es, int fd, char *cmd)
 {
-    s->status_tag[0] = 0;
-    if (s->state == state) {
-	/* Already there, nothing to do */
-	return;
-    }
-
-    notify_worker_state_change(s->es, WORKERNO(s),
-			      state_name(s->state), state_name(state));
-    /* Adjust counts */
-    WorkerCount[s->state]--;
-    WorkerCount[state]++;
-
-    unlinkFromList(s);
-    s->next = Workers[state];
-    Workers[state] = s;
-    s->state = state;
-    s->lastStateChange = time(NULL);
-
-    /* Update busy histogram if worker was made busy */
-    if (state == STATE_BUSY) {
-	AllWorkers[WorkerCount[STATE_BUSY]-1].histo++;
-	/* Also update firstReqTime */
-	if (s->firstReqTime == (time_t) -1) {
-	    s->firstReqTime = s->lastStateChange;
-	}
-    }
+    int workerno;
+    char buf[1024];
+    Worker *s;
 
-    /* Notify listeners */
-    if (Settings.notifySock && s->es && Old_NumFreeWorkers != NUM_FREE_WORKERS) {
-	char msg[65];
-	sprintf(msg, "F %d\n", NUM_FREE_WORKERS);
-	notify_listeners(s->es, msg);
-    }
-    /* If we went to zero, notify with a Z message */
-    if (NUM_FREE_WORKERS == 0) {
-	notify_listeners(s->es, "Z\n");
+    if (sscanf(cmd+10, "%d", &workerno) != 1) {
+	reply_to_mimedefang(es, fd, "error: Invalid worker number\n");
+	return;
     }
-    if (Old_NumFreeWorkers == 0 && NUM_FREE_WORKERS != 0) {
-	/* Went from zero to one free worker, notify with a Y message */
-	notify_listeners(s->es, "Y\n");
+    if (workerno < 0 || workerno >= Settings.maxWorkers) {
+	reply_to_mimedefang(es, fd, "error: Worker number out of range\n");
+	return;
     }
+    s = &AllWorkers[workerno];
+    (void) refreshWorkerStatus(s);
+    snprintf(buf, sizeof(buf), "Worker %d\nState %s\nPID %d\nNumRequests %d\nNumScans %d\nAge %d\nFirstReqAge %d\nLastStateChangeAge %d\nStartupMs %ld\nWarmupMs %ld\nStatusTag %s\n",
+	     workerno,
+	     state_name(s->state),
+	     (int) s->pid,
+	     s->numRequests,
+	     s->numScans,
+	     worker_age(s),
+	     worker_request_age(s),
+	     (int) (time(NULL) - s->lastStateChange),
+	     (s->startupUs < 0) ? -1L : s->startupUs / 1000,
+	     (s->warmupUs < 0) ? -1L : s->warmupUs / 1000,
+	     s->status_tag);
+    reply_to_mimedefang(es, fd, buf);
+}
 
-    Old_NumFreeWorkers = NUM_FREE_WORKERS;
+/**********************************************************************
+* %FUNCTION: writeCommandToWorker
+* %ARGUMENTS:
+*  es -- event selector
+*  s -- the worker
+*  cmd -- command to send, including trailing newline
+*  cmdbuf -- if non-NULL and *cmdbuf == cmd, cmd is a malloc'd buffer
+*            which may be handed over instead of copied.
+* %RETURNS:
+*  The pending write event, or NULL on error.
+* %DESCRIPTION:
+*  Sends a command to a worker.  If the command buffer is handed over,
+*  *cmdbuf is set to NULL so the caller does not free it.
+***********************************************************************/
+static EventTcpState *
+writeCommandToWorker(EventSelector *es, Worker *s, char *cmd, char **cmdbuf)
+{
+    if (cmdbuf && *cmdbuf == cmd) {
+	*cmdbuf = NULL;
+	return EventTcp_WriteBufOwned(es, s->workerStdin, cmd, strlen(cmd),
+				      handleWorkerReceivedCommand,
+				      Settings.clientTimeout, s);
+    }
+    return EventTcp_WriteBuf(es, s->workerStdin, cmd, strlen(cmd),
+			     handleWorkerReceivedCommand,
+			     Settings.clientTimeout, s);
 }
 
 /**********************************************************************
-* %FUNCTION: activateWorker
+* %FUNCTION: doScan
 * %ARGUMENTS:
-*  s -- a worker
-*  reason -- reason worker is being activated
+*  es -- event selector
+*  fd -- connection to MIMEDefang
+*  cmd -- scan command
 * %RETURNS:
-*  The process-ID of the worker
+*  Nothing
 * %DESCRIPTION:
-*  Activates the worker if it is not currently associated with a running
-*  process.
+*  Sends the scan command to the worker and arranges for answer to be
+*  sent back when scanning is complete.
 ***********************************************************************/
-static pid_t
-activateWorker(Worker *s, char const *reason)
+static void
+doScan(EventSelector *es, int fd, char *cmd, Lease *lease)
 {
-    int pin[2], pout[2], perr[2], pstatus[2];
-    char const *pname;
-    int i;
-    time_t now = (time_t) 0; /* Avoid compiler warning by initializing */
-    sigset_t sigs;
-    char *sarg;
+    int len;
 
-    /* Check if it's already active */
-    if (s->state == STATE_BUSY ||
-	s->state == STATE_IDLE) {
-	if (s->pid == (pid_t) -1) {
-	    if (DOLOG) {
-		syslog(LOG_ERR, "Argh!!! Worker %d in state %s has pid of -1!  Internal error!",
-		       WORKERNO(s), state_name(s->state));
-		putOnList(s, STATE_STOPPED);
-	    }
-	} else {
-	    return s->pid;
+    /* Add newline back to command */
+    len = strlen(cmd);
+    if (len < MAX_CMD_LEN-1) {
+	cmd[len+1] = 0;
+	cmd[len] = '\n';
+    } else {
+	char *answer = "error: Command too long\n";
+	reply_to_mimedefang(es, fd, answer);
+	if (DOLOG) {
+	    syslog(LOG_DEBUG, "doScan: Command too long");
 	}
+	return;
     }
 
-    /* Check if enough time has elapsed */
-    if (Settings.waitTime) {
-	now = time(NULL);
-	if (LastWorkerActivation &&
-	     (((int) (now - LastWorkerActivation)) < Settings.waitTime)) {
-	    if (DOLOG) {
-		syslog(LOG_DEBUG, "Did not start worker %d: Not enough time elapsed since last worker activation", WORKERNO(s));
+    doScanAux(es, fd, cmd, 1, NULL, lease, NULL, NULL);
+}
+
+static void
+doScanAux(EventSelector *es, int fd, char *cmd, int queueable, char **cmdbuf,
+	  Lease *lease, char const *qid, char const *dir)
+{
+    Worker *s;
+
+    /* Find a free worker */
+    s = findAdmittedWorker(SCAN_CMD, lease);
+    if (!s) {
+	char *answer = "error: No free workers\n";
+	if (queueable && Settings.requestQueueSize > 0) {
+	    if (queue_request(es, fd, cmd, 0, NULL, lease)) {
+		/* Successfully queued */
+		return;
 	    }
-	    return -1;
 	}
-    }
 
-    /* Set up pipes */
-    if (pipe(pin) < 0) {
-	if (DOLOG) syslog(LOG_ERR, "Could not start worker %d: pipe failed: %m",
-			  WORKERNO(s));
-	return -1;
+	Rejections++;
+	if (DOLOG) {
+	    syslog(LOG_WARNING, "No free workers");
+	}
+	reply_to_mimedefang(es, fd, answer);
+	return;
     }
-    if (pipe(pout) < 0) {
-	if (DOLOG) syslog(LOG_ERR, "Could not start worker %d: pipe failed: %m",
-			  WORKERNO(s));
-	close(pin[0]);
-	close(pin[1]);
-	return -1;
+
+    /* Requests under a lease are not queued */
+    if (queueWhileStarting(es, fd, cmd, 0, s, queueable && !lease)) {
+	return;
     }
 
-    if (pipe(perr) < 0) {
-	if (DOLOG) syslog(LOG_ERR, "Could not start worker %d: pipe failed: %m",
-			  WORKERNO(s));
-	close(pin[0]);
-	close(pin[1]);
-	close(pout[0]);
-	close(pout[1]);
-	return -1;
-    }
-
-    pstatus[0] = -1;
-    pstatus[1] = -1;
-    if (Settings.wantStatusReports) {
-	if (pipe(pstatus) < 0) {
-	    if (DOLOG) syslog(LOG_ERR,
-			      "Could not start worker %d: pipe failed: %m",
-			      WORKERNO(s));
-	    close(pin[0]);
-	    close(pin[1]);
-	    close(pout[0]);
-	    close(pout[1]);
-	    close(perr[0]);
-	    close(perr[1]);
-	    return -1;
+    if (activateWorker(s, "About to perform scan") == (pid_t) -1) {
+	char *answer = "error: Unable to activate worker\n";
+	Rejections++;
+	if (DOLOG) {
+	    syslog(LOG_ERR, "Unable to activate worker %d",
+		   WORKERNO(s));
 	}
-    }
-    /* fork and exec */
-    s->pid = fork();
-
-    if (s->pid == (pid_t) -1) {
-	if (DOLOG) syslog(LOG_ERR, "Could not start worker %d: fork failed: %m",
-			  WORKERNO(s));
-	close(pin[0]);
-	close(pin[1]);
-	close(pout[0]);
-	close(pout[1]);
-	close(perr[0]);
-	close(perr[1]);
-	if (pstatus[0] >= 0) close(pstatus[0]);
-	if (pstatus[1] >= 0) close(pstatus[1]);
-	return s->pid; /* Fork failed */
+	reply_to_mimedefang(es, fd, answer);
+	return;
     }
 
-    if (s->pid) {
-	HistoryBucket *b;
+    /* Put the worker on the busy list */
+    putOnList(s, STATE_BUSY);
+    useLease(s, lease, 1);
 
-	putOnList(s, STATE_IDLE);
-	/* Record time when this worker became idle */
-	s->idleTime = time(NULL);
+    /* Set last_cmd field */
+    s->last_cmd = SCAN_CMD;
 
-	/* Record activation time (just copy instead of calling time()) */
-	s->activationTime = s->idleTime;
+    /* Update worker status */
+    set_worker_status_from_command(s, cmd);
 
-	/* Track activations in history */
-	b = get_history_bucket(SCAN_CMD);
-	b->activated++;
+    /* Set worker's clientFD so we can reply */
+    s->clientFD = fd;
 
-	/* In the parent -- return */
-	close(pin[0]);
-	close(pout[1]);
-	close(perr[1]);
-	if (pstatus[1] >= 0) close(pstatus[1]);
+    /* Set worker's queue ID and working directory.  A binary request
+       hands them to us; otherwise pick them out of the command. */
+    if (qid && dir) {
+	strncpy(s->qid, qid, MAX_QID_LEN);
+	strncpy(s->workdir, dir, MAX_DIR_LEN);
+    } else {
+	sscanf(cmd, "scan %" STR(MAX_QID_LEN) "s %" STR(MAX_DIR_LEN) "s", s->qid, s->workdir);
+    }
+    s->workdir[MAX_DIR_LEN] = 0;
+    s->qid[MAX_QID_LEN] = 0;
 
-	s->workerStdin = pin[1];
-	s->workerStdout = pout[0];
-	s->workerStderr = perr[0];
-	s->workerStatusFD = pstatus[0];
-	s->activated = Activations++;
+    /* Set worker's start-of-command time */
+    gettimeofday(&(s->start_cmd), NULL);
+    s->queueWaitUs = DispatchWaitUs;
 
-	/* Make worker stderr non-blocking */
-	if (set_nonblocking(s->workerStderr) < 0) {
-	    syslog(LOG_ERR, "Could not make worker %d's stderr non-blocking: %m", WORKERNO(s));
-	}
-	/* Handle anything written to worker's stderr */
-	s->errHandler = Event_AddHandler(s->es, s->workerStderr,
-					 EVENT_FLAG_READABLE,
-					 handleWorkerStderr, s);
+    /* And tell the worker to go ahead... */
+    s->event = writeCommandToWorker(es, s, cmd, cmdbuf);
+    if (!s->event) {
+	if (DOLOG) syslog(LOG_ERR, "doScan: EventTcp_WriteBuf failed: %m");
+	killWorker(s, "EventTcp_WriteBuf failed");
+    } else {
+	statsLog("StartFilter", WORKERNO(s), NULL);
+    }
+}
 
-	/* Handle anything written to status descriptor */
-	if (Settings.wantStatusReports) {
-	    if (set_nonblocking(s->workerStatusFD) < 0) {
-		syslog(LOG_ERR, "Could not make worker %d's status descriptor non-blocking: %m", WORKERNO(s));
-	    }
-	    s->statusHandler = Event_AddHandler(s->es, s->workerStatusFD,
-						EVENT_FLAG_READABLE,
-						handleWorkerStatusFD, s);
-	} else {
-	    s->statusHandler = NULL;
-	}
+/**********************************************************************
+* %FUNCTION: doWorkerCommand
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- connection to MIMEDefang
+*  cmd -- command
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Sends the command to the worker and arranges for answer to be
+*  sent back when command finishes.
+***********************************************************************/
+static void
+doWorkerCommand(EventSelector *es, int fd, char *cmd, Lease *lease)
+{
+    int len;
 
-	s->clientFD = -1;
-	s->numRequests = 0;
-	s->numScans = 0;
-	s->oom = 0;
-	s->generation = Generation;
-	s->last_cmd = NO_CMD;
+    /* Add newline back to command */
+    len = strlen(cmd);
+    if (len < MAX_CMD_LEN-1) {
+	cmd[len+1] = 0;
+	cmd[len] = '\n';
+    } else {
+	char *answer = "error: Command too long\n";
+	reply_to_mimedefang(es, fd, answer);
 	if (DOLOG) {
-	    syslog(LOG_INFO, "Starting worker %d (pid %lu) (%d running): %s",
-		   WORKERNO(s),
-		   (unsigned long) s->pid, NUM_RUNNING_WORKERS, reason);
-	}
-	statsLog("StartWorker", WORKERNO(s), "reason=\"%s\"", reason);
-	if (Settings.waitTime) {
-	    LastWorkerActivation = now;
-	}
-	/* Every STOPPED->running transition is effectively a scale-out
-	 * event.  Log it consistently and update LastScaleOut so the
-	 * scale-in cooldown is honoured against lazy-spawn activations
-	 * (findFreeWorker -> activateWorker) just as it is for the
-	 * explicit EMA / queued-request paths. */
-	if (Settings.autoscaling) {
-	    LastScaleOut = (now != (time_t) 0) ? now : time(NULL);
-	    syslog(LOG_INFO,
-		   "Autoscale: scaled out to %d workers (ema_busy=%.2f queued=%d)",
-		   NUM_RUNNING_WORKERS, EMABusyRatio, NumQueuedRequests);
+	    syslog(LOG_DEBUG, "doWorkerCommand: Command too long");
 	}
-	return s->pid;
+	return;
     }
 
-    /* In the child */
-
-    /* Reset signal-handling dispositions */
-    signal(SIGTERM, SIG_DFL);
-    signal(SIGCHLD, SIG_DFL);
-    signal(SIGHUP, SIG_DFL);
-    signal(SIGINT, SIG_DFL);
-    sigemptyset(&sigs);
-    sigprocmask(SIG_SETMASK, &sigs, NULL);
+    doWorkerCommandAux(es, fd, cmd, 1, NULL, lease, NULL);
+}
 
-    /* Set resource limits */
-#ifdef HAVE_SETRLIMIT
-    limit_mem_usage(Settings.maxRSS, Settings.maxAS);
-#endif
+/**********************************************************************
+* %FUNCTION: domain_hash
+* %ARGUMENTS:
+*  domain -- a domain name
+* %RETURNS:
+*  A case-insensitive hash of domain
+***********************************************************************/
+static unsigned int
+domain_hash(char const *domain)
+{
+    unsigned int h = 5381;
 
-    /* Close unneeded file descriptors */
-    closelog();
-    close(pin[1]);
-    close(pout[0]);
-    close(perr[0]);
-    dup2(pin[0], STDIN_FILENO);
-    dup2(pout[1], STDOUT_FILENO);
-    dup2(perr[1], STDERR_FILENO);
+    while (*domain) {
+	h = h * 33 + (unsigned char) tolower((unsigned char) *domain++);
+    }
+    return h;
+}
 
-    if (pin[0] != STDIN_FILENO) close(pin[0]);
-    if (pout[1] != STDOUT_FILENO) close(pout[1]);
-    if (perr[1] != STDERR_FILENO) close(perr[1]);
+/**********************************************************************
+* %FUNCTION: findDomainCount
+* %ARGUMENTS:
+*  domain -- a domain name
+* %RETURNS:
+*  The in-flight recipok counter for domain, or NULL if no busy worker
+*  is doing recipok for it.
+***********************************************************************/
+static DomainCount *
+findDomainCount(char const *domain)
+{
+    DomainCount *d = DomainHash[domain_hash(domain) & DomainHashMask];
 
-    if (Settings.wantStatusReports) {
-	dup2(pstatus[1], STDERR_FILENO+1);
-	if (pstatus[1] != STDERR_FILENO+1) close(pstatus[1]);
+    while (d) {
+	if (!strcasecmp(d->domain, domain)) return d;
+	d = d->next;
     }
+    return NULL;
+}
+
+/**********************************************************************
+* %FUNCTION: freeDomainCountIfUnused
+* %ARGUMENTS:
+*  d -- a domain counter
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Unhashes d and returns it to the free list if no busy worker and no
+*  queued request refers to it.
+***********************************************************************/
+static void
+freeDomainCountIfUnused(DomainCount *d)
+{
+    DomainCount **link;
 
-    if (!Settings.wantStatusReports) (void) close(STDERR_FILENO+1);
+    if (d->count > 0 || d->numWaiting > 0) return;
 
-    for (i=STDERR_FILENO+2; i<1024; i++) {
-	(void) close(i);
+    link = &DomainHash[domain_hash(d->domain) & DomainHashMask];
+    while (*link && *link != d) {
+	link = &(*link)->next;
     }
+    if (*link) *link = d->next;
+    d->next = FreeDomainCounts;
+    FreeDomainCounts = d;
+}
 
-    pname = strrchr(Settings.progPath, '/');
-    if (pname) {
-	pname++;
+/**********************************************************************
+* %FUNCTION: setDomainReady
+* %ARGUMENTS:
+*  d -- a domain counter
+*  ready -- true to add d to the ReadyDomains list, false to remove it
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  A domain is ready when it has queued recipoks and is below the
+*  per-domain limit, so the first of them can be handed to a worker.
+***********************************************************************/
+static void
+setDomainReady(DomainCount *d, int ready)
+{
+    if (ready) {
+	d->prevReady = NULL;
+	d->nextReady = ReadyDomains;
+	if (ReadyDomains) ReadyDomains->prevReady = d;
+	ReadyDomains = d;
     } else {
-	pname = Settings.progPath;
+	if (d->prevReady) {
+	    d->prevReady->nextReady = d->nextReady;
+	} else {
+	    ReadyDomains = d->nextReady;
+	}
+	if (d->nextReady) d->nextReady->prevReady = d->prevReady;
+	d->nextReady = NULL;
+	d->prevReady = NULL;
     }
+    d->ready = ready;
+}
 
-#ifdef EMBED_PERL
-    if (Settings.useEmbeddedPerl) {
-	run_embedded_filter();
-	term_embedded_interpreter();
-        deinit_embedded_interpreter();
-	exit(EXIT_SUCCESS);
+/**********************************************************************
+* %FUNCTION: countRecipokDomain
+* %ARGUMENTS:
+*  s -- a busy worker about to run recipok for s->domain
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Increments the in-flight recipok count for s->domain.
+***********************************************************************/
+static void
+countRecipokDomain(Worker *s)
+{
+    DomainCount *d;
+    unsigned int h;
+    int i;
+
+    if (!s->domain[0]) return;
+    d = findDomainCount(s->domain);
+    if (!d) {
+	d = FreeDomainCounts;
+	if (!d) {
+	    /* Can't happen: see comment at DomainCounts */
+	    syslog(LOG_CRIT, "Out of domain counters for worker %d", WORKERNO(s));
+	    return;
+	}
+	FreeDomainCounts = d->next;
+	d->count = 0;
+	d->waitHead = NULL;
+	d->waitTail = NULL;
+	d->numWaiting = 0;
+	d->ready = 0;
+	for (i=0; s->domain[i]; i++) {
+	    d->domain[i] = tolower((unsigned char) s->domain[i]);
+	}
+	d->domain[i] = 0;
+	h = domain_hash(d->domain) & DomainHashMask;
+	d->next = DomainHash[h];
+	DomainHash[h] = d;
     }
-#endif
-    if (Settings.wantStatusReports) {
-	sarg = "-serveru";
-    } else {
-	sarg = "-server";
+    d->count++;
+    s->recipokDomain = d;
+    if (d->ready && d->count >= Settings.maxRecipokPerDomain) {
+	setDomainReady(d, 0);
     }
-    if (Settings.subFilter) {
-	execl(Settings.progPath, pname, "-f", Settings.subFilter, sarg, NULL);
-    } else {
-	execl(Settings.progPath, pname, sarg, NULL);
+}
+
+/**********************************************************************
+* %FUNCTION: releaseRecipokDomain
+* %ARGUMENTS:
+*  s -- a worker
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Drops the worker's in-flight recipok count, if it holds one.
+***********************************************************************/
+static void
+releaseRecipokDomain(Worker *s)
+{
+    DomainCount *d = s->recipokDomain;
+
+    if (!d) return;
+    s->recipokDomain = NULL;
+    d->count--;
+    if (d->numWaiting && !d->ready && d->count < Settings.maxRecipokPerDomain) {
+	setDomainReady(d, 1);
     }
-    _exit(EXIT_FAILURE);
+    freeDomainCountIfUnused(d);
+}
+
+/**********************************************************************
+* %FUNCTION: findLease
+* %ARGUMENTS:
+*  id -- lease ID
+* %RETURNS:
+*  The lease with that ID, or NULL if it does not exist (any more).
+***********************************************************************/
+static Lease *
+findLease(unsigned int id)
+{
+    Lease *l;
+
+    if (!id) return NULL;
+    l = &Leases[id % (unsigned int) Settings.maxWorkers];
+    return (l->id == id) ? l : NULL;
+}
+
+/**********************************************************************
+* %FUNCTION: requestLease
+* %ARGUMENTS:
+*  id -- lease ID a request names
+* %RETURNS:
+*  The lease the request may run under, or NULL.
+* %DESCRIPTION:
+*  Like findLease, but a lease which already has a command running
+*  can't take another; that request waits its turn like any other.
+***********************************************************************/
+static Lease *
+requestLease(unsigned int id)
+{
+    Lease *l = findLease(id);
+
+    if (l && l->worker) return NULL;
+    return l;
+}
+
+/**********************************************************************
+* %FUNCTION: freeLease
+* %ARGUMENTS:
+*  l -- a lease
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Ends a lease.  Does not hand the worker it held back to queued
+*  requests; see drainQueue.
+***********************************************************************/
+static void
+freeLease(Lease *l)
+{
+    int slot = l - Leases;
+
+    if (l->timer) {
+	Event_DelHandler(l->es, l->timer);
+	l->timer = NULL;
+    }
+    if (l->worker) {
+	l->worker->lease = NULL;
+	l->worker = NULL;
+	NumActiveLeases--;
+    }
+    l->id = 0;
+    l->nextFree = FreeLease;
+    FreeLease = slot;
+    NumLeases--;
+    publishGauge();
+}
+
+/**********************************************************************
+* %FUNCTION: drainQueue
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Hands queued requests to workers which a lease was holding back.
+***********************************************************************/
+static void
+drainQueue(void)
+{
+    while (handle_queued_request()) {
+	/* Keep going */
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: leaseExpired
+* %ARGUMENTS:
+*  es -- event selector
+*  fd, flags -- ignored
+*  data -- the lease
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Ends a lease whose TTL ran out.
+***********************************************************************/
+static void
+leaseExpired(EventSelector *es,
+	     int fd,
+	     unsigned int flags,
+	     void *data)
+{
+    Lease *l = (Lease *) data;
+
+    /* Timer handlers are freed once they fire */
+    l->timer = NULL;
+    LeasesExpired++;
+    if (Settings.debugWorkerScheduling) {
+	syslog(LOG_INFO, "Lease %u expired", l->id);
+    }
+    freeLease(l);
+    drainQueue();
+}
+
+/**********************************************************************
+* %FUNCTION: useLease
+* %ARGUMENTS:
+*  s -- worker just made busy for a request
+*  l -- lease the request runs under, or NULL
+*  consume -- if true, the request ends the lease
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Charges the request's worker to its lease.  A scan consumes the
+*  lease; any other command borrows it until the worker is done.
+***********************************************************************/
+static void
+useLease(Worker *s, Lease *l, int consume)
+{
+    if (!l) return;
+    if (consume) {
+	LeasesConsumed++;
+	freeLease(l);
+	return;
+    }
+    l->worker = s;
+    s->lease = l;
+    NumActiveLeases++;
+    publishGauge();
+}
+
+/**********************************************************************
+* %FUNCTION: releaseWorkerLease
+* %ARGUMENTS:
+*  s -- a worker leaving the busy state
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Gives back a lease the worker borrowed; it holds a worker back again.
+***********************************************************************/
+static void
+releaseWorkerLease(Worker *s)
+{
+    Lease *l = s->lease;
+
+    if (!l) return;
+    s->lease = NULL;
+    l->worker = NULL;
+    NumActiveLeases--;
+    publishGauge();
+}
+
+/**********************************************************************
+* %FUNCTION: findAdmittedWorker
+* %ARGUMENTS:
+*  cmdno -- command number, as for findFreeWorker
+*  l -- lease the request runs under, or NULL
+* %RETURNS:
+*  A free worker the request may use, or NULL.
+* %DESCRIPTION:
+*  Like findFreeWorker, but leaves free workers held back by leases to
+*  the lease holders.
+***********************************************************************/
+static Worker *
+findAdmittedWorker(int cmdno, Lease *l)
+{
+    if (NUM_FREE_WORKERS <= NUM_RESERVED_WORKERS - (l ? 1 : 0)) {
+	return NULL;
+    }
+    return findFreeWorker(cmdno);
+}
+
+/**********************************************************************
+* %FUNCTION: at_recipok_limit
+* %ARGUMENTS:
+*  cmd -- a recipok command
+* %RETURNS:
+*  The counter for the recipient's domain if it is at the per-domain
+*  recipok limit; NULL otherwise.
+***********************************************************************/
+static DomainCount *
+at_recipok_limit(char *cmd)
+{
+    char domain_buf[MAX_DOMAIN_LEN];
+    char const *ptr = cmd;
+    char *out = domain_buf;
+    int len = 0;
+    DomainCount *d;
+
+    while(*ptr && (*ptr != '@')) ptr++;
+
+    /* No domain?  Punt! */
+    if (*ptr != '@') return NULL;
+
+    ptr++;
+    while(*ptr && *ptr != '>' && *ptr != ' ') {
+	len++;
+	*out++ = *ptr++;
+	if (len >= MAX_DOMAIN_LEN - 1) break;
+    }
+    *out = 0;
+
+    d = findDomainCount(domain_buf);
+    if (d && d->count >= Settings.maxRecipokPerDomain) {
+	if (DOLOG) {
+	    syslog(LOG_WARNING, "Hit per-domain recipok limit (%d) for domain %s", Settings.maxRecipokPerDomain, domain_buf);
+	}
+	return d;
+    }
+    return NULL;
+}
+
+static void
+doWorkerCommandAux(EventSelector *es, int fd, char *cmd, int queueable, char **cmdbuf,
+		   Lease *lease, char const *qid)
+{
+    Worker *s;
+    char reason[200];
+    int cmdno;
+    int len;
+
+    /* Leave the trailing newline out of the stats-log reason */
+    len = strcspn(cmd, "\n");
+    if (len > 100) len = 100;
+    sprintf(reason, "About to execute command '%.*s'", len, cmd);
+
+    cmdno = cmd_to_number(cmd);
+
+    /* If cmdno is RECIPOK_CMD, make
+       sure we are not at per-domain limit */
+    if ((cmdno == RECIPOK_CMD) && (Settings.maxRecipokPerDomain > 0)) {
+	DomainCount *d = at_recipok_limit(cmd);
+	if (d) {
+	    /* Wait for a worker doing recipok for this domain to finish.
+	       This is safe even for a request coming off the queue: it
+	       is only dispatched once the domain is below the limit. */
+	    if (Settings.requestQueueSize > 0 &&
+		queue_request(es, fd, cmd, 0, d, lease)) {
+		return;
+	    }
+	    reply_to_mimedefang(es, fd, "ok -1 Per-domain%20recipok%20limit%20hit;%20please%20try%20again%20later\n");
+	    return;
+	}
+    }
+
+    /* Find a free worker */
+    s = findAdmittedWorker(cmdno, lease);
+    if (!s) {
+	char *answer = "error: No free workers\n";
+	if (queueable && Settings.requestQueueSize > 0) {
+	    if (queue_request(es, fd, cmd, 0, NULL, lease)) {
+		/* Successfully queued */
+		return;
+	    }
+	}
+
+	Rejections++;
+	if (DOLOG) {
+	    syslog(LOG_WARNING, "No free workers");
+	}
+	reply_to_mimedefang(es, fd, answer);
+	return;
+    }
+
+    /* Requests under a lease are not queued */
+    if (queueWhileStarting(es, fd, cmd, 0, s, queueable && !lease)) {
+	return;
+    }
+
+    if (activateWorker(s, reason) == (pid_t) -1) {
+	char *answer = "error: Unable to activate worker\n";
+	Rejections++;
+	if (DOLOG) {
+	    syslog(LOG_ERR, "Unable to activate worker %d",
+		   WORKERNO(s));
+	}
+	reply_to_mimedefang(es, fd, answer);
+	return;
+    }
+
+    /* Put the worker on the busy list */
+    putOnList(s, STATE_BUSY);
+    useLease(s, lease, 0);
+
+    /* Update last_cmd */
+    if (cmdno >= 0) {
+	s->last_cmd = cmdno;
+    }
+
+    /* Update worker's status tag */
+    set_worker_status_from_command(s, cmd);
+
+    /* Set worker's clientFD so we can reply */
+    s->clientFD = fd;
+
+    /* Null workdir signals not to log EndFilter event */
+    s->workdir[0] = 0;
+
+    /* Set the qid.  A binary request hands it to us; otherwise pick
+       it out of the command. */
+    switch(cmdno) {
+    case SENDEROK_CMD:
+	/* senderok sender ip name helo dir qid */
+	if (qid) {
+	    strncpy(s->qid, qid, MAX_QID_LEN);
+	} else {
+	    sscanf(cmd, "senderok %*s %*s %*s %*s %*s %" STR(MAX_QID_LEN)  "s", s->qid);
+	}
+	s->qid[MAX_QID_LEN] = 0;
+	break;
+    case RECIPOK_CMD:
+	/* recipok recipient sender ip name firstrecip helo dir qid junk */
+	if (qid) {
+	    strncpy(s->qid, qid, MAX_QID_LEN);
+	} else {
+	    sscanf(cmd, "recipok %*s %*s %*s %*s %*s %*s %*s %" STR(MAX_QID_LEN) "s", s->qid);
+	}
+	s->qid[MAX_QID_LEN] = 0;
+	break;
+    default:
+	s->qid[0]     = 0;
+	break;
+    }
+
+    /* Set worker's start-of-command time */
+    gettimeofday(&(s->start_cmd), NULL);
+    s->queueWaitUs = DispatchWaitUs;
+
+    /* And tell the worker to go ahead... */
+    s->event = writeCommandToWorker(es, s, cmd, cmdbuf);
+    if (!s->event) {
+	if (DOLOG) syslog(LOG_ERR, "doWorkerCommand: EventTcp_WriteBuf failed: %m");
+	killWorker(s, "EventTcp_WriteBuf failed");
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: handleWorkerReceivedCommand
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- connection to MIMEDefang
+*  buf -- buffer of data read from MIMEDefang
+*  len -- amount of data read from MIMEDefang
+*  flag -- flag from reader
+*  data -- the worker
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called when command has been written to worker.  Sets up an event handler
+*  to read the worker's reply
+***********************************************************************/
+static void
+handleWorkerReceivedCommand(EventSelector *es,
+			   int fd,
+			   char *buf,
+			   int len,
+			   int flag,
+			   void *data)
+{
+    Worker *s = (Worker *) data;
+
+    /* Event was triggered */
+    s->event = NULL;
+
+    if (flag == EVENT_TCP_FLAG_TIMEOUT || flag == EVENT_TCP_FLAG_IOERROR) {
+	/* Error writing to worker */
+	char *answer = "error: Error talking to worker process\n";
+	if (DOLOG) {
+	    syslog(LOG_ERR, "handleWorkerReceivedCommand(%d): Timeout or error: Flag = %d: %m",
+		   WORKERNO(s),
+		   flag);
+	}
+	reply_to_mimedefang(es, s->clientFD, answer);
+	/* The reply_to_mimedefang will close clientFD when it's done */
+	s->clientFD = -1;
+
+	/* Kill the worker process */
+	killWorker(s, "Error talking to worker process");
+	return;
+    }
+
+    /* Worker has been given the command; now wait for it to reply */
+    s->event = EventTcp_ReadBuf(es, s->workerStdout, MAX_CMD_LEN, '\n',
+				handleWorkerReceivedAnswer,
+				Settings.busyTimeout, 1, s);
+    if (!s->event) {
+	if (DOLOG) syslog(LOG_ERR, "handleWorkerReceivedCommand: EventTcp_ReadBuf failed: %m");
+	killWorker(s, "EventTcp_ReadBuf failed");
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: handleWorkerReceivedAnswer
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- connection to MIMEDefang
+*  buf -- buffer of data read from MIMEDefang
+*  len -- amount of data read from MIMEDefang
+*  flag -- flag from reader
+*  data -- the worker
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called when the worker's answer comes back.
+***********************************************************************/
+static void
+handleWorkerReceivedAnswer(EventSelector *es,
+			  int fd,
+			  char *buf,
+			  int len,
+			  int flag,
+			  void *data)
+{
+    Worker *s = (Worker *) data;
+    struct timeval now;
+    HistoryBucket *b;
+    HistoryTotals *t;
+
+    /* Event was triggered */
+    s->event = NULL;
+
+    /* If nothing was received from worker, send error message back */
+    if (!len || (flag == EVENT_TCP_FLAG_TIMEOUT)) {
+	KindFailures[(s->cmd >= 0 && s->cmd < NUM_CMDS) ? s->cmd : QUEUE_KIND_OTHER]++;
+	if (flag == EVENT_TCP_FLAG_TIMEOUT) {
+	    /* Heuristic... */
+	    if (WorkerCount[STATE_BUSY] > 3) {
+		reply_to_mimedefang(es, s->clientFD,
+				    "ERR Filter timed out - system may be overloaded "
+				    "(consider increasing busy timeout)\n");
+		/* The reply_to_mimedefang will close clientFD when it's done */
+		s->clientFD = -1;
+	    } else {
+		reply_to_mimedefang(es, s->clientFD,
+				    "ERR Filter timed out - check filter rules or system load\n");
+		/* The reply_to_mimedefang will close clientFD when it's done */
+		s->clientFD = -1;
+	    }
+	} else {
+	    if (DOLOG) {
+		if (s->oom) {
+		    syslog(LOG_ERR, "Worker %d ran out of memory -- possible DoS attack due to complex MIME?", WORKERNO(s));
+		} else {
+		    syslog(LOG_ERR, "Worker %d died prematurely -- check your filter rules", WORKERNO(s));
+		}
+	    } else {
+		if (s->oom) {
+		    syslog(LOG_ERR, "Worker %d ran out of memory -- possible DoS attack due to complex MIME?", WORKERNO(s));
+		} else {
+		    syslog(LOG_ERR, "Worker %d died prematurely -- check your filter rules and use the '-l' flag on mimedefang-multiplexor to see Perl error messages", WORKERNO(s));
+		}
+	    }
+	    reply_to_mimedefang(es, s->clientFD, "ERR No response from worker\n");
+	    /* The reply_to_mimedefang will close clientFD when it's done */
+	    s->clientFD = -1;
+	}
+    } else {
+	/* Write the worker's answer back to the client */
+	reply_to_mimedefang_with_len(es, s->clientFD, buf, len);
+	/* The reply_to_mimedefang will close clientFD when it's done */
+	s->clientFD = -1;
+    }
+
+    s->numRequests++;
+
+    gettimeofday(&now, NULL);
+
+    /* Failures are counted in KindFailures, not the latency histograms */
+    if (len && flag != EVENT_TCP_FLAG_TIMEOUT) {
+	record_latency((s->cmd >= 0 && s->cmd < NUM_CMDS) ? s->cmd : QUEUE_KIND_OTHER,
+		       s->queueWaitUs,
+		       (now.tv_sec - s->start_cmd.tv_sec) * 1000000L +
+		       (now.tv_usec - s->start_cmd.tv_usec));
+    }
+
+    if (s->cmd >= 0 && s->cmd < NUM_CMDS) {
+	long sec_diff, usec_diff;
+	int ms;
+
+
+	/* Calculate how many milliseconds the command took */
+	sec_diff = now.tv_sec - s->start_cmd.tv_sec;
+	usec_diff = now.tv_usec - s->start_cmd.tv_usec;
+	if (usec_diff < 0) {
+	    usec_diff += 1000000;
+	    sec_diff--;
+	}
+	ms = (int) (sec_diff * 1000 + usec_diff / 1000);
+	t = get_history_bucket(s->cmd);
+	t->count++;
+	t->workers += WorkerCount[STATE_BUSY];
+	t->ms += ms;
+	record_fine_history(s->cmd, &now);
+	observeDemand(now.tv_sec, WorkerCount[STATE_BUSY] +
+		      NUM_RESERVED_WORKERS + mainQueueDepth());
+
+	b = get_hourly_history_bucket(s->cmd);
+	b->count++;
+	b->workers += WorkerCount[STATE_BUSY];
+	b->ms += ms;
+
+	/* Only increment NumMsgsProcessed for a "scan" command */
+	if (s->cmd == SCAN_CMD) {
+	    s->numScans++;
+	    NumMsgsProcessed++;
+	}
+    }
+
+    /* If we had a busy timeout, kill the worker */
+    if (flag == EVENT_TCP_FLAG_TIMEOUT) {
+	notify_listeners(es, "B\n");
+	killWorker(s, "Busy timeout");
+    } else {
+	/* Put worker on free list */
+	putOnList(s, STATE_IDLE);
+
+	/* Nuke cmd field, just in case */
+	s->cmd = -1;
+
+	/* Record time when this worker became idle */
+	s->idleTime = time(NULL);
+
+	/* Check worker for expiry */
+	checkWorkerForExpiry(s);
+    }
+    if (s->workdir[0]) {
+	statsLog("EndFilter", WORKERNO(s), "numRequests=%d", s->numRequests);
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: unlinkFromList
+* %ARGUMENTS:
+*  s -- a worker
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Unlinks "s" from the list it is currently on.
+***********************************************************************/
+static void
+unlinkFromList(Worker *s)
+{
+    int state = s->state;
+    Worker *prev = NULL;
+
+    if (!Workers[state]) {
+	/* Panic... worker not on this list */
+	syslog(LOG_CRIT, "%s worker %d not found on its list!",
+	       state_name(s->state), WORKERNO(s));
+	return;
+    }
+
+    /* If it's the first on the list, simple */
+    if (Workers[state] == s) {
+	Workers[state] = s->next;
+	s->next = NULL;
+	return;
+    }
+
+    /* Somewhere in the middle of the list */
+    prev = Workers[state];
+    while (prev->next != s) {
+	if (!prev->next) {
+	    /* Panic... worker not on this list */
+	    syslog(LOG_CRIT, "%s worker %d not found on its list!",
+		   state_name(s->state), WORKERNO(s));
+	    return;
+	}
+	prev = prev->next;
+    }
+
+    prev->next = s->next;
+    s->next = NULL;
+}
+
+/**********************************************************************
+* %FUNCTION: idleSwap
+* %ARGUMENTS:
+*  heap -- an idle bucket's heap
+*  i, j -- positions to exchange
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Swaps two entries in an idle heap, keeping their idleSlot fields right.
+***********************************************************************/
+static void
+idleSwap(Worker **heap, int i, int j)
+{
+    Worker *tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+    heap[i]->idleSlot = i;
+    heap[j]->idleSlot = j;
+}
+
+/**********************************************************************
+* %FUNCTION: idleSift
+* %ARGUMENTS:
+*  b -- idle bucket
+*  i -- position which may be out of order
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Restores the heap order of bucket b around position i.
+***********************************************************************/
+static void
+idleSift(int b, int i)
+{
+    Worker **heap = IdleHeap[b];
+    int n = IdleHeapSize[b];
+
+    while (i > 0 && heap[i]->activated < heap[(i-1)/2]->activated) {
+	idleSwap(heap, i, (i-1)/2);
+	i = (i-1)/2;
+    }
+    for (;;) {
+	int l = 2*i + 1;
+	int m = i;
+	if (l < n && heap[l]->activated < heap[m]->activated) m = l;
+	if (l+1 < n && heap[l+1]->activated < heap[m]->activated) m = l+1;
+	if (m == i) break;
+	idleSwap(heap, i, m);
+	i = m;
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: idleInsert
+* %ARGUMENTS:
+*  s -- a worker which just became idle
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Adds s to the idle bucket for its last_cmd.
+***********************************************************************/
+static void
+idleInsert(Worker *s)
+{
+    int b = IDLE_BUCKET(s->last_cmd);
+
+    if (b < 0 || b >= NUM_IDLE_BUCKETS) {
+	b = IDLE_BUCKET(OTHER_CMD);
+    }
+    s->idleBucket = b;
+    s->idleSlot = IdleHeapSize[b]++;
+    IdleHeap[b][s->idleSlot] = s;
+    idleSift(b, s->idleSlot);
+}
+
+/**********************************************************************
+* %FUNCTION: idleRemove
+* %ARGUMENTS:
+*  s -- a worker which is no longer idle
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Removes s from its idle bucket.
+***********************************************************************/
+static void
+idleRemove(Worker *s)
+{
+    int b = s->idleBucket;
+    int slot = s->idleSlot;
+    int last;
+
+    if (b < 0) {
+	syslog(LOG_CRIT, "%s worker %d not found in an idle bucket!",
+	       state_name(s->state), WORKERNO(s));
+	return;
+    }
+    last = --IdleHeapSize[b];
+    if (slot != last) {
+	idleSwap(IdleHeap[b], slot, last);
+	idleSift(b, slot);
+    }
+    s->idleBucket = -1;
+    s->idleSlot = -1;
+}
+
+/**********************************************************************
+* %FUNCTION: putOnList
+* %ARGUMENTS:
+*  s -- a worker
+*  state -- state to change to.
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Sets s->state to state, and moves s to the Workers[state] list.
+***********************************************************************/
+static void
+putOnList(Worker *s, int state)
+{
+    s->status_tag[0] = 0;
+    if (s->state == state) {
+	/* Already there, nothing to do */
+	return;
+    }
+
+    /* Ignore whatever the worker wrote to the status board before it
+       became busy */
+    if (state == STATE_BUSY) {
+	(void) refreshWorkerStatus(s);
+    }
+
+    notify_worker_state_change(s->es, WORKERNO(s),
+			      state_name(s->state), state_name(state));
+    /* Adjust counts */
+    WorkerCount[s->state]--;
+    WorkerCount[state]++;
+
+    if (s->state == STATE_IDLE) {
+	idleRemove(s);
+    } else if (s->state == STATE_BUSY) {
+	releaseRecipokDomain(s);
+	releaseWorkerLease(s);
+    }
+    unlinkFromList(s);
+    s->next = Workers[state];
+    Workers[state] = s;
+    s->state = state;
+    s->lastStateChange = time(NULL);
+    if (state == STATE_IDLE) {
+	idleInsert(s);
+    }
+
+    publishWorkerSlot(s);
+
+    /* Update busy histogram if worker was made busy */
+    if (state == STATE_BUSY) {
+	AllWorkers[WorkerCount[STATE_BUSY]-1].histo++;
+	/* Also update firstReqTime */
+	if (s->firstReqTime == (time_t) -1) {
+	    s->firstReqTime = s->lastStateChange;
+	}
+    }
+
+    /* Notify listeners */
+    if (Settings.notifySock && s->es && Old_NumFreeWorkers != NUM_FREE_WORKERS) {
+	char msg[65];
+	sprintf(msg, "F %d\n", NUM_FREE_WORKERS);
+	notify_listeners(s->es, msg);
+    }
+    /* If we went to zero, notify with a Z message */
+    if (NUM_FREE_WORKERS == 0) {
+	notify_listeners(s->es, "Z\n");
+    }
+    if (Old_NumFreeWorkers == 0 && NUM_FREE_WORKERS != 0) {
+	/* Went from zero to one free worker, notify with a Y message */
+	notify_listeners(s->es, "Y\n");
+    }
+
+    Old_NumFreeWorkers = NUM_FREE_WORKERS;
+    publishGauge();
+}
+
+/**********************************************************************
+* %FUNCTION: activateWorker
+* %ARGUMENTS:
+*  s -- a worker
+*  reason -- reason worker is being activated
+* %RETURNS:
+*  The process-ID of the worker
+* %DESCRIPTION:
+*  Activates the worker if it is not currently associated with a running
+*  process, for a caller that is about to give it a command.  The
+*  command waits in the worker's stdin until it has initialized.
+***********************************************************************/
+static pid_t
+activateWorker(Worker *s, char const *reason)
+{
+    return launchWorker(s, reason, STATE_IDLE);
+}
+
+/**********************************************************************
+* %FUNCTION: startWorker
+* %ARGUMENTS:
+*  s -- a worker
+*  reason -- reason worker is being started
+* %RETURNS:
+*  The process-ID of the worker, or -1 on failure
+* %DESCRIPTION:
+*  Starts a stopped worker ahead of demand.  The worker stays in
+*  STATE_STARTING, where nothing is handed to it, until it answers a
+*  "ping" (and, with -B, a warm-up scan).  A worker only reads commands
+*  once it has read the filter and run filter_initialize, so the answer
+*  means it is ready.
+***********************************************************************/
+static pid_t
+startWorker(Worker *s, char const *reason)
+{
+    pid_t pid;
+
+    if (s->state != STATE_STOPPED) {
+	return activateWorker(s, reason);
+    }
+    pid = launchWorker(s, reason, STATE_STARTING);
+    if (pid == (pid_t) -1) {
+	return pid;
+    }
+
+    s->event = EventTcp_WriteBuf(s->es, s->workerStdin, "ping\n", 5,
+				 handleWorkerStartupSent,
+				 Settings.clientTimeout, s);
+    if (!s->event) {
+	if (DOLOG) syslog(LOG_ERR, "startWorker: EventTcp_WriteBuf failed: %m");
+	killWorker(s, "EventTcp_WriteBuf failed");
+	return (pid_t) -1;
+    }
+    return pid;
+}
+
+/**********************************************************************
+* %FUNCTION: handleWorkerStartupSent
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- not used
+*  buf -- not used
+*  len -- not used
+*  flag -- flag from writer
+*  data -- the worker
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called when the startup "ping", or the warm-up scan that follows it,
+*  has been written to a worker.  Waits for the worker to answer it.
+***********************************************************************/
+static void
+handleWorkerStartupSent(EventSelector *es,
+			int fd,
+			char *buf,
+			int len,
+			int flag,
+			void *data)
+{
+    Worker *s = (Worker *) data;
+
+    /* Event was triggered */
+    s->event = NULL;
+
+    if (flag == EVENT_TCP_FLAG_TIMEOUT || flag == EVENT_TCP_FLAG_IOERROR) {
+	if (DOLOG) {
+	    syslog(LOG_ERR, "handleWorkerStartupSent(%d): Timeout or error: Flag = %d: %m",
+		   WORKERNO(s),
+		   flag);
+	}
+	killWorker(s, "Error talking to worker process");
+	return;
+    }
+
+    /* The ping has been answered once startupUs is known */
+    s->event = EventTcp_ReadBuf(es, s->workerStdout, MAX_CMD_LEN, '\n',
+				(s->startupUs < 0) ?
+				handleWorkerReady : handleWorkerWarmedUp,
+				Settings.busyTimeout, 1, s);
+    if (!s->event) {
+	if (DOLOG) syslog(LOG_ERR, "handleWorkerStartupSent: EventTcp_ReadBuf failed: %m");
+	killWorker(s, "EventTcp_ReadBuf failed");
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: handleWorkerReady
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- not used
+*  buf -- the worker's answer
+*  len -- length of answer
+*  flag -- flag from reader
+*  data -- the worker
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called when a starting worker answers its "ping".  A worker which
+*  answers anything but PONG is killed.  Records how long it took to
+*  start, then sends it the warm-up scan if -B was given, or makes it
+*  idle.
+***********************************************************************/
+static void
+handleWorkerReady(EventSelector *es,
+		  int fd,
+		  char *buf,
+		  int len,
+		  int flag,
+		  void *data)
+{
+    Worker *s = (Worker *) data;
+    struct timeval now;
+    int i = 0;
+
+    /* Event was triggered */
+    s->event = NULL;
+
+    if (!len || flag == EVENT_TCP_FLAG_TIMEOUT) {
+	killWorker(s, (flag == EVENT_TCP_FLAG_TIMEOUT) ?
+		   "Busy timeout while starting" :
+		   "Worker exited while starting");
+	return;
+    }
+
+    /* Anything else means the filter wrote to standard output, and
+       every later answer would be out of step */
+    if (buf[len-1] == '\n') len--;
+    if (len != 4 || strncmp(buf, "PONG", 4)) {
+	if (len > 80) len = 80;
+	syslog(LOG_ERR, "Worker %d answered its startup ping with '%.*s' -- check that your filter does not print to standard output",
+	       WORKERNO(s), len, buf);
+	killWorker(s, "Bad answer to startup ping");
+	return;
+    }
+
+    gettimeofday(&now, NULL);
+    s->startupUs = (now.tv_sec - s->startTime.tv_sec) * 1000000L +
+	(now.tv_usec - s->startTime.tv_usec);
+    if (s->startupUs < 0) s->startupUs = 0;
+    while (i < NUM_METRIC_BOUNDS && s->startupUs > MetricBoundUs[i]) i++;
+    StartupHisto.counts[i]++;
+    StartupHisto.count++;
+    StartupHisto.sum += (double) s->startupUs;
+
+    if (DOLOG) {
+	syslog(LOG_INFO, "Worker %d (pid %lu) ready after %ld ms",
+	       WORKERNO(s), (unsigned long) s->pid, s->startupUs / 1000);
+    }
+    statsLog("WorkerReady", WORKERNO(s), "startup_usec=%ld", s->startupUs);
+
+    if (!WarmupCmd) {
+	workerReady(s);
+	return;
+    }
+
+    s->start_cmd = now;
+    s->event = EventTcp_WriteBuf(es, s->workerStdin, WarmupCmd,
+				 strlen(WarmupCmd), handleWorkerStartupSent,
+				 Settings.clientTimeout, s);
+    if (!s->event) {
+	if (DOLOG) syslog(LOG_ERR, "handleWorkerReady: EventTcp_WriteBuf failed: %m");
+	killWorker(s, "EventTcp_WriteBuf failed");
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: handleWorkerWarmedUp
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- not used
+*  buf -- the worker's answer
+*  len -- length of answer
+*  flag -- flag from reader
+*  data -- the worker
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called when a starting worker has finished its warm-up scan.  A
+*  failed scan is logged, but the worker is still made idle: it
+*  answered, so it is working.
+***********************************************************************/
+static void
+handleWorkerWarmedUp(EventSelector *es,
+		     int fd,
+		     char *buf,
+		     int len,
+		     int flag,
+		     void *data)
+{
+    Worker *s = (Worker *) data;
+    struct timeval now;
+
+    /* Event was triggered */
+    s->event = NULL;
+
+    if (!len || flag == EVENT_TCP_FLAG_TIMEOUT) {
+	killWorker(s, (flag == EVENT_TCP_FLAG_TIMEOUT) ?
+		   "Busy timeout during warm-up scan" :
+		   "Worker exited during warm-up scan");
+	return;
+    }
+
+    gettimeofday(&now, NULL);
+    s->warmupUs = (now.tv_sec - s->start_cmd.tv_sec) * 1000000L +
+	(now.tv_usec - s->start_cmd.tv_usec);
+    if (s->warmupUs < 0) s->warmupUs = 0;
+
+    if (buf[len-1] == '\n') len--;
+    if (len < 2 || strncmp(buf, "ok", 2)) {
+	syslog(LOG_WARNING, "Warm-up scan on worker %d failed: %.*s",
+	       WORKERNO(s), len, buf);
+    } else if (DOLOG) {
+	syslog(LOG_INFO, "Worker %d (pid %lu) warmed up in %ld ms",
+	       WORKERNO(s), (unsigned long) s->pid, s->warmupUs / 1000);
+    }
+    statsLog("WorkerWarmedUp", WORKERNO(s), "warmup_usec=%ld", s->warmupUs);
+
+    workerReady(s);
+}
+
+/**********************************************************************
+* %FUNCTION: workerReady
+* %ARGUMENTS:
+*  s -- a starting worker
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Makes a worker that has finished starting idle, handing it a queued
+*  request if there is one.
+***********************************************************************/
+static void
+workerReady(Worker *s)
+{
+    Worker *old;
+
+    putOnList(s, STATE_IDLE);
+    s->idleTime = time(NULL);
+
+    /* After a reread, each new worker replaces an idle old one */
+    if (s->generation == Generation) {
+	for (old = Workers[STATE_IDLE]; old; old = old->next) {
+	    if (old->generation < Generation) {
+		killWorker(old, "Replaced by worker running new filter rules");
+		break;
+	    }
+	}
+    }
+
+    /* Hand it a queued request, or retire it if the filter changed
+       while it was starting */
+    checkWorkerForExpiry(s);
+}
+
+/**********************************************************************
+* %FUNCTION: queueWhileStarting
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- client socket
+*  cmd -- request
+*  map -- true if this is a Sendmail map request
+*  s -- worker picked for the request
+*  queueable -- true if the request may be queued
+* %RETURNS:
+*  1 if the request was queued (or answered with an error); 0 if the
+*  caller should hand it to s as usual.
+* %DESCRIPTION:
+*  If no worker is idle and s would have to be started for the request,
+*  starts s and queues the request instead, so that it goes to whichever
+*  worker is free first rather than waiting for s to initialize.  This
+*  needs the request queue (-q).
+***********************************************************************/
+static int
+queueWhileStarting(EventSelector *es, int fd, char *cmd, int map,
+		   Worker *s, int queueable)
+{
+    if (s->state != STATE_STOPPED || !queueable ||
+	Settings.requestQueueSize <= 0 || !FreeRequests) {
+	return 0;
+    }
+    if (startWorker(s, "About to handle queued request") == (pid_t) -1) {
+	return 0;
+    }
+    if (queue_request(es, fd, cmd, map, NULL, NULL)) {
+	return 1;
+    }
+
+    /* s is no longer usable for this request */
+    Rejections++;
+    if (map) {
+	reply_to_map(es, fd, "TEMP No free workers");
+    } else {
+	reply_to_mimedefang(es, fd, "error: No free workers\n");
+    }
+    return 1;
+}
+
+/**********************************************************************
+* %FUNCTION: launchWorker
+* %ARGUMENTS:
+*  s -- a worker
+*  reason -- reason worker is being activated
+*  state -- STATE_IDLE, or STATE_STARTING to wait for the worker to say
+*           it is ready
+* %RETURNS:
+*  The process-ID of the worker
+* %DESCRIPTION:
+*  Activates the worker if it is not currently associated with a running
+*  process.
+***********************************************************************/
+static pid_t
+launchWorker(Worker *s, char const *reason, int state)
+{
+    int pin[2], pout[2], perr[2], pstatus[2];
+    int fds[MX_ZYGOTE_FDS];
+    time_t now = (time_t) 0; /* Avoid compiler warning by initializing */
+    struct timeval spawn_start, spawn_end;
+    long spawn_usec;
+
+    /* Check if it's already active */
+    if (s->state == STATE_BUSY ||
+	s->state == STATE_IDLE ||
+	s->state == STATE_STARTING) {
+	if (s->pid == (pid_t) -1) {
+	    if (DOLOG) {
+		syslog(LOG_ERR, "Argh!!! Worker %d in state %s has pid of -1!  Internal error!",
+		       WORKERNO(s), state_name(s->state));
+		putOnList(s, STATE_STOPPED);
+	    }
+	} else {
+	    return s->pid;
+	}
+    }
+
+    /* Check if enough time has elapsed */
+    if (Settings.waitTime) {
+	now = time(NULL);
+	if (LastWorkerActivation &&
+	     (((int) (now - LastWorkerActivation)) < Settings.waitTime)) {
+	    if (DOLOG) {
+		syslog(LOG_DEBUG, "Did not start worker %d: Not enough time elapsed since last worker activation", WORKERNO(s));
+	    }
+	    return -1;
+	}
+    }
+
+    /* Worker start latency covers the pipes and the fork or spawn */
+    gettimeofday(&spawn_start, NULL);
+
+    /* Set up pipes */
+    if (pipe(pin) < 0) {
+	if (DOLOG) syslog(LOG_ERR, "Could not start worker %d: pipe failed: %m",
+			  WORKERNO(s));
+	return -1;
+    }
+    if (pipe(pout) < 0) {
+	if (DOLOG) syslog(LOG_ERR, "Could not start worker %d: pipe failed: %m",
+			  WORKERNO(s));
+	close(pin[0]);
+	close(pin[1]);
+	return -1;
+    }
+
+    if (pipe(perr) < 0) {
+	if (DOLOG) syslog(LOG_ERR, "Could not start worker %d: pipe failed: %m",
+			  WORKERNO(s));
+	close(pin[0]);
+	close(pin[1]);
+	close(pout[0]);
+	close(pout[1]);
+	return -1;
+    }
+
+    pstatus[0] = -1;
+    pstatus[1] = -1;
+    if (StatusBoard) {
+	/* The worker writes its tag straight into its board slot */
+	MXBoardResetTag(WORKERNO(s));
+	s->boardSeq = 0;
+	pstatus[1] = MXBoardWorkerFD(WORKERNO(s));
+	if (pstatus[1] < 0) {
+	    if (DOLOG) syslog(LOG_WARNING,
+			      "Could not open status board for worker %d: %m",
+			      WORKERNO(s));
+	}
+    } else if (Settings.wantStatusReports) {
+	if (pipe(pstatus) < 0) {
+	    if (DOLOG) syslog(LOG_ERR,
+			      "Could not start worker %d: pipe failed: %m",
+			      WORKERNO(s));
+	    close(pin[0]);
+	    close(pin[1]);
+	    close(pout[0]);
+	    close(pout[1]);
+	    close(perr[0]);
+	    close(perr[1]);
+	    return -1;
+	}
+    }
+    /* fork and exec */
+    s->zygote = NULL;
+    s->pid = (pid_t) -1;
+#ifdef USE_ZYGOTE
+    if (CurZygote) {
+	fds[0] = pin[0];
+	fds[1] = pout[1];
+	fds[2] = perr[1];
+	fds[3] = pstatus[1];
+	s->pid = MXZygoteSpawn(CurZygote->ctl, fds, ZYGOTE_SPAWN_TIMEOUT_MS);
+	if (s->pid != (pid_t) -1) {
+	    s->zygote = CurZygote;
+	} else {
+	    /* A reply may still be on its way, so ctl is out of step */
+	    syslog(LOG_ERR, "Could not start worker %d from zygote (pid %lu): %m: Rereading filter rules",
+		   WORKERNO(s), (unsigned long) CurZygote->pid);
+	    retireZygote(CurZygote);
+	    scheduleReread(s->es, 0);
+	}
+    }
+    if (!s->zygote && Settings.useEmbeddedPerl && ZygoteRules) {
+	/* Our own interpreter has the rules from before the last reread;
+	   wait for a zygote with the current ones */
+	syslog(LOG_WARNING, "Could not start worker %d: Waiting for a zygote with the current filter rules",
+	       WORKERNO(s));
+	close(pin[0]);
+	close(pin[1]);
+	close(pout[0]);
+	close(pout[1]);
+	close(perr[0]);
+	close(perr[1]);
+	if (pstatus[0] >= 0) close(pstatus[0]);
+	if (pstatus[1] >= 0) close(pstatus[1]);
+	return (pid_t) -1;
+    }
+    if (!s->zygote)
+#endif
+    {
+#ifdef USE_POSIX_SPAWN
+	if (canSpawnWorker()) {
+	    s->pid = spawnWorker(pin, pout, perr, pstatus);
+	} else {
+	    s->pid = fork();
+	}
+#else
+	s->pid = fork();
+#endif
+    }
+
+    if (s->pid == (pid_t) -1) {
+	if (DOLOG) syslog(LOG_ERR, "Could not start worker %d: fork/spawn failed: %m",
+			  WORKERNO(s));
+	close(pin[0]);
+	close(pin[1]);
+	close(pout[0]);
+	close(pout[1]);
+	close(perr[0]);
+	close(perr[1]);
+	if (pstatus[0] >= 0) close(pstatus[0]);
+	if (pstatus[1] >= 0) close(pstatus[1]);
+	return s->pid; /* Fork failed */
+    }
+
+    if (s->pid) {
+	gettimeofday(&spawn_end, NULL);
+	spawn_usec = (spawn_end.tv_sec - spawn_start.tv_sec) * 1000000L +
+	    (spawn_end.tv_usec - spawn_start.tv_usec);
+
+#ifdef USE_PIDFD
+	/* A zygote's worker is not our child; its zygote reports its exit */
+	if (UsePidfd && !s->zygote && superviseWorker(s) < 0) {
+	    /* Without a pidfd nothing would ever reap this worker */
+	    close(pin[0]);
+	    close(pin[1]);
+	    close(pout[0]);
+	    close(pout[1]);
+	    close(perr[0]);
+	    close(perr[1]);
+	    if (pstatus[0] >= 0) close(pstatus[0]);
+	    if (pstatus[1] >= 0) close(pstatus[1]);
+	    kill(s->pid, SIGKILL);
+	    waitpid(s->pid, NULL, 0);
+	    s->pid = (pid_t) -1;
+	    return s->pid;
+	}
+#endif
+
+	/* Set these before going idle; they pick the worker's idle bucket */
+	s->activated = Activations++;
+	s->last_cmd = NO_CMD;
+	s->startTime = spawn_start;
+	s->startupUs = -1;
+	s->warmupUs = -1;
+	putOnList(s, state);
+	/* Record time when this worker became idle */
+	s->idleTime = time(NULL);
+
+	/* Record activation time (just copy instead of calling time()) */
+	s->activationTime = s->idleTime;
+
+	/* Track activations in history */
+	get_history_bucket(SCAN_CMD)->activated++;
+
+	/* In the parent -- return */
+	close(pin[0]);
+	close(pout[1]);
+	close(perr[1]);
+	if (pstatus[1] >= 0) close(pstatus[1]);
+
+	s->workerStdin = pin[1];
+	s->workerStdout = pout[0];
+	s->workerStderr = perr[0];
+	s->workerStatusFD = pstatus[0];
+
+	/* Make worker stderr non-blocking */
+	if (set_nonblocking(s->workerStderr) < 0) {
+	    syslog(LOG_ERR, "Could not make worker %d's stderr non-blocking: %m", WORKERNO(s));
+	}
+	/* Handle anything written to worker's stderr */
+	s->errHandler = Event_AddHandler(s->es, s->workerStderr,
+					 EVENT_FLAG_READABLE,
+					 handleWorkerStderr, s);
+
+	/* Handle anything written to status descriptor */
+	if (s->workerStatusFD >= 0) {
+	    if (set_nonblocking(s->workerStatusFD) < 0) {
+		syslog(LOG_ERR, "Could not make worker %d's status descriptor non-blocking: %m", WORKERNO(s));
+	    }
+	    s->statusHandler = Event_AddHandler(s->es, s->workerStatusFD,
+						EVENT_FLAG_READABLE,
+						handleWorkerStatusFD, s);
+	} else {
+	    s->statusHandler = NULL;
+	}
+
+	s->clientFD = -1;
+	s->numRequests = 0;
+	s->numScans = 0;
+	s->oom = 0;
+	s->generation = Generation;
+	publishWorkerSlot(s);
+	if (DOLOG) {
+	    syslog(LOG_INFO, "Starting worker %d (pid %lu) (%d running): %s",
+		   WORKERNO(s),
+		   (unsigned long) s->pid, NUM_RUNNING_WORKERS, reason);
+	}
+	statsLog("StartWorker", WORKERNO(s), "reason=\"%s\" spawn_usec=%ld",
+		 reason, spawn_usec);
+	if (Settings.waitTime) {
+	    LastWorkerActivation = now;
+	}
+	/* Every STOPPED->running transition is effectively a scale-out
+	 * event.  Log it consistently and update LastScaleOut so the
+	 * scale-in cooldown is honoured against lazy-spawn activations
+	 * (findFreeWorker -> activateWorker) just as it is for the
+	 * explicit EMA / queued-request paths. */
+	if (Settings.autoscaling) {
+	    LastScaleOut = (now != (time_t) 0) ? now : time(NULL);
+	    syslog(LOG_INFO,
+		   "Autoscale: scaled out to %d workers (ema_busy=%.2f queued=%d)",
+		   NUM_RUNNING_WORKERS, EMABusyRatio, NumQueuedRequests);
+	}
+	return s->pid;
+    }
+
+    /* In the child */
+    close(pin[1]);
+    close(pout[0]);
+    close(perr[0]);
+    if (pstatus[0] >= 0) close(pstatus[0]);
+    fds[0] = pin[0];
+    fds[1] = pout[1];
+    fds[2] = perr[1];
+    fds[3] = pstatus[1];
+    runWorker(fds);
+    _exit(EXIT_FAILURE);
+}
+
+/**********************************************************************
+* %FUNCTION: runWorker
+* %ARGUMENTS:
+*  fds -- the worker's stdin, stdout and stderr, and the write end of
+*         its status descriptor (or -1)
+* %RETURNS:
+*  Does not return
+* %DESCRIPTION:
+*  Runs the filter in a freshly-forked worker process.  Called from
+*  launchWorker, or in a zygote.
+***********************************************************************/
+static void
+runWorker(int const fds[MX_ZYGOTE_FDS])
+{
+    char const *pname;
+    sigset_t sigs;
+    char *sarg;
+    int i;
+
+    /* Reset signal-handling dispositions */
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    sigemptyset(&sigs);
+    sigprocmask(SIG_SETMASK, &sigs, NULL);
+
+    /* Set resource limits */
+#ifdef HAVE_SETRLIMIT
+    limit_mem_usage(Settings.maxRSS, Settings.maxAS);
+#endif
+
+    /* Close unneeded file descriptors */
+    closelog();
+    dup2(fds[0], STDIN_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[2], STDERR_FILENO);
+
+    if (fds[0] != STDIN_FILENO) close(fds[0]);
+    if (fds[1] != STDOUT_FILENO) close(fds[1]);
+    if (fds[2] != STDERR_FILENO) close(fds[2]);
+
+    if (fds[3] >= 0) {
+	dup2(fds[3], STDERR_FILENO+1);
+	if (fds[3] != STDERR_FILENO+1) close(fds[3]);
+    } else {
+	(void) close(STDERR_FILENO+1);
+    }
+
+    for (i=STDERR_FILENO+2; i<1024; i++) {
+	(void) close(i);
+    }
+
+    pname = strrchr(Settings.progPath, '/');
+    if (pname) {
+	pname++;
+    } else {
+	pname = Settings.progPath;
+    }
+
+#ifdef EMBED_PERL
+    if (Settings.useEmbeddedPerl) {
+#ifdef PR_SET_DUMPABLE
+	/* Dropping privileges made us undumpable, so the multiplexor
+	   could not read our /proc entries for "memory".  A worker that
+	   execs the filter is dumpable again anyway. */
+	(void) prctl(PR_SET_DUMPABLE, 1);
+#endif
+	run_embedded_filter();
+	term_embedded_interpreter();
+        deinit_embedded_interpreter();
+	exit(EXIT_SUCCESS);
+    }
+#endif
+    if (Settings.wantStatusReports) {
+	sarg = "-serveru";
+    } else {
+	sarg = "-server";
+    }
+    if (Settings.subFilter) {
+	execl(Settings.progPath, pname, "-f", Settings.subFilter, sarg, NULL);
+    } else {
+	execl(Settings.progPath, pname, sarg, NULL);
+    }
+    _exit(EXIT_FAILURE);
+}
+
+#ifdef USE_POSIX_SPAWN
+/**********************************************************************
+* %FUNCTION: canSpawnWorker
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  1 if workers can be started with posix_spawn; 0 if they must be forked
+* %DESCRIPTION:
+*  An embedded-Perl worker runs the interpreter we already have in
+*  memory, and resource limits have to be set in the child, so both
+*  need the fork path.
+***********************************************************************/
+static int
+canSpawnWorker(void)
+{
+#ifdef EMBED_PERL
+    if (Settings.useEmbeddedPerl) return 0;
+#endif
+#ifdef HAVE_SETRLIMIT
+    if (Settings.maxRSS || Settings.maxAS) return 0;
+#endif
+    return 1;
+}
+
+/**********************************************************************
+* %FUNCTION: spawnWorker
+* %ARGUMENTS:
+*  pin, pout, perr -- pipes for the worker's stdin, stdout and stderr
+*  pstatus -- status pipe, or -1 and the worker's status board descriptor,
+*             or {-1, -1} if status reports are off
+* %RETURNS:
+*  The worker's process-ID, or -1 with errno set on failure
+* %DESCRIPTION:
+*  Starts the filter with posix_spawn.  Unlike fork(), this does not
+*  copy the multiplexor's page tables, and the child closes inherited
+*  descriptors with a single closefrom/close_range rather than one
+*  close() per descriptor.  The child ends up in the same state as one
+*  produced by the fork path in activateWorker.
+***********************************************************************/
+static pid_t
+spawnWorker(int pin[2], int pout[2], int perr[2], int pstatus[2])
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    char const *argv[5];
+    char const *pname;
+    pid_t pid;
+    int argc = 0;
+    int n;
+
+    pname = strrchr(Settings.progPath, '/');
+    if (pname) {
+	pname++;
+    } else {
+	pname = Settings.progPath;
+    }
+    argv[argc++] = pname;
+    if (Settings.subFilter) {
+	argv[argc++] = "-f";
+	argv[argc++] = Settings.subFilter;
+    }
+    argv[argc++] = Settings.wantStatusReports ? "-serveru" : "-server";
+    argv[argc] = NULL;
+
+    n = posix_spawn_file_actions_init(&actions);
+    if (n) {
+	errno = n;
+	return (pid_t) -1;
+    }
+    n = posix_spawnattr_init(&attr);
+    if (n) {
+	posix_spawn_file_actions_destroy(&actions);
+	errno = n;
+	return (pid_t) -1;
+    }
+
+    n = posix_spawn_file_actions_adddup2(&actions, pin[0], STDIN_FILENO);
+    if (!n) n = posix_spawn_file_actions_adddup2(&actions, pout[1], STDOUT_FILENO);
+    if (!n) n = posix_spawn_file_actions_adddup2(&actions, perr[1], STDERR_FILENO);
+    if (!n && pstatus[1] >= 0) {
+	n = posix_spawn_file_actions_adddup2(&actions, pstatus[1], STDERR_FILENO+1);
+    }
+    if (!n) {
+	n = posix_spawn_file_actions_addclosefrom_np(&actions,
+						     (pstatus[1] >= 0) ? STDERR_FILENO+2 : STDERR_FILENO+1);
+    }
+
+    /* Reset signal-handling dispositions and unblock everything */
+    sigemptyset(&sigs);
+    if (!n) n = posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGCHLD);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGINT);
+    if (!n) n = posix_spawnattr_setsigdefault(&attr, &sigs);
+    if (!n) n = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    if (!n) {
+	n = posix_spawn(&pid, Settings.progPath, &actions, &attr,
+			(char * const *) argv, environ);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (n) {
+	errno = n;
+	return (pid_t) -1;
+    }
+    return pid;
+}
+#endif
+
+/**********************************************************************
+* %FUNCTION: checkWorkerForExpiry
+* %ARGUMENTS:
+*  s -- a worker to check
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  If the worker has served too many requests, it is killed.
+***********************************************************************/
+static void
+checkWorkerForExpiry(Worker *s)
+{
+    /* If there is a queued request, don't terminate worker just yet.  Allow
+       it to go up to triple maxRequests.  Yes, this is a horrible hack. */
+    if (s->numRequests < Settings.maxRequests * 3) {
+	if (handle_queued_request()) {
+	    return;
+	}
+    }
+    if (s->numRequests >= Settings.maxRequests) {
+	char reason[200];
+	snprintf(reason, sizeof(reason), "Worker has processed %d requests",
+		 s->numRequests);
+	killWorker(s, reason);
+    } else if (Settings.maxLifetime > 0 && worker_request_age(s) > Settings.maxLifetime) {
+	char reason[200];
+	snprintf(reason, sizeof(reason), "Worker has exceeded maximum lifetime of %d seconds", Settings.maxLifetime);
+	killWorker(s, reason);
+    } else if (s->generation < Generation) {
+	killWorker(s, "New generation -- forcing reread of filter rules");
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: killWorker
+* %ARGUMENTS:
+*  s -- a worker to kill
+*  reason -- reason worker is being killed
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Kills a worker by closing its pipe.  The worker then has 10 seconds
+*  to clean up and exit before we send SIGTERM
+***********************************************************************/
+static void
+killWorker(Worker *s, char const *reason)
+{
+    struct timeval t;
+    int withPrejudice = 0;
+
+    int age = worker_age(s);
+    int req_age = worker_request_age(s);
+    if (s->state != STATE_KILLED) {
+	if (DOLOG) syslog(LOG_INFO, "Killing %s worker %d (pid %lu) req=%d age=%d req_age=%d: %s",
+			  state_name_lc(s->state),
+			  WORKERNO(s),
+			  (unsigned long) s->pid,
+			  s->numRequests,
+			  age,
+			  req_age,
+			  reason);
+	/* In case, for some weird reason, the worker has stopped... */
+	kill(s->pid, SIGCONT);
+
+	/* If worker is busy, we kill it with prejudice */
+	if (s->state == STATE_BUSY) {
+	    withPrejudice = 1;
+	    kill(s->pid, SIGTERM);
+	}
+
+	putOnList(s, STATE_KILLED);
+	/* Close stdin so worker sees EOF */
+	close(s->workerStdin);
+	s->workerStdin = -1;
+
+	/* Kill any pending event */
+	if (s->event) {
+	    EventTcp_CancelPending(s->event);
+	    s->event = NULL;
+	}
+
+	/* Set up a timer to send SIGTERM if worker doesn't exit in
+	   10 seconds */
+	t.tv_sec = 10;
+	t.tv_usec = 0;
+	if (withPrejudice) {
+	    s->termHandler = Event_AddTimerHandler(s->es, t,
+						   nukeWorker, (void *) s);
+	} else {
+	    s->termHandler = Event_AddTimerHandler(s->es, t,
+						   terminateWorker, (void *) s);
+	}
+	statsLog("KillWorker", WORKERNO(s), "req=%d age=%d reason=\"%s\"", s->numRequests, age, reason);
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: terminateWorker
+* %ARGUMENTS:
+*  es -- Event selector
+*  fd -- not used
+*  flags -- ignored
+*  data -- the worker to terminate
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Sends a SIGTERM to worker, because it's taken too long to exit.
+***********************************************************************/
+static void
+terminateWorker(EventSelector *es,
+	       int fd,
+	       unsigned int flags,
+	       void *data)
+{
+    struct timeval t;
+    Worker *s = (Worker *) data;
+    s->termHandler = NULL;
+    if (s->pid != (pid_t) -1) {
+	if (DOLOG) {
+	    syslog(LOG_INFO,
+		   "Worker %d (pid %lu) taking too long to exit; sending SIGTERM",
+		   WORKERNO(s), (unsigned long) s->pid);
+	}
+	kill(s->pid, SIGCONT);
+	kill(s->pid, SIGTERM);
+	/* Set up a timer to send SIGKILL if worker doesn't exit in
+	   10 seconds */
+	t.tv_sec = 10;
+	t.tv_usec = 0;
+	s->termHandler = Event_AddTimerHandler(s->es, t, nukeWorker, (void *) s);
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: nukeWorker
+* %ARGUMENTS:
+*  es -- Event selector
+*  fd -- not used
+*  flags -- ignored
+*  data -- the worker to nuke
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Sends a SIGKILL to worker, because it's taken too long to exit, in spite
+*  of getting a SIGTERM
+***********************************************************************/
+static void
+nukeWorker(EventSelector *es,
+	  int fd,
+	  unsigned int flags,
+	  void *data)
+{
+    Worker *s = (Worker *) data;
+    s->termHandler = NULL;
+    if (s->pid != (pid_t) -1) {
+	if (DOLOG) {
+	    syslog(LOG_INFO,
+		   "Worker %d (pid %lu) taking way too long to exit; sending SIGKILL",
+		   WORKERNO(s), (unsigned long) s->pid);
+	}
+	kill(s->pid, SIGCONT);
+	kill(s->pid, SIGKILL);
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: childHandler
+*%ARGUMENTS:
+* sig -- signal number
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Called by SIGCHLD.  Writes 'C' to Pipe to wake up the select
+* loop and cause reaping of dead sessions
+***********************************************************************/
+static void
+childHandler(int sig)
+{
+    char byte = 'C';
+    if (!ReapPending) {
+	ReapPending = 1;
+	if (!CharPending) {
+	    int errno_save = errno;
+	    write(Pipe[1], &byte, 1);
+	    errno = errno_save;
+	    CharPending = 1;;
+	}
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: hupHandler
+*%ARGUMENTS:
+* sig -- signal number
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Called by SIGHUP.  Writes 'H' to Pipe to wake up the select
+* loop and cause closing and reopening of stats descriptor
+***********************************************************************/
+static void
+hupHandler(int sig)
+{
+    char byte = 'H';
+    if (!HupPending) {
+	HupPending = 1;
+	if (!CharPending) {
+	    int errno_save = errno;
+	    write(Pipe[1], &byte, 1);
+	    errno = errno_save;
+	    CharPending = 1;;
+	}
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: intHandler
+*%ARGUMENTS:
+* sig -- signal number
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Called by SIGINT.  Writes 'I' to Pipe to wake up the select
+* loop and cause closing and reopening of stats descriptor
+***********************************************************************/
+static void
+intHandler(int sig)
+{
+    char byte = 'I';
+    if (!IntPending) {
+	IntPending = 1;
+	if (!CharPending) {
+	    int errno_save = errno;
+	    write(Pipe[1], &byte, 1);
+	    errno = errno_save;
+	    CharPending = 1;;
+	}
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: handlePipe
+* %ARGUMENTS:
+*  es -- event selector (ignored)
+*  fd -- file descriptor which is readable
+*  flags -- ignored
+*  data -- ignored
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Simply reads from the pipe; then reaps and/or closes and reopens
+*  stats file.
+***********************************************************************/
+static void
+handlePipe(EventSelector *es,
+	    int fd,
+	    unsigned int flags,
+	    void *data)
+{
+    char buf[64];
+    sigset_t sigs, osigs;
+    int n;
+    int doreap, dohup, doint;
+
+    /* The read and the reset of CharPending must be atomic with respect
+       to signal handlers. */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGCHLD);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGHUP);
+
+    n = sigprocmask(SIG_BLOCK, &sigs, &osigs);
+    if (n < 0) {
+	syslog(LOG_ERR, "sigprocmask failed: %m");
+    }
+
+    /* Begin atomic portion */
+    read(fd, buf, 64);
+    doreap = ReapPending;
+    doint  = IntPending;
+    dohup  = HupPending;
+    CharPending = 0;
+    ReapPending = 0;
+    IntPending  = 0;
+    HupPending  = 0;
+    /* End atomic portion */
+
+    /* Reset signal mask */
+    if (n >= 0) {
+	sigprocmask(SIG_SETMASK, &osigs, NULL);
+    }
+
+    if (doreap) {
+	reapTerminatedWorkers(0);
+
+	/* Activate new workers if we've fallen below minimum */
+	if (NUM_RUNNING_WORKERS < Settings.minWorkers) {
+	    scheduleBringWorkersUpToMin(es);
+	}
+    }
+    if (dohup) {
+	statsReopenFile();
+    }
+    if (doint) {
+	newGeneration(es);
+	notify_listeners(es, "R\n");
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: reapTerminatedWorkers
+* %ARGUMENTS:
+*  killed -- If true, multiplexor was killed and has killed all workers
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Reaps all terminated workers
+***********************************************************************/
+static void
+reapTerminatedWorkers(int killed)
+{
+    pid_t pid;
+    int status;
+    Worker *s;
+
+#ifdef HAVE_WAIT3
+    struct rusage resource;
+#endif
+
+#ifdef USE_ZYGOTE
+    pollZygotes(killed);
+#endif
+
+#ifdef USE_PIDFD
+    if (UsePidfd) {
+	int i;
+	for (i=0; i<Settings.maxWorkers; i++) {
+	    s = &AllWorkers[i];
+	    if (s->pidfd >= 0) {
+		reapWorkerByPidfd(s, killed);
+	    }
+	}
+	return;
+    }
+#endif
+
+#ifdef HAVE_WAIT3
+    while ((pid = wait3(&status, WNOHANG, &resource)) > 0) {
+#else
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+#endif
+	s = findWorkerByPid(pid);
+	if (!s) continue;
+
+#ifdef HAVE_WAIT3
+	workerReaped(s, status, &resource, killed);
+#else
+	workerReaped(s, status, NULL, killed);
+#endif
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: workerReaped
+* %ARGUMENTS:
+*  s -- a worker whose process has just been reaped
+*  status -- wait status of the process
+*  resource -- resource usage of the process, or NULL
+*  killed -- If true, multiplexor was killed and has killed all workers
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Logs the worker's exit and returns it to the stopped list.
+***********************************************************************/
+static void
+workerReaped(Worker *s, int status, struct rusage *resource, int killed)
+{
+    int oldstate;
+
+    oldstate = s->state;
+    if (killed) {
+	s->state = STATE_KILLED;
+    }
+    logWorkerReaped(s, status);
+    if (killed) {
+	s->state = oldstate;
+    }
+
+#ifdef HAVE_WAIT3
+    if (resource) {
+	log_worker_resource_usage(s, resource);
+    }
+#endif
+    s->pid = (pid_t) -1;
+    s->zygote = NULL;
+    s->activationTime = (time_t) -1;
+    s->firstReqTime = (time_t) -1;
+    shutDescriptors(s);
+    putOnList(s, STATE_STOPPED);
+    statsLog("ReapWorker", WORKERNO(s), NULL);
+    get_history_bucket(SCAN_CMD)->reaped++;
+    NumReaps++;
+    if (s->oom) NumOOMs++;
+}
+
+#ifdef USE_PIDFD
+/**********************************************************************
+* %FUNCTION: superviseWorker
+* %ARGUMENTS:
+*  s -- a freshly-forked worker
+* %RETURNS:
+*  0 on success, -1 on failure
+* %DESCRIPTION:
+*  Opens a pidfd for the worker and watches it, so the worker's exit
+*  arrives as a readable event bound to the worker.
+***********************************************************************/
+static int
+superviseWorker(Worker *s)
+{
+    s->pidfd = pidfd_open(s->pid, 0);
+    if (s->pidfd < 0) {
+	if (DOLOG) syslog(LOG_ERR, "Could not start worker %d: pidfd_open failed: %m",
+			  WORKERNO(s));
+	return -1;
+    }
+    s->pidfdHandler = Event_AddHandler(s->es, s->pidfd, EVENT_FLAG_READABLE,
+				       handleWorkerExit, s);
+    if (!s->pidfdHandler) {
+	if (DOLOG) syslog(LOG_ERR, "Could not start worker %d: Event_AddHandler failed: %m",
+			  WORKERNO(s));
+	close(s->pidfd);
+	s->pidfd = -1;
+	return -1;
+    }
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: reapWorkerByPidfd
+* %ARGUMENTS:
+*  s -- a worker with an open pidfd
+*  killed -- If true, multiplexor was killed and has killed all workers
+* %RETURNS:
+*  1 if the worker was reaped; 0 if it is still running or on error
+* %DESCRIPTION:
+*  Reaps the worker with waitid(P_PIDFD).  The raw system call is used
+*  because, unlike the libc wrapper, it also returns resource usage.
+***********************************************************************/
+static int
+reapWorkerByPidfd(Worker *s, int killed)
+{
+    siginfo_t info;
+    struct rusage resource;
+    int status;
+
+    memset(&info, 0, sizeof(info));
+    if (syscall(SYS_waitid, P_PIDFD, s->pidfd, &info,
+		WEXITED | WNOHANG, &resource) < 0) {
+	if (errno != EINTR && DOLOG) {
+	    syslog(LOG_ERR, "waitid on worker %d failed: %m", WORKERNO(s));
+	}
+	return 0;
+    }
+
+    /* Still running */
+    if (info.si_pid == 0) return 0;
+
+    /* Rebuild a wait()-style status for logWorkerReaped */
+    if (info.si_code == CLD_EXITED) {
+	status = (info.si_status & 0xff) << 8;
+    } else {
+	status = info.si_status & 0x7f;
+    }
+
+    Event_DelHandler(s->es, s->pidfdHandler);
+    s->pidfdHandler = NULL;
+    close(s->pidfd);
+    s->pidfd = -1;
+
+    workerReaped(s, status, &resource, killed);
+    return 1;
+}
+
+/**********************************************************************
+* %FUNCTION: handleWorkerExit
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- the worker's pidfd
+*  flags -- ignored
+*  data -- the worker
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called when a worker's pidfd becomes readable, i.e. the worker
+*  has exited.
+***********************************************************************/
+static void
+handleWorkerExit(EventSelector *es,
+		 int fd,
+		 unsigned int flags,
+		 void *data)
+{
+    Worker *s = (Worker *) data;
+
+    if (!reapWorkerByPidfd(s, 0)) return;
+
+    /* Activate new workers if we've fallen below minimum */
+    if (NUM_RUNNING_WORKERS < Settings.minWorkers) {
+	scheduleBringWorkersUpToMin(es);
+    }
+}
+#endif
+
+/**********************************************************************
+* %FUNCTION: shutDescriptors
+* %ARGUMENTS:
+*  s -- a worker
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Closes worker's descriptors if necessary
+***********************************************************************/
+static void
+shutDescriptors(Worker *s)
+{
+    char buffer[64];
+    int n;
+
+    if (s->workerStdin >= 0) {
+	close(s->workerStdin);
+	s->workerStdin = -1;
+    }
+    if (s->workerStdout >= 0) {
+	close(s->workerStdout);
+	s->workerStdout = -1;
+    }
+    if (s->workerStderr >= 0) {
+	Event_DelHandler(s->es, s->errHandler);
+	s->errHandler = NULL;
+	/* Consume and log any error messages */
+	while( (n=read(s->workerStderr, buffer, sizeof(buffer)-1)) > 0) {
+	    buffer[n] = 0;
+	    if (buffer[n-1] == '\n') {
+		buffer[n-1] = 0;
+	    }
+	    if (DOLOG) {
+		syslog(LOG_INFO, "Worker %d stderr: %s", WORKERNO(s), buffer);
+	    }
+	}
+	close(s->workerStderr);
+	s->workerStderr = -1;
+    }
+    if (s->workerStatusFD >= 0) {
+	close(s->workerStatusFD);
+	Event_DelHandler(s->es, s->statusHandler);
+	s->statusHandler = NULL;
+	s->workerStatusFD = -1;
+    }
+
+    if (s->termHandler) {
+	Event_DelHandler(s->es, s->termHandler);
+	s->termHandler = NULL;
+    }
+
+    if (s->event) {
+	EventTcp_CancelPending(s->event);
+	s->event = NULL;
+    }
+
+    if (s->clientFD >= 0) {
+	close_client(s->clientFD);
+	s->clientFD = -1;
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: handleIdleTimeout
+* %ARGUMENTS:
+*  es -- event selector
+*  fd, flags, data -- ignored
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called periodically to check for idle workers that can be killed
+***********************************************************************/
+static void
+handleIdleTimeout(EventSelector *es,
+		  int fd,
+		  unsigned int flags,
+		  void *data)
+{
+    time_t now = time(NULL);
+    struct timeval t;
+
+    /* Kill idle workers which have been idle for maxIdleTime
+       or alive for more than maxLifetime*/
+    Worker *s = Workers[STATE_IDLE];
+    Worker *next;
+    int numAlive = NUM_RUNNING_WORKERS;
+
+    /* First pass: Kill workers that have exceeded their
+     * lifetimes */
+    while(s) {
+	next = s->next;
+	if (Settings.maxLifetime > 0 && worker_request_age(s) > Settings.maxLifetime) {
+	    char reason[200];
+	    snprintf(reason, sizeof(reason), "Worker has exceeded maximum lifetime of %d seconds", Settings.maxLifetime);
+	    numAlive--;
+	    killWorker(s, reason);
+	}
+	s = next;
+    }
+
+    /* Next pass: Kill workers that have been idle for too long */
+    s = Workers[STATE_IDLE];
+    while(s && numAlive > Settings.minWorkers) {
+	next = s->next;
+	if ((unsigned long) now - (unsigned long) s->idleTime >= Settings.maxIdleTime) {
+	    numAlive--;
+	    killWorker(s, "Idle timeout");
+	}
+	s = next;
+    }
+
+    /* If there are fewer running workers than Settings.minWorkers,
+       then start some more. */
+    if (numAlive < Settings.minWorkers) {
+	scheduleBringWorkersUpToMin(es);
+    }
+
+    /* Reschedule timer */
+    t.tv_usec = 0;
+    t.tv_sec = Settings.maxIdleTime;
+    Event_AddTimerHandler(es, t, handleIdleTimeout, NULL);
+}
+
+/**********************************************************************
+* %FUNCTION: publishGauge
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Copies the worker counts into the shared gauge, if we have one.
+***********************************************************************/
+static void
+publishGauge(void)
+{
+    MXGaugeValues v;
+
+    if (!Settings.publishGauge) return;
+    v.idle = WorkerCount[STATE_IDLE];
+    /* Starting workers are not free yet */
+    v.busy = WorkerCount[STATE_BUSY] + WorkerCount[STATE_STARTING];
+    v.stopped = WorkerCount[STATE_STOPPED];
+    v.killed = WorkerCount[STATE_KILLED];
+    v.queued = NumQueuedRequests;
+    v.leased = NUM_RESERVED_WORKERS;
+    v.generation = (unsigned int) Generation;
+    MXGaugeUpdate(&v);
+}
+
+/**********************************************************************
+* %FUNCTION: gaugeHeartbeat
+* %ARGUMENTS:
+*  es -- event selector
+*  fd, flags, data -- ignored
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Republishes the gauge every second so readers can tell it is live.
+***********************************************************************/
+static void
+gaugeHeartbeat(EventSelector *es,
+	       int fd,
+	       unsigned int flags,
+	       void *data)
+{
+    struct timeval t;
+
+    publishGauge();
+    t.tv_usec = 0;
+    t.tv_sec = 1;
+    Event_AddTimerHandler(es, t, gaugeHeartbeat, NULL);
+}
+
+/**********************************************************************
+* %FUNCTION: doStatusLog
+* %ARGUMENTS:
+*  es -- event selector
+*  fd, flags, data -- ignored
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called periodically to log worker status (numRunning, etc.)
+***********************************************************************/
+static void
+doStatusLog(EventSelector *es,
+	    int fd,
+	    unsigned int flags,
+	    void *data)
+{
+    struct timeval t;
+
+    syslog(LOG_INFO,
+	   "Worker status: Stopped=%d Starting=%d Idle=%d Busy=%d Killed=%d Queued=%d (%d/%d/%d by class) Msgs=%d Activations=%u MuxConns=%d",
+	   WorkerCount[STATE_STOPPED],
+	   WorkerCount[STATE_STARTING],
+	   WorkerCount[STATE_IDLE],
+	   WorkerCount[STATE_BUSY],
+	   WorkerCount[STATE_KILLED],
+	   NumQueuedRequests,
+	   ClassStats[0].depth, ClassStats[1].depth, ClassStats[2].depth,
+	   NumMsgsProcessed,
+	   Activations,
+	   NumMuxConns);
+
+    /* Reschedule timer */
+    t.tv_usec = 0;
+    t.tv_sec = Settings.logStatusInterval;
+    Event_AddTimerHandler(es, t, doStatusLog, NULL);
+}
+
+/**********************************************************************
+* %FUNCTION: logWorkerReaped
+* %ARGUMENTS:
+*  s -- worker
+*  status -- termination status
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Logs to syslog
+***********************************************************************/
+static void
+logWorkerReaped(Worker *s, int status)
+{
+    int level;
+    char *extra;
+
+    if (s->state == STATE_KILLED) {
+	level = LOG_DEBUG;
+	extra = "";
+    } else {
+	level = LOG_ERR;
+	extra = " (WORKER DIED UNEXPECTEDLY)";
+	if (s->es) {
+	    notify_listeners(s->es, "U\n");
+	}
+    }
+    if (!DOLOG) {
+	return;
+    }
+
+    if (WIFEXITED(status)) {
+	syslog(level, "Reap: worker %d (pid %lu) exited normally with status %d%s",
+	       WORKERNO(s), (unsigned long) s->pid, WEXITSTATUS(status),
+	       extra);
+	return;
+    }
+    if (WIFSIGNALED(status)) {
+	if (s->state == STATE_KILLED && (WTERMSIG(status) == SIGTERM ||
+			  WTERMSIG(status) == SIGKILL)) {
+	    syslog(level, "Reap: worker %d (pid %lu) exited due to SIGTERM/SIGKILL as expected.",
+		   WORKERNO(s), (unsigned long) s->pid);
+	} else {
+	    syslog(level, "Reap: worker %d (pid %lu) exited due to signal %d%s",
+		   WORKERNO(s), (unsigned long) s->pid, WTERMSIG(status),
+		   extra);
+	}
+	return;
+    }
+    syslog(level, "Reap: worker %d (pid %lu) exited for unknown reason%s",
+	   WORKERNO(s), (unsigned long) s->pid, extra);
+}
+
+/**********************************************************************
+* %FUNCTION: sigterm
+* %ARGUMENTS:
+*  sig -- signal number
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called when SIGTERM received -- kills workers and exits
+***********************************************************************/
+static void
+sigterm(int sig)
+{
+    int i, j, oneleft;
+
+    /* Only the parent process should handle SIGTERM */
+    if (ParentPid != getpid()) {
+	syslog(LOG_WARNING, "Child process received SIGTERM before signal disposition could be reset!  Exiting!");
+	exit(EXIT_FAILURE);
+    }
+
+    if (pidfile) {
+	unlink(pidfile);
+    }
+    if (lockfile) {
+	unlink(lockfile);
+    }
+    if (DOLOG) {
+	if (sig) {
+	    syslog(LOG_INFO, "Received SIGTERM: Stopping workers and terminating");
+	}
+    }
+
+    /* Remove our socket so we don't get any more requests */
+    if (Settings.sockName) {
+	(void) remove(Settings.sockName);
+    }
+
+    /* Tell mimedefang to stop trusting the gauge */
+    MXGaugeClose();
+    MXBoardClose();
+
+    if (Settings.stateFile) {
+	saveState();
+	MXStateClose();
+    }
+
+    /* Hack...*/
+    if (Settings.unprivSockName && (Settings.unprivSockName[0] == '/')) {
+	(void) remove(Settings.unprivSockName);
+    }
+    if (Settings.metricsSock && (Settings.metricsSock[0] == '/')) {
+	(void) remove(Settings.metricsSock);
+    }
+
+#ifdef USE_ZYGOTE
+    /* Zygotes exit once their workers have gone */
+    while (NewZygote || CurZygote) {
+	retireZygote(NewZygote ? NewZygote : CurZygote);
+    }
+#endif
+
+    /* First, close descriptors to force EOF on STDIN; then wait up to 10
+       seconds before sending SIGTERM */
+    for (i=0; i<Settings.maxWorkers; i++) {
+	if (AllWorkers[i].pid != (pid_t) -1) {
+	    kill(AllWorkers[i].pid, SIGCONT);
+	    close(AllWorkers[i].workerStdin);
+	    AllWorkers[i].workerStdin = -1;
+	}
+    }
+
+    /* Wait up to 10 seconds for workers to exit; then kill with SIGTERM */
+    for (j=0; j<10; j++) {
+	reapTerminatedWorkers(1);
+	oneleft = 0;
+	for (i=0; i<Settings.maxWorkers; i++) {
+	    if (AllWorkers[i].pid != (pid_t) -1) {
+		oneleft = 1;
+		break;
+	    }
+	}
+	if (!oneleft) {
+#ifdef EMBED_PERL
+  if (Settings.useEmbeddedPerl) {
+    term_embedded_interpreter();
+    deinit_embedded_interpreter();
+  }
+#endif
+	    exit(EXIT_SUCCESS);
+	}
+	if (j != 9) {
+	    sleep(1);
+	}
+    }
+
+    syslog(LOG_INFO, "Still some workers alive: Sending SIGTERM");
+    /* Still some workers.  SIGTERM them */
+    for (i=0; i<Settings.maxWorkers; i++) {
+	if (AllWorkers[i].pid != (pid_t) -1) {
+	    kill(AllWorkers[i].pid, SIGCONT);
+	    kill(AllWorkers[i].pid, SIGTERM);
+	}
+    }
+
+    /* Wait up to 10 seconds for workers to exit; then kill with SIGKILL */
+    for (j=0; j<10; j++) {
+	reapTerminatedWorkers(1);
+	oneleft = 0;
+	for (i=0; i<Settings.maxWorkers; i++) {
+	    if (AllWorkers[i].pid != (pid_t) -1) {
+		oneleft = 1;
+		break;
+	    }
+	}
+	if (!oneleft) {
+#ifdef EMBED_PERL
+	    if (Settings.useEmbeddedPerl) {
+                term_embedded_interpreter();
+                deinit_embedded_interpreter();
+            }
+#endif
+	    exit(EXIT_SUCCESS);
+	}
+	if (j != 9) {
+	    sleep(1);
+	}
+    }
+
+    syslog(LOG_INFO, "Still some workers alive: Sending SIGKILL");
+    /* Kill with SIGKILL */
+    for (i=0; i<Settings.maxWorkers; i++) {
+	if (AllWorkers[i].pid != (pid_t) -1) {
+	    kill(AllWorkers[i].pid, SIGCONT);
+	    kill(AllWorkers[i].pid, SIGKILL);
+	}
+    }
+#ifdef EMBED_PERL
+    if (Settings.useEmbeddedPerl) {
+        term_embedded_interpreter();
+        deinit_embedded_interpreter();
+    }
+#endif
+    exit(EXIT_SUCCESS);
+}
+
+/**********************************************************************
+* %FUNCTION: statsReopenFile
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Opens or re-opens statistics file.
+***********************************************************************/
+static void
+statsReopenFile(void)
+{
+    if (!Settings.statsFile) return;
+    if (Settings.statsFP) {
+	if (fclose(Settings.statsFP) == EOF) {
+	    syslog(LOG_ERR, "Failed to close stats file: %m");
+	}
+	Settings.statsFP = NULL;
+    }
+
+    Settings.statsFP = fopen(Settings.statsFile, "a");
+    if (!Settings.statsFP) {
+	syslog(LOG_ERR, "Could not open stats file %s: %m",
+	       Settings.statsFile);
+    } else {
+	if(set_cloexec(fileno(Settings.statsFP)) < 0) {
+	    syslog(LOG_ERR, "Could not set FD_CLOEXEC option on socket");
+	}
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: statsLog
+* %ARGUMENTS:
+*  event -- name of event to put in log
+*  workerno -- worker involved in this event, or -1 if not worker-specific
+*  fmt   -- "printf" format string with extra args to add to line
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Logs an event to the stats file
+***********************************************************************/
+static void
+statsLog(char const *event, int workerno, char const *fmt, ...)
+{
+    struct timeval now;
+    time_t tnow;
+    struct tm *t;
+    char tbuf[64];
+    char statbuf[1024];
+    va_list ap;
+    int ms;
+
+    if (!Settings.statsFP && !Settings.statsToSyslog) return;
+
+    gettimeofday(&now, NULL);
+    tnow = (time_t) now.tv_sec;
+    t = localtime(&tnow);
+    ms = now.tv_usec / 1000;
+
+    strftime(tbuf, sizeof(tbuf), "%d/%m/%Y:%H:%M:%S", t);
+    snprintf(statbuf, sizeof(statbuf),
+	     "%s %lu.%03d %s worker=%d nworkers=%d nbusy=%d",
+	     tbuf, (unsigned long) tnow, ms, event, workerno,
+	     NUM_RUNNING_WORKERS, WorkerCount[STATE_BUSY]);
+
+    statbuf[sizeof(statbuf)-1] = 0;
+
+    if (fmt) {
+	int len = strlen(statbuf);
+	statbuf[len] = ' ';
+	va_start(ap, fmt);
+	vsnprintf(statbuf+len+1, sizeof(statbuf)-len-1, fmt, ap);
+	va_end(ap);
+	statbuf[sizeof(statbuf)-1] = 0;
+    }
+
+    if (Settings.statsFP) {
+	fprintf(Settings.statsFP, "%s\n", statbuf);
+	if (Settings.flushStats) fflush(Settings.statsFP);
+    }
+    if (Settings.statsToSyslog) {
+	/* Chop off the date, because it's redundant.  The date is
+	   always "dd/mm/YYYY:hh:mm:ss " = 20 characters long. */
+	syslog(LOG_INFO, "stats %s", statbuf + 20);
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: newGeneration
+* %ARGUMENTS:
+*  es -- event selector
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Kills all running-but-idle workers and increments Generation.  This
+*  causes running-but-busy workers to terminate at the earliest opportunity.
+*  Use this if you change the filter file and want to restart the workers.
+*  With an embedded interpreter, the rules are reloaded in a zygote if
+*  possible, and the workers are replaced once it is ready.  Otherwise
+*  our own interpreter is rebuilt and workers are forked from it again.
+***********************************************************************/
+static void
+newGeneration(EventSelector *es)
+{
+#ifdef USE_ZYGOTE
+    if (Settings.useEmbeddedPerl && startZygote(es) == 0) {
+	return;
+    }
+#endif
+
+    Generation++;
+    publishGauge();
+#ifdef EMBED_PERL
+    if (Settings.useEmbeddedPerl) {
+	if (make_embedded_interpreter(Settings.progPath,
+				      Settings.subFilter,
+				      Settings.wantStatusReports, Env) < 0) {
+	    syslog(LOG_ERR, "Error creating embedded Perl interpreter: Reverting to non-embedded interpreter!");
+	    Settings.useEmbeddedPerl = 0;
+	} else {
+	    if (DOLOG) {
+		syslog(LOG_INFO, "Re-initialized embedded Perl interpreter");
+	    }
+	}
+#ifdef USE_ZYGOTE
+	if (CurZygote) {
+	    retireZygote(CurZygote);
+	}
+	ZygoteRules = 0;
+#endif
+    }
+#endif
+
+    /* Reset SIGCHLD handler in case some Perl code has monkeyed with it */
+    set_sigchld_handler();
+
+    while(Workers[STATE_IDLE]) {
+	killWorker(Workers[STATE_IDLE],
+		  "Forcing reread of filter rules");
+    }
+}
+
+#ifdef USE_ZYGOTE
+/**********************************************************************
+* %FUNCTION: buildZygoteInterpreter
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  0 on success, -1 on failure
+* %DESCRIPTION:
+*  Runs in a new zygote, which has closed all our descriptors.  Reopens
+*  syslog and builds the embedded interpreter.
+***********************************************************************/
+static int
+buildZygoteInterpreter(void)
+{
+#ifdef PR_SET_DUMPABLE
+    /* See runWorker */
+    (void) prctl(PR_SET_DUMPABLE, 1);
+#endif
+    if (Settings.syslog_label) {
+	openlog(Settings.syslog_label, LOG_PID|LOG_NDELAY, LogFacility);
+    } else {
+	openlog("mimedefang-multiplexor", LOG_PID|LOG_NDELAY, LogFacility);
+    }
+    return make_embedded_interpreter(Settings.progPath, Settings.subFilter,
+				     Settings.wantStatusReports, Env);
+}
+
+/**********************************************************************
+* %FUNCTION: startZygote
+* %ARGUMENTS:
+*  es -- event selector
+* %RETURNS:
+*  0 if a zygote was started; -1 otherwise
+* %DESCRIPTION:
+*  Starts a zygote that builds a new embedded interpreter.  A zygote
+*  still building from an earlier reread is abandoned.  Generation does
+*  not change until the new zygote is ready.
+***********************************************************************/
+static int
+startZygote(EventSelector *es)
+{
+    Zygote *z;
+
+    if (NewZygote) {
+	retireZygote(NewZygote);
+    }
+
+    z = malloc(sizeof(Zygote));
+    if (!z) {
+	syslog(LOG_ERR, "Could not start zygote: Out of memory");
+	return -1;
+    }
+    z->es = es;
+    gettimeofday(&z->started, NULL);
+    z->pid = MXZygoteStart(&z->ctl, &z->events, buildZygoteInterpreter,
+			   runWorker);
+    if (z->pid == (pid_t) -1) {
+	syslog(LOG_ERR, "Could not start zygote: %m");
+	free(z);
+	return -1;
+    }
+    z->eventHandler = Event_AddHandler(es, z->events, EVENT_FLAG_READABLE,
+				       handleZygoteEvents, z);
+    if (!z->eventHandler) {
+	syslog(LOG_ERR, "Could not start zygote: Event_AddHandler failed: %m");
+	close(z->ctl);
+	close(z->events);
+	kill(z->pid, SIGKILL);
+	waitpid(z->pid, NULL, 0);
+	free(z);
+	return -1;
+    }
+    z->next = Zygotes;
+    Zygotes = z;
+    NewZygote = z;
+    if (DOLOG) {
+	syslog(LOG_INFO, "Started zygote (pid %lu) to reread filter rules",
+	       (unsigned long) z->pid);
+    }
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: retireZygote
+* %ARGUMENTS:
+*  z -- a zygote
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Stops using a zygote.  It exits once its last worker has exited; one
+*  that is still building the interpreter has none and is killed.
+***********************************************************************/
+static void
+retireZygote(Zygote *z)
+{
+    if (z->ctl >= 0) {
+	close(z->ctl);
+	z->ctl = -1;
+    }
+    if (z == NewZygote) {
+	NewZygote = NULL;
+	kill(z->pid, SIGKILL);
+    }
+    if (z == CurZygote) {
+	CurZygote = NULL;
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: zygoteReady
+* %ARGUMENTS:
+*  z -- a zygote that has finished building its interpreter
+*  status -- 0 if it succeeded; -1 if it failed
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Makes z the zygote new workers are forked from and starts replacing
+*  the idle workers.  Busy workers are replaced when they finish.
+***********************************************************************/
+static void
+zygoteReady(Zygote *z, int status)
+{
+    struct timeval now;
+    long ms;
+    Worker *s, *next;
+
+    if (z != NewZygote) {
+	return;
+    }
+    gettimeofday(&now, NULL);
+    ms = (now.tv_sec - z->started.tv_sec) * 1000 +
+	(now.tv_usec - z->started.tv_usec) / 1000;
+
+    if (status < 0) {
+	retireZygote(z);
+	if (!CurZygote && ZygoteRules) {
+	    syslog(LOG_ERR, "Error creating embedded Perl interpreter: No zygote to start workers from: Retrying in %d seconds",
+		   ZYGOTE_RETRY_SECONDS);
+	    scheduleReread(z->es, ZYGOTE_RETRY_SECONDS);
+	} else {
+	    syslog(LOG_ERR, "Error creating embedded Perl interpreter: Keeping old filter rules");
+	}
+	return;
+    }
+
+    NewZygote = NULL;
+    if (CurZygote) {
+	retireZygote(CurZygote);
+    }
+    CurZygote = z;
+    ZygoteRules = 1;
+    Generation++;
+    publishGauge();
+    if (DOLOG) {
+	syslog(LOG_INFO, "Re-initialized embedded Perl interpreter in zygote (pid %lu) in %ld ms",
+	       (unsigned long) z->pid, ms);
+    }
+
+    /* Start a replacement for each idle worker; workerReady retires
+       the old one.  Without a free slot, retire it right away. */
+    for (s = Workers[STATE_IDLE]; s; s = next) {
+	next = s->next;
+	if (!Workers[STATE_STOPPED] ||
+	    startWorker(Workers[STATE_STOPPED], "Replacing worker after reread") == (pid_t) -1) {
+	    killWorker(s, "Forcing reread of filter rules");
+	}
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: zygoteGone
+* %ARGUMENTS:
+*  z -- a zygote that has exited
+*  killed -- If true, multiplexor was killed and has killed all workers
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Reaps the zygote and frees it.  Workers it leaves behind can no
+*  longer be reaped, so they are killed.  If it was the zygote new
+*  workers come from, a reread is scheduled.
+***********************************************************************/
+static void
+zygoteGone(Zygote *z, int killed)
+{
+    Zygote **zp;
+    int current = (z == CurZygote);
+    int building = (z == NewZygote);
+    int i;
+
+    Event_DelHandler(z->es, z->eventHandler);
+    close(z->events);
+    retireZygote(z);
+    waitpid(z->pid, NULL, 0);
+
+    for (i=0; i<Settings.maxWorkers; i++) {
+	if (AllWorkers[i].zygote == z && AllWorkers[i].pid != (pid_t) -1) {
+	    kill(AllWorkers[i].pid, SIGKILL);
+	    workerReaped(&AllWorkers[i], SIGKILL, NULL, killed);
+	}
+    }
+
+    for (zp = &Zygotes; *zp; zp = &(*zp)->next) {
+	if (*zp == z) {
+	    *zp = z->next;
+	    break;
+	}
+    }
+
+    if (killed) {
+	/* Shutting down */
+    } else if (current) {
+	syslog(LOG_ERR, "Zygote (pid %lu) exited unexpectedly: Rereading filter rules",
+	       (unsigned long) z->pid);
+	scheduleReread(z->es, 0);
+    } else if (building && !CurZygote && ZygoteRules) {
+	syslog(LOG_ERR, "Zygote (pid %lu) exited while creating embedded Perl interpreter: No zygote to start workers from: Retrying in %d seconds",
+	       (unsigned long) z->pid, ZYGOTE_RETRY_SECONDS);
+	scheduleReread(z->es, ZYGOTE_RETRY_SECONDS);
+    } else if (building) {
+	syslog(LOG_ERR, "Zygote (pid %lu) exited while creating embedded Perl interpreter: Keeping old filter rules",
+	       (unsigned long) z->pid);
+    } else if (DOLOG) {
+	syslog(LOG_DEBUG, "Zygote (pid %lu) exited", (unsigned long) z->pid);
+    }
+    free(z);
+}
+
+/**********************************************************************
+* %FUNCTION: doScheduledReread
+* %ARGUMENTS:
+*  es -- event selector
+*  fd, flags, data -- ignored
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Timer handler that rereads the filter rules after a zygote was lost.
+*  Does nothing if a reread is already under way.
+***********************************************************************/
+static void
+doScheduledReread(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    rereadScheduled = 0;
+    if (!NewZygote) {
+	newGeneration(es);
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: scheduleReread
+* %ARGUMENTS:
+*  es -- event selector
+*  secs -- seconds from now
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Schedules a reread of the filter rules from the event loop, so it
+*  does not run in the middle of starting or reaping a worker.
+***********************************************************************/
+static void
+scheduleReread(EventSelector *es, int secs)
+{
+    struct timeval t;
+
+    /* Do nothing if already scheduled */
+    if (rereadScheduled) return;
+
+    t.tv_usec = 0;
+    t.tv_sec = secs;
+    if (Event_AddTimerHandler(es, t, doScheduledReread, NULL)) {
+	rereadScheduled = 1;
+    } else {
+	syslog(LOG_ERR, "Could not schedule reread of filter rules: %m");
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: readZygoteEvents
+* %ARGUMENTS:
+*  z -- a zygote
+*  killed -- If true, multiplexor was killed and has killed all workers
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Handles everything z has reported.  z may be freed on return.
+***********************************************************************/
+static void
+readZygoteEvents(Zygote *z, int killed)
+{
+    MXZygoteEvent ev;
+    Worker *s;
+    int n;
+
+    for (;;) {
+	n = MXZygoteReadEvent(z->events, &ev);
+	if (n == 0) return;
+	if (n < 0) {
+	    zygoteGone(z, killed);
+	    return;
+	}
+	if (ev.pid == 0) {
+	    if (killed) {
+		retireZygote(z);
+	    } else {
+		zygoteReady(z, ev.status);
+	    }
+	    continue;
+	}
+	s = findWorkerByPid(ev.pid);
+	if (s && s->zygote == z) {
+#ifdef HAVE_WAIT3
+	    workerReaped(s, ev.status, &ev.usage, killed);
+#else
+	    workerReaped(s, ev.status, NULL, killed);
+#endif
+	}
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: pollZygotes
+* %ARGUMENTS:
+*  killed -- If true, multiplexor was killed and has killed all workers
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Handles pending events from all zygotes, reaping their workers.
+***********************************************************************/
+static void
+pollZygotes(int killed)
+{
+    Zygote *z, *next;
+
+    for (z = Zygotes; z; z = next) {
+	next = z->next;
+	readZygoteEvents(z, killed);
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: handleZygoteEvents
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- the zygote's events socket
+*  flags -- ignored
+*  data -- the zygote
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called when a zygote is ready, one of its workers has exited, or it
+*  has exited itself.
+***********************************************************************/
+static void
+handleZygoteEvents(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    readZygoteEvents((Zygote *) data, 0);
+
+    /* Activate new workers if we've fallen below minimum */
+    if (NUM_RUNNING_WORKERS < Settings.minWorkers) {
+	scheduleBringWorkersUpToMin(es);
+    }
+}
+#endif
+
+/**********************************************************************
+* %FUNCTION: mainQueueDepth
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  The number of requests waiting for a free worker.  Recipoks held
+*  back by the per-domain limit are not counted: more workers would
+*  not help them.
+***********************************************************************/
+static int
+mainQueueDepth(void)
+{
+    int c, n = 0;
+
+    for (c=0; c<NUM_QUEUE_CLASSES; c++) {
+	n += ClassStats[c].depth;
+    }
+    return n;
+}
+
+/**********************************************************************
+* %FUNCTION: observeDemand
+* %ARGUMENTS:
+*  now -- current time
+*  demand -- busy and leased workers plus queued requests
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Tracks the peak demand in the current hour and, when a new hour
+*  starts, folds the last one into its slot of the weekly profile and
+*  records it in the 24-hour ring.
+***********************************************************************/
+static void
+observeDemand(time_t now, int demand)
+{
+    long hour = (long) (now / 3600);
+    struct tm tm;
+    ProfileSlot *p;
+
+    if (hour != ProfileHour) {
+	if (ProfileSlotNow >= 0 && ProfileSlotNow < PROFILE_HOURS) {
+	    p = &AutoscaleProfile[ProfileSlotNow];
+	    if (p->weeks) {
+		p->peak = p->peak * (1.0 - PROFILE_ALPHA) +
+		    (double) ProfilePeak * PROFILE_ALPHA;
+	    } else {
+		p->peak = (double) ProfilePeak;
+	    }
+	    p->weeks++;
+	}
+	if (ProfileHour >= 0) {
+	    DailyPeak[ProfileHour % 24] = ProfilePeak;
+	    DailyPeakHour[ProfileHour % 24] = ProfileHour;
+	}
+	localtime_r(&now, &tm);
+	ProfileHour = hour;
+	ProfileSlotNow = tm.tm_wday * 24 + tm.tm_hour;
+	ProfilePeak = 0;
+    }
+    if (demand > ProfilePeak) ProfilePeak = demand;
+}
+
+/**********************************************************************
+* %FUNCTION: predictedDemand
+* %ARGUMENTS:
+*  when -- a time
+* %RETURNS:
+*  The peak demand expected in the hour containing "when"
+* %DESCRIPTION:
+*  Uses the weekly profile if it has seen that hour of the week.
+*  Otherwise, falls back to the peak demand in the same hour yesterday,
+*  from the 24-hour ring.  That slot is only overwritten when the hour
+*  after it ends, so it is still there while the hour is under way.
+***********************************************************************/
+static double
+predictedDemand(time_t when)
+{
+    struct tm tm;
+    ProfileSlot const *p;
+    long hour;
+
+    localtime_r(&when, &tm);
+    p = &AutoscaleProfile[tm.tm_wday * 24 + tm.tm_hour];
+    if (p->weeks) return p->peak;
+
+    hour = (long) ((when - 86400) / 3600);
+    if (hour >= 0 && DailyPeakHour[hour % 24] == hour) {
+	return (double) DailyPeak[hour % 24];
+    }
+    return 0.0;
+}
+
+/**********************************************************************
+* %FUNCTION: autoscaleOut
+* %ARGUMENTS:
+*  n -- number of workers to start
+*  why -- reason, for the log
+* %RETURNS:
+*  Number of workers started
+* %DESCRIPTION:
+*  Starts up to n stopped workers, or only logs that it would in dry-run
+*  mode.  Stops early if a worker fails to start (for instance because of
+*  the -W wait time).
+***********************************************************************/
+static int
+autoscaleOut(int n, char const *why)
+{
+    char reason[160];
+    int started = 0;
+    Worker *s;
+
+    if (n > WorkerCount[STATE_STOPPED]) n = WorkerCount[STATE_STOPPED];
+    if (n <= 0) return 0;
+
+    if (Settings.autoscaleDryRun) {
+	syslog(LOG_INFO, "Autoscale (dry run): would start %d worker%s with %d running: %s",
+	       n, (n == 1) ? "" : "s", NUM_RUNNING_WORKERS, why);
+	LastScaleOut = time(NULL);
+	return 0;
+    }
+
+    snprintf(reason, sizeof(reason), "Autoscale: %s", why);
+    while (started < n && (s = Workers[STATE_STOPPED]) != NULL) {
+	if (startWorker(s, reason) == (pid_t) -1) break;
+	started++;
+    }
+    AutoscaleOuts += started;
+    /* LastScaleOut is updated and the scale-out is logged by
+     * launchWorker() itself for every STOPPED->running
+     * transition.  No duplicate bookkeeping needed here. */
+    return started;
+}
+
+/**********************************************************************
+* %FUNCTION: handleAutoscale
+* %ARGUMENTS:
+*  es -- event selector
+*  fd, flags, data -- ignored
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Called periodically when autoscaling is enabled (-k flag).
+*  Uses an exponential moving average (EMA) of the busy-worker ratio
+*  to make scale-out and scale-in decisions with AIMD-style cooldowns,
+*  together with the backlog: queued requests, requests rejected since
+*  the last check and the 95th percentile queue wait over the last
+*  minute.  Scale out when any of them crosses its threshold, by one
+*  worker per queued or rejected request; scale in when the EMA falls
+*  below scaleInBusyRatio, there is no backlog, queue waits are short
+*  and both cooldown timers have elapsed.
+*  In predictive mode, also starts workers ahead of the demand expected
+*  from the weekly profile, and never scales in below it.
+***********************************************************************/
+static void
+handleAutoscale(EventSelector *es,
+		int fd,
+		unsigned int flags,
+		void *data)
+{
+    time_t now    = time(NULL);
+    struct timeval t;
+    int nRunning  = NUM_RUNNING_WORKERS;
+    /* Workers held back by leases are about to be busy */
+    int nBusy     = WorkerCount[STATE_BUSY] + NUM_RESERVED_WORKERS;
+    double rawBusy = (nRunning > 0) ? (double)nBusy / nRunning : 0.0;
+    int target = 0;
+    int backlog, deferred;
+    char reason[128];
+    Worker *s;
+
+    /* Update exponential moving average of busy ratio */
+    EMABusyRatio = EMABusyRatio * (1.0 - Settings.emaAlpha)
+                 + rawBusy      *        Settings.emaAlpha;
+
+    /* Backlog signals */
+    AutoscaleQueued = mainQueueDepth();
+    AutoscaleRejections = Rejections - RejectionsSeen;
+    AutoscaleQueueWait = recent_queue_wait(1, 95.0);
+    backlog = AutoscaleQueued + (int) AutoscaleRejections;
+
+    if (EMABusyRatio > Settings.scaleOutBusyRatio) {
+	AutoscaleSignal = SCALE_SIGNAL_BUSY;
+    } else if (Settings.scaleOutQueued > 0 &&
+	       AutoscaleQueued >= Settings.scaleOutQueued) {
+	AutoscaleSignal = SCALE_SIGNAL_QUEUED;
+    } else if (Settings.scaleOutRejections > 0 &&
+	       AutoscaleRejections >= (unsigned long) Settings.scaleOutRejections) {
+	AutoscaleSignal = SCALE_SIGNAL_REJECTS;
+    } else if (Settings.scaleOutQueueWaitMs > 0 &&
+	       AutoscaleQueueWait > (double) Settings.scaleOutQueueWaitMs) {
+	AutoscaleSignal = SCALE_SIGNAL_QUEUE_WAIT;
+    } else {
+	AutoscaleSignal = SCALE_SIGNAL_NONE;
+    }
+
+    observeDemand(now, nBusy + AutoscaleQueued);
+
+    /* Rejections held back by the scale-out cooldown count at the next
+       check */
+    deferred = AutoscaleSignal != SCALE_SIGNAL_NONE
+	&& nRunning < Settings.maxWorkers
+	&& (now - LastScaleOut) <= (time_t)Settings.scaleOutCooldown;
+    if (!deferred) RejectionsSeen = Rejections;
+
+    if (Settings.predictive) {
+	double want;
+
+	PredictedDemand = predictedDemand(now);
+	if (3600 - (int) (now % 3600) <= Settings.predictLead) {
+	    double next = predictedDemand(now + 3600 - (now % 3600));
+	    if (next > PredictedDemand) PredictedDemand = next;
+	}
+
+	/* Enough workers that the expected peak stays below the
+	   scale-out threshold */
+	want = PredictedDemand / Settings.scaleOutBusyRatio;
+	target = (int) want;
+	if ((double) target < want) target++;
+	if (target < Settings.minWorkers) target = Settings.minWorkers;
+	if (target > Settings.maxWorkers) target = Settings.maxWorkers;
+	PredictedWorkers = target;
+    }
+
+    /* Get ready for the expected demand.  A dry run starts nothing, so
+       it would log the same shortfall every time; log it once per
+       target instead. */
+    if (target > nRunning) {
+	if (!Settings.autoscaleDryRun || target != ReportedTarget) {
+	    snprintf(reason, sizeof(reason),
+		     "predictive scale-out (expected peak %.1f)", PredictedDemand);
+	    autoscaleOut(target - nRunning, reason);
+	}
+	ReportedTarget = target;
+    }
+    /* Scale OUT: pool is saturated */
+    else if (AutoscaleSignal != SCALE_SIGNAL_NONE
+	    && nRunning < Settings.maxWorkers
+	    && (now - LastScaleOut) > (time_t)Settings.scaleOutCooldown) {
+	snprintf(reason, sizeof(reason),
+		 "scale-out on %s (ema_busy=%.2f queued=%d rejects=%lu queue_wait_p95=%.0fms)",
+		 ScaleSignalName[AutoscaleSignal], EMABusyRatio, AutoscaleQueued,
+		 AutoscaleRejections, AutoscaleQueueWait);
+	autoscaleOut(backlog > 1 ? backlog : 1, reason);
+    }
+    /* Scale IN: pool is under-utilised */
+    else if (EMABusyRatio < Settings.scaleInBusyRatio
+	     && backlog == 0
+	     && AutoscaleQueueWait <= (double) Settings.scaleInQueueWaitMs
+	     && nRunning  > Settings.minWorkers
+	     && nRunning  > target
+	     && WorkerCount[STATE_IDLE] > NUM_RESERVED_WORKERS
+	     && (now - LastScaleIn)  > (time_t)Settings.scaleInCooldown
+	     && (now - LastScaleOut) > (time_t)Settings.scaleInCooldown) {
+	s = Workers[STATE_IDLE];
+	if (s && Settings.autoscaleDryRun) {
+	    syslog(LOG_INFO, "Autoscale (dry run): would stop worker %d with %d running: scale-in (ema_busy=%.2f)",
+		   WORKERNO(s), nRunning, EMABusyRatio);
+	    LastScaleIn = now;
+	} else if (s) {
+	    snprintf(reason, sizeof(reason),
+		     "Autoscale: scale-in (ema_busy=%.2f)", EMABusyRatio);
+	    killWorker(s, reason);
+	    AutoscaleIns++;
+	    LastScaleIn = now;
+	    syslog(LOG_INFO,
+		   "Autoscale: scaled in to %d workers (ema_busy=%.2f)",
+		   NUM_RUNNING_WORKERS, EMABusyRatio);
+	}
+    }
+
+    if (target <= nRunning) ReportedTarget = 0;
+
+    /* Reschedule */
+    t.tv_usec = 0;
+    t.tv_sec  = Settings.autoscaleInterval;
+    Event_AddTimerHandler(es, t, handleAutoscale, NULL);
+}
+
+/**********************************************************************
+* %FUNCTION: bringWorkersUpToMin
+* %ARGUMENTS:
+*  es -- event selector
+*  fd, flags, data -- ignored
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  If there are fewer than minWorkers running, start one.  If still fewer,
+*  schedule self to re-run in slewTime seconds.
+***********************************************************************/
+void
+bringWorkersUpToMin(EventSelector *es,
+		   int fd,
+		   unsigned int flags,
+		   void *data)
+{
+    Worker *s;
+    char reason[200];
+
+    minScheduled = 0;
+
+    if (NUM_RUNNING_WORKERS >= Settings.minWorkers) {
+	/* Enough workers, so do nothing */
+	return;
+    }
+
+    /* Start a worker */
+    s = Workers[STATE_STOPPED];
+    if (s) {
+	snprintf(reason, sizeof(reason),
+		 "Bringing workers up to minWorkers (%d)", Settings.minWorkers);
+	/* Queued requests are handed to it once it is ready */
+	(void) startWorker(s, reason);
+    }
+
+
+    /* Reschedule if necessary */
+    if (NUM_RUNNING_WORKERS < Settings.minWorkers) {
+	scheduleBringWorkersUpToMin(es);
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: scheduleBringWorkersUpToMin
+* %ARGUMENTS:
+*  es -- event selector
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Schedules a call to bringWorkersUpToMin in slewTime seconds from now.
+***********************************************************************/
+static void
+scheduleBringWorkersUpToMin(EventSelector *es)
+{
+    struct timeval t;
+
+    /* Do nothing if already scheduled */
+    if (minScheduled) return;
+
+    minScheduled = 1;
+    t.tv_usec = 0;
+    t.tv_sec = Settings.slewTime;
+    Event_AddTimerHandler(es, t, bringWorkersUpToMin, NULL);
+}
+
+#ifdef HAVE_SETRLIMIT
+/**********************************************************************
+* %FUNCTION: limit_mem_usage
+* %ARGUMENTS:
+*  rss -- maximum resident-set size in kB
+*  as  -- maximum total address space in kB
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Calls setrlimit to limit resource usage
+***********************************************************************/
+static void
+limit_mem_usage(unsigned long rss,
+		unsigned long as)
+{
+    int n;
+    struct rlimit lim;
+
+#ifdef RLIMIT_RSS
+    if (rss) {
+	/* Convert kb to bytes */
+	rss *= 1024;
+	lim.rlim_cur = rss;
+	lim.rlim_max = rss;
+	n = setrlimit(RLIMIT_RSS, &lim);
+	if (n < 0) {
+	    syslog(LOG_WARNING, "setrlimit(RLIMIT_RSS, %lu) failed: %m",
+		   rss);
+	}
+    }
+#endif
+    if (as) {
+	/* Convert kb to bytes */
+	as *= 1024;
+	lim.rlim_cur = as;
+	lim.rlim_max = as;
+#ifdef RLIMIT_AS
+	n = setrlimit(RLIMIT_AS, &lim);
+	if (n < 0) {
+	    syslog(LOG_WARNING, "setrlimit(RLIMIT_AS, %lu) failed: %m",
+		   as);
+	}
+#endif
+
+#ifdef RLIMIT_DATA
+	n = setrlimit(RLIMIT_DATA, &lim);
+	if (n < 0) {
+	    syslog(LOG_WARNING, "setrlimit(RLIMIT_DATA, %lu) failed: %m",
+		   as);
+	}
+#endif
+
+    }
+}
+#endif /* HAVE_SETRLIMIT */
+
+/**********************************************************************
+* %FUNCTION: doWorkerReport
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- socket
+*  only_busy -- if true, only report on busy workers
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Prints a list of workers, statuses and pids
+***********************************************************************/
+static void
+doWorkerReport(EventSelector *es, int fd, int only_busy)
+{
+    int len = Settings.maxWorkers * (33 + MAX_STATUS_LEN + 2 + 32) + 1;
+    char *ans = malloc(len);
+    char *ptr = ans;
+    char status = '?';
+    int i, j;
+    time_t now;
+    int secs;
+    if (!ans) {
+	reply_to_mimedefang(es, fd, "error: Out of memory\n");
+	return;
+    }
+    *ans = 0;
+    now = time(NULL);
+
+    for (i=0; i<Settings.maxWorkers; i++) {
+	Worker *s = &AllWorkers[i];
+	if (only_busy && (s->state != STATE_BUSY)) {
+	    continue;
+	}
+	(void) refreshWorkerStatus(s);
+	switch (s->state) {
+	case STATE_STOPPED: status = 'S'; break;
+	case STATE_IDLE:    status = 'I'; break;
+	case STATE_BUSY:    status = 'B'; break;
+	case STATE_KILLED:  status = 'K'; break;
+	case STATE_STARTING: status = 'W'; break;
+	}
+	j = snprintf(ptr, len, "%d %c", i, status);
+	len -= j;
+	ptr += j;
+	if (s->state != STATE_STOPPED) {
+	    j = snprintf(ptr, len, " %lu", (unsigned long) s->pid);
+	    len -= j;
+	    ptr += j;
+	}
+	if (s->state == STATE_BUSY && s->cmd >= 0 && s->cmd < NUM_CMDS) {
+	    j = snprintf(ptr, len, " %s", CmdName[s->cmd]);
+	    len -= j;
+	    ptr += j;
+	}
+
+	if (s->last_cmd >= 0 && s->last_cmd < NUM_CMDS) {
+	    j = snprintf(ptr, len, " last=%s", CmdName[s->last_cmd]);
+	    len -= j;
+	    ptr += j;
+	}
+
+	secs = (int) (now - s->lastStateChange);
+	j = snprintf(ptr, len, " ago=%d", secs);
+	len -= j;
+	ptr += j;
+	if (s->status_tag[0]) {
+	    j = snprintf(ptr, len, " (%s)", s->status_tag);
+	    len -= j;
+	    ptr += j;
+	}
+	j = snprintf(ptr, len, "\n");
+	len -= j;
+	ptr += j;
+    }
+    reply_to_mimedefang_owned(es, fd, ans);
+}
+
+/**********************************************************************
+* %FUNCTION: doStatus
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- socket
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Prints a status string back.  Each char corresponds to a worker;
+*  the chars are:
+*  S -- worker is stopped
+*  I -- worker is idle
+*  B -- worker is busy
+*  K -- worker is killed but not yet reaped
+*  W -- worker is starting and not yet ready.
+***********************************************************************/
+static void
+doStatus(EventSelector *es, int fd)
+{
+    char *ans = malloc(Settings.maxWorkers + 2 + 300);
+    int i;
+
+    if (!ans) {
+	reply_to_mimedefang(es, fd, "error: Out of memory\n");
+	return;
+    }
+
+    for (i=0; i < Settings.maxWorkers; i++) {
+	Worker *s = &AllWorkers[i];
+	switch (s->state) {
+	case STATE_STOPPED: ans[i] = 'S'; break;
+	case STATE_IDLE:    ans[i] = 'I'; break;
+	case STATE_BUSY:    ans[i] = 'B'; break;
+	case STATE_KILLED:  ans[i] = 'K'; break;
+	case STATE_STARTING: ans[i] = 'W'; break;
+	default:            ans[i] = '?';
+	}
+    }
+    sprintf(ans + Settings.maxWorkers, " %d %d %d %d %d\n", NumMsgsProcessed, Activations, Settings.requestQueueSize, NumQueuedRequests, (int) (time(NULL) - TimeOfProgramStart));
+    reply_to_mimedefang_owned(es, fd, ans);
+}
+
+/**********************************************************************
+* %FUNCTION: doAutoscaleStatus
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- socket
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Prints current autoscaling configuration and runtime state.
+***********************************************************************/
+static void
+doAutoscaleStatus(EventSelector *es, int fd)
+{
+    char ans[512];
+    snprintf(ans, sizeof(ans),
+             "enabled=%d interval=%d ema_busy=%.4f scale_out=%.2f scale_in=%.2f out_cool=%d in_cool=%d ema_alpha=%.4f reserved=%d predictive=%d dry_run=%d lead=%d predicted=%.2f target=%d queued=%d out_queued=%d rejects=%lu out_rejects=%d queue_wait_p95=%.3f out_wait=%d in_wait=%d signal=%s\n",
+             Settings.autoscaling,
+             Settings.autoscaleInterval,
+             EMABusyRatio,
+             Settings.scaleOutBusyRatio,
+             Settings.scaleInBusyRatio,
+             Settings.scaleOutCooldown,
+             Settings.scaleInCooldown,
+             Settings.emaAlpha,
+             NUM_RESERVED_WORKERS,
+             Settings.predictive,
+             Settings.autoscaleDryRun,
+             Settings.predictLead / 60,
+             PredictedDemand,
+             PredictedWorkers,
+             AutoscaleQueued,
+             Settings.scaleOutQueued,
+             AutoscaleRejections,
+             Settings.scaleOutRejections,
+             AutoscaleQueueWait,
+             Settings.scaleOutQueueWaitMs,
+             Settings.scaleInQueueWaitMs,
+             ScaleSignalName[AutoscaleSignal]);
+    reply_to_mimedefang(es, fd, ans);
 }
 
 /**********************************************************************
-* %FUNCTION: checkWorkerForExpiry
+* %FUNCTION: doAutoscaleProfile
 * %ARGUMENTS:
-*  s -- a worker to check
+*  es -- event selector
+*  fd -- socket
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  If the worker has served too many requests, it is killed.
+*  Prints the weekly demand profile, one line per hour of the week that
+*  has been seen: day, hour, average peak demand and weeks seen.
 ***********************************************************************/
 static void
-checkWorkerForExpiry(Worker *s)
+doAutoscaleProfile(EventSelector *es, int fd)
 {
-    /* If there is a queued request, don't terminate worker just yet.  Allow
-       it to go up to triple maxRequests.  Yes, this is a horrible hack. */
-    if (s->numRequests < Settings.maxRequests * 3) {
-	if (handle_queued_request()) {
-	    return;
-	}
+    static char const *days[7] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    char ans[PROFILE_HOURS * 32 + 1];
+    char *ptr = ans;
+    int len = sizeof(ans);
+    int i, j;
+
+    *ans = 0;
+    for (i=0; i<PROFILE_HOURS; i++) {
+	if (!AutoscaleProfile[i].weeks) continue;
+	j = snprintf(ptr, len, "%s %02d %.2f %d\n", days[i / 24], i % 24,
+		     AutoscaleProfile[i].peak, AutoscaleProfile[i].weeks);
+	ptr += j;
+	len -= j;
     }
-    if (s->numRequests >= Settings.maxRequests) {
-	char reason[200];
-	snprintf(reason, sizeof(reason), "Worker has processed %d requests",
-		 s->numRequests);
-	killWorker(s, reason);
-    } else if (Settings.maxLifetime > 0 && worker_request_age(s) > Settings.maxLifetime) {
-	char reason[200];
-	snprintf(reason, sizeof(reason), "Worker has exceeded maximum lifetime of %d seconds", Settings.maxLifetime);
-	killWorker(s, reason);
-    } else if (s->generation < Generation) {
-	killWorker(s, "New generation -- forcing reread of filter rules");
+    if (!*ans) {
+	reply_to_mimedefang(es, fd, "\n");
+	return;
     }
+    reply_to_mimedefang(es, fd, ans);
 }
 
 /**********************************************************************
-* %FUNCTION: killWorker
+* %FUNCTION: doPoolStatus
 * %ARGUMENTS:
-*  s -- a worker to kill
-*  reason -- reason worker is being killed
+*  es -- event selector
+*  fd -- socket
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Kills a worker by closing its pipe.  The worker then has 10 seconds
-*  to clean up and exit before we send SIGTERM
+*  Prints allocation statistics for the event loop's memory pools.
 ***********************************************************************/
 static void
-killWorker(Worker *s, char const *reason)
+doPoolStatus(EventSelector *es, int fd)
 {
-    struct timeval t;
-    int withPrejudice = 0;
-
-    int age = worker_age(s);
-    int req_age = worker_request_age(s);
-    if (s->state != STATE_KILLED) {
-	if (DOLOG) syslog(LOG_INFO, "Killing %s worker %d (pid %lu) req=%d age=%d req_age=%d: %s",
-			  state_name_lc(s->state),
-			  WORKERNO(s),
-			  (unsigned long) s->pid,
-			  s->numRequests,
-			  age,
-			  req_age,
-			  reason);
-	/* In case, for some weird reason, the worker has stopped... */
-	kill(s->pid, SIGCONT);
-
-	/* If worker is busy, we kill it with prejudice */
-	if (s->state == STATE_BUSY) {
-	    withPrejudice = 1;
-	    kill(s->pid, SIGTERM);
-	}
-
-	putOnList(s, STATE_KILLED);
-	/* Close stdin so worker sees EOF */
-	close(s->workerStdin);
-	s->workerStdin = -1;
-
-	/* Kill any pending event */
-	if (s->event) {
-	    EventTcp_CancelPending(s->event);
-	    s->event = NULL;
-	}
+    char ans[256];
+    EventPoolStats handlers, objects;
 
-	/* Set up a timer to send SIGTERM if worker doesn't exit in
-	   10 seconds */
-	t.tv_sec = 10;
-	t.tv_usec = 0;
-	if (withPrejudice) {
-	    s->termHandler = Event_AddTimerHandler(s->es, t,
-						   nukeWorker, (void *) s);
-	} else {
-	    s->termHandler = Event_AddTimerHandler(s->es, t,
-						   terminateWorker, (void *) s);
-	}
-	statsLog("KillWorker", WORKERNO(s), "req=%d age=%d reason=\"%s\"", s->numRequests, age, reason);
-    }
+    Event_GetPoolStats(es, &handlers, &objects);
+    snprintf(ans, sizeof(ans),
+	     "handlers_allocated=%lu handlers_reused=%lu handlers_cached=%d objects_allocated=%lu objects_reused=%lu objects_cached=%d\n",
+	     handlers.allocated,
+	     handlers.reused,
+	     handlers.cached,
+	     objects.allocated,
+	     objects.reused,
+	     objects.cached);
+    reply_to_mimedefang(es, fd, ans);
 }
 
+/* Memory use of a process, in kB */
+typedef struct {
+    unsigned long rss;		/* Resident                                  */
+    unsigned long pss;		/* Proportional share of resident pages      */
+    unsigned long shared;	/* Resident and shared with other processes  */
+    unsigned long priv;		/* Resident and private                      */
+    unsigned long swap;		/* Swapped out                               */
+} MemUsage;
+
 /**********************************************************************
-* %FUNCTION: terminateWorker
+* %FUNCTION: readMemUsage
 * %ARGUMENTS:
-*  es -- Event selector
-*  fd -- not used
-*  flags -- ignored
-*  data -- the worker to terminate
+*  pid -- a process
+*  mem -- filled in with its memory use
 * %RETURNS:
-*  Nothing
+*  0 on success, -1 if it could not be read
 * %DESCRIPTION:
-*  Sends a SIGTERM to worker, because it's taken too long to exit.
+*  Reads /proc/<pid>/smaps_rollup.  Kernels older than 4.14 do not have
+*  it, and summing /proc/<pid>/smaps instead would mean parsing every
+*  mapping of every worker in the event loop, so their memory use is
+*  unavailable.
 ***********************************************************************/
-static void
-terminateWorker(EventSelector *es,
-	       int fd,
-	       unsigned int flags,
-	       void *data)
+static int
+readMemUsage(pid_t pid, MemUsage *mem)
 {
-    struct timeval t;
-    Worker *s = (Worker *) data;
-    s->termHandler = NULL;
-    if (s->pid != (pid_t) -1) {
-	if (DOLOG) {
-	    syslog(LOG_INFO,
-		   "Worker %d (pid %lu) taking too long to exit; sending SIGTERM",
-		   WORKERNO(s), (unsigned long) s->pid);
+    char path[64];
+    char line[256];
+    char key[32];
+    unsigned long val;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%lu/smaps_rollup", (unsigned long) pid);
+    fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    memset(mem, 0, sizeof(*mem));
+    while (fgets(line, sizeof(line), fp)) {
+	if (sscanf(line, "%31[^:]: %lu", key, &val) != 2) continue;
+	if (!strcmp(key, "Rss")) {
+	    mem->rss += val;
+	} else if (!strcmp(key, "Pss")) {
+	    mem->pss += val;
+	} else if (!strcmp(key, "Shared_Clean") || !strcmp(key, "Shared_Dirty")) {
+	    mem->shared += val;
+	} else if (!strcmp(key, "Private_Clean") || !strcmp(key, "Private_Dirty")) {
+	    mem->priv += val;
+	} else if (!strcmp(key, "Swap")) {
+	    mem->swap += val;
 	}
-	kill(s->pid, SIGCONT);
-	kill(s->pid, SIGTERM);
-	/* Set up a timer to send SIGKILL if worker doesn't exit in
-	   10 seconds */
-	t.tv_sec = 10;
-	t.tv_usec = 0;
-	s->termHandler = Event_AddTimerHandler(s->es, t, nukeWorker, (void *) s);
     }
+    fclose(fp);
+
+    /* A process that has exited has an empty file */
+    return mem->rss ? 0 : -1;
 }
 
 /**********************************************************************
-* %FUNCTION: nukeWorker
+* %FUNCTION: doMemoryReport
 * %ARGUMENTS:
-*  es -- Event selector
-*  fd -- not used
-*  flags -- ignored
-*  data -- the worker to nuke
+*  es -- event selector
+*  fd -- socket
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Sends a SIGKILL to worker, because it's taken too long to exit, in spite
-*  of getting a SIGTERM
+*  Prints how much of each running worker's memory is shared with other
+*  processes and how much is its own.
 ***********************************************************************/
 static void
-nukeWorker(EventSelector *es,
-	  int fd,
-	  unsigned int flags,
-	  void *data)
+doMemoryReport(EventSelector *es, int fd)
 {
-    Worker *s = (Worker *) data;
-    s->termHandler = NULL;
-    if (s->pid != (pid_t) -1) {
-	if (DOLOG) {
-	    syslog(LOG_INFO,
-		   "Worker %d (pid %lu) taking way too long to exit; sending SIGKILL",
-		   WORKERNO(s), (unsigned long) s->pid);
+    int len = (Settings.maxWorkers + 2) * 128 + 1;
+    char *ans = malloc(len);
+    char *ptr = ans;
+    char status = '?';
+    MemUsage mem, total;
+    pid_t parent = (pid_t) -1;
+    int i, j, n = 0;
+
+    if (!ans) {
+	reply_to_mimedefang(es, fd, "error: Out of memory\n");
+	return;
+    }
+    *ans = 0;
+    memset(&total, 0, sizeof(total));
+
+    for (i=0; i<Settings.maxWorkers; i++) {
+	Worker *s = &AllWorkers[i];
+	if (s->state == STATE_STOPPED || s->pid == (pid_t) -1) {
+	    continue;
 	}
-	kill(s->pid, SIGCONT);
-	kill(s->pid, SIGKILL);
+	switch (s->state) {
+	case STATE_IDLE:    status = 'I'; break;
+	case STATE_BUSY:    status = 'B'; break;
+	case STATE_KILLED:  status = 'K'; break;
+	case STATE_STARTING: status = 'W'; break;
+	}
+	if (readMemUsage(s->pid, &mem) < 0) {
+	    j = snprintf(ptr, len, "%d %c %lu unavailable\n", i, status,
+			 (unsigned long) s->pid);
+	} else {
+	    j = snprintf(ptr, len, "%d %c %lu rss=%lu pss=%lu shared=%lu private=%lu swap=%lu\n",
+			 i, status, (unsigned long) s->pid,
+			 mem.rss, mem.pss, mem.shared, mem.priv, mem.swap);
+	    total.rss += mem.rss;
+	    total.pss += mem.pss;
+	    total.shared += mem.shared;
+	    total.priv += mem.priv;
+	    total.swap += mem.swap;
+	    n++;
+	}
+	len -= j;
+	ptr += j;
+    }
+
+    /* The process embedded-Perl workers are forked from */
+#ifdef EMBED_PERL
+    if (Settings.useEmbeddedPerl) {
+	parent = getpid();
+#ifdef USE_ZYGOTE
+	if (CurZygote) parent = CurZygote->pid;
+#endif
+    }
+#endif
+    if (parent != (pid_t) -1 && readMemUsage(parent, &mem) == 0) {
+	j = snprintf(ptr, len, "parent %lu rss=%lu pss=%lu shared=%lu private=%lu swap=%lu\n",
+		     (unsigned long) parent,
+		     mem.rss, mem.pss, mem.shared, mem.priv, mem.swap);
+	len -= j;
+	ptr += j;
     }
+
+    snprintf(ptr, len, "total workers=%d rss=%lu pss=%lu shared=%lu private=%lu swap=%lu\n",
+	     n, total.rss, total.pss, total.shared, total.priv, total.swap);
+    reply_to_mimedefang_owned(es, fd, ans);
 }
 
-/**********************************************************************
-*%FUNCTION: childHandler
-*%ARGUMENTS:
-* sig -- signal number
-*%RETURNS:
-* Nothing
-*%DESCRIPTION:
-* Called by SIGCHLD.  Writes 'C' to Pipe to wake up the select
-* loop and cause reaping of dead sessions
-***********************************************************************/
-static void
-childHandler(int sig)
+static int
+compare_domain_counts(void const *a, void const *b)
 {
-    char byte = 'C';
-    if (!ReapPending) {
-	ReapPending = 1;
-	if (!CharPending) {
-	    int errno_save = errno;
-	    write(Pipe[1], &byte, 1);
-	    errno = errno_save;
-	    CharPending = 1;;
-	}
-    }
+    DomainCount const *da = *(DomainCount const * const *) a;
+    DomainCount const *db = *(DomainCount const * const *) b;
+
+    if (da->count != db->count) return db->count - da->count;
+    if (da->numWaiting != db->numWaiting) return db->numWaiting - da->numWaiting;
+    return strcmp(da->domain, db->domain);
 }
 
 /**********************************************************************
-*%FUNCTION: hupHandler
-*%ARGUMENTS:
-* sig -- signal number
-*%RETURNS:
-* Nothing
-*%DESCRIPTION:
-* Called by SIGHUP.  Writes 'H' to Pipe to wake up the select
-* loop and cause closing and reopening of stats descriptor
+* %FUNCTION: doHotDomains
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- socket
+*  cmd -- "hotdomains" optionally followed by the number of domains to list
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Lists the domains with the most recipok commands in flight, busiest
+*  first.  Each line holds the domain, its number of busy workers and
+*  its number of recipoks queued by the per-domain limit.
 ***********************************************************************/
 static void
-hupHandler(int sig)
+doHotDomains(EventSelector *es, int fd, char const *cmd)
 {
-    char byte = 'H';
-    if (!HupPending) {
-	HupPending = 1;
-	if (!CharPending) {
-	    int errno_save = errno;
-	    write(Pipe[1], &byte, 1);
-	    errno = errno_save;
-	    CharPending = 1;;
+    DomainCount **hot;
+    char *ans, *ptr;
+    int n = 10;
+    int num = 0;
+    int i, j, len;
+
+    if (cmd[10] && (sscanf(cmd+11, "%d", &n) != 1 || n < 1)) {
+	reply_to_mimedefang(es, fd, "error: Invalid number of domains\n");
+	return;
+    }
+
+    hot = malloc(NumDomainCounts * sizeof(DomainCount *));
+    if (!hot) {
+	reply_to_mimedefang(es, fd, "error: Out of memory\n");
+	return;
+    }
+    for (i=0; i<NumDomainCounts; i++) {
+	if (DomainCounts[i].count > 0 || DomainCounts[i].numWaiting > 0) {
+	    hot[num++] = &DomainCounts[i];
 	}
     }
+    qsort(hot, num, sizeof(DomainCount *), compare_domain_counts);
+    if (n > num) n = num;
+
+    len = n * (MAX_DOMAIN_LEN + 32) + 1;
+    ans = malloc(len);
+    if (!ans) {
+	free(hot);
+	reply_to_mimedefang(es, fd, "error: Out of memory\n");
+	return;
+    }
+    *ans = 0;
+    ptr = ans;
+    for (i=0; i<n; i++) {
+	j = snprintf(ptr, len, "%s %d %d\n", hot[i]->domain, hot[i]->count,
+		     hot[i]->numWaiting);
+	len -= j;
+	ptr += j;
+    }
+    free(hot);
+    if (!*ans) {
+	/* An empty reply would look like a dropped connection */
+	free(ans);
+	reply_to_mimedefang(es, fd, "\n");
+	return;
+    }
+    reply_to_mimedefang_owned(es, fd, ans);
 }
 
 /**********************************************************************
-*%FUNCTION: intHandler
-*%ARGUMENTS:
-* sig -- signal number
-*%RETURNS:
-* Nothing
-*%DESCRIPTION:
-* Called by SIGINT.  Writes 'I' to Pipe to wake up the select
-* loop and cause closing and reopening of stats descriptor
+* %FUNCTION: doDomainQueueStatus
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- socket
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Prints statistics about recipoks queued by the per-domain limit.
 ***********************************************************************/
 static void
-intHandler(int sig)
+doDomainQueueStatus(EventSelector *es, int fd)
 {
-    char byte = 'I';
-    if (!IntPending) {
-	IntPending = 1;
-	if (!CharPending) {
-	    int errno_save = errno;
-	    write(Pipe[1], &byte, 1);
-	    errno = errno_save;
-	    CharPending = 1;;
-	}
+    char ans[256];
+    int waiting = 0;
+    int i;
+
+    for (i=0; i<NumDomainCounts; i++) {
+	waiting += DomainCounts[i].numWaiting;
     }
+    snprintf(ans, sizeof(ans),
+	     "limit=%d waiting=%d queued=%lu dispatched=%lu timed_out=%lu avg_wait_ms=%.1f max_wait_ms=%.1f\n",
+	     Settings.maxRecipokPerDomain,
+	     waiting,
+	     DomainQueued,
+	     DomainDispatched,
+	     DomainTimedOut,
+	     DomainDispatched ? DomainWaitTotalMs / DomainDispatched : 0.0,
+	     DomainWaitMaxMs);
+    reply_to_mimedefang(es, fd, ans);
 }
 
 /**********************************************************************
-* %FUNCTION: handlePipe
+* %FUNCTION: doLease
 * %ARGUMENTS:
-*  es -- event selector (ignored)
-*  fd -- file descriptor which is readable
-*  flags -- ignored
-*  data -- ignored
+*  es -- event selector
+*  fd -- socket
+*  ttl -- lifetime of the lease in seconds
+*  required -- number of free workers which must remain unleased
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Simply reads from the pipe; then reaps and/or closes and reopens
-*  stats file.
+*  Holds back a free worker for ttl seconds if more than "required"
+*  free workers are not already held back.  Replies "ok id avail" or
+*  "none avail", where avail is the number of free workers not held
+*  back before the request.
 ***********************************************************************/
 static void
-handlePipe(EventSelector *es,
-	    int fd,
-	    unsigned int flags,
-	    void *data)
+doLease(EventSelector *es, int fd, int ttl, int required)
 {
-    char buf[64];
-    sigset_t sigs, osigs;
-    int n;
-    int doreap, dohup, doint;
+    char ans[64];
+    int avail = NUM_UNRESERVED_WORKERS;
+    struct timeval t;
+    Lease *l;
+    int slot;
 
-    /* The read and the reset of CharPending must be atomic with respect
-       to signal handlers. */
-    sigemptyset(&sigs);
-    sigaddset(&sigs, SIGCHLD);
-    sigaddset(&sigs, SIGINT);
-    sigaddset(&sigs, SIGHUP);
+    if (ttl <= 0 || ttl > MAX_LEASE_TTL || required < 0) {
+	reply_to_mimedefang(es, fd, "error: Invalid lease request\n");
+	return;
+    }
 
-    n = sigprocmask(SIG_BLOCK, &sigs, &osigs);
-    if (n < 0) {
-	syslog(LOG_ERR, "sigprocmask failed: %m");
+    if (avail <= required || FreeLease < 0) {
+	LeasesDenied++;
+	snprintf(ans, sizeof(ans), "none %d\n", avail);
+	reply_to_mimedefang(es, fd, ans);
+	return;
     }
 
-    /* Begin atomic portion */
-    read(fd, buf, 64);
-    doreap = ReapPending;
-    doint  = IntPending;
-    dohup  = HupPending;
-    CharPending = 0;
-    ReapPending = 0;
-    IntPending  = 0;
-    HupPending  = 0;
-    /* End atomic portion */
+    slot = FreeLease;
+    l = &Leases[slot];
+    t.tv_sec = ttl;
+    t.tv_usec = 0;
+    l->timer = Event_AddTimerHandler(es, t, leaseExpired, l);
+    if (!l->timer) {
+	reply_to_mimedefang(es, fd, "error: Out of memory\n");
+	return;
+    }
+    FreeLease = l->nextFree;
 
-    /* Reset signal mask */
-    if (n >= 0) {
-	sigprocmask(SIG_SETMASK, &osigs, NULL);
+    /* The ID encodes the slot and is not reused for a long time */
+    if (++LeaseSerial > UINT_MAX / (unsigned int) Settings.maxWorkers - 1) {
+	LeaseSerial = 1;
     }
+    l->id = LeaseSerial * (unsigned int) Settings.maxWorkers + slot;
+    l->es = es;
+    l->worker = NULL;
+    NumLeases++;
+    LeasesGranted++;
+    publishGauge();
 
-    if (doreap) {
-	reapTerminatedWorkers(0);
+    snprintf(ans, sizeof(ans), "ok %u %d\n", l->id, avail);
+    reply_to_mimedefang(es, fd, ans);
+}
 
-	/* Activate new workers if we've fallen below minimum */
-	if (NUM_RUNNING_WORKERS < Settings.minWorkers) {
-	    scheduleBringWorkersUpToMin(es);
-	}
-    }
-    if (dohup) {
-	statsReopenFile();
-    }
-    if (doint) {
-	newGeneration();
-	notify_listeners(es, "R\n");
+/**********************************************************************
+* %FUNCTION: doUnlease
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- socket
+*  id -- lease ID
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Releases a lease.  Releasing a lease which no longer exists is not
+*  an error.
+***********************************************************************/
+static void
+doUnlease(EventSelector *es, int fd, unsigned int id)
+{
+    Lease *l = findLease(id);
+
+    if (l) {
+	LeasesReleased++;
+	freeLease(l);
+	drainQueue();
     }
+    reply_to_mimedefang(es, fd, "ok\n");
 }
 
 /**********************************************************************
-* %FUNCTION: reapTerminatedWorkers
+* %FUNCTION: doLeaseStatus
 * %ARGUMENTS:
-*  killed -- If true, multiplexor was killed and has killed all workers
+*  es -- event selector
+*  fd -- socket
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Reaps all terminated workers
+*  Prints lease statistics.
 ***********************************************************************/
 static void
-reapTerminatedWorkers(int killed)
+doLeaseStatus(EventSelector *es, int fd)
 {
-    pid_t pid;
-    int status;
-    Worker *s;
-    int oldstate;
-    HistoryBucket *b;
-
-#ifdef HAVE_WAIT3
-    struct rusage resource;
+    char ans[256];
 
-    while ((pid = wait3(&status, WNOHANG, &resource)) > 0) {
-#else
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-#endif
-	s = findWorkerByPid(pid);
-	if (!s) continue;
+    snprintf(ans, sizeof(ans),
+	     "leases=%d active=%d reserved=%d granted=%lu denied=%lu consumed=%lu released=%lu expired=%lu\n",
+	     NumLeases,
+	     NumActiveLeases,
+	     NUM_RESERVED_WORKERS,
+	     LeasesGranted,
+	     LeasesDenied,
+	     LeasesConsumed,
+	     LeasesReleased,
+	     LeasesExpired);
+    reply_to_mimedefang(es, fd, ans);
+}
 
-	oldstate = s->state;
-	if (killed) {
-	    s->state = STATE_KILLED;
-	}
-	logWorkerReaped(s, status);
-	if (killed) {
-	    s->state = oldstate;
+/**********************************************************************
+* %FUNCTION: doQueueStatus
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- socket
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Prints one line of queue statistics per priority class, followed by
+*  the kinds of request assigned to that class.
+***********************************************************************/
+static void
+doQueueStatus(EventSelector *es, int fd)
+{
+    char ans[1024];
+    char *ptr = ans;
+    int len = sizeof(ans);
+    int i, kind, j;
+
+    for (i=0; i<NUM_QUEUE_CLASSES; i++) {
+	QueueStats *q = &ClassStats[i];
+	char const *sep;
+	j = snprintf(ptr, len,
+		     "class=%d depth=%d queued=%lu dispatched=%lu timed_out=%lu avg_wait_ms=%.1f max_wait_ms=%.1f kinds=",
+		     i, q->depth, q->queued, q->dispatched, q->timedOut,
+		     q->dispatched ? q->waitTotalMs / q->dispatched : 0.0,
+		     q->waitMaxMs);
+	len -= j;
+	ptr += j;
+	sep = "";
+	for (kind=0; kind<NUM_QUEUE_KINDS; kind++) {
+	    if (QueueClass[kind] != i) continue;
+	    j = snprintf(ptr, len, "%s%s", sep, QueueKindName[kind]);
+	    len -= j;
+	    ptr += j;
+	    sep = ",";
 	}
-
-#ifdef HAVE_WAIT3
-	log_worker_resource_usage(s, &resource);
-#endif
-	s->pid = (pid_t) -1;
-	s->activationTime = (time_t) -1;
-	s->firstReqTime = (time_t) -1;
-	shutDescriptors(s);
-	putOnList(s, STATE_STOPPED);
-	statsLog("ReapWorker", WORKERNO(s), NULL);
-	b = get_history_bucket(SCAN_CMD);
-	b->reaped++;
+	j = snprintf(ptr, len, "\n");
+	len -= j;
+	ptr += j;
     }
+    reply_to_mimedefang(es, fd, ans);
 }
 
 /**********************************************************************
-* %FUNCTION: shutDescriptors
+* %FUNCTION: doHelp
 * %ARGUMENTS:
-*  s -- a worker
+*  es -- event selector
+*  fd -- socket
+*  unpriv -- true on unprivileged socket; print raw help
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Closes worker's descriptors if necessary
+*  Prints a help string listing commands the multiplexor accepts.
 ***********************************************************************/
 static void
-shutDescriptors(Worker *s)
+doHelp(EventSelector *es, int fd, int unpriv)
 {
-    char buffer[64];
-    int n;
-
-    if (s->workerStdin >= 0) {
-	close(s->workerStdin);
-	s->workerStdin = -1;
-    }
-    if (s->workerStdout >= 0) {
-	close(s->workerStdout);
-	s->workerStdout = -1;
-    }
-    if (s->workerStderr >= 0) {
-	Event_DelHandler(s->es, s->errHandler);
-	s->errHandler = NULL;
-	/* Consume and log any error messages */
-	while( (n=read(s->workerStderr, buffer, sizeof(buffer)-1)) > 0) {
-	    buffer[n] = 0;
-	    if (buffer[n-1] == '\n') {
-		buffer[n-1] = 0;
-	    }
-	    if (DOLOG) {
-		syslog(LOG_INFO, "Worker %d stderr: %s", WORKERNO(s), buffer);
-	    }
-	}
-	close(s->workerStderr);
-	s->workerStderr = -1;
-    }
-    if (s->workerStatusFD >= 0) {
-	close(s->workerStatusFD);
-	Event_DelHandler(s->es, s->statusHandler);
-	s->statusHandler = NULL;
-	s->workerStatusFD = -1;
+    if (unpriv) {
+	reply_to_mimedefang(es, fd,
+	"help             -- List available multiplexor commands\n"
+	"free             -- Display number of free workers\n"
+	"load             -- Display worker load (scans)\n"
+	"rawload          -- Display worker load in computer-readable format\n"
+	"load1 secs       -- Display worker load in alternate format\n"
+	"jsonload1 secs   -- Display worker load in JSON format\n"
+	"rawload1 secs    -- Display worker load in computer-readable alternate format\n"
+	"load-relayok     -- Display load (relayok requests)\n"
+	"rawload-relayok  -- Computer-readable load (relayok requests)\n"
+	"load-senderok    -- Display load (senderok requests)\n"
+	"rawload-senderok -- Computer-readable load (senderok requests)\n"
+	"load-recipok     -- Display load (recipok requests)\n"
+	"rawload-recipok  -- Computer-readable load (recipok requests)\n"
+	"status           -- Display worker status\n"
+	"jsonstatus       -- Display worker status in JSON format\n"
+	"rawstatus        -- Display worker status in computer-readable format\n"
+	"barstatus        -- Display worker status as bar graph\n"
+	"histo            -- Display histogram of busy workers\n"
+	"burst            -- Display requests per 100ms over the last 10 seconds\n"
+	"msgs             -- Display number of messages processed since startup\n"
+	"workers          -- Display workers with process-IDs\n"
+	"busyworkers      -- Display busy workers with process-IDs\n"
+        "workerinfo n     -- Display information about a particular worker\n"
+	"autoscale        -- Display autoscaling configuration and runtime state\n"
+	"autoscaleprofile -- Display the weekly demand profile for predictive autoscaling\n"
+	"pools            -- Display event-loop memory pool statistics\n"
+	"memory           -- Display shared and private memory of each worker\n"
+	"hotdomains [n]   -- Display domains with the most recipoks in progress\n"
+	"domainqueue      -- Display statistics for per-domain recipok queueing\n"
+	"queuestatus      -- Display request queue statistics by priority class\n"
+	"latency [mins]   -- Display latency percentiles by kind of request\n"
+	"latencyhisto k m [mins] -- Display latency histogram for kind k, measure m\n"
+	"metrics          -- Display counters and gauges in OpenMetrics format\n"
+	"(Analogous hload commands provide hourly information)\n");
+    } else {
+	reply_to_mimedefang(es, fd,
+	"help             -- List available multiplexor commands\n"
+	"status           -- Display worker status\n"
+	"jsonstatus       -- Display worker status in JSON format\n"
+	"rawstatus        -- Display worker status in computer-readable format\n"
+	"barstatus        -- Display worker status as bar graph\n"
+	"free             -- Display number of free workers\n"
+	"load             -- Display worker load (scans)\n"
+	"rawload          -- Display worker load in computer-readable format\n"
+	"load1 secs       -- Display worker load in alternate format\n"
+	"jsonload1 secs   -- Display worker load in JSON format\n"
+	"rawload1 secs    -- Display worker load in alternate format\n"
+	"load-relayok     -- Display load (relayok requests)\n"
+	"rawload-relayok  -- Computer-readable load (relayok requests)\n"
+	"load-senderok    -- Display load (senderok requests)\n"
+	"rawload-senderok -- Computer-readable load (senderok requests)\n"
+	"load-recipok     -- Display load (recipok requests)\n"
+	"rawload-recipok  -- Computer-readable load (recipok requests)\n"
+	"histo            -- Display histogram of busy workers\n"
+	"burst            -- Display requests per 100ms over the last 10 seconds\n"
+	"msgs             -- Display number of messages processed since startup\n"
+	"reread           -- Force a re-read of filter rules\n"
+	"workers          -- Display workers with process-IDs\n"
+	"busyworkers      -- Display busy workers with process-IDs\n"
+	"workerinfo n     -- Display information about a particular worker\n"
+	"autoscale        -- Display autoscaling configuration and runtime state\n"
+	"autoscaleprofile -- Display the weekly demand profile for predictive autoscaling\n"
+	"pools            -- Display event-loop memory pool statistics\n"
+	"memory           -- Display shared and private memory of each worker\n"
+	"hotdomains [n]   -- Display domains with the most recipoks in progress\n"
+	"domainqueue      -- Display statistics for per-domain recipok queueing\n"
+	"queuestatus      -- Display request queue statistics by priority class\n"
+	"latency [mins]   -- Display latency percentiles by kind of request\n"
+	"latencyhisto k m [mins] -- Display latency histogram for kind k, measure m\n"
+	"metrics          -- Display counters and gauges in OpenMetrics format\n"
+	"leases           -- Display worker lease statistics\n"
+	"lease ttl [n]    -- Hold back a free worker for ttl seconds\n"
+	"unlease id       -- Release a lease\n"
+	"scan /path       -- Run a scan (do not invoke using md-mx-ctrl)\n"
+	"(Analogous hload commands provide hourly information)\n");
     }
+}
 
-    if (s->termHandler) {
-	Event_DelHandler(s->es, s->termHandler);
-	s->termHandler = NULL;
+static void
+doLoad1(EventSelector *es, int fd, int back)
+{
+    char ans[1024];
+    int msgs[NUM_CMDS], workers[NUM_CMDS], activated, reaped;
+    BIG_INT ms[NUM_CMDS];
+    double avg[NUM_CMDS], ams[NUM_CMDS];
+    int counts[NUM_CMDS];
+    int cmd;
+    time_t now = time(NULL);
+    Worker *s;
+
+    for (cmd=MIN_CMD; cmd <= MAX_CMD; cmd++) {
+	get_history_totals(cmd, now, back, &msgs[cmd], &workers[cmd], &ms[cmd], &activated, &reaped);
+	if (msgs[cmd]) {
+	    avg[cmd] = (double) workers[cmd] / (double) msgs[cmd];
+	    ams[cmd] = (double) ms[cmd]     / (double) msgs[cmd];
+	} else {
+	    avg[cmd] = 0.0;
+	    ams[cmd] = 0.0;
+	}
     }
-
-    if (s->event) {
-	EventTcp_CancelPending(s->event);
-	s->event = NULL;
+    memset(counts, 0, sizeof(counts));
+    s = Workers[STATE_BUSY];
+    while(s) {
+	if (s->cmd >= MIN_CMD && s->cmd <= MAX_CMD) {
+	    counts[s->cmd]++;
+	}
+	s = s->next;
     }
 
-    if (s->clientFD >= 0) {
-	close(s->clientFD);
-	s->clientFD = -1;
-    }
+    snprintf(ans, sizeof(ans), "%d %f %f %d %f %f %d %f %f %d %f %f %d %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
+	     msgs[SCAN_CMD],     avg[SCAN_CMD],     ams[SCAN_CMD],
+	     msgs[RELAYOK_CMD],  avg[RELAYOK_CMD],  ams[RELAYOK_CMD],
+	     msgs[SENDEROK_CMD], avg[SENDEROK_CMD], ams[SENDEROK_CMD],
+	     msgs[RECIPOK_CMD],  avg[RECIPOK_CMD],  ams[RECIPOK_CMD],
+	     WorkerCount[STATE_BUSY] + WorkerCount[STATE_STARTING],
+	     WorkerCount[STATE_IDLE],
+	     WorkerCount[STATE_STOPPED], WorkerCount[STATE_KILLED],
+	     NumMsgsProcessed, Activations,
+	     Settings.requestQueueSize, NumQueuedRequests,
+	     (int)(now - TimeOfProgramStart), back,
+	     counts[SCAN_CMD], counts[RELAYOK_CMD], counts[SENDEROK_CMD], counts[RECIPOK_CMD]);
+    reply_to_mimedefang(es, fd, ans);
 }
 
 /**********************************************************************
-* %FUNCTION: handleIdleTimeout
+* %FUNCTION: doLoad
 * %ARGUMENTS:
 *  es -- event selector
-*  fd, flags, data -- ignored
+*  fd -- socket
+*  cmd -- which command's history we want
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Called periodically to check for idle workers that can be killed
+*  Prints a load string back.  This string is a list of numbers:
+*
+*    msgs_0 msgs_1 msgs_5 msgs_10
+*    avg_0 avg_1 avg_5 avg_10
+*    ams_0 ams_1 ams_5 ams_10
+*    a0 a1 a5 a10
+*    r0 r1 r5 r10
+*    busy idle stopped killed
+*    msgs_processed total_activations
+*    request_queue_size num_queued_requests seconds_since_program_start
+*
+*    Note for below:  If N=0, then time frame is last 10 seconds.
+*    msgs_N -- Number of messages processed in last N minutes.
+*    avg_N  -- Average number of busy workers when msg processed
+*    ams_N  -- Average scan time in milliseconds
+*    aN     -- Number of workers activated in last N minutes
+*    rN     -- Number of workers reaped in last N minutes
+*    busy idle stopped killed -- Snapshot of # workers in each status
+*    msgs_processed -- Total msgs processed since startup
+*    total_activations -- Total worker activations since startup
+*    request_queue_size -- size of queue
+*    num_queued_requests -- number of requests on queue
+*    seconds_since_program_start -- just what it says!
+*
+* NOTE: Activations and reaps (aN, rN) are only valid if cmd == SCAN_CMD
 ***********************************************************************/
 static void
-handleIdleTimeout(EventSelector *es,
-		  int fd,
-		  unsigned int flags,
-		  void *data)
+doLoad(EventSelector *es, int fd, int cmd)
 {
+    char ans[1024];
     time_t now = time(NULL);
-    struct timeval t;
+    int msgs_0, msgs_1, msgs_5, msgs_10, worker_0, worker_1, worker_5, worker_10;
+    BIG_INT ms_0, ms_1, ms_5, ms_10;
+    int a0, a1, a5, a10; /* Activations */
+    int r0, r1, r5, r10; /* Reaps */
+    double ams_0, ams_1, ams_5, ams_10;
+    double avg_0, avg_1, avg_5, avg_10;
 
-    /* Kill idle workers which have been idle for maxIdleTime
-       or alive for more than maxLifetime*/
-    Worker *s = Workers[STATE_IDLE];
-    Worker *next;
-    int numAlive = NUM_RUNNING_WORKERS;
+    /* Tricky... get slices of history so as not to overlap */
 
-    /* First pass: Kill workers that have exceeded their
-     * lifetimes */
-    while(s) {
-	next = s->next;
-	if (Settings.maxLifetime > 0 && worker_request_age(s) > Settings.maxLifetime) {
-	    char reason[200];
-	    snprintf(reason, sizeof(reason), "Worker has exceeded maximum lifetime of %d seconds", Settings.maxLifetime);
-	    numAlive--;
-	    killWorker(s, reason);
-	}
-	s = next;
-    }
+    /*                       start     go_back_by  results....                 */
+    get_history_totals(cmd, now,      10,         &msgs_0,  &worker_0,  &ms_0,  &a0,  &r0);
+    get_history_totals(cmd, now-10,   1*60-10,    &msgs_1,  &worker_1,  &ms_1,  &a1,  &r1);
+    get_history_totals(cmd, now-1*60, 5*60-1*60,  &msgs_5,  &worker_5,  &ms_5,  &a5,  &r5);
+    get_history_totals(cmd, now-5*60, 10*60-5*60, &msgs_10, &worker_10, &ms_10, &a10, &r10);
 
-    /* Next pass: Kill workers that have been idle for too long */
-    s = Workers[STATE_IDLE];
-    while(s && numAlive > Settings.minWorkers) {
-	next = s->next;
-	if ((unsigned long) now - (unsigned long) s->idleTime >= Settings.maxIdleTime) {
-	    numAlive--;
-	    killWorker(s, "Idle timeout");
-	}
-	s = next;
-    }
+    /* Accumulate partial sums */
+    msgs_1 += msgs_0;
+    worker_1 += worker_0;
+    ms_1 += ms_0;
+    a1 += a0;
+    r1 += r0;
 
-    /* If there are fewer running workers than Settings.minWorkers,
-       then start some more. */
-    if (numAlive < Settings.minWorkers) {
-	scheduleBringWorkersUpToMin(es);
-    }
+    msgs_5 += msgs_1;
+    worker_5 += worker_1;
+    ms_5 += ms_1;
+    a5 += a1;
+    r5 += r1;
 
-    /* Reschedule timer */
-    t.tv_usec = 0;
-    t.tv_sec = Settings.maxIdleTime;
-    Event_AddTimerHandler(es, t, handleIdleTimeout, NULL);
-}
+    msgs_10 += msgs_5;
+    worker_10 += worker_5;
+    ms_10 += ms_5;
+    a10 += a5;
+    r10 += r5;
 
-/**********************************************************************
-* %FUNCTION: doStatusLog
-* %ARGUMENTS:
-*  es -- event selector
-*  fd, flags, data -- ignored
-* %RETURNS:
-*  Nothing
-* %DESCRIPTION:
-*  Called periodically to log worker status (numRunning, etc.)
-***********************************************************************/
-static void
-doStatusLog(EventSelector *es,
-	    int fd,
-	    unsigned int flags,
-	    void *data)
-{
-    struct timeval t;
+    if (!msgs_0) avg_0 = 1.0;
+    else avg_0 = (double) worker_0 / (double) msgs_0;
 
-    syslog(LOG_INFO,
-	   "Worker status: Stopped=%d Idle=%d Busy=%d Killed=%d Queued=%d Msgs=%d Activations=%u",
-	   WorkerCount[STATE_STOPPED],
-	   WorkerCount[STATE_IDLE],
-	   WorkerCount[STATE_BUSY],
-	   WorkerCount[STATE_KILLED],
-	   NumQueuedRequests,
-	   NumMsgsProcessed,
-	   Activations);
+    if (!msgs_1) avg_1 = 1.0;
+    else avg_1 = (double) worker_1 / (double) msgs_1;
 
-    /* Reschedule timer */
-    t.tv_usec = 0;
-    t.tv_sec = Settings.logStatusInterval;
-    Event_AddTimerHandler(es, t, doStatusLog, NULL);
+    if (!msgs_5) avg_5 = 1.0;
+    else avg_5 = (double) worker_5 / (double) msgs_5;
+
+    if (!msgs_10) avg_10 = 1.0;
+    else avg_10 = (double) worker_10 / (double) msgs_10;
+
+    if (!msgs_0) ams_0 = 0.0;
+    else ams_0 = (double) ms_0 / (double) msgs_0;
+
+    if (!msgs_1) ams_1 = 0.0;
+    else ams_1 = (double) ms_1 / (double) msgs_1;
+
+    if (!msgs_5) ams_5 = 0.0;
+    else ams_5 = (double) ms_5 / (double) msgs_5;
+
+    if (!msgs_10) ams_10 = 0.0;
+    else ams_10 = (double) ms_10 / (double) msgs_10;
+
+    snprintf(ans, sizeof(ans), "%d %d %d %d %f %f %f %f %f %f %f %f %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
+	     msgs_0, msgs_1, msgs_5, msgs_10, avg_0, avg_1, avg_5, avg_10,
+	     ams_0, ams_1, ams_5, ams_10, a0, a1, a5, a10, r0, r1, r5, r10,
+	     WorkerCount[STATE_BUSY] + WorkerCount[STATE_STARTING],
+	     WorkerCount[STATE_IDLE],
+	     WorkerCount[STATE_STOPPED],
+	     WorkerCount[STATE_KILLED],
+	     NumMsgsProcessed, Activations,
+	     Settings.requestQueueSize, NumQueuedRequests,
+	     (int)(now - TimeOfProgramStart));
+    reply_to_mimedefang(es, fd, ans);
 }
 
 /**********************************************************************
-* %FUNCTION: logWorkerReaped
+* %FUNCTION: doHourlyLoad
 * %ARGUMENTS:
-*  s -- worker
-*  status -- termination status
+*  es -- event selector
+*  fd -- socket
+*  cmd -- which command's history we want
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Logs to syslog
+*  Prints a load string back.  This string is a list of numbers:
+*
+*    msgs_1 msgs_4 msgs_12 msgs_24  - #msgs in last N hours
+*    avg_1 avg_4 avg_12 avg_24      - Avg workers/cmd last N hours
+*    ams_1 ams_4 ams_12 ams_24      - Avg ms/cmd last N hours
+*    secs_1 secs_4 secs_12 secs_24  - Total elapsed seconds in output
 ***********************************************************************/
 static void
-logWorkerReaped(Worker *s, int status)
+doHourlyLoad(EventSelector *es, int fd, int cmd)
 {
-    int level;
-    char *extra;
+    int msgs_1, msgs_4, msgs_12, msgs_24;
+    double ams_1, ams_4, ams_12, ams_24;
+    double avg_1, avg_4, avg_12, avg_24;
+    int secs_1, secs_4, secs_12, secs_24;
+    int workers;
+    BIG_INT ms;
 
-    if (s->state == STATE_KILLED) {
-	level = LOG_DEBUG;
-	extra = "";
+    char ans[1024];
+    time_t now = time(NULL);
+
+    get_hourly_history_totals(cmd, now, 1, &msgs_1, &workers, &ms, &secs_1);
+    if (msgs_1) {
+	avg_1 = ((double) workers) / ((double) msgs_1);
+	ams_1 = ((double) ms) / ((double) msgs_1);
     } else {
-	level = LOG_ERR;
-	extra = " (WORKER DIED UNEXPECTEDLY)";
-	if (s->es) {
-	    notify_listeners(s->es, "U\n");
-	}
+	avg_1 = 0.0;
+	ams_1 = 0.0;
     }
-    if (!DOLOG) {
-	return;
+
+    get_hourly_history_totals(cmd, now, 4, &msgs_4, &workers, &ms, &secs_4);
+    if (msgs_4) {
+	avg_4 = ((double) workers) / ((double) msgs_4);
+	ams_4 = ((double) ms) / ((double) msgs_4);
+    } else {
+	avg_4 = 0.0;
+	ams_4 = 0.0;
     }
 
-    if (WIFEXITED(status)) {
-	syslog(level, "Reap: worker %d (pid %lu) exited normally with status %d%s",
-	       WORKERNO(s), (unsigned long) s->pid, WEXITSTATUS(status),
-	       extra);
-	return;
+    get_hourly_history_totals(cmd, now, 12, &msgs_12, &workers, &ms, &secs_12);
+    if (msgs_12) {
+	avg_12 = ((double) workers) / ((double) msgs_12);
+	ams_12 = ((double) ms) / ((double) msgs_12);
+    } else {
+	avg_12 = 0.0;
+	ams_12 = 0.0;
     }
-    if (WIFSIGNALED(status)) {
-	if (s->state == STATE_KILLED && (WTERMSIG(status) == SIGTERM ||
-			  WTERMSIG(status) == SIGKILL)) {
-	    syslog(level, "Reap: worker %d (pid %lu) exited due to SIGTERM/SIGKILL as expected.",
-		   WORKERNO(s), (unsigned long) s->pid);
-	} else {
-	    syslog(level, "Reap: worker %d (pid %lu) exited due to signal %d%s",
-		   WORKERNO(s), (unsigned long) s->pid, WTERMSIG(status),
-		   extra);
-	}
-	return;
+
+    get_hourly_history_totals(cmd, now, 24, &msgs_24, &workers, &ms, &secs_24);
+    if (msgs_24) {
+	avg_24 = ((double) workers) / ((double) msgs_24);
+	ams_24 = ((double) ms) / ((double) msgs_24);
+    } else {
+	avg_24 = 0.0;
+	ams_24 = 0.0;
     }
-    syslog(level, "Reap: worker %d (pid %lu) exited for unknown reason%s",
-	   WORKERNO(s), (unsigned long) s->pid, extra);
+    snprintf(ans, sizeof(ans), "%d %d %d %d %f %f %f %f %f %f %f %f %d %d %d %d\n",
+	     msgs_1, msgs_4, msgs_12, msgs_24,
+	     avg_1, avg_4, avg_12, avg_24,
+	     ams_1, ams_4, ams_12, ams_24,
+	     secs_1, secs_4, secs_12, secs_24);
+    reply_to_mimedefang(es, fd, ans);
 }
 
 /**********************************************************************
-* %FUNCTION: sigterm
+* %FUNCTION: doHistogram
 * %ARGUMENTS:
-*  sig -- signal number
+*  es -- event selector
+*  fd -- socket
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Called when SIGTERM received -- kills workers and exits
+*  Prints the histogram like this:
+*  1 num1
+*  2 num2
+*  .......
+*  N numN
+*
+* Each "numI" is the number of times "I" workers were busy.
 ***********************************************************************/
 static void
-sigterm(int sig)
+doHistogram(EventSelector *es, int fd)
 {
-    int i, j, oneleft;
+  /* Allow 20 bytes/entry - two 9-digit numbers, a space and a carriage-return
+   */
+  int i;
+  size_t roomleft = (size_t) (Settings.maxWorkers * 20);
+  char *ans = malloc(roomleft + 1);
+  char *pos = ans;
 
-    /* Only the parent process should handle SIGTERM */
-    if (ParentPid != getpid()) {
-	syslog(LOG_WARNING, "Child process received SIGTERM before signal disposition could be reset!  Exiting!");
-	exit(EXIT_FAILURE);
-    }
+  if (!ans) {
+    reply_to_mimedefang(es, fd, "error: Out of memory\n");
+    return;
+  }
 
-    if (pidfile) {
-	unlink(pidfile);
-    }
-    if (lockfile) {
-	unlink(lockfile);
-    }
-    if (DOLOG) {
-	if (sig) {
-	    syslog(LOG_INFO, "Received SIGTERM: Stopping workers and terminating");
-	}
-    }
 
-    /* Remove our socket so we don't get any more requests */
-    if (Settings.sockName) {
-	(void) remove(Settings.sockName);
+  for (i=0; i<Settings.maxWorkers; i++) {
+    int count = snprintf(pos, roomleft, "%4d %u\n", i+1,
+			 AllWorkers[i].histo);
+    if (count < 0 || count >= roomleft) {
+      free(ans);
+      reply_to_mimedefang(es, fd, "error: String too long\n");
+      return;
     }
+    pos += count;
+    roomleft -= count;
+  }
+  reply_to_mimedefang_owned(es, fd, ans);
+}
 
-    /* Hack...*/
-    if (Settings.unprivSockName && (Settings.unprivSockName[0] == '/')) {
-	(void) remove(Settings.unprivSockName);
-    }
 
-    /* First, close descriptors to force EOF on STDIN; then wait up to 10
-       seconds before sending SIGTERM */
-    for (i=0; i<Settings.maxWorkers; i++) {
-	if (AllWorkers[i].pid != (pid_t) -1) {
-	    kill(AllWorkers[i].pid, SIGCONT);
-	    close(AllWorkers[i].workerStdin);
-	    AllWorkers[i].workerStdin = -1;
-	}
-    }
+/**********************************************************************
+* %FUNCTION: findFreeWorker
+* %ARGUMENTS:
+*  cmdno -- the command number.  One of: OTHER_CMD, SCAN_CMD,
+*           RELAYOK_CMD, SENDEROK_CMD, or RECIPOK_CMD
+* %RETURNS:
+*  A pointer to a free worker, or NULL if none found.  Prefers to
+*  return a running worker rather than one which needs activation.  Also,
+*  prefers to return the worker which has been running the longest since
+*  activation.  Also prefers to pick a worker that last ran the same
+*  command as cmdno, then one which has not run any command yet.
+* %DESCRIPTION:
+*  Finds a free (preferably running) worker.  Only looks at the top of
+*  each idle bucket, so the cost does not depend on the number of workers.
+***********************************************************************/
+static Worker *
+findFreeWorker(int cmdno)
+{
+    Worker *best = NULL;
+    int b = IDLE_BUCKET(cmdno);
+    int i;
 
-    /* Wait up to 10 seconds for workers to exit; then kill with SIGTERM */
-    for (j=0; j<10; j++) {
-	reapTerminatedWorkers(1);
-	oneleft = 0;
-	for (i=0; i<Settings.maxWorkers; i++) {
-	    if (AllWorkers[i].pid != (pid_t) -1) {
-		oneleft = 1;
-		break;
+    if (b >= 0 && b < NUM_IDLE_BUCKETS && IdleHeapSize[b]) {
+	best = IdleHeap[b][0];
+    } else if (IdleHeapSize[IDLE_BUCKET(NO_CMD)]) {
+	best = IdleHeap[IDLE_BUCKET(NO_CMD)][0];
+    } else {
+	/* Oldest idle worker, whatever it last ran */
+	for (i=0; i<NUM_IDLE_BUCKETS; i++) {
+	    if (IdleHeapSize[i] &&
+		(!best || IdleHeap[i][0]->activated < best->activated)) {
+		best = IdleHeap[i][0];
 	    }
 	}
-	if (!oneleft) {
-#ifdef EMBED_PERL
-  if (Settings.useEmbeddedPerl) {
-    term_embedded_interpreter();
-    deinit_embedded_interpreter();
-  }
-#endif
-	    exit(EXIT_SUCCESS);
-	}
-	if (j != 9) {
-	    sleep(1);
-	}
     }
 
-    syslog(LOG_INFO, "Still some workers alive: Sending SIGTERM");
-    /* Still some workers.  SIGTERM them */
-    for (i=0; i<Settings.maxWorkers; i++) {
-	if (AllWorkers[i].pid != (pid_t) -1) {
-	    kill(AllWorkers[i].pid, SIGCONT);
-	    kill(AllWorkers[i].pid, SIGTERM);
-	}
+    if (!best) {
+	/* No running workers - just pick the first stopped worker */
+	best = Workers[STATE_STOPPED];
     }
-
-    /* Wait up to 10 seconds for workers to exit; then kill with SIGKILL */
-    for (j=0; j<10; j++) {
-	reapTerminatedWorkers(1);
-	oneleft = 0;
-	for (i=0; i<Settings.maxWorkers; i++) {
-	    if (AllWorkers[i].pid != (pid_t) -1) {
-		oneleft = 1;
-		break;
-	    }
-	}
-	if (!oneleft) {
-#ifdef EMBED_PERL
-	    if (Settings.useEmbeddedPerl) {
-                term_embedded_interpreter();
-                deinit_embedded_interpreter();
-            }
-#endif
-	    exit(EXIT_SUCCESS);
-	}
-	if (j != 9) {
-	    sleep(1);
-	}
+    if (best) {
+	best->status_tag[0] = 0;
+	best->cmd = -1;
     }
 
-    syslog(LOG_INFO, "Still some workers alive: Sending SIGKILL");
-    /* Kill with SIGKILL */
-    for (i=0; i<Settings.maxWorkers; i++) {
-	if (AllWorkers[i].pid != (pid_t) -1) {
-	    kill(AllWorkers[i].pid, SIGCONT);
-	    kill(AllWorkers[i].pid, SIGKILL);
-	}
-    }
-#ifdef EMBED_PERL
-    if (Settings.useEmbeddedPerl) {
-        term_embedded_interpreter();
-        deinit_embedded_interpreter();
+    if (Settings.debugWorkerScheduling && best) {
+	syslog(LOG_INFO, "Scheduling %s worker %d for cmdno %d (activated=%d, last=%d)",
+	       state_name(best->state), WORKERNO(best), cmdno, best->activated, best->last_cmd);
     }
-#endif
-    exit(EXIT_SUCCESS);
+    return best;
 }
 
 /**********************************************************************
-* %FUNCTION: statsReopenFile
+* %FUNCTION: log_worker_resource_usage
 * %ARGUMENTS:
-*  None
+*  s -- worker
+*  usage -- struct rusage with worker's resource usage.
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Opens or re-opens statistics file.
+*  Logs worker's resource usage.
 ***********************************************************************/
+#ifdef HAVE_WAIT3
 static void
-statsReopenFile(void)
+log_worker_resource_usage(Worker *s,
+			 struct rusage *usage)
 {
-    if (!Settings.statsFile) return;
-    if (Settings.statsFP) {
-	if (fclose(Settings.statsFP) == EOF) {
-	    syslog(LOG_ERR, "Failed to close stats file: %m");
-	}
-	Settings.statsFP = NULL;
-    }
+    if (!DOLOG) return;
+    syslog(LOG_INFO,
+	   "Worker %d resource usage: req=%d, scans=%d, user=%d.%03d, "
+	   "sys=%d.%03d, nswap=%ld, majflt=%ld, minflt=%ld, "
+	   "maxrss=%ld, bi=%ld, bo=%ld",
+	   WORKERNO(s),
+	   s->numRequests,
+	   s->numScans,
+	   (int) usage->ru_utime.tv_sec,
+	   (int) usage->ru_utime.tv_usec / 1000,
+	   (int) usage->ru_stime.tv_sec,
+	   (int) usage->ru_stime.tv_usec / 1000,
+	   usage->ru_nswap,
+	   usage->ru_majflt,
+	   usage->ru_minflt,
+	   usage->ru_maxrss,
+	   usage->ru_inblock,
+	   usage->ru_oublock);
+}
+#endif
 
-    Settings.statsFP = fopen(Settings.statsFile, "a");
-    if (!Settings.statsFP) {
-	syslog(LOG_ERR, "Could not open stats file %s: %m",
-	       Settings.statsFile);
-    } else {
-	if(set_cloexec(fileno(Settings.statsFP)) < 0) {
-	    syslog(LOG_ERR, "Could not set FD_CLOEXEC option on socket");
-	}
+static void handleMapAccept(EventSelector *es, int fd);
+static void got_map_request(EventSelector *es, int fd,
+			    char *buf, int len, int flag, void *data);
+
+static void
+handle_worker_received_map_command(EventSelector *es,
+				  int fd,
+				  char *buf,
+				  int len,
+				  int flag,
+				  void *data);
+
+static void
+receive_worker_map_answer(EventSelector *es,
+			 int fd,
+			 char *buf,
+			 int len,
+			 int flag,
+			 void *data);
+
+static void
+sent_map_reply(EventSelector *es,
+	       int fd,
+	       char *buf,
+	       int len,
+	       int flag,
+	       void *data)
+{
+    if (!EventTcp_ReadNetstring(es, fd, got_map_request, 0, NULL)) {
+	syslog(LOG_ERR, "sent_map_reply: EventTcp_ReadNetstring failed: %m");
+	close(fd);
     }
 }
-
 /**********************************************************************
-* %FUNCTION: statsLog
+* %FUNCTION: reply_to_map_with_len
 * %ARGUMENTS:
-*  event -- name of event to put in log
-*  workerno -- worker involved in this event, or -1 if not worker-specific
-*  fmt   -- "printf" format string with extra args to add to line
+*  es -- event selector
+*  fd -- file descriptor
+*  msg -- message to send back
+*  len -- length of message
 * %RETURNS:
-*  Nothing
+*  The event associated with the reply, or NULL.
 * %DESCRIPTION:
-*  Logs an event to the stats file
+*  Sends a final message back to map.
 ***********************************************************************/
-static void
-statsLog(char const *event, int workerno, char const *fmt, ...)
+static EventTcpState *
+reply_to_map_with_len(EventSelector *es,
+			     int fd,
+			     char const *msg,
+			     int len)
 {
-    struct timeval now;
-    time_t tnow;
-    struct tm *t;
-    char tbuf[64];
-    char statbuf[1024];
-    va_list ap;
-    int ms;
-
-    if (!Settings.statsFP && !Settings.statsToSyslog) return;
-
-    gettimeofday(&now, NULL);
-    tnow = (time_t) now.tv_sec;
-    t = localtime(&tnow);
-    ms = now.tv_usec / 1000;
-
-    strftime(tbuf, sizeof(tbuf), "%d/%m/%Y:%H:%M:%S", t);
-    snprintf(statbuf, sizeof(statbuf),
-	     "%s %lu.%03d %s worker=%d nworkers=%d nbusy=%d",
-	     tbuf, (unsigned long) tnow, ms, event, workerno,
-	     NUM_RUNNING_WORKERS, WorkerCount[STATE_BUSY]);
-
-    statbuf[sizeof(statbuf)-1] = 0;
-
-    if (fmt) {
-	int len = strlen(statbuf);
-	statbuf[len] = ' ';
-	va_start(ap, fmt);
-	vsnprintf(statbuf+len+1, sizeof(statbuf)-len-1, fmt, ap);
-	va_end(ap);
-	statbuf[sizeof(statbuf)-1] = 0;
-    }
-
-    if (Settings.statsFP) {
-	fprintf(Settings.statsFP, "%s\n", statbuf);
-	if (Settings.flushStats) fflush(Settings.statsFP);
-    }
-    if (Settings.statsToSyslog) {
-	/* Chop off the date, because it's redundant.  The date is
-	   always "dd/mm/YYYY:hh:mm:ss " = 20 characters long. */
-	syslog(LOG_INFO, "stats %s", statbuf + 20);
+    EventTcpState *e;
+    e = EventTcp_WriteNetstring(es, fd, msg, len, sent_map_reply,
+				Settings.clientTimeout, NULL);
+    if (!e) {
+	if (DOLOG) {
+	    syslog(LOG_ERR, "reply_to_map: EventTcp_WriteBuf failed: %m");
+	}
+	close(fd);
     }
+    return e;
 }
 
 /**********************************************************************
-* %FUNCTION: newGeneration
+* %FUNCTION: reply_to_map
 * %ARGUMENTS:
-*  None
+*  es -- event selector
+*  fd -- file descriptor
+*  msg -- message to send back
 * %RETURNS:
-*  Nothing
+*  The event associated with the reply, or NULL.
 * %DESCRIPTION:
-*  Kills all running-but-idle workers and increments Generation.  This
-*  causes running-but-busy workers to terminate at the earliest opportunity.
-*  Use this if you change the filter file and want to restart the workers.
+*  Sends a final message back to map.
 ***********************************************************************/
-static void
-newGeneration(void)
+static EventTcpState *
+reply_to_map(EventSelector *es,
+		    int fd,
+		    char const *msg)
 {
-    Generation++;
-#ifdef EMBED_PERL
-    if (Settings.useEmbeddedPerl) {
-	if (make_embedded_interpreter(Settings.progPath,
-				      Settings.subFilter,
-				      Settings.wantStatusReports, Env) < 0) {
-	    syslog(LOG_ERR, "Error creating embedded Perl interpreter: Reverting to non-embedded interpreter!");
-	    Settings.useEmbeddedPerl = 0;
-	} else {
-	    if (DOLOG) {
-		syslog(LOG_INFO, "Re-initialized embedded Perl interpreter");
-	    }
-	}
-    }
-#endif
-
-    /* Reset SIGCHLD handler in case some Perl code has monkeyed with it */
-    set_sigchld_handler();
-
-    while(Workers[STATE_IDLE]) {
-	killWorker(Workers[STATE_IDLE],
-		  "Forcing reread of filter rules");
-    }
+    return reply_to_map_with_len(es, fd, msg, strlen(msg));
 }
 
 /**********************************************************************
-* %FUNCTION: handleAutoscale
+* %FUNCTION: handleMapAccept
 * %ARGUMENTS:
 *  es -- event selector
-*  fd, flags, data -- ignored
+*  fd -- accepted connection
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Called periodically when autoscaling is enabled (-k flag).
-*  Uses an exponential moving average (EMA) of the busy-worker ratio
-*  to make scale-out and scale-in decisions with AIMD-style cooldowns.
-*  Scale out when the EMA exceeds scaleOutBusyRatio; scale in when it
-*  falls below scaleInBusyRatio and both cooldown timers have elapsed.
+*  Handles a connection attempt for TCP map.  Sets up to read requests.
 ***********************************************************************/
 static void
-handleAutoscale(EventSelector *es,
-		int fd,
-		unsigned int flags,
-		void *data)
+handleMapAccept(EventSelector *es,
+		int fd)
 {
-    time_t now    = time(NULL);
-    struct timeval t;
-    int nRunning  = NUM_RUNNING_WORKERS;
-    int nBusy     = WorkerCount[STATE_BUSY];
-    double rawBusy = (nRunning > 0) ? (double)nBusy / nRunning : 0.0;
-    char reason[128];
-    Worker *s;
-
-    /* Update exponential moving average of busy ratio */
-    EMABusyRatio = EMABusyRatio * (1.0 - Settings.emaAlpha)
-                 + rawBusy      *        Settings.emaAlpha;
-
-    /* Scale OUT: pool is saturated */
-    if (EMABusyRatio > Settings.scaleOutBusyRatio
-	    && nRunning < Settings.maxWorkers
-	    && (now - LastScaleOut) > (time_t)Settings.scaleOutCooldown) {
-	s = Workers[STATE_STOPPED];
-	if (s) {
-	    snprintf(reason, sizeof(reason),
-		     "Autoscale: scale-out (ema_busy=%.2f)", EMABusyRatio);
-	    activateWorker(s, reason);
-	    /* LastScaleOut is updated and the scale-out is logged by
-	     * activateWorker() itself for every STOPPED->running
-	     * transition.  No duplicate bookkeeping needed here. */
-	}
-    }
-    /* Scale IN: pool is under-utilised */
-    else if (EMABusyRatio < Settings.scaleInBusyRatio
-	     && nRunning  > Settings.minWorkers
-	     && (now - LastScaleIn)  > (time_t)Settings.scaleInCooldown
-	     && (now - LastScaleOut) > (time_t)Settings.scaleInCooldown) {
-	s = Workers[STATE_IDLE];
-	if (s) {
-	    snprintf(reason, sizeof(reason),
-		     "Autoscale: scale-in (ema_busy=%.2f)", EMABusyRatio);
-	    killWorker(s, reason);
-	    LastScaleIn = now;
-	    syslog(LOG_INFO,
-		   "Autoscale: scaled in to %d workers (ema_busy=%.2f)",
-		   NUM_RUNNING_WORKERS, EMABusyRatio);
-	}
+    if (!EventTcp_ReadNetstring(es, fd, got_map_request, 0, NULL)) {
+	syslog(LOG_ERR, "handleMapAccept: EventTcp_ReadNetstring failed: %m");
+	close(fd);
     }
-
-    /* Reschedule */
-    t.tv_usec = 0;
-    t.tv_sec  = Settings.autoscaleInterval;
-    Event_AddTimerHandler(es, t, handleAutoscale, NULL);
 }
 
 /**********************************************************************
-* %FUNCTION: bringWorkersUpToMin
+* %FUNCTION: got_request
 * %ARGUMENTS:
 *  es -- event selector
-*  fd, flags, data -- ignored
+*  fd -- connection from Sendmail map reader
+*  buf -- map request
+*  len -- length of map request
+*  flag -- flag from reader
+*  data -- ignored
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  If there are fewer than minWorkers running, start one.  If still fewer,
-*  schedule self to re-run in slewTime seconds.
+*  Handles a received map command.
 ***********************************************************************/
-void
-bringWorkersUpToMin(EventSelector *es,
-		   int fd,
-		   unsigned int flags,
-		   void *data)
+static void
+got_map_request(EventSelector *es,
+	    int fd,
+	    char *buf,
+	    int len,
+	    int flag,
+	    void *data)
 {
-    Worker *s;
-    char reason[200];
-
-    minScheduled = 0;
+    char *cmd, *oldcmd;
+    char *t;
 
-    if (NUM_RUNNING_WORKERS >= Settings.minWorkers) {
-	/* Enough workers, so do nothing */
+    if (flag == EVENT_TCP_FLAG_TIMEOUT ||
+	flag == EVENT_TCP_FLAG_IOERROR ||
+	flag == EVENT_TCP_FLAG_EOF) {
+	close(fd);
 	return;
     }
 
-    /* Start a worker */
-    s = Workers[STATE_STOPPED];
-    if (s) {
-	snprintf(reason, sizeof(reason),
-		 "Bringing workers up to minWorkers (%d)", Settings.minWorkers);
-	if (activateWorker(s, reason) >= 0) {
-	    /* Check for and handle queued requests, if there are any */
-	    /* FOR THE FUTURE
-	    handle_queued_request();
-	    */
-	}
+    /* Chop off comma */
+    if (len && buf[len-1] == ',') {
+	buf[len-1] = 0;
+	len--;
+    } else {
+	reply_to_map(es, fd, "PERM Netstring missing terminating comma");
+	return;
     }
 
+    /* Convert the command to something we can use */
+    cmd = malloc(len*3+1 + 4 + 3);
 
-    /* Reschedule if necessary */
-    if (NUM_RUNNING_WORKERS < Settings.minWorkers) {
-	scheduleBringWorkersUpToMin(es);
+    if (!cmd) {
+	reply_to_map(es, fd, "TEMP Out of memory");
+	return;
     }
-}
 
-/**********************************************************************
-* %FUNCTION: scheduleBringWorkersUpToMin
-* %ARGUMENTS:
-*  es -- event selector
-* %RETURNS:
-*  Nothing
-* %DESCRIPTION:
-*  Schedules a call to bringWorkersUpToMin in slewTime seconds from now.
-***********************************************************************/
-static void
-scheduleBringWorkersUpToMin(EventSelector *es)
-{
-    struct timeval t;
+    t = buf;
+    while(*t && (*t != ' ')) t++;
+    if (*t != ' ') {
+	free(cmd);
+	reply_to_map(es, fd, "PERM Invalid request format");
+	return;
+    }
 
-    /* Do nothing if already scheduled */
-    if (minScheduled) return;
+    *t = 0;
+    oldcmd = cmd;
+    strcpy(cmd, "map ");
+    cmd += 4;
+    cmd += percent_encode(buf, cmd, len*3+1);
+    *cmd++ = ' ';
+    cmd += percent_encode(t+1, cmd, len*3+1+4 - (cmd - oldcmd));
+    *cmd++ = '\n';
+    *cmd = 0;
+    cmd = oldcmd;
 
-    minScheduled = 1;
-    t.tv_usec = 0;
-    t.tv_sec = Settings.slewTime;
-    Event_AddTimerHandler(es, t, bringWorkersUpToMin, NULL);
+    doMapRequest(es, fd, cmd, 1);
 }
 
-#ifdef HAVE_SETRLIMIT
 /**********************************************************************
-* %FUNCTION: limit_mem_usage
+* %FUNCTION: doMapRequest
 * %ARGUMENTS:
-*  rss -- maximum resident-set size in kB
-*  as  -- maximum total address space in kB
+*  es -- event selector
+*  fd -- map client socket
+*  cmd -- malloc'd "map" command for the worker; freed by this function
+*  queueable -- if true, queue the request if no worker is free
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Calls setrlimit to limit resource usage
+*  Hands a map request to a free worker.
 ***********************************************************************/
 static void
-limit_mem_usage(unsigned long rss,
-		unsigned long as)
+doMapRequest(EventSelector *es, int fd, char *cmd, int queueable)
 {
-    int n;
-    struct rlimit lim;
+    Worker *s;
 
-#ifdef RLIMIT_RSS
-    if (rss) {
-	/* Convert kb to bytes */
-	rss *= 1024;
-	lim.rlim_cur = rss;
-	lim.rlim_max = rss;
-	n = setrlimit(RLIMIT_RSS, &lim);
-	if (n < 0) {
-	    syslog(LOG_WARNING, "setrlimit(RLIMIT_RSS, %lu) failed: %m",
-		   rss);
+    /* Send the request to a worker */
+    s = findAdmittedWorker(OTHER_CMD, NULL);
+    if (!s) {
+	if (queueable && Settings.requestQueueSize > 0 &&
+	    queue_request(es, fd, cmd, 1, NULL, NULL)) {
+	    free(cmd);
+	    return;
 	}
+	free(cmd);
+	Rejections++;
+	reply_to_map(es, fd, "TEMP No free workers");
+	return;
     }
-#endif
-    if (as) {
-	/* Convert kb to bytes */
-	as *= 1024;
-	lim.rlim_cur = as;
-	lim.rlim_max = as;
-#ifdef RLIMIT_AS
-	n = setrlimit(RLIMIT_AS, &lim);
-	if (n < 0) {
-	    syslog(LOG_WARNING, "setrlimit(RLIMIT_AS, %lu) failed: %m",
-		   as);
-	}
-#endif
+    if (queueWhileStarting(es, fd, cmd, 1, s, queueable)) {
+	free(cmd);
+	return;
+    }
+    if (activateWorker(s, "About to handle map request") == (pid_t) -1) {
+	free(cmd);
+	Rejections++;
+	syslog(LOG_WARNING, "map command failed: No free workers");
+	reply_to_map(es, fd, "TEMP Unable to activate worker");
+	return;
+    }
+    putOnList(s, STATE_BUSY);
+    s->clientFD = fd;
+    s->workdir[0] = 0;
+    set_worker_status_from_command(s, cmd);
+    gettimeofday(&(s->start_cmd), NULL);
+    s->queueWaitUs = DispatchWaitUs;
+    s->event = EventTcp_WriteBufOwned(es, s->workerStdin, cmd, strlen(cmd),
+				      handle_worker_received_map_command,
+				      Settings.clientTimeout, s);
+    if (!s->event) {
+	if (DOLOG) syslog(LOG_ERR, "got_map_request: EventTcp_WriteBuf failed: %m");
+	s->clientFD = -1; /* Do not close FD */
+	killWorker(s, "EventTcp_WriteBuf failed");
+	reply_to_map(es, fd, "TEMP Could not send command to worker");
+    }
+}
 
-#ifdef RLIMIT_DATA
-	n = setrlimit(RLIMIT_DATA, &lim);
-	if (n < 0) {
-	    syslog(LOG_WARNING, "setrlimit(RLIMIT_DATA, %lu) failed: %m",
-		   as);
-	}
-#endif
+static void
+handle_worker_received_map_command(EventSelector *es,
+				  int fd,
+				  char *buf,
+				  int len,
+				  int flag,
+				  void *data)
+{
+    Worker *s = (Worker *) data;
+
+    /* Event was triggered */
+    s->event = NULL;
+
+    if (flag == EVENT_TCP_FLAG_TIMEOUT || flag == EVENT_TCP_FLAG_IOERROR) {
+	reply_to_map(es, s->clientFD, "TEMP Error talking to worker process");
+
+	s->clientFD = -1;
+	/* Kill the worker process */
+	killWorker(s, "Error talking to worker process");
+	return;
+    }
+
+    /* Worker has been given the command; now wait for it to reply */
+    s->event = EventTcp_ReadBuf(es, s->workerStdout, MAX_CMD_LEN, '\n',
+				receive_worker_map_answer,
+				Settings.busyTimeout, 1, s);
+    if (!s->event) {
+	if (DOLOG) syslog(LOG_ERR, "handleWorkerReceivedCommand: EventTcp_ReadBuf failed: %m");
+	reply_to_map(es, s->clientFD, "TEMP Error talking to worker process");
+	s->clientFD = -1;
 
+	killWorker(s, "EventTcp_ReadBuf failed");
     }
 }
-#endif /* HAVE_SETRLIMIT */
 
-/**********************************************************************
-* %FUNCTION: doWorkerReport
-* %ARGUMENTS:
-*  es -- event selector
-*  fd -- socket
-*  only_busy -- if true, only report on busy workers
-* %RETURNS:
-*  Nothing
-* %DESCRIPTION:
-*  Prints a list of workers, statuses and pids
-***********************************************************************/
 static void
-doWorkerReport(EventSelector *es, int fd, int only_busy)
+receive_worker_map_answer(EventSelector *es,
+			 int fd,
+			 char *buf,
+			 int len,
+			 int flag,
+			 void *data)
 {
-    int len = Settings.maxWorkers * (33 + MAX_STATUS_LEN + 2 + 32) + 1;
-    char *ans = malloc(len);
-    char *ptr = ans;
-    char status = '?';
-    int i, j;
-    time_t now;
-    int secs;
-    if (!ans) {
-	reply_to_mimedefang(es, fd, "error: Out of memory\n");
+    Worker *s = (Worker *) data;
+    struct timeval now;
+    s->event = NULL;
+
+    if (!len || (flag == EVENT_TCP_FLAG_TIMEOUT)) {
+	KindFailures[QUEUE_KIND_MAP]++;
+	reply_to_map(es, s->clientFD, "TEMP Busy timeout on worker");
+	s->clientFD = -1;
+	killWorker(s, "Busy timeout");
 	return;
     }
-    *ans = 0;
-    now = time(NULL);
-
-    for (i=0; i<Settings.maxWorkers; i++) {
-	Worker *s = &AllWorkers[i];
-	if (only_busy && (s->state != STATE_BUSY)) {
-	    continue;
-	}
-	switch (s->state) {
-	case STATE_STOPPED: status = 'S'; break;
-	case STATE_IDLE:    status = 'I'; break;
-	case STATE_BUSY:    status = 'B'; break;
-	case STATE_KILLED:  status = 'K'; break;
-	}
-	j = snprintf(ptr, len, "%d %c", i, status);
-	len -= j;
-	ptr += j;
-	if (s->state != STATE_STOPPED) {
-	    j = snprintf(ptr, len, " %lu", (unsigned long) s->pid);
-	    len -= j;
-	    ptr += j;
-	}
-	if (s->state == STATE_BUSY && s->cmd >= 0 && s->cmd < NUM_CMDS) {
-	    j = snprintf(ptr, len, " %s", CmdName[s->cmd]);
-	    len -= j;
-	    ptr += j;
-	}
 
-	if (s->last_cmd >= 0 && s->last_cmd < NUM_CMDS) {
-	    j = snprintf(ptr, len, " last=%s", CmdName[s->last_cmd]);
-	    len -= j;
-	    ptr += j;
-	}
+    gettimeofday(&now, NULL);
+    record_latency(QUEUE_KIND_MAP, s->queueWaitUs,
+		   (now.tv_sec - s->start_cmd.tv_sec) * 1000000L +
+		   (now.tv_usec - s->start_cmd.tv_usec));
 
-	secs = (int) (now - s->lastStateChange);
-	j = snprintf(ptr, len, " ago=%d", secs);
-	len -= j;
-	ptr += j;
-	if (s->status_tag[0]) {
-	    j = snprintf(ptr, len, " (%s)", s->status_tag);
-	    len -= j;
-	    ptr += j;
-	}
-	j = snprintf(ptr, len, "\n");
-	len -= j;
-	ptr += j;
+    /* Remove newline at end */
+    if (buf[len-1] == '\n') {
+	buf[len-1] = 0;
     }
-    reply_to_mimedefang(es, fd, ans);
-    free(ans);
+
+    /* Send the answer back */
+    percent_decode(buf);
+    reply_to_map(es, s->clientFD, buf);
+
+    s->clientFD = -1;
+    s->numRequests++;
+    putOnList(s, STATE_IDLE);
+    s->idleTime = time(NULL);
+    checkWorkerForExpiry(s);
 }
 
+
 /**********************************************************************
-* %FUNCTION: doStatus
+* %FUNCTION: parse_queue_classes
 * %ARGUMENTS:
-*  es -- event selector
-*  fd -- socket
+*  spec -- comma-separated list of kind=class pairs, where kind is one
+*          of scan, relayok, senderok, recipok, other or map
 * %RETURNS:
-*  Nothing
+*  0 on success, -1 if spec is invalid.
 * %DESCRIPTION:
-*  Prints a status string back.  Each char corresponds to a worker;
-*  the chars are:
-*  S -- worker is stopped
-*  I -- worker is idle
-*  B -- worker is busy
-*  K -- worker is killed but not yet reaped.
+*  Sets the priority class used when queueing each kind of request.
 ***********************************************************************/
-static void
-doStatus(EventSelector *es, int fd)
+static int
+parse_queue_classes(char const *spec)
 {
-    char *ans = malloc(Settings.maxWorkers + 2 + 300);
-    int i;
-
-    if (!ans) {
-	reply_to_mimedefang(es, fd, "error: Out of memory\n");
-	return;
-    }
+    char const *p = spec;
+    int kind, cls, n;
 
-    for (i=0; i < Settings.maxWorkers; i++) {
-	Worker *s = &AllWorkers[i];
-	switch (s->state) {
-	case STATE_STOPPED: ans[i] = 'S'; break;
-	case STATE_IDLE:    ans[i] = 'I'; break;
-	case STATE_BUSY:    ans[i] = 'B'; break;
-	case STATE_KILLED:  ans[i] = 'K'; break;
-	default:            ans[i] = '?';
+    while (*p) {
+	for (kind=0; kind<NUM_QUEUE_KINDS; kind++) {
+	    n = strlen(QueueKindName[kind]);
+	    if (!strncmp(p, QueueKindName[kind], n) && p[n] == '=') break;
 	}
+	if (kind == NUM_QUEUE_KINDS) return -1;
+	p += n+1;
+	if (*p < '0' || *p >= '0' + NUM_QUEUE_CLASSES) return -1;
+	cls = *p++ - '0';
+	if (*p && *p != ',') return -1;
+	if (*p) p++;
+	QueueClass[kind] = cls;
     }
-    sprintf(ans + Settings.maxWorkers, " %d %d %d %d %d\n", NumMsgsProcessed, Activations, Settings.requestQueueSize, NumQueuedRequests, (int) (time(NULL) - TimeOfProgramStart));
-    reply_to_mimedefang(es, fd, ans);
-    free(ans);
+    return 0;
 }
 
 /**********************************************************************
-* %FUNCTION: doAutoscaleStatus
+* %FUNCTION: parse_autoscale_modes
 * %ARGUMENTS:
-*  es -- event selector
-*  fd -- socket
+*  spec -- comma-separated list of "predict", "dryrun", "lead=minutes"
+*          and "signal=threshold" items
 * %RETURNS:
-*  Nothing
-* %DESCRIPTION:
-*  Prints current autoscaling configuration and runtime state.
-***********************************************************************/
-static void
-doAutoscaleStatus(EventSelector *es, int fd)
-{
-    char ans[256];
-    snprintf(ans, sizeof(ans),
-             "enabled=%d interval=%d ema_busy=%.4f scale_out=%.2f scale_in=%.2f out_cool=%d in_cool=%d ema_alpha=%.4f\n",
-             Settings.autoscaling,
-             Settings.autoscaleInterval,
-             EMABusyRatio,
-             Settings.scaleOutBusyRatio,
-             Settings.scaleInBusyRatio,
-             Settings.scaleOutCooldown,
-             Settings.scaleInCooldown,
-             Settings.emaAlpha);
-    reply_to_mimedefang(es, fd, ans);
+*  0 on success, -1 if spec is invalid.
+* %DESCRIPTION:
+*  Sets the autoscaling modes and thresholds given with -K.
+***********************************************************************/
+static int
+parse_autoscale_modes(char const *spec)
+{
+    static struct {
+	char const *name;
+	int *value;
+    } const thresholds[] = {
+	{"queued=",  &Settings.scaleOutQueued},
+	{"rejects=", &Settings.scaleOutRejections},
+	{"outwait=", &Settings.scaleOutQueueWaitMs},
+	{"inwait=",  &Settings.scaleInQueueWaitMs},
+	{NULL, NULL}
+    };
+    char const *p = spec;
+    int lead, n, i, v;
+
+    while (*p) {
+	if (!strncmp(p, "predict", 7) && (!p[7] || p[7] == ',')) {
+	    Settings.predictive = 1;
+	    p += 7;
+	} else if (!strncmp(p, "dryrun", 6) && (!p[6] || p[6] == ',')) {
+	    Settings.autoscaleDryRun = 1;
+	    p += 6;
+	} else if (sscanf(p, "lead=%d%n", &lead, &n) == 1 &&
+		   lead >= 0 && lead <= 60 && (!p[n] || p[n] == ',')) {
+	    Settings.predictLead = lead * 60;
+	    p += n;
+	} else {
+	    for (i=0; thresholds[i].name; i++) {
+		size_t l = strlen(thresholds[i].name);
+		if (strncmp(p, thresholds[i].name, l)) continue;
+		if (sscanf(p+l, "%d%n", &v, &n) != 1 || v < 0 ||
+		    (p[l+n] && p[l+n] != ',')) {
+		    return -1;
+		}
+		*thresholds[i].value = v;
+		p += l+n;
+		break;
+	    }
+	    if (!thresholds[i].name) return -1;
+	}
+	if (*p) p++;
+    }
+    return 0;
 }
 
 /**********************************************************************
-* %FUNCTION: doHelp
+* %FUNCTION: enqueue_request
 * %ARGUMENTS:
-*  es -- event selector
-*  fd -- socket
-*  unpriv -- true on unprivileged socket; print raw help
+*  slot -- a request slot
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Prints a help string listing commands the multiplexor accepts.
+*  Appends slot to its domain's queue if it has one, otherwise to the
+*  queue for its priority class.
 ***********************************************************************/
 static void
-doHelp(EventSelector *es, int fd, int unpriv)
+enqueue_request(Request *slot)
 {
-    if (unpriv) {
-	reply_to_mimedefang(es, fd,
-	"help             -- List available multiplexor commands\n"
-	"free             -- Display number of free workers\n"
-	"load             -- Display worker load (scans)\n"
-	"rawload          -- Display worker load in computer-readable format\n"
-	"load1 secs       -- Display worker load in alternate format\n"
-	"jsonload1 secs   -- Display worker load in JSON format\n"
-	"rawload1 secs    -- Display worker load in computer-readable alternate format\n"
-	"load-relayok     -- Display load (relayok requests)\n"
-	"rawload-relayok  -- Computer-readable load (relayok requests)\n"
-	"load-senderok    -- Display load (senderok requests)\n"
-	"rawload-senderok -- Computer-readable load (senderok requests)\n"
-	"load-recipok     -- Display load (recipok requests)\n"
-	"rawload-recipok  -- Computer-readable load (recipok requests)\n"
-	"status           -- Display worker status\n"
-	"jsonstatus       -- Display worker status in JSON format\n"
-	"rawstatus        -- Display worker status in computer-readable format\n"
-	"barstatus        -- Display worker status as bar graph\n"
-	"histo            -- Display histogram of busy workers\n"
-	"msgs             -- Display number of messages processed since startup\n"
-	"workers          -- Display workers with process-IDs\n"
-	"busyworkers      -- Display busy workers with process-IDs\n"
-        "workerinfo n     -- Display information about a particular worker\n"
-	"autoscale        -- Display autoscaling configuration and runtime state\n"
-	"(Analogous hload commands provide hourly information)\n");
+    DomainCount *d = slot->domain;
+    Request **head, **tail;
+
+    NumQueuedRequests++;
+    if (slot->lease) NumQueuedLeased++;
+    publishGauge();
+    if (d) {
+	/* Waits on its domain's queue, not the main one */
+	head = &d->waitHead;
+	tail = &d->waitTail;
+	d->numWaiting++;
     } else {
-	reply_to_mimedefang(es, fd,
-	"help             -- List available multiplexor commands\n"
-	"status           -- Display worker status\n"
-	"jsonstatus       -- Display worker status in JSON format\n"
-	"rawstatus        -- Display worker status in computer-readable format\n"
-	"barstatus        -- Display worker status as bar graph\n"
-	"free             -- Display number of free workers\n"
-	"load             -- Display worker load (scans)\n"
-	"rawload          -- Display worker load in computer-readable format\n"
-	"load1 secs       -- Display worker load in alternate format\n"
-	"jsonload1 secs   -- Display worker load in JSON format\n"
-	"rawload1 secs    -- Display worker load in alternate format\n"
-	"load-relayok     -- Display load (relayok requests)\n"
-	"rawload-relayok  -- Computer-readable load (relayok requests)\n"
-	"load-senderok    -- Display load (senderok requests)\n"
-	"rawload-senderok -- Computer-readable load (senderok requests)\n"
-	"load-recipok     -- Display load (recipok requests)\n"
-	"rawload-recipok  -- Computer-readable load (recipok requests)\n"
-	"histo            -- Display histogram of busy workers\n"
-	"msgs             -- Display number of messages processed since startup\n"
-	"reread           -- Force a re-read of filter rules\n"
-	"workers          -- Display workers with process-IDs\n"
-	"busyworkers      -- Display busy workers with process-IDs\n"
-	"workerinfo n     -- Display information about a particular worker\n"
-	"autoscale        -- Display autoscaling configuration and runtime state\n"
-	"scan /path       -- Run a scan (do not invoke using md-mx-ctrl)\n"
-	"(Analogous hload commands provide hourly information)\n");
+	head = &RequestHead[slot->cls];
+	tail = &RequestTail[slot->cls];
+	ClassStats[slot->cls].depth++;
+    }
+    slot->next = NULL;
+    slot->prev = *tail;
+    if (*tail) {
+	(*tail)->next = slot;
+    } else {
+	*head = slot;
     }
+    *tail = slot;
 }
 
+/**********************************************************************
+* %FUNCTION: dequeue_request
+* %ARGUMENTS:
+*  slot -- a queued request
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Unlinks slot from whichever queue it is on.
+***********************************************************************/
 static void
-doLoad1(EventSelector *es, int fd, int back)
+dequeue_request(Request *slot)
 {
-    char ans[1024];
-    int msgs[NUM_CMDS], workers[NUM_CMDS], activated, reaped;
-    BIG_INT ms[NUM_CMDS];
-    double avg[NUM_CMDS], ams[NUM_CMDS];
-    int counts[NUM_CMDS];
-    int cmd;
-    time_t now = time(NULL);
-    Worker *s;
+    DomainCount *d = slot->domain;
+    Request **head, **tail;
 
-    for (cmd=MIN_CMD; cmd <= MAX_CMD; cmd++) {
-	get_history_totals(cmd, now, back, &msgs[cmd], &workers[cmd], &ms[cmd], &activated, &reaped);
-	if (msgs[cmd]) {
-	    avg[cmd] = (double) workers[cmd] / (double) msgs[cmd];
-	    ams[cmd] = (double) ms[cmd]     / (double) msgs[cmd];
-	} else {
-	    avg[cmd] = 0.0;
-	    ams[cmd] = 0.0;
-	}
+    NumQueuedRequests--;
+    if (slot->lease) NumQueuedLeased--;
+    publishGauge();
+    if (d) {
+	head = &d->waitHead;
+	tail = &d->waitTail;
+    } else {
+	head = &RequestHead[slot->cls];
+	tail = &RequestTail[slot->cls];
+	ClassStats[slot->cls].depth--;
     }
-    memset(counts, 0, sizeof(counts));
-    s = Workers[STATE_BUSY];
-    while(s) {
-	if (s->cmd >= MIN_CMD && s->cmd <= MAX_CMD) {
-	    counts[s->cmd]++;
-	}
-	s = s->next;
+    if (slot->prev) {
+	slot->prev->next = slot->next;
+    } else {
+	*head = slot->next;
+    }
+    if (slot->next) {
+	slot->next->prev = slot->prev;
+    } else {
+	*tail = slot->prev;
     }
+    slot->next = NULL;
+    slot->prev = NULL;
 
-    snprintf(ans, sizeof(ans), "%d %f %f %d %f %f %d %f %f %d %f %f %d %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
-	     msgs[SCAN_CMD],     avg[SCAN_CMD],     ams[SCAN_CMD],
-	     msgs[RELAYOK_CMD],  avg[RELAYOK_CMD],  ams[RELAYOK_CMD],
-	     msgs[SENDEROK_CMD], avg[SENDEROK_CMD], ams[SENDEROK_CMD],
-	     msgs[RECIPOK_CMD],  avg[RECIPOK_CMD],  ams[RECIPOK_CMD],
-	     WorkerCount[STATE_BUSY], WorkerCount[STATE_IDLE],
-	     WorkerCount[STATE_STOPPED], WorkerCount[STATE_KILLED],
-	     NumMsgsProcessed, Activations,
-	     Settings.requestQueueSize, NumQueuedRequests,
-	     (int)(now - TimeOfProgramStart), back,
-	     counts[SCAN_CMD], counts[RELAYOK_CMD], counts[SENDEROK_CMD], counts[RECIPOK_CMD]);
-    reply_to_mimedefang(es, fd, ans);
+    if (d) {
+	slot->domain = NULL;
+	d->numWaiting--;
+	if (!d->numWaiting && d->ready) {
+	    setDomainReady(d, 0);
+	}
+	freeDomainCountIfUnused(d);
+    }
 }
 
 /**********************************************************************
-* %FUNCTION: doLoad
+* %FUNCTION: release_request
 * %ARGUMENTS:
-*  es -- event selector
-*  fd -- socket
-*  cmd -- which command's history we want
+*  slot -- a request slot which has been dequeued
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Prints a load string back.  This string is a list of numbers:
-*
-*    msgs_0 msgs_1 msgs_5 msgs_10
-*    avg_0 avg_1 avg_5 avg_10
-*    ams_0 ams_1 ams_5 ams_10
-*    a0 a1 a5 a10
-*    r0 r1 r5 r10
-*    busy idle stopped killed
-*    msgs_processed total_activations
-*    request_queue_size num_queued_requests seconds_since_program_start
-*
-*    Note for below:  If N=0, then time frame is last 10 seconds.
-*    msgs_N -- Number of messages processed in last N minutes.
-*    avg_N  -- Average number of busy workers when msg processed
-*    ams_N  -- Average scan time in milliseconds
-*    aN     -- Number of workers activated in last N minutes
-*    rN     -- Number of workers reaped in last N minutes
-*    busy idle stopped killed -- Snapshot of # workers in each status
-*    msgs_processed -- Total msgs processed since startup
-*    total_activations -- Total worker activations since startup
-*    request_queue_size -- size of queue
-*    num_queued_requests -- number of requests on queue
-*    seconds_since_program_start -- just what it says!
-*
-* NOTE: Activations and reaps (aN, rN) are only valid if cmd == SCAN_CMD
+*  Frees the slot's command and puts the slot back on the free list.
 ***********************************************************************/
 static void
-doLoad(EventSelector *es, int fd, int cmd)
+release_request(Request *slot)
 {
-    char ans[1024];
-    time_t now = time(NULL);
-    int msgs_0, msgs_1, msgs_5, msgs_10, worker_0, worker_1, worker_5, worker_10;
-    BIG_INT ms_0, ms_1, ms_5, ms_10;
-    int a0, a1, a5, a10; /* Activations */
-    int r0, r1, r5, r10; /* Reaps */
-    double ams_0, ams_1, ams_5, ams_10;
-    double avg_0, avg_1, avg_5, avg_10;
-
-    /* Tricky... get slices of history so as not to overlap */
-
-    /*                       start     go_back_by  results....                 */
-    get_history_totals(cmd, now,      10,         &msgs_0,  &worker_0,  &ms_0,  &a0,  &r0);
-    get_history_totals(cmd, now-10,   1*60-10,    &msgs_1,  &worker_1,  &ms_1,  &a1,  &r1);
-    get_history_totals(cmd, now-1*60, 5*60-1*60,  &msgs_5,  &worker_5,  &ms_5,  &a5,  &r5);
-    get_history_totals(cmd, now-5*60, 10*60-5*60, &msgs_10, &worker_10, &ms_10, &a10, &r10);
-
-    /* Accumulate partial sums */
-    msgs_1 += msgs_0;
-    worker_1 += worker_0;
-    ms_1 += ms_0;
-    a1 += a0;
-    r1 += r0;
-
-    msgs_5 += msgs_1;
-    worker_5 += worker_1;
-    ms_5 += ms_1;
-    a5 += a1;
-    r5 += r1;
-
-    msgs_10 += msgs_5;
-    worker_10 += worker_5;
-    ms_10 += ms_5;
-    a10 += a5;
-    r10 += r5;
+    free(slot->cmd);
+    slot->cmd = NULL;
+    slot->es = NULL;
+    slot->fd = -1;
+    slot->lease = 0;
+    slot->timeoutHandler = NULL;
+    slot->next = FreeRequests;
+    FreeRequests = slot;
+}
 
-    if (!msgs_0) avg_0 = 1.0;
-    else avg_0 = (double) worker_0 / (double) msgs_0;
+/**********************************************************************
+* %FUNCTION: queue_request
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- client file descriptor
+*  cmd -- command to queue
+*  map -- true if this is a Sendmail map request
+*  d -- domain counter if this is a recipok held back by the per-domain
+*       limit; NULL otherwise
+*  lease -- lease the request runs under, or NULL
+* %RETURNS:
+*  1 if request is successfully queued; 0 if not.
+* %DESCRIPTION:
+*  Queues a request if all workers are temporarily busy.  Each priority
+*  class is handled in FIFO order as workers become free, and lower
+*  classes go first.  Recipoks held back by the per-domain limit wait
+*  on their domain's own queue and are handled as soon as the domain
+*  drops below the limit.  A leased request keeps its lease ID while
+*  queued and, if the lease is still good when a worker frees up, may
+*  use the worker its lease holds back.
+***********************************************************************/
+int
+queue_request(EventSelector *es, int fd, char *cmd, int map, DomainCount *d,
+	      Lease *lease)
+{
+    Request *slot = FreeRequests;
+    int kind;
+    struct timeval t;
 
-    if (!msgs_1) avg_1 = 1.0;
-    else avg_1 = (double) worker_1 / (double) msgs_1;
+    if (!slot) {
+	if (DOLOG) {
+	    syslog(LOG_INFO, "Cannot queue request: request queue is full");
+	}
+	return 0;
+    }
 
-    if (!msgs_5) avg_5 = 1.0;
-    else avg_5 = (double) worker_5 / (double) msgs_5;
+    slot->cmd = strdup(cmd);
+    if (!slot->cmd) {
+	if (DOLOG) {
+	    syslog(LOG_ERR, "Cannot queue request: Out of memory!");
+	}
+	return 0;
+    }
 
-    if (!msgs_10) avg_10 = 1.0;
-    else avg_10 = (double) worker_10 / (double) msgs_10;
+    t.tv_usec = 0;
+    t.tv_sec = Settings.requestQueueTimeout;
+    slot->timeoutHandler = Event_AddTimerHandler(es, t,
+						 handleRequestQueueTimeout,
+						 slot);
+    if (!slot->timeoutHandler) {
+	free(slot->cmd);
+	slot->cmd = NULL;
+	if (DOLOG) {
+	    syslog(LOG_ERR, "Cannot queue request: Out of memory!");
+	}
+	return 0;
+    }
+    FreeRequests = slot->next;
 
-    if (!msgs_0) ams_0 = 0.0;
-    else ams_0 = (double) ms_0 / (double) msgs_0;
+    if (map) {
+	kind = QUEUE_KIND_MAP;
+    } else {
+	kind = cmd_to_number(cmd);
+	if (kind < 0) kind = QUEUE_KIND_OTHER;
+    }
+    slot->fd = fd;
+    slot->es = es;
+    slot->map = map;
+    slot->cls = QueueClass[kind];
+    slot->domain = d;
+    slot->lease = lease ? lease->id : 0;
+    gettimeofday(&slot->queued, NULL);
+    enqueue_request(slot);
+    if (d) {
+	DomainQueued++;
+	if (DOLOG) {
+	    syslog(LOG_INFO, "Per-domain recipok limit hit for %s: Queueing request (%d waiting for domain)",
+		   d->domain, d->numWaiting);
+	}
+    } else {
+	ClassStats[slot->cls].queued++;
+	if (DOLOG) {
+	    syslog(LOG_INFO, "All workers are busy: Queueing request in class %d (%d queued)",
+		   slot->cls, NumQueuedRequests);
+	}
+    }
+    return 1;
+}
 
-    if (!msgs_1) ams_1 = 0.0;
-    else ams_1 = (double) ms_1 / (double) msgs_1;
+/**********************************************************************
+* %FUNCTION: handleRequestQueueTimeout
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- ignored
+*  flags -- ignored
+*  data -- the queued request that timed out
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Handles a queue timeout -- sends error back to client
+***********************************************************************/
+static void
+handleRequestQueueTimeout(EventSelector *es,
+			  int fd,
+			  unsigned int flags,
+			  void *data)
+{
+    Request *slot = (Request *) data;
+    int map = slot->map;
+    fd = slot->fd;
 
-    if (!msgs_5) ams_5 = 0.0;
-    else ams_5 = (double) ms_5 / (double) msgs_5;
+    if (slot->domain) {
+	DomainTimedOut++;
+    } else {
+	ClassStats[slot->cls].timedOut++;
+	Rejections++;
+    }
+    dequeue_request(slot);
+    release_request(slot);
+    if (map) {
+	reply_to_map(es, fd, "TEMP Queued request timed out");
+    } else {
+	reply_to_mimedefang(es, fd, "error: Queued request timed out\n");
+    }
+}
 
-    if (!msgs_10) ams_10 = 0.0;
-    else ams_10 = (double) ms_10 / (double) msgs_10;
+/**********************************************************************
+* %FUNCTION: find_leased_request
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  The first request, in dispatch order, whose lease is still good; NULL
+*  if there is none.
+***********************************************************************/
+static Request *
+find_leased_request(void)
+{
+    DomainCount *d;
+    Request *slot;
+    int i;
 
-    snprintf(ans, sizeof(ans), "%d %d %d %d %f %f %f %f %f %f %f %f %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
-	     msgs_0, msgs_1, msgs_5, msgs_10, avg_0, avg_1, avg_5, avg_10,
-	     ams_0, ams_1, ams_5, ams_10, a0, a1, a5, a10, r0, r1, r5, r10,
-	     WorkerCount[STATE_BUSY],
-	     WorkerCount[STATE_IDLE],
-	     WorkerCount[STATE_STOPPED],
-	     WorkerCount[STATE_KILLED],
-	     NumMsgsProcessed, Activations,
-	     Settings.requestQueueSize, NumQueuedRequests,
-	     (int)(now - TimeOfProgramStart));
-    reply_to_mimedefang(es, fd, ans);
+    if (!NumQueuedLeased) return NULL;
+    for (d = ReadyDomains; d; d = d->nextReady) {
+	for (slot = d->waitHead; slot; slot = slot->next) {
+	    if (requestLease(slot->lease)) return slot;
+	}
+    }
+    for (i=0; i<NUM_QUEUE_CLASSES; i++) {
+	for (slot = RequestHead[i]; slot; slot = slot->next) {
+	    if (requestLease(slot->lease)) return slot;
+	}
+    }
+    return NULL;
 }
 
 /**********************************************************************
-* %FUNCTION: doHourlyLoad
+* %FUNCTION: handle_queued_request
 * %ARGUMENTS:
-*  es -- event selector
-*  fd -- socket
-*  cmd -- which command's history we want
+*  None
 * %RETURNS:
-*  Nothing
+*  1 if a queued request is waiting and was passed off to a worker; 0
+*  otherwise.
 * %DESCRIPTION:
-*  Prints a load string back.  This string is a list of numbers:
-*
-*    msgs_1 msgs_4 msgs_12 msgs_24  - #msgs in last N hours
-*    avg_1 avg_4 avg_12 avg_24      - Avg workers/cmd last N hours
-*    ams_1 ams_4 ams_12 ams_24      - Avg ms/cmd last N hours
-*    secs_1 secs_4 secs_12 secs_24  - Total elapsed seconds in output
+*  Checks the queue for pending requests.  Recipoks waiting for a
+*  domain which has dropped below the per-domain limit go first, then
+*  the priority classes in order.  A request only gets a worker no
+*  lease is holding back, unless it runs under the lease holding that
+*  worker; such a request may overtake the ones ahead of it.
 ***********************************************************************/
-static void
-doHourlyLoad(EventSelector *es, int fd, int cmd)
+static int
+handle_queued_request(void)
 {
-    int msgs_1, msgs_4, msgs_12, msgs_24;
-    double ams_1, ams_4, ams_12, ams_24;
-    double avg_1, avg_4, avg_12, avg_24;
-    int secs_1, secs_4, secs_12, secs_24;
-    int workers;
-    BIG_INT ms;
+    Request *slot = NULL;
+    Lease *lease;
+    struct timeval now;
+    double ms;
+    int len;
+    int i;
 
-    char ans[1024];
-    time_t now = time(NULL);
+    /* Not even a lease holder could have a worker */
+    if (NUM_FREE_WORKERS <= NUM_RESERVED_WORKERS - 1) return 0;
 
-    get_hourly_history_totals(cmd, now, 1, &msgs_1, &workers, &ms, &secs_1);
-    if (msgs_1) {
-	avg_1 = ((double) workers) / ((double) msgs_1);
-	ams_1 = ((double) ms) / ((double) msgs_1);
+    if (ReadyDomains) {
+	slot = ReadyDomains->waitHead;
     } else {
-	avg_1 = 0.0;
-	ams_1 = 0.0;
+	for (i=0; i<NUM_QUEUE_CLASSES && !slot; i++) {
+	    slot = RequestHead[i];
+	}
     }
+    if (!slot) return 0;
 
-    get_hourly_history_totals(cmd, now, 4, &msgs_4, &workers, &ms, &secs_4);
-    if (msgs_4) {
-	avg_4 = ((double) workers) / ((double) msgs_4);
-	ams_4 = ((double) ms) / ((double) msgs_4);
-    } else {
-	avg_4 = 0.0;
-	ams_4 = 0.0;
+    /* Free workers held back by leases are not ours to hand out */
+    lease = requestLease(slot->lease);
+    if (!lease && NUM_FREE_WORKERS <= NUM_RESERVED_WORKERS) {
+	slot = find_leased_request();
+	if (!slot) return 0;
+	lease = requestLease(slot->lease);
     }
 
-    get_hourly_history_totals(cmd, now, 12, &msgs_12, &workers, &ms, &secs_12);
-    if (msgs_12) {
-	avg_12 = ((double) workers) / ((double) msgs_12);
-	ams_12 = ((double) ms) / ((double) msgs_12);
+    gettimeofday(&now, NULL);
+    ms = (now.tv_sec - slot->queued.tv_sec) * 1000.0 +
+	(now.tv_usec - slot->queued.tv_usec) / 1000.0;
+    if (slot->domain) {
+	DomainDispatched++;
+	DomainWaitTotalMs += ms;
+	if (ms > DomainWaitMaxMs) DomainWaitMaxMs = ms;
     } else {
-	avg_12 = 0.0;
-	ams_12 = 0.0;
+	QueueStats *q = &ClassStats[slot->cls];
+	q->dispatched++;
+	q->waitTotalMs += ms;
+	if (ms > q->waitMaxMs) q->waitMaxMs = ms;
     }
 
-    get_hourly_history_totals(cmd, now, 24, &msgs_24, &workers, &ms, &secs_24);
-    if (msgs_24) {
-	avg_24 = ((double) workers) / ((double) msgs_24);
-	ams_24 = ((double) ms) / ((double) msgs_24);
+    dequeue_request(slot);
+    Event_DelHandler(slot->es, slot->timeoutHandler);
+    slot->timeoutHandler = NULL;
+    len = strlen(slot->cmd);
+    DispatchWaitUs = (long) (ms * 1000.0);
+    if (slot->map) {
+	/* doMapRequest takes over the command buffer */
+	char *cmd = slot->cmd;
+	slot->cmd = NULL;
+	doMapRequest(slot->es, slot->fd, cmd, 0);
+    } else if (len > 5 && !strncmp(slot->cmd, "scan ", 5)) {
+	doScanAux(slot->es, slot->fd, slot->cmd, 0, &slot->cmd, lease, NULL, NULL);
     } else {
-	avg_24 = 0.0;
-	ams_24 = 0.0;
+	doWorkerCommandAux(slot->es, slot->fd, slot->cmd, 0, &slot->cmd, lease, NULL);
     }
-    snprintf(ans, sizeof(ans), "%d %d %d %d %f %f %f %f %f %f %f %f %d %d %d %d\n",
-	     msgs_1, msgs_4, msgs_12, msgs_24,
-	     avg_1, avg_4, avg_12, avg_24,
-	     ams_1, ams_4, ams_12, ams_24,
-	     secs_1, secs_4, secs_12, secs_24);
-    reply_to_mimedefang(es, fd, ans);
+    DispatchWaitUs = 0;
+    release_request(slot);
+    return 1;
 }
 
 /**********************************************************************
-* %FUNCTION: doHistogram
+* %FUNCTION: do_tick
 * %ARGUMENTS:
 *  es -- event selector
-*  fd -- socket
+*  fd, flags -- ignored
+*  data -- really the tick number in disguise
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Prints the histogram like this:
-*  1 num1
-*  2 num2
-*  .......
-*  N numN
-*
-* Each "numI" is the number of times "I" workers were busy.
+*  Called periodically to run a "tick" request.
 ***********************************************************************/
 static void
-doHistogram(EventSelector *es, int fd)
+do_tick(EventSelector *es,
+	int fd,
+	unsigned int flags,
+	void *data)
 {
-  /* Allow 20 bytes/entry - two 9-digit numbers, a space and a carriage-return
-   */
-  int i;
-  size_t roomleft = (size_t) (Settings.maxWorkers * 20);
-  char *ans = malloc(roomleft + 1);
-  char *pos = ans;
+    Worker *s;
+    char buffer[128];
 
-  if (!ans) {
-    reply_to_mimedefang(es, fd, "error: Out of memory\n");
-    return;
-  }
+    /* Ugly */
+    int tick_no = (int) ((long) data);
 
+    s = findAdmittedWorker(OTHER_CMD, NULL);
+    if (!s) {
+	if (DOLOG) {
+	    syslog(LOG_WARNING, "Tick %d skipped -- no free workers", tick_no);
+	}
+	schedule_tick(es, tick_no);
+	return;
+    }
+    if (activateWorker(s, "About to run tick") == (pid_t) -1) {
+	if (DOLOG) {
+	    syslog(LOG_WARNING, "Tick %d skipped -- unable to activate worker %d",
+		   tick_no,
+		   WORKERNO(s));
+	}
+	schedule_tick(es, tick_no);
+	return;
+    }
 
-  for (i=0; i<Settings.maxWorkers; i++) {
-    int count = snprintf(pos, roomleft, "%4d %u\n", i+1,
-			 AllWorkers[i].histo);
-    if (count < 0 || count >= roomleft) {
-      free(ans);
-      reply_to_mimedefang(es, fd, "error: String too long\n");
-      return;
+    putOnList(s, STATE_BUSY);
+    s->clientFD = -1;
+    s->tick_no = tick_no;
+    sprintf(buffer, "tick %d", tick_no);
+    strncpy(s->status_tag, buffer, MAX_STATUS_LEN);
+    s->status_tag[MAX_STATUS_LEN-1] = 0;
+    publishWorkerSlot(s);
+    sprintf(buffer, "tick %d\n", tick_no);
+    s->event = EventTcp_WriteBuf(es, s->workerStdin, buffer, strlen(buffer),
+				 handleWorkerReceivedTick,
+				 Settings.clientTimeout, s);
+    if (!s->event) {
+	if (DOLOG) {
+	    syslog(LOG_WARNING, "Tick %d skipped -- EventTcp_WriteBuf failed: %m", tick_no);
+	}
+	killWorker(s, "EventTcp_WriteBuf failed");
+	schedule_tick(es, tick_no);
     }
-    pos += count;
-    roomleft -= count;
-  }
-  reply_to_mimedefang(es, fd, ans);
-  free(ans);
 }
 
-
 /**********************************************************************
-* %FUNCTION: findFreeWorker
+* %FUNCTION: handleWorkerReceivedTick
 * %ARGUMENTS:
-*  cmdno -- the command number.  One of: OTHER_CMD, SCAN_CMD,
-*           RELAYOK_CMD, SENDEROK_CMD, or RECIPOK_CMD
+*  es -- event selector
+*  fd -- not used
+*  buf -- buffer of data read from multiplexor
+*  len -- amount of data read from multiplexor
+*  flag -- flag from reader
+*  data -- the worker
 * %RETURNS:
-*  A pointer to a free worker, or NULL if none found.  Prefers to
-*  return a running worker rather than one which needs activation.  Also,
-*  prefers to return the worker which has been running the longest since
-*  activation.  Also prefers to pick a worker that last ran the same
-*  command as cmdno
+*  Nothing
 * %DESCRIPTION:
-*  Finds a free (preferably running) worker.
+*  Called when "tick\n" has been written to worker.  Sets up an event handler
+*  to read the worker's reply
 ***********************************************************************/
-static Worker *
-findFreeWorker(int cmdno)
+static void
+handleWorkerReceivedTick(EventSelector *es,
+			   int fd,
+			   char *buf,
+			   int len,
+			   int flag,
+			   void *data)
 {
-    Worker *s = Workers[STATE_IDLE];
-    Worker *best = s;
-    Worker *best_same_cmd = NULL;
-    while(s) {
-	if (s->activated < best->activated) {
-	    best = s;
-	}
-	if (s->last_cmd == cmdno || s->last_cmd == NO_CMD) {
-	    if (!best_same_cmd) {
-		best_same_cmd = s;
-	    } else if (best_same_cmd->last_cmd != cmdno ||
-		       s->activated < best_same_cmd->activated) {
-		best_same_cmd = s;
-
-	    }
-	}
-	s = s->next;
-    }
+    Worker *s = (Worker *) data;
 
-    if (best_same_cmd) {
-	best = best_same_cmd;
-    }
+    /* Event was triggered */
+    s->event = NULL;
 
-    if (!best) {
-	/* No running workers - just pick the first stopped worker */
-	best = Workers[STATE_STOPPED];
-    }
-    if (best) {
-	best->status_tag[0] = 0;
-	best->cmd = -1;
+    if (flag == EVENT_TCP_FLAG_TIMEOUT || flag == EVENT_TCP_FLAG_IOERROR) {
+	if (DOLOG) {
+	    syslog(LOG_ERR, "handleWorkerReceivedTick(%d): Timeout or error: Flag = %d: %m",
+		   WORKERNO(s),
+		   flag);
+	}
+	/* Kill the worker process */
+	killWorker(s, "Error talking to worker process");
+	schedule_tick(es, s->tick_no);
+	return;
     }
 
-    if (Settings.debugWorkerScheduling && best) {
-	syslog(LOG_INFO, "Scheduling %s worker %d for cmdno %d (activated=%d, last=%d)",
-	       state_name(best->state), WORKERNO(best), cmdno, best->activated, best->last_cmd);
+    /* Worker has been given the command; now wait for it to reply */
+    s->event = EventTcp_ReadBuf(es, s->workerStdout, MAX_CMD_LEN, '\n',
+				handleWorkerReceivedAnswerFromTick,
+				Settings.busyTimeout, 1, s);
+    if (!s->event) {
+	if (DOLOG) syslog(LOG_ERR, "handleWorkerReceivedTick: EventTcp_ReadBuf failed: %m");
+	killWorker(s, "EventTcp_ReadBuf failed");
+	schedule_tick(es, s->tick_no);
     }
-    return best;
 }
 
 /**********************************************************************
-* %FUNCTION: log_worker_resource_usage
+* %FUNCTION: handleWorkerReceivedAnswerFromTick
 * %ARGUMENTS:
-*  s -- worker
-*  usage -- struct rusage with worker's resource usage.
+*  es -- event selector
+*  fd -- not used
+*  buf -- buffer of data read
+*  len -- amount of data read
+*  flag -- flag from reader
+*  data -- the worker
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Logs worker's resource usage.
+*  Called when the worker's answer comes back from the "tick" request
 ***********************************************************************/
-#ifdef HAVE_WAIT3
-static void
-log_worker_resource_usage(Worker *s,
-			 struct rusage *usage)
-{
-    if (!DOLOG) return;
-    syslog(LOG_INFO,
-	   "Worker %d resource usage: req=%d, scans=%d, user=%d.%03d, "
-	   "sys=%d.%03d, nswap=%ld, majflt=%ld, minflt=%ld, "
-	   "maxrss=%ld, bi=%ld, bo=%ld",
-	   WORKERNO(s),
-	   s->numRequests,
-	   s->numScans,
-	   (int) usage->ru_utime.tv_sec,
-	   (int) usage->ru_utime.tv_usec / 1000,
-	   (int) usage->ru_stime.tv_sec,
-	   (int) usage->ru_stime.tv_usec / 1000,
-	   usage->ru_nswap,
-	   usage->ru_majflt,
-	   usage->ru_minflt,
-	   usage->ru_maxrss,
-	   usage->ru_inblock,
-	   usage->ru_oublock);
-}
-#endif
-
-static void handleMapAccept(EventSelector *es, int fd);
-static void got_map_request(EventSelector *es, int fd,
-			    char *buf, int len, int flag, void *data);
-
 static void
-handle_worker_received_map_command(EventSelector *es,
+handleWorkerReceivedAnswerFromTick(EventSelector *es,
 				  int fd,
 				  char *buf,
 				  int len,
 				  int flag,
-				  void *data);
+				  void *data)
+{
+    Worker *s = (Worker *) data;
 
-static void
-receive_worker_map_answer(EventSelector *es,
-			 int fd,
-			 char *buf,
-			 int len,
-			 int flag,
-			 void *data);
+    /* Event was triggered */
+    s->event = NULL;
 
-static void
-sent_map_reply(EventSelector *es,
-	       int fd,
-	       char *buf,
-	       int len,
-	       int flag,
-	       void *data)
-{
-    if (!EventTcp_ReadNetstring(es, fd, got_map_request, 0, NULL)) {
-	syslog(LOG_ERR, "sent_map_reply: EventTcp_ReadNetstring failed: %m");
-	close(fd);
+    /* We don't care how the worker replied. */
+
+    s->numRequests++;
+
+    /* If we had a busy timeout, kill the worker */
+    if (flag == EVENT_TCP_FLAG_TIMEOUT) {
+	killWorker(s, "Busy timeout");
+    } else {
+	/* Put worker on free list */
+	putOnList(s, STATE_IDLE);
+
+	/* Record time when this worker became idle */
+	s->idleTime = time(NULL);
+
+	/* Check worker for expiry */
+	checkWorkerForExpiry(s);
     }
+
+    /* And reschedule another tick request */
+    schedule_tick(es, s->tick_no);
 }
+
 /**********************************************************************
-* %FUNCTION: reply_to_map_with_len
+* %FUNCTION: schedule_tick
 * %ARGUMENTS:
 *  es -- event selector
-*  fd -- file descriptor
-*  msg -- message to send back
-*  len -- length of message
+*  tick_no -- tick number
 * %RETURNS:
-*  The event associated with the reply, or NULL.
+*  Nothing
 * %DESCRIPTION:
-*  Sends a final message back to map.
+*  Schedules a "tick" command for tick_interval seconds in the future,
+*  if tick_interval is non-zero
 ***********************************************************************/
-static EventTcpState *
-reply_to_map_with_len(EventSelector *es,
-			     int fd,
-			     char const *msg,
-			     int len)
+static void
+schedule_tick(EventSelector *es,
+	      int tick_no)
 {
-    EventTcpState *e;
-    e = EventTcp_WriteNetstring(es, fd, msg, len, sent_map_reply,
-				Settings.clientTimeout, NULL);
-    if (!e) {
-	if (DOLOG) {
-	    syslog(LOG_ERR, "reply_to_map: EventTcp_WriteBuf failed: %m");
-	}
-	close(fd);
+    struct timeval t;
+
+    if (Settings.tick_interval <= 0) {
+	return;
+    }
+
+    t.tv_usec = 0;
+    t.tv_sec = Settings.tick_interval;
+    if (!Event_AddTimerHandler(es, t, do_tick, (void *) ((long) tick_no))) {
+	syslog(LOG_CRIT, "Unable to schedule tick handler!  Event_AddTimerHandler failed!");
     }
-    return e;
 }
 
 /**********************************************************************
-* %FUNCTION: reply_to_map
+* %FUNCTION: init_history
 * %ARGUMENTS:
-*  es -- event selector
-*  fd -- file descriptor
-*  msg -- message to send back
+*  None
 * %RETURNS:
-*  The event associated with the reply, or NULL.
+*  Nothing
 * %DESCRIPTION:
-*  Sends a final message back to map.
+*  Resets all history bucket entries to zero
 ***********************************************************************/
-static EventTcpState *
-reply_to_map(EventSelector *es,
-		    int fd,
-		    char const *msg)
+static void
+init_history(void)
 {
-    return reply_to_map_with_len(es, fd, msg, strlen(msg));
+    memset(history_total, 0, sizeof(history_total));
+    memset(history_mark, 0, sizeof(history_mark));
+    memset(history_mark_time, 0, sizeof(history_mark_time));
+    history_now = (int) time(NULL);
+    history_mark_time[history_now % HISTORY_SECONDS] = history_now;
+    memset(fine_history, 0, sizeof(fine_history));
+    memset(hourly_history, 0, sizeof(hourly_history));
 }
 
 /**********************************************************************
-* %FUNCTION: handleMapAccept
+* %FUNCTION: advance_history
 * %ARGUMENTS:
-*  es -- event selector
-*  fd -- accepted connection
+*  now -- current time
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Handles a connection attempt for TCP map.  Sets up to read requests.
+*  Marks the running totals at the start of each second since the last
+*  call, up to and including now.  Costs one mark per elapsed second
+*  (at most HISTORY_SECONDS), however often it is called.
 ***********************************************************************/
 static void
-handleMapAccept(EventSelector *es,
-		int fd)
+advance_history(time_t now)
 {
-    if (!EventTcp_ReadNetstring(es, fd, got_map_request, 0, NULL)) {
-	syslog(LOG_ERR, "handleMapAccept: EventTcp_ReadNetstring failed: %m");
-	close(fd);
+    int t = (int) now;
+    int cmd, slot;
+
+    if (t <= history_now) return;
+    if (t - history_now > HISTORY_SECONDS) {
+	history_now = t - HISTORY_SECONDS;
+    }
+    while (history_now < t) {
+	history_now++;
+	slot = history_now % HISTORY_SECONDS;
+	history_mark_time[slot] = history_now;
+	for (cmd=0; cmd<NUM_CMDS; cmd++) {
+	    history_mark[cmd][slot] = history_total[cmd];
+	}
     }
 }
 
 /**********************************************************************
-* %FUNCTION: got_request
+* %FUNCTION: get_history_bucket
 * %ARGUMENTS:
-*  es -- event selector
-*  fd -- connection from Sendmail map reader
-*  buf -- map request
-*  len -- length of map request
-*  flag -- flag from reader
-*  data -- ignored
+*  cmd -- which command's totals we want
 * %RETURNS:
-*  Nothing
+*  A pointer to the command's running totals, ready for incrementing
 * %DESCRIPTION:
-*  Handles a received map command.
+*  Marks any seconds that have started since the last call first, so
+*  the increments count towards the current second.
 ***********************************************************************/
-static void
-got_map_request(EventSelector *es,
-	    int fd,
-	    char *buf,
-	    int len,
-	    int flag,
-	    void *data)
+static HistoryTotals *
+get_history_bucket(int cmd)
 {
-    Worker *s;
-    char *cmd, *oldcmd;
-    char *t;
-
-    if (flag == EVENT_TCP_FLAG_TIMEOUT ||
-	flag == EVENT_TCP_FLAG_IOERROR ||
-	flag == EVENT_TCP_FLAG_EOF) {
-	close(fd);
-	return;
-    }
-
-    /* Chop off comma */
-    if (len && buf[len-1] == ',') {
-	buf[len-1] = 0;
-	len--;
-    } else {
-	reply_to_map(es, fd, "PERM Netstring missing terminating comma");
-	return;
-    }
-
-    /* Convert the command to something we can use */
-    cmd = malloc(len*3+1 + 4 + 3);
-
-    if (!cmd) {
-	reply_to_map(es, fd, "TEMP Out of memory");
-	return;
-    }
-
-    t = buf;
-    while(*t && (*t != ' ')) t++;
-    if (*t != ' ') {
-	free(cmd);
-	reply_to_map(es, fd, "PERM Invalid request format");
-	return;
-    }
-
-    *t = 0;
-    oldcmd = cmd;
-    strcpy(cmd, "map ");
-    cmd += 4;
-    cmd += percent_encode(buf, cmd, len*3+1);
-    *cmd++ = ' ';
-    cmd += percent_encode(t+1, cmd, len*3+1+4 - (cmd - oldcmd));
-    *cmd++ = '\n';
-    *cmd = 0;
-    cmd = oldcmd;
-
-    /* Send the request to a worker */
-    s = findFreeWorker(OTHER_CMD);
-    if (!s) {
-	free(cmd);
-	reply_to_map(es, fd, "TEMP No free workers");
-	return;
-    }
-    if (activateWorker(s, "About to handle map request") == (pid_t) -1) {
-	free(cmd);
-	syslog(LOG_WARNING, "map command failed: No free workers");
-	reply_to_map(es, fd, "TEMP Unable to activate worker");
-	return;
-    }
-    putOnList(s, STATE_BUSY);
-    s->clientFD = fd;
-    s->workdir[0] = 0;
-    set_worker_status_from_command(s, cmd);
-    s->event = EventTcp_WriteBuf(es, s->workerStdin, cmd, strlen(cmd),
-				 handle_worker_received_map_command,
-				 Settings.clientTimeout, s);
-    free(cmd);
-    if (!s->event) {
-	if (DOLOG) syslog(LOG_ERR, "got_map_request: EventTcp_WriteBuf failed: %m");
-	s->clientFD = -1; /* Do not close FD */
-	killWorker(s, "EventTcp_WriteBuf failed");
-	reply_to_map(es, fd, "TEMP Could not send command to worker");
-    }
+    advance_history(time(NULL));
+    return &history_total[cmd];
 }
 
+/**********************************************************************
+* %FUNCTION: record_fine_history
+* %ARGUMENTS:
+*  cmd -- command that completed
+*  now -- time it completed
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Counts a completed command in the sub-second history.
+***********************************************************************/
 static void
-handle_worker_received_map_command(EventSelector *es,
-				  int fd,
-				  char *buf,
-				  int len,
-				  int flag,
-				  void *data)
+record_fine_history(int cmd, struct timeval const *now)
 {
-    Worker *s = (Worker *) data;
-
-    /* Event was triggered */
-    s->event = NULL;
+    long elapsed = (long) now->tv_sec * (1000 / HISTORY_FINE_MS) +
+	now->tv_usec / (HISTORY_FINE_MS * 1000);
+    FineBucket *b = &fine_history[elapsed % HISTORY_FINE_SLOTS];
 
-    if (flag == EVENT_TCP_FLAG_TIMEOUT || flag == EVENT_TCP_FLAG_IOERROR) {
-	reply_to_map(es, s->clientFD, "TEMP Error talking to worker process");
-
-	s->clientFD = -1;
-	/* Kill the worker process */
-	killWorker(s, "Error talking to worker process");
-	return;
+    if (b->elapsed != elapsed) {
+	memset(b, 0, sizeof(*b));
+	b->elapsed = elapsed;
     }
+    b->count[cmd]++;
+}
 
-    /* Worker has been given the command; now wait for it to reply */
-    s->event = EventTcp_ReadBuf(es, s->workerStdout, MAX_CMD_LEN, '\n',
-				receive_worker_map_answer,
-				Settings.busyTimeout, 1, s);
-    if (!s->event) {
-	if (DOLOG) syslog(LOG_ERR, "handleWorkerReceivedCommand: EventTcp_ReadBuf failed: %m");
-	reply_to_map(es, s->clientFD, "TEMP Error talking to worker process");
-	s->clientFD = -1;
+/**********************************************************************
+* %FUNCTION: doBurst
+* %ARGUMENTS:
+*  es -- event selector
+*  fd -- socket
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Prints one line per command: the most requests completed in any
+*  HISTORY_FINE_MS interval of the last HISTORY_FINE_SLOTS intervals,
+*  followed by the count for each interval, oldest first.
+***********************************************************************/
+static void
+doBurst(EventSelector *es, int fd)
+{
+    char ans[NUM_CMDS * (HISTORY_FINE_SLOTS * 11 + 64)];
+    char *ptr = ans;
+    int len = sizeof(ans);
+    struct timeval now;
+    long end, e;
+    unsigned int c, peak;
+    int cmd, j;
+    FineBucket const *b;
 
-	killWorker(s, "EventTcp_ReadBuf failed");
+    gettimeofday(&now, NULL);
+    end = (long) now.tv_sec * (1000 / HISTORY_FINE_MS) +
+	now.tv_usec / (HISTORY_FINE_MS * 1000);
+
+    *ans = 0;
+    for (cmd=0; cmd<NUM_CMDS; cmd++) {
+	peak = 0;
+	for (e = end - HISTORY_FINE_SLOTS + 1; e <= end; e++) {
+	    b = &fine_history[e % HISTORY_FINE_SLOTS];
+	    if (b->elapsed == e && b->count[cmd] > peak) peak = b->count[cmd];
+	}
+	j = snprintf(ptr, len, "%s interval_ms=%d peak=%u counts=",
+		     CmdName[cmd], HISTORY_FINE_MS, peak);
+	ptr += j;
+	len -= j;
+	for (e = end - HISTORY_FINE_SLOTS + 1; e <= end; e++) {
+	    b = &fine_history[e % HISTORY_FINE_SLOTS];
+	    c = (b->elapsed == e) ? b->count[cmd] : 0;
+	    j = snprintf(ptr, len, (e == end) ? "%u\n" : "%u,", c);
+	    ptr += j;
+	    len -= j;
+	}
     }
+    reply_to_mimedefang(es, fd, ans);
 }
 
+/**********************************************************************
+* %FUNCTION: restoreState
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Opens the state file and, if it holds a save, picks up the load and
+*  latency history and autoscaling state where the last run left off.
+*  Old entries are ignored as usual by the readers of each history, and
+*  a moving average older than HISTORY_SECONDS is not restored.
+***********************************************************************/
 static void
-receive_worker_map_answer(EventSelector *es,
-			 int fd,
-			 char *buf,
-			 int len,
-			 int flag,
-			 void *data)
+restoreState(void)
 {
-    Worker *s = (Worker *) data;
-    s->event = NULL;
+    time_t now = time(NULL);
+    int r;
 
-    if (!len || (flag == EVENT_TCP_FLAG_TIMEOUT)) {
-	reply_to_map(es, s->clientFD, "TEMP Busy timeout on worker");
-	s->clientFD = -1;
-	killWorker(s, "Busy timeout");
+    r = MXStateOpen(Settings.stateFile, STATE_VERSION, sizeof(StateBuf), &StateBuf);
+    if (r < 0) {
+	syslog(LOG_WARNING, "Statistics will not be kept across restarts");
+	Settings.stateFile = NULL;
 	return;
     }
+    if (r == 0) return;
 
-    /* Remove newline at end */
-    if (buf[len-1] == '\n') {
-	buf[len-1] = 0;
+    /* A save from the future means the clock went back; don't trust it */
+    if (StateBuf.saved > now || StateBuf.now > (int) now) {
+	syslog(LOG_WARNING, "State file %s was saved in the future; ignoring it",
+	       Settings.stateFile);
+	return;
     }
 
-    /* Send the answer back */
-    percent_decode(buf);
-    reply_to_map(es, s->clientFD, buf);
-
-    s->clientFD = -1;
-    s->numRequests++;
-    putOnList(s, STATE_IDLE);
-    s->idleTime = time(NULL);
-    checkWorkerForExpiry(s);
+    memcpy(history_total, StateBuf.total, sizeof(history_total));
+    memcpy(history_mark, StateBuf.mark, sizeof(history_mark));
+    memcpy(history_mark_time, StateBuf.markTime, sizeof(history_mark_time));
+    history_now = StateBuf.now;
+    memcpy(hourly_history, StateBuf.hourly, sizeof(hourly_history));
+    memcpy(latency, StateBuf.latency, sizeof(latency));
+    LastScaleOut = StateBuf.lastScaleOut;
+    LastScaleIn = StateBuf.lastScaleIn;
+    memcpy(AutoscaleProfile, StateBuf.profile, sizeof(AutoscaleProfile));
+    ProfileHour = StateBuf.profileHour;
+    ProfileSlotNow = StateBuf.profileSlot;
+    ProfilePeak = StateBuf.profilePeak;
+    memcpy(DailyPeak, StateBuf.dailyPeak, sizeof(DailyPeak));
+    memcpy(DailyPeakHour, StateBuf.dailyPeakHour, sizeof(DailyPeakHour));
+    if (now - StateBuf.saved < HISTORY_SECONDS) {
+	EMABusyRatio = StateBuf.emaBusyRatio;
+    }
+
+    /* Mark the seconds we were down */
+    advance_history(now);
+
+    syslog(LOG_INFO, "Restored statistics saved %ld seconds ago from %s (ema_busy=%.2f)",
+	   (long) (now - StateBuf.saved), Settings.stateFile, EMABusyRatio);
 }
 
-
+/**********************************************************************
+* %FUNCTION: saveState
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Saves the load and latency history and autoscaling state in the
+*  state file.
+***********************************************************************/
 static void
-enqueue_request(Request *slot)
+saveState(void)
 {
-    NumQueuedRequests++;
-    slot->next = NULL;
-    if (!RequestHead) {
-	RequestHead = slot;
-	RequestTail = slot;
-    } else {
-	/* Assert that RequestTail != NULL */
-	RequestTail->next = slot;
-	RequestTail = slot;
-    }
+    StateBuf.saved = time(NULL);
+    advance_history(StateBuf.saved);
+    memcpy(StateBuf.total, history_total, sizeof(history_total));
+    memcpy(StateBuf.mark, history_mark, sizeof(history_mark));
+    memcpy(StateBuf.markTime, history_mark_time, sizeof(history_mark_time));
+    StateBuf.now = history_now;
+    memcpy(StateBuf.hourly, hourly_history, sizeof(hourly_history));
+    memcpy(StateBuf.latency, latency, sizeof(latency));
+    StateBuf.emaBusyRatio = EMABusyRatio;
+    StateBuf.lastScaleOut = LastScaleOut;
+    StateBuf.lastScaleIn = LastScaleIn;
+    memcpy(StateBuf.profile, AutoscaleProfile, sizeof(AutoscaleProfile));
+    StateBuf.profileHour = ProfileHour;
+    StateBuf.profileSlot = ProfileSlotNow;
+    StateBuf.profilePeak = ProfilePeak;
+    memcpy(StateBuf.dailyPeak, DailyPeak, sizeof(DailyPeak));
+    memcpy(StateBuf.dailyPeakHour, DailyPeakHour, sizeof(DailyPeakHour));
+    MXStateSave(&StateBuf);
 }
 
+/**********************************************************************
+* %FUNCTION: saveStateTimer
+* %ARGUMENTS:
+*  es -- event selector
+*  fd, flags, data -- ignored
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Saves state every STATE_SAVE_INTERVAL seconds.
+***********************************************************************/
 static void
-dequeue_request(Request *slot)
+saveStateTimer(EventSelector *es,
+	       int fd,
+	       unsigned int flags,
+	       void *data)
 {
-    Request *prev;
+    struct timeval t;
 
-    NumQueuedRequests--;
-    if (slot == RequestHead) {
-	RequestHead = RequestHead->next;
-	if (!RequestHead) {
-	    RequestTail = NULL;
-	}
-	/* Safety... */
-	slot->next = NULL;
-	return;
-    }
-    prev = RequestHead;
-    while (prev->next && prev->next != slot) {
-	prev = prev->next;
-    }
-    if (prev->next == slot) {
-	prev->next = slot->next;
-	if (slot == RequestTail) {
-	    RequestTail = prev;
-	}
-    }
-    /* Safety... */
-    slot->next = NULL;
+    saveState();
+    t.tv_usec = 0;
+    t.tv_sec = STATE_SAVE_INTERVAL;
+    Event_AddTimerHandler(es, t, saveStateTimer, NULL);
 }
 
 /**********************************************************************
-* %FUNCTION: queue_request
+* %FUNCTION: get_hourly_history_bucket
 * %ARGUMENTS:
-*  es -- event selector
-*  fd -- client file descriptor
-*  cmd -- command to queue
+*  cmd -- which command's buckets we want
 * %RETURNS:
-*  1 if request is successfully queued; 0 if not.
+*  A pointer to an initialized history bucket ready for incrementing counters
 * %DESCRIPTION:
-*  Queues a request if all workers are temporarily busy.  Queue is
-*  handled in FIFO order as workers become free.
+*  Determines current bucket and initializes it if required.
 ***********************************************************************/
-int
-queue_request(EventSelector *es, int fd, char *cmd)
+static HistoryBucket *
+get_hourly_history_bucket(int cmd)
 {
-    Request *slot = NULL;
-    int i;
-    struct timeval t;
-
-    if (NumQueuedRequests >= Settings.requestQueueSize) {
-	if (DOLOG) {
-	    syslog(LOG_INFO, "Cannot queue request: request queue is full");
-	}
-	return 0;
+    time_t now = time(NULL);
+    int hour = ((int) now) / 3600;
+    int bucket = hour % HISTORY_HOURS;
+    HistoryBucket *b = &(hourly_history[cmd][bucket]);
+    if (b->elapsed != hour) {
+	b->first = now;
+	b->elapsed = hour;
+	b->count = 0;
+	b->workers = 0;
+	b->ms = 0;
+	b->activated = 0;
+	b->reaped = 0;
     }
+    b->last = now;
+    return b;
+}
 
-    /* Find a free request slot */
-    for (i=0; i<Settings.requestQueueSize; i++) {
-	if (RequestQueue[i].fd == -1) {
-	    slot = &RequestQueue[i];
-	    break;
-	}
-    }
+/**********************************************************************
+* %FUNCTION: lat_bucket
+* %ARGUMENTS:
+*  us -- a latency in microseconds
+* %RETURNS:
+*  The index of the latency histogram bucket holding us.
+***********************************************************************/
+static int
+lat_bucket(unsigned long us)
+{
+    int e = 0;
 
-    if (!slot) {
-	if (DOLOG) {
-	    syslog(LOG_ERR, "Cannot queue request: Unable to find free slot!");
-	}
-	return 0;
-    }
+    if (us > 0xFFFFFFFFUL) us = 0xFFFFFFFFUL;
+    while ((us >> e) >= 2 * LAT_SUB_BUCKETS) e++;
+    if (!e) return (int) us;
+    return e * LAT_SUB_BUCKETS + (int) (us >> e);
+}
 
-    slot->cmd = strdup(cmd);
-    if (!slot->cmd) {
-	if (DOLOG) {
-	    syslog(LOG_ERR, "Cannot queue request: Out of memory!");
-	}
-	return 0;
-    }
+/**********************************************************************
+* %FUNCTION: lat_bucket_high
+* %ARGUMENTS:
+*  b -- a latency histogram bucket
+*  low -- set to the smallest value in the bucket
+* %RETURNS:
+*  The largest value in the bucket.
+***********************************************************************/
+static unsigned long
+lat_bucket_high(int b, unsigned long *low)
+{
+    int e = b >> LAT_SUB_BITS;
 
-    t.tv_usec = 0;
-    t.tv_sec = Settings.requestQueueTimeout;
-    slot->timeoutHandler = Event_AddTimerHandler(es, t,
-						 handleRequestQueueTimeout,
-						 slot);
-    if (!slot->timeoutHandler) {
-	free(slot->cmd);
-	if (DOLOG) {
-	    syslog(LOG_ERR, "Cannot queue request: Out of memory!");
-	}
-	return 0;
-    }
-    slot->fd = fd;
-    slot->es = es;
-    enqueue_request(slot);
-    if (DOLOG) {
-	syslog(LOG_INFO, "All workers are busy: Queueing request (%d queued)",
-	       NumQueuedRequests);
+    if (!e) {
+	*low = (unsigned long) b;
+	return *low;
     }
-    return 1;
+    *low = ((unsigned long) (LAT_SUB_BUCKETS + (b & (LAT_SUB_BUCKETS - 1)))) << (e-1);
+    return *low + (1UL << (e-1)) - 1;
 }
 
 /**********************************************************************
-* %FUNCTION: handleRequestQueueTimeout
+* %FUNCTION: record_latency
 * %ARGUMENTS:
-*  es -- event selector
-*  fd -- ignored
-*  flags -- ignored
-*  data -- the queued request that timed out
+*  kind -- kind of request (QUEUE_KIND_*, or a command number)
+*  queueUs -- microseconds the request spent queued
+*  serviceUs -- microseconds the worker took
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Handles a queue timeout -- sends error back to client
+*  Adds a finished request to the current latency slot.
 ***********************************************************************/
 static void
-handleRequestQueueTimeout(EventSelector *es,
-			  int fd,
-			  unsigned int flags,
-			  void *data)
+record_latency(int kind, long queueUs, long serviceUs)
 {
-    Request *slot = (Request *) data;
-    fd = slot->fd;
-
-    free(slot->cmd);
-    slot->cmd = NULL;
-    slot->fd = -1;
-    slot->timeoutHandler = NULL;
-    dequeue_request(slot);
-    reply_to_mimedefang(es, fd, "error: Queued request timed out\n");
+    int elapsed = (int) (time(NULL) / LAT_SLOT_SECONDS);
+    LatencySlot *slot = &latency[elapsed % LAT_SLOTS];
+    long v[NUM_LAT_MEASURES];
+    LatencyHisto *h;
+    int m;
+
+    if (kind < 0 || kind >= NUM_QUEUE_KINDS) return;
+    if (slot->elapsed != elapsed) {
+	memset(slot, 0, sizeof(*slot));
+	slot->elapsed = elapsed;
+    }
+
+    if (queueUs < 0) queueUs = 0;
+    if (serviceUs < 0) serviceUs = 0;
+    v[LAT_QUEUE] = queueUs;
+    v[LAT_SERVICE] = serviceUs;
+    v[LAT_TOTAL] = queueUs + serviceUs;
+    for (m=0; m<NUM_LAT_MEASURES; m++) {
+	h = &slot->h[kind][m];
+	h->counts[lat_bucket((unsigned long) v[m])]++;
+	h->count++;
+	h->sum += (double) v[m];
+	if ((unsigned long) v[m] > h->max) h->max = (unsigned long) v[m];
+    }
+
+    for (m=0; m<NUM_LAT_MEASURES; m++) {
+	MetricHisto *mh = &MetricLatency[kind][m];
+	int i = 0;
+	while (i < NUM_METRIC_BOUNDS && v[m] > MetricBoundUs[i]) i++;
+	mh->counts[i]++;
+	mh->count++;
+	mh->sum += (double) v[m];
+    }
 }
 
 /**********************************************************************
-* %FUNCTION: handle_queued_request
+* %FUNCTION: get_latency_totals
 * %ARGUMENTS:
-*  None
+*  kind -- kind of request
+*  measure -- LAT_QUEUE, LAT_SERVICE or LAT_TOTAL
+*  minutes -- how far back to look
+*  out -- filled in with the merged histogram
 * %RETURNS:
-*  1 if a queued request is waiting and was passed off to a worker; 0
-*  otherwise.
+*  Nothing
 * %DESCRIPTION:
-*  Checks the queue for pending requests.
+*  Merges the latency slots for the last "minutes" minutes, including
+*  the current, partly-filled slot.
 ***********************************************************************/
-static int
-handle_queued_request(void)
+static void
+get_latency_totals(int kind, int measure, int minutes, LatencyHisto *out)
 {
-    Request *slot = RequestHead;
-    int len;
+    int now = (int) (time(NULL) / LAT_SLOT_SECONDS);
+    int nslots = minutes * 60 / LAT_SLOT_SECONDS;
+    LatencyHisto const *h;
+    int i, b;
+
+    memset(out, 0, sizeof(*out));
+    if (nslots > LAT_SLOTS) nslots = LAT_SLOTS;
+    for (i=0; i<nslots; i++) {
+	LatencySlot const *slot = &latency[(now - i) % LAT_SLOTS];
+	if (slot->elapsed != now - i) continue;
+	h = &slot->h[kind][measure];
+	if (!h->count) continue;
+	for (b=0; b<LAT_BUCKETS; b++) {
+	    out->counts[b] += h->counts[b];
+	}
+	out->count += h->count;
+	out->sum += h->sum;
+	if (h->max > out->max) out->max = h->max;
+    }
+}
 
-    if (!slot) return 0;
-    dequeue_request(slot);
-    Event_DelHandler(slot->es, slot->timeoutHandler);
-    slot->timeoutHandler = NULL;
-    len = strlen(slot->cmd);
-    if (len > 5 && !strncmp(slot->cmd, "scan ", 5)) {
-	doScanAux(slot->es, slot->fd, slot->cmd, 0);
-    } else {
-	doWorkerCommandAux(slot->es, slot->fd, slot->cmd, 0);
+/**********************************************************************
+* %FUNCTION: lat_percentile
+* %ARGUMENTS:
+*  h -- a latency histogram
+*  p -- a percentile between 0 and 100
+* %RETURNS:
+*  The smallest bucket bound which at least p percent of the values do
+*  not exceed, in milliseconds.  Never more than the largest value.
+***********************************************************************/
+static double
+lat_percentile(LatencyHisto const *h, double p)
+{
+    unsigned long want, seen = 0, low, high;
+    int b;
+
+    if (!h->count) return 0.0;
+    want = (unsigned long) ((p / 100.0) * h->count + 0.999999);
+    if (want < 1) want = 1;
+    for (b=0; b<LAT_BUCKETS; b++) {
+	seen += h->counts[b];
+	if (seen >= want) {
+	    high = lat_bucket_high(b, &low);
+	    if (high > h->max) high = h->max;
+	    return (double) high / 1000.0;
+	}
+    }
+    return (double) h->max / 1000.0;
+}
+
+/**********************************************************************
+* %FUNCTION: recent_queue_wait
+* %ARGUMENTS:
+*  minutes -- how far back to look
+*  p -- a percentile between 0 and 100
+* %RETURNS:
+*  The p'th percentile of the time requests of all kinds spent queued
+*  over the last "minutes" minutes, in milliseconds.
+***********************************************************************/
+static double
+recent_queue_wait(int minutes, double p)
+{
+    LatencyHisto all, h;
+    int kind, b;
+
+    memset(&all, 0, sizeof(all));
+    for (kind=0; kind<NUM_QUEUE_KINDS; kind++) {
+	get_latency_totals(kind, LAT_QUEUE, minutes, &h);
+	if (!h.count) continue;
+	for (b=0; b<LAT_BUCKETS; b++) {
+	    all.counts[b] += h.counts[b];
+	}
+	all.count += h.count;
+	all.sum += h.sum;
+	if (h.max > all.max) all.max = h.max;
     }
-    slot->es = NULL;
-    slot->fd = -1;
-    free(slot->cmd);
-    slot->cmd = NULL;
-    return 1;
+    return lat_percentile(&all, p);
 }
 
 /**********************************************************************
-* %FUNCTION: do_tick
+* %FUNCTION: doLatency
 * %ARGUMENTS:
 *  es -- event selector
-*  fd, flags -- ignored
-*  data -- really the tick number in disguise
+*  fd -- client socket
+*  buf -- "latency" or "latency minutes"
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Called periodically to run a "tick" request.
+*  Prints count, mean and percentiles of each latency measure for each
+*  kind of request over the last 1 to 10 minutes (default 1).
 ***********************************************************************/
 static void
-do_tick(EventSelector *es,
-	int fd,
-	unsigned int flags,
-	void *data)
+doLatency(EventSelector *es, int fd, char const *buf)
 {
-    Worker *s;
-    char buffer[128];
-
-    /* Ugly */
-    int tick_no = (int) ((long) data);
-
-    s = findFreeWorker(OTHER_CMD);
-    if (!s) {
-	if (DOLOG) {
-	    syslog(LOG_WARNING, "Tick %d skipped -- no free workers", tick_no);
-	}
-	schedule_tick(es, tick_no);
-	return;
-    }
-    if (activateWorker(s, "About to run tick") == (pid_t) -1) {
-	if (DOLOG) {
-	    syslog(LOG_WARNING, "Tick %d skipped -- unable to activate worker %d",
-		   tick_no,
-		   WORKERNO(s));
-	}
-	schedule_tick(es, tick_no);
+    char ans[NUM_QUEUE_KINDS * NUM_LAT_MEASURES * 256];
+    char *ptr = ans;
+    int len = sizeof(ans);
+    int minutes = 1;
+    int kind, m, j;
+    LatencyHisto h;
+
+    if (buf[7] && (sscanf(buf+7, "%d", &minutes) != 1 ||
+		   minutes < 1 || minutes > HISTORY_SECONDS / 60)) {
+	reply_to_mimedefang(es, fd, "error: Minutes must be from 1 to 10\n");
 	return;
     }
 
-    putOnList(s, STATE_BUSY);
-    s->clientFD = -1;
-    s->tick_no = tick_no;
-    sprintf(buffer, "tick %d", tick_no);
-    strncpy(s->status_tag, buffer, MAX_STATUS_LEN);
-    s->status_tag[MAX_STATUS_LEN-1] = 0;
-    sprintf(buffer, "tick %d\n", tick_no);
-    s->event = EventTcp_WriteBuf(es, s->workerStdin, buffer, strlen(buffer),
-				 handleWorkerReceivedTick,
-				 Settings.clientTimeout, s);
-    if (!s->event) {
-	if (DOLOG) {
-	    syslog(LOG_WARNING, "Tick %d skipped -- EventTcp_WriteBuf failed: %m", tick_no);
+    *ans = 0;
+    for (kind=0; kind<NUM_QUEUE_KINDS; kind++) {
+	for (m=0; m<NUM_LAT_MEASURES; m++) {
+	    get_latency_totals(kind, m, minutes, &h);
+	    j = snprintf(ptr, len,
+			 "%s %s count=%u mean_ms=%.3f p50_ms=%.3f p90_ms=%.3f p95_ms=%.3f p99_ms=%.3f p999_ms=%.3f max_ms=%.3f\n",
+			 QueueKindName[kind], LatMeasureName[m], h.count,
+			 h.count ? h.sum / h.count / 1000.0 : 0.0,
+			 lat_percentile(&h, 50.0), lat_percentile(&h, 90.0),
+			 lat_percentile(&h, 95.0), lat_percentile(&h, 99.0),
+			 lat_percentile(&h, 99.9), (double) h.max / 1000.0);
+	    len -= j;
+	    ptr += j;
 	}
-	killWorker(s, "EventTcp_WriteBuf failed");
-	schedule_tick(es, tick_no);
     }
+    reply_to_mimedefang(es, fd, ans);
 }
 
 /**********************************************************************
-* %FUNCTION: handleWorkerReceivedTick
+* %FUNCTION: doLatencyHisto
 * %ARGUMENTS:
 *  es -- event selector
-*  fd -- not used
-*  buf -- buffer of data read from multiplexor
-*  len -- amount of data read from multiplexor
-*  flag -- flag from reader
-*  data -- the worker
+*  fd -- client socket
+*  buf -- "latencyhisto kind measure [minutes]"
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Called when "tick\n" has been written to worker.  Sets up an event handler
-*  to read the worker's reply
+*  Prints the non-empty buckets of one latency histogram, one per line:
+*  smallest value, largest value (both in microseconds) and count.
 ***********************************************************************/
 static void
-handleWorkerReceivedTick(EventSelector *es,
-			   int fd,
-			   char *buf,
-			   int len,
-			   int flag,
-			   void *data)
+doLatencyHisto(EventSelector *es, int fd, char const *buf)
 {
-    Worker *s = (Worker *) data;
-
-    /* Event was triggered */
-    s->event = NULL;
-
-    if (flag == EVENT_TCP_FLAG_TIMEOUT || flag == EVENT_TCP_FLAG_IOERROR) {
-	if (DOLOG) {
-	    syslog(LOG_ERR, "handleWorkerReceivedTick(%d): Timeout or error: Flag = %d: %m",
-		   WORKERNO(s),
-		   flag);
-	}
-	/* Kill the worker process */
-	killWorker(s, "Error talking to worker process");
-	schedule_tick(es, s->tick_no);
+    char kname[16], mname[16];
+    char *ans, *ptr;
+    int len, minutes = 1;
+    int kind, m, b, j, n;
+    unsigned long low, high;
+    LatencyHisto h;
+
+    n = sscanf(buf+13, "%15s %15s %d", kname, mname, &minutes);
+    if (n < 2 || minutes < 1 || minutes > HISTORY_SECONDS / 60) {
+	reply_to_mimedefang(es, fd, "error: Usage: latencyhisto kind measure [minutes]\n");
+	return;
+    }
+    for (kind=0; kind<NUM_QUEUE_KINDS; kind++) {
+	if (!strcmp(kname, QueueKindName[kind])) break;
+    }
+    for (m=0; m<NUM_LAT_MEASURES; m++) {
+	if (!strcmp(mname, LatMeasureName[m])) break;
+    }
+    if (kind == NUM_QUEUE_KINDS || m == NUM_LAT_MEASURES) {
+	reply_to_mimedefang(es, fd, "error: Unknown kind or measure\n");
 	return;
     }
 
-    /* Worker has been given the command; now wait for it to reply */
-    s->event = EventTcp_ReadBuf(es, s->workerStdout, MAX_CMD_LEN, '\n',
-				handleWorkerReceivedAnswerFromTick,
-				Settings.busyTimeout, 1, s);
-    if (!s->event) {
-	if (DOLOG) syslog(LOG_ERR, "handleWorkerReceivedTick: EventTcp_ReadBuf failed: %m");
-	killWorker(s, "EventTcp_ReadBuf failed");
-	schedule_tick(es, s->tick_no);
+    get_latency_totals(kind, m, minutes, &h);
+    len = LAT_BUCKETS * 40 + 1;
+    ans = malloc(len);
+    if (!ans) {
+	reply_to_mimedefang(es, fd, "error: Out of memory\n");
+	return;
     }
+    ptr = ans;
+    *ans = 0;
+    for (b=0; b<LAT_BUCKETS; b++) {
+	if (!h.counts[b]) continue;
+	high = lat_bucket_high(b, &low);
+	j = snprintf(ptr, len, "%lu %lu %u\n", low, high, h.counts[b]);
+	len -= j;
+	ptr += j;
+    }
+    reply_to_mimedefang_owned(es, fd, ans);
 }
 
+/* Growing text buffer for buildMetrics.  buf is NULL after a failure. */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+} MetricsText;
+
+/* A metrics reply being written; both parts are freed once it is out */
+typedef struct {
+    char header[256];
+    char *body;
+} MetricsReply;
+
 /**********************************************************************
-* %FUNCTION: handleWorkerReceivedAnswerFromTick
+* %FUNCTION: metricf
 * %ARGUMENTS:
-*  es -- event selector
-*  fd -- not used
-*  buf -- buffer of data read
-*  len -- amount of data read
-*  flag -- flag from reader
-*  data -- the worker
+*  t -- text buffer
+*  fmt -- printf-style format
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Called when the worker's answer comes back from the "tick" request
+*  Appends formatted text to t, growing it as needed.  On failure,
+*  frees the buffer and sets t->buf to NULL.
 ***********************************************************************/
 static void
-handleWorkerReceivedAnswerFromTick(EventSelector *es,
-				  int fd,
-				  char *buf,
-				  int len,
-				  int flag,
-				  void *data)
+metricf(MetricsText *t, char const *fmt, ...)
 {
-    Worker *s = (Worker *) data;
-
-    /* Event was triggered */
-    s->event = NULL;
-
-    /* We don't care how the worker replied. */
-
-    s->numRequests++;
-
-    /* If we had a busy timeout, kill the worker */
-    if (flag == EVENT_TCP_FLAG_TIMEOUT) {
-	killWorker(s, "Busy timeout");
-    } else {
-	/* Put worker on free list */
-	putOnList(s, STATE_IDLE);
-
-	/* Record time when this worker became idle */
-	s->idleTime = time(NULL);
+    va_list ap;
+    int n;
+    char *b;
 
-	/* Check worker for expiry */
-	checkWorkerForExpiry(s);
+    while (t->buf) {
+	va_start(ap, fmt);
+	n = vsnprintf(t->buf + t->len, t->size - t->len, fmt, ap);
+	va_end(ap);
+	if (n < 0) break;
+	if ((size_t) n < t->size - t->len) {
+	    t->len += n;
+	    return;
+	}
+	b = realloc(t->buf, t->size * 2);
+	if (!b) break;
+	t->buf = b;
+	t->size *= 2;
     }
-
-    /* And reschedule another tick request */
-    schedule_tick(es, s->tick_no);
+    free(t->buf);
+    t->buf = NULL;
 }
 
 /**********************************************************************
-* %FUNCTION: schedule_tick
+* %FUNCTION: metricFamily
 * %ARGUMENTS:
-*  es -- event selector
-*  tick_no -- tick number
+*  t -- text buffer
+*  name -- metric name without the "mimedefang_" prefix
+*  type -- OpenMetrics type
+*  help -- help text
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Schedules a "tick" command for tick_interval seconds in the future,
-*  if tick_interval is non-zero
+*  Appends the TYPE and HELP lines for a metric family.
 ***********************************************************************/
 static void
-schedule_tick(EventSelector *es,
-	      int tick_no)
+metricFamily(MetricsText *t, char const *name, char const *type,
+	     char const *help)
 {
-    struct timeval t;
+    metricf(t, "# TYPE mimedefang_%s %s\n# HELP mimedefang_%s %s\n",
+	    name, type, name, help);
+}
 
-    if (Settings.tick_interval <= 0) {
-	return;
+/**********************************************************************
+* %FUNCTION: buildMetrics
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  A malloc'd OpenMetrics text exposition, or NULL if out of memory
+* %DESCRIPTION:
+*  Renders the multiplexor's counters and gauges.  Everything comes
+*  from counters maintained as events happen, so the cost does not
+*  depend on the number of workers.
+***********************************************************************/
+static char *
+buildMetrics(void)
+{
+    MetricsText t;
+    unsigned long cum;
+    int i, kind, m, c;
+
+    t.len = 0;
+    t.size = 16384;
+    t.buf = malloc(t.size);
+    if (!t.buf) return NULL;
+    *t.buf = 0;
+
+    metricFamily(&t, "build_info", "gauge", "Multiplexor version.");
+    metricf(&t, "mimedefang_build_info{version=\"%s\"} 1\n", VERSION);
+    metricFamily(&t, "start_time_seconds", "gauge", "Time the multiplexor started.");
+    metricf(&t, "mimedefang_start_time_seconds %lu\n",
+	    (unsigned long) TimeOfProgramStart);
+    metricFamily(&t, "generation", "gauge", "Current filter generation.");
+    metricf(&t, "mimedefang_generation %d\n", Generation);
+
+    metricFamily(&t, "workers", "gauge", "Workers by state.");
+    for (i=0; i<NUM_WORKER_STATES; i++) {
+	metricf(&t, "mimedefang_workers{state=\"%s\"} %d\n",
+		state_name_lc(i), WorkerCount[i]);
+    }
+    metricFamily(&t, "workers_min", "gauge", "Minimum number of running workers.");
+    metricf(&t, "mimedefang_workers_min %d\n", Settings.minWorkers);
+    metricFamily(&t, "workers_max", "gauge", "Maximum number of workers.");
+    metricf(&t, "mimedefang_workers_max %d\n", Settings.maxWorkers);
+    metricFamily(&t, "worker_activations", "counter", "Worker processes started.");
+    metricf(&t, "mimedefang_worker_activations_total %u\n", Activations);
+    metricFamily(&t, "worker_reaps", "counter", "Worker processes that exited.");
+    metricf(&t, "mimedefang_worker_reaps_total %lu\n", NumReaps);
+    metricFamily(&t, "worker_oom", "counter", "Worker processes that exited after running out of memory.");
+    metricf(&t, "mimedefang_worker_oom_total %lu\n", NumOOMs);
+    metricFamily(&t, "worker_startup_seconds", "histogram",
+		 "Time from starting a worker process to its answering the startup ping.");
+    cum = 0;
+    for (i=0; i<NUM_METRIC_BOUNDS; i++) {
+	cum += StartupHisto.counts[i];
+	metricf(&t, "mimedefang_worker_startup_seconds_bucket{le=\"%g\"} %lu\n",
+		MetricBoundUs[i] / 1000000.0, cum);
+    }
+    metricf(&t, "mimedefang_worker_startup_seconds_bucket{le=\"+Inf\"} %lu\n", StartupHisto.count);
+    metricf(&t, "mimedefang_worker_startup_seconds_count %lu\n", StartupHisto.count);
+    metricf(&t, "mimedefang_worker_startup_seconds_sum %.6f\n", StartupHisto.sum / 1000000.0);
+
+    metricFamily(&t, "queue_capacity", "gauge", "Size of the request queue.");
+    metricf(&t, "mimedefang_queue_capacity %d\n", Settings.requestQueueSize);
+    metricFamily(&t, "queue_depth", "gauge", "Requests waiting in the queue by priority class.");
+    for (c=0; c<NUM_QUEUE_CLASSES; c++) {
+	metricf(&t, "mimedefang_queue_depth{class=\"%d\"} %d\n", c, ClassStats[c].depth);
+    }
+    metricFamily(&t, "queued_requests", "counter", "Requests queued by priority class.");
+    for (c=0; c<NUM_QUEUE_CLASSES; c++) {
+	metricf(&t, "mimedefang_queued_requests_total{class=\"%d\"} %lu\n", c, ClassStats[c].queued);
+    }
+    metricFamily(&t, "rejections", "counter", "Requests turned away for want of a free worker, including queue timeouts.");
+    metricf(&t, "mimedefang_rejections_total %lu\n", Rejections);
+    metricFamily(&t, "queue_timeouts", "counter", "Queued requests that timed out by priority class.");
+    for (c=0; c<NUM_QUEUE_CLASSES; c++) {
+	metricf(&t, "mimedefang_queue_timeouts_total{class=\"%d\"} %lu\n", c, ClassStats[c].timedOut);
+    }
+
+    metricFamily(&t, "requests", "counter", "Requests completed by a worker, by kind.");
+    for (kind=0; kind<NUM_QUEUE_KINDS; kind++) {
+	metricf(&t, "mimedefang_requests_total{kind=\"%s\"} %lu\n",
+		QueueKindName[kind], MetricLatency[kind][LAT_TOTAL].count);
+    }
+    metricFamily(&t, "request_failures", "counter", "Requests with no answer from the worker, by kind.");
+    for (kind=0; kind<NUM_QUEUE_KINDS; kind++) {
+	metricf(&t, "mimedefang_request_failures_total{kind=\"%s\"} %lu\n",
+		QueueKindName[kind], KindFailures[kind]);
+    }
+    metricFamily(&t, "request_duration_seconds", "histogram",
+		 "Request latency by kind and phase (queue wait, worker service, total).");
+    for (kind=0; kind<NUM_QUEUE_KINDS; kind++) {
+	for (m=0; m<NUM_LAT_MEASURES; m++) {
+	    MetricHisto const *mh = &MetricLatency[kind][m];
+	    cum = 0;
+	    for (i=0; i<NUM_METRIC_BOUNDS; i++) {
+		cum += mh->counts[i];
+		metricf(&t, "mimedefang_request_duration_seconds_bucket{kind=\"%s\",phase=\"%s\",le=\"%g\"} %lu\n",
+			QueueKindName[kind], LatMeasureName[m],
+			MetricBoundUs[i] / 1000000.0, cum);
+	    }
+	    metricf(&t, "mimedefang_request_duration_seconds_bucket{kind=\"%s\",phase=\"%s\",le=\"+Inf\"} %lu\n",
+		    QueueKindName[kind], LatMeasureName[m], mh->count);
+	    metricf(&t, "mimedefang_request_duration_seconds_count{kind=\"%s\",phase=\"%s\"} %lu\n",
+		    QueueKindName[kind], LatMeasureName[m], mh->count);
+	    metricf(&t, "mimedefang_request_duration_seconds_sum{kind=\"%s\",phase=\"%s\"} %.6f\n",
+		    QueueKindName[kind], LatMeasureName[m], mh->sum / 1000000.0);
+	}
     }
 
-    t.tv_usec = 0;
-    t.tv_sec = Settings.tick_interval;
-    if (!Event_AddTimerHandler(es, t, do_tick, (void *) ((long) tick_no))) {
-	syslog(LOG_CRIT, "Unable to schedule tick handler!  Event_AddTimerHandler failed!");
-    }
+    metricFamily(&t, "leases", "gauge", "Worker leases outstanding.");
+    metricf(&t, "mimedefang_leases %d\n", NumLeases);
+    metricFamily(&t, "leases_granted", "counter", "Worker leases granted.");
+    metricf(&t, "mimedefang_leases_granted_total %lu\n", LeasesGranted);
+    metricFamily(&t, "leases_denied", "counter", "Worker lease requests denied.");
+    metricf(&t, "mimedefang_leases_denied_total %lu\n", LeasesDenied);
+    metricFamily(&t, "mux_connections", "gauge", "Persistent connections from mimedefang.");
+    metricf(&t, "mimedefang_mux_connections %d\n", NumMuxConns);
+
+    metricFamily(&t, "autoscale_enabled", "gauge", "Whether adaptive autoscaling is enabled.");
+    metricf(&t, "mimedefang_autoscale_enabled %d\n", Settings.autoscaling);
+    metricFamily(&t, "autoscale_busy_ema", "gauge", "Moving average of the busy-worker ratio.");
+    metricf(&t, "mimedefang_autoscale_busy_ema %.6f\n", EMABusyRatio);
+    metricFamily(&t, "autoscale_events", "counter", "Workers started or stopped by autoscaling.");
+    metricf(&t, "mimedefang_autoscale_events_total{direction=\"out\"} %lu\n", AutoscaleOuts);
+    metricf(&t, "mimedefang_autoscale_events_total{direction=\"in\"} %lu\n", AutoscaleIns);
+    metricFamily(&t, "autoscale_predicted_demand", "gauge", "Peak demand expected by predictive autoscaling.");
+    metricf(&t, "mimedefang_autoscale_predicted_demand %.6f\n", PredictedDemand);
+    metricFamily(&t, "autoscale_predicted_workers", "gauge", "Workers predictive autoscaling keeps running.");
+    metricf(&t, "mimedefang_autoscale_predicted_workers %d\n", PredictedWorkers);
+
+    metricf(&t, "# EOF\n");
+    return t.buf;
 }
 
 /**********************************************************************
-* %FUNCTION: init_history
+* %FUNCTION: handleMetricsAccept
 * %ARGUMENTS:
-*  None
+*  es -- event selector
+*  fd -- accepted connection
 * %RETURNS:
 *  Nothing
 * %DESCRIPTION:
-*  Resets all history bucket entries to zero
+*  Handles a connection on the metrics socket.  Reads the HTTP request.
 ***********************************************************************/
 static void
-init_history(void)
+handleMetricsAccept(EventSelector *es, int fd)
 {
-    memset(history, 0, sizeof(history));
-    memset(hourly_history, 0, sizeof(hourly_history));
+    if (!EventTcp_ReadBuf(es, fd, MAX_CMD_LEN, '\n', handleMetricsRequest,
+			  Settings.clientTimeout, 1, NULL)) {
+	if (DOLOG) {
+	    syslog(LOG_ERR, "handleMetricsAccept: EventTcp_ReadBuf failed: %m");
+	}
+	close(fd);
+    }
 }
 
 /**********************************************************************
-* %FUNCTION: get_history_bucket
+* %FUNCTION: handleMetricsRequest
 * %ARGUMENTS:
-*  cmd -- which command's buckets we want
+*  es -- event selector
+*  fd -- connection
+*  buf -- start of the HTTP request
+*  len -- length of buf
+*  flag -- EventTcp flag
+*  data -- ignored
 * %RETURNS:
-*  A pointer to an initialized history bucket ready for incrementing counters
+*  Nothing
 * %DESCRIPTION:
-*  Determines current bucket and initializes it if required.
+*  Answers "GET /metrics" (or "GET /") with the OpenMetrics exposition
+*  and closes the connection.  Only the request line is looked at.
 ***********************************************************************/
-static HistoryBucket *
-get_history_bucket(int cmd)
+static void
+handleMetricsRequest(EventSelector *es,
+		     int fd,
+		     char *buf,
+		     int len,
+		     int flag,
+		     void *data)
 {
-    time_t now = time(NULL);
-    int bucket = ((int) now) % HISTORY_SECONDS;
-    HistoryBucket *b = &(history[cmd][bucket]);
-    if (b->elapsed != now) {
-	b->elapsed = now;
-	b->count = 0;
-	b->workers = 0;
-	b->ms = 0;
-	b->activated = 0;
-	b->reaped = 0;
+    char method[16], path[256];
+    MetricsReply *r;
+    struct iovec iov[2];
+    char *body = NULL;
+    char const *status;
+    size_t hlen, blen;
+
+    if (flag == EVENT_TCP_FLAG_TIMEOUT || flag == EVENT_TCP_FLAG_IOERROR ||
+	!len) {
+	close(fd);
+	return;
+    }
+    buf[len-1] = 0;
+    method[0] = 0;
+
+#ifdef MSG_DONTWAIT
+    /* Consume any headers we have not read, so closing the connection
+       does not reset it before the client has read the reply */
+    {
+	char slop[512];
+	while (recv(fd, slop, sizeof(slop), MSG_DONTWAIT) > 0);
+    }
+#endif
+
+    if (sscanf(buf, "%15s %255s", method, path) != 2) {
+	status = "400 Bad Request";
+    } else if (strcmp(method, "GET") && strcmp(method, "HEAD")) {
+	status = "405 Method Not Allowed";
+    } else if (strcmp(path, "/metrics") && strcmp(path, "/")) {
+	status = "404 Not Found";
+    } else {
+	body = buildMetrics();
+	status = body ? "200 OK" : "500 Internal Server Error";
+    }
+
+    r = malloc(sizeof(MetricsReply));
+    if (!r) {
+	free(body);
+	close(fd);
+	return;
+    }
+    r->body = body;
+    blen = body ? strlen(body) : 0;
+    hlen = snprintf(r->header, sizeof(r->header),
+		    "HTTP/1.0 %s\r\n"
+		    "Content-Type: %s\r\n"
+		    "Content-Length: %lu\r\n"
+		    "Connection: close\r\n\r\n",
+		    status,
+		    body ? "application/openmetrics-text; version=1.0.0; charset=utf-8" : "text/plain",
+		    (unsigned long) blen);
+    if (!strcmp(method, "HEAD")) blen = 0;
+
+    /* The exposition can be large, so write it where it lies */
+    iov[0].iov_base = r->header;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = body;
+    iov[1].iov_len = blen;
+    if (!EventTcp_WriteV(es, fd, iov, blen ? 2 : 1, metricsWritten,
+			 Settings.clientTimeout, r)) {
+	if (DOLOG) {
+	    syslog(LOG_ERR, "handleMetricsRequest: EventTcp_WriteV failed: %m");
+	}
+	metricsWritten(es, fd, NULL, 0, EVENT_TCP_FLAG_IOERROR, r);
     }
-    return b;
 }
 
 /**********************************************************************
-* %FUNCTION: get_hourly_history_bucket
+* %FUNCTION: metricsWritten
 * %ARGUMENTS:
-*  cmd -- which command's buckets we want
+*  es -- event selector
+*  fd -- connection
+*  buf, len, flag -- ignored
+*  data -- the MetricsReply
 * %RETURNS:
-*  A pointer to an initialized history bucket ready for incrementing counters
+*  Nothing
 * %DESCRIPTION:
-*  Determines current bucket and initializes it if required.
+*  Frees the metrics reply and closes the connection once it has been
+*  written or the write has failed.
 ***********************************************************************/
-static HistoryBucket *
-get_hourly_history_bucket(int cmd)
+static void
+metricsWritten(EventSelector *es,
+	       int fd,
+	       char *buf,
+	       int len,
+	       int flag,
+	       void *data)
 {
-    time_t now = time(NULL);
-    int hour = ((int) now) / 3600;
-    int bucket = hour % HISTORY_HOURS;
-    HistoryBucket *b = &(hourly_history[cmd][bucket]);
-    if (b->elapsed != hour) {
-	b->first = now;
-	b->elapsed = hour;
-	b->count = 0;
-	b->workers = 0;
-	b->ms = 0;
-	b->activated = 0;
-	b->reaped = 0;
-    }
-    b->last = now;
-    return b;
+    MetricsReply *r = (MetricsReply *) data;
+
+    free(r->body);
+    free(r);
+    close(fd);
 }
 
 /**********************************************************************
@@ -5155,7 +10329,8 @@ get_history_totals(int cmd,
 {
     int start = ((int) now) - back + 1;
     int end = (int) now;
-    int i, bucket;
+    HistoryTotals const *hi, *lo;
+    static HistoryTotals const zero = {0, 0, 0, 0, 0};
 
     *total = 0;
     *workers = 0;
@@ -5166,16 +10341,32 @@ get_history_totals(int cmd,
     if (back <= 0) return 0;
     if (back > HISTORY_SECONDS) return -1;
 
-    for (i = start; i <= end; i++) {
-	bucket = i % HISTORY_SECONDS;
-	if (history[cmd][bucket].elapsed == i) {
-	    (*total)  += history[cmd][bucket].count;
-	    (*workers) += history[cmd][bucket].workers;
-	    (*ms)     += history[cmd][bucket].ms;
-	    (*activated) += history[cmd][bucket].activated;
-	    (*reaped) += history[cmd][bucket].reaped;
-	}
+    advance_history(time(NULL));
+    if (end > history_now) end = history_now;
+    if (start > end) return 0;
+
+    /* Totals at the end of second "end" ... */
+    if (end == history_now) {
+	hi = &history_total[cmd];
+    } else if (history_mark_time[(end + 1) % HISTORY_SECONDS] == end + 1) {
+	hi = &history_mark[cmd][(end + 1) % HISTORY_SECONDS];
+    } else {
+	return 0;
     }
+
+    /* ... less the totals at the start of second "start".  Seconds
+       with no mark are from before we started. */
+    if (history_mark_time[start % HISTORY_SECONDS] == start) {
+	lo = &history_mark[cmd][start % HISTORY_SECONDS];
+    } else {
+	lo = &zero;
+    }
+
+    *total = (int) (hi->count - lo->count);
+    *workers = (int) (hi->workers - lo->workers);
+    *ms = (BIG_INT) (hi->ms - lo->ms);
+    *activated = (int) (hi->activated - lo->activated);
+    *reaped = (int) (hi->reaped - lo->reaped);
     return 0;
 }
 
@@ -191,6 +191,7 @@ struct privdata {
     unsigned char suspiciousBody; /* Suspicious characters in message body? */
     unsigned char lastWasCR;	/* Last char of body chunk was CR? */
     unsigned char filterFailed; /* Filter failed */
+    unsigned int lease;         /* Multiplexor worker lease, or 0 */
 };
 
 static void set_queueid(SMFICTX *ctx);
@@ -212,6 +213,7 @@ static void append_percent_encoded(dynamic_buffer *dbuf,
 				   char const *buf);
 
 static sfsistat cleanup(SMFICTX *ctx);
+static void release_lease(struct privdata *data);
 static sfsistat mfclose(SMFICTX *ctx);
 static int do_sm_quarantine(SMFICTX *ctx, char const *reason);
 static void remove_working_directory(SMFICTX *ctx, struct privdata *data);
@@ -248,6 +250,10 @@ static int keepFailedDirectories = 0;
 /* Number of scanning workers reserved for connection from loopback */
 static int workersReservedForLoopback = -1;
 
+/* Lifetime in seconds of the worker lease taken in mfconnect; 0 means
+   don't take one */
+static int LeaseTTL = 0;
+
 static void set_dsn(SMFICTX *ctx, char *buf2, int code);
 
 #define NO_DELETE_NAME "/DO-NOT-DELETE-WORK-DIRS"
@@ -483,6 +489,7 @@ static sfsistat
 mfconnect(SMFICTX *ctx, char *hostname, _SOCK_ADDR *sa)
 {
     struct privdata *data;
+    unsigned int lease = 0;
 
     char const *tmp;
     char *me;
@@ -503,12 +510,9 @@ mfconnect(SMFICTX *ctx, char *hostname, _SOCK_ADDR *sa)
     if (!AllowNewConnectionsToQueue) {
 	int is_local;
 	int required_workers;
-	int n = MXCheckFreeWorkers(MultiplexorSocketName, NULL);
-	if (n < 0) {
-	    syslog(LOG_WARNING, "mfconnect: Error communicating with multiplexor");
-	    DEBUG_EXIT("mfconnect", "SMFIS_TEMPFAIL");
-	    return SMFIS_TEMPFAIL;
-	}
+	MXGaugeValues gauge;
+	int n;
+
 	if (!sa) {
 	    is_local = 1;
 	} else {
@@ -524,6 +528,29 @@ mfconnect(SMFICTX *ctx, char *hostname, _SOCK_ADDR *sa)
 	} else {
 	    required_workers = 0;
 	}
+
+	/* Read the multiplexor's shared gauge if it publishes one;
+	   otherwise ask it over the socket.  With -l, take a lease on a
+	   worker instead of just counting them, so that connections
+	   admitted together don't all race for the same workers later.
+	   If the gauge already shows too few, don't bother asking. */
+	if (MXGaugeRead(MultiplexorSocketName, &gauge) == 0) {
+	    n = gauge.idle + gauge.stopped - gauge.leased;
+	    if (n < 0) n = 0;
+	} else {
+	    n = -1;
+	}
+	if (LeaseTTL > 0 && (n < 0 || n > required_workers)) {
+	    n = MXLease(MultiplexorSocketName, LeaseTTL, required_workers,
+			&lease, NULL);
+	} else if (n < 0) {
+	    n = MXCheckFreeWorkers(MultiplexorSocketName, NULL);
+	}
+	if (n < 0) {
+	    syslog(LOG_WARNING, "mfconnect: Error communicating with multiplexor");
+	    DEBUG_EXIT("mfconnect", "SMFIS_TEMPFAIL");
+	    return SMFIS_TEMPFAIL;
+	}
 	if (n <= required_workers) {
 	    if (workersReservedForLoopback < 0 ||
 		! is_local) {
@@ -536,6 +563,7 @@ mfconnect(SMFICTX *ctx, char *hostname, _SOCK_ADDR *sa)
 
     data = malloc_with_log(sizeof *data);
     if (!data) {
+	if (lease) MXUnlease(MultiplexorSocketName, lease, NULL);
 	DEBUG_EXIT("mfconnect", "SMFIS_TEMPFAIL");
 	return SMFIS_TEMPFAIL;
     }
@@ -559,9 +587,11 @@ mfconnect(SMFICTX *ctx, char *hostname, _SOCK_ADDR *sa)
     data->suspiciousBody = 0;
     data->lastWasCR      = 0;
     data->filterFailed   = 0;
+    data->lease          = lease;
 
     /* Save private data */
     if (smfi_setpriv(ctx, data) != MI_SUCCESS) {
+	release_lease(data);
 	free(data);
 	/* Can't hurt... */
 	smfi_setpriv(ctx, NULL);
@@ -691,7 +721,7 @@ mfconnect(SMFICTX *ctx, char *hostname, _SOCK_ADDR *sa)
 
     if (doRelayCheck) {
 	char buf2[SMALLBUF];
-	int n = MXRelayOK(MultiplexorSocketName, buf2, data->hostip,
+	int n = MXRelayOK(MultiplexorSocketName, data->lease, buf2, data->hostip,
 			  data->hostname, data->hostport, data->myip, data->daemon_port, data->qid);
 	if (n == MD_REJECT) {
 	    /* Can't call smfi_setreply from connect callback */
@@ -758,7 +788,7 @@ helo(SMFICTX *ctx, char *helohost)
 
     if (doHeloCheck) {
 	char buf2[SMALLBUF];
-	int n = MXHeloOK(MultiplexorSocketName, buf2, data->hostip,
+	int n = MXHeloOK(MultiplexorSocketName, data->lease, buf2, data->hostip,
 			 data->hostname, data->heloArg, data->hostport, data->myip, data->daemon_port, data->qid);
 	if (n == MD_REJECT) {
 	    set_dsn(ctx, buf2, 5);
@@ -980,7 +1010,7 @@ envfrom(SMFICTX *ctx, char **from)
     data->cmdFD = put_fd(data->cmdFD);
 
     if (doSenderCheck) {
-	int n = MXSenderOK(MultiplexorSocketName, buf2,
+	int n = MXSenderOK(MultiplexorSocketName, data->lease, buf2,
 			   (char const **) from, data->hostip, data->hostname,
 			   data->heloArg, data->dir, data->qid);
 	if (n == MD_REJECT) {
@@ -1214,7 +1244,7 @@ rcptto(SMFICTX *ctx, char **to)
 		return SMFIS_TEMPFAIL;
 	    }
 	}
-	n = MXRecipientOK(MultiplexorSocketName, ans,
+	n = MXRecipientOK(MultiplexorSocketName, data->lease, ans,
 			  (char const **) to, data->sender, data->hostip,
 			  data->hostname, data->firstRecip, data->heloArg,
 			  data->dir, data->qid,
@@ -1715,13 +1745,16 @@ eom(SMFICTX *ctx)
     data->lastWasCR = 0;
 
     /* Run the filter */
-    if (MXScanDir(MultiplexorSocketName, data->qid, data->dir) < 0) {
+    if (MXScanDir(MultiplexorSocketName, data->lease, data->qid, data->dir) < 0) {
 	data->filterFailed = 1;
 	cleanup(ctx);
 	DEBUG_EXIT("eom", "SMFIS_TEMPFAIL");
 	return SMFIS_TEMPFAIL;
     }
 
+    /* The scan consumed the lease */
+    data->lease = 0;
+
     /* Read the results file */
     snprintf(buffer, SMALLBUF, "%s/RESULTS", data->dir);
     res_fd = open(buffer, O_RDONLY);
@@ -2096,6 +2129,7 @@ mfclose(SMFICTX *ctx)
     DEBUG_ENTER("mfclose");
     cleanup(ctx);
     if (data) {
+	release_lease(data);
 	if (data->fd >= 0)       closefd(data->fd);
 	if (data->headerFD >= 0) closefd(data->headerFD);
 	if (data->cmdFD >= 0)    closefd(data->cmdFD);
@@ -2121,14 +2155,36 @@ mfclose(SMFICTX *ctx)
 *%RETURNS:
 * SMFIS_TEMPFAIL or SMFIS_CONTINUE
 *%DESCRIPTION:
-* Called if current message is aborted.  Just cleans up.
+* Called if current message is aborted.  Cleans up and gives back any
+* worker lease the connection still holds.
 ***********************************************************************/
 static sfsistat
 mfabort(SMFICTX *ctx)
 {
+    struct privdata *data = DATA;
+
+    if (data) release_lease(data);
     return cleanup(ctx);
 }
 
+/**********************************************************************
+*%FUNCTION: release_lease
+*%ARGUMENTS:
+* data -- our private data
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Releases the worker lease taken in mfconnect if no scan consumed it.
+***********************************************************************/
+static void
+release_lease(struct privdata *data)
+{
+    if (data->lease) {
+	MXUnlease(MultiplexorSocketName, data->lease, data->qid);
+	data->lease = 0;
+    }
+}
+
 /**********************************************************************
 *%FUNCTION: cleanup
 *%ARGUMENTS:
@@ -2268,6 +2324,8 @@ usage(void)
     fprintf(stderr, "  -T                -- Log filter times to syslog\n");
     fprintf(stderr, "  -b n              -- Set listen() backlog to n\n");
     fprintf(stderr, "  -C                -- Try very hard to conserve file descriptors\n");
+    fprintf(stderr, "  -J n              -- Keep n persistent connections to multiplexor\n");
+    fprintf(stderr, "  -l ttl            -- Lease a worker for up to ttl seconds per connection\n");
     fprintf(stderr, "  -x string         -- Add string as X-Scanned-By header\n");
     fprintf(stderr, "  -X                -- Do not add X-Scanned-By header\n");
     fprintf(stderr, "  -D                -- Do not become a daemon (stay in foreground)\n");
@@ -2316,6 +2374,7 @@ main(int argc, char **argv)
     int j;
     mode_t socket_umask = 077;
     mode_t file_umask   = 077;
+    int muxConnections = 0;
 
 #ifdef ENABLE_DEBUGGING
     /* Keep debugging malloc macros happy... */
@@ -2370,7 +2429,7 @@ main(int argc, char **argv)
     }
 
     /* Process command line options */
-    while ((c = getopt(argc, argv, "GNCDHL:MP:o:R:S:TU:Xa:b:cdhkm:p:qrstvx:z:y")) != -1) {
+    while ((c = getopt(argc, argv, "GNCDHJ:L:MP:o:R:S:TU:Xa:b:cdhkl:m:p:qrstvx:z:y")) != -1) {
 	switch (c) {
 	case 'y':
 	    setsymlist_ok = 1;
@@ -2417,6 +2476,16 @@ main(int argc, char **argv)
 	case 'C':
 	    ConserveDescriptors = 1;
 	    break;
+	case 'J':
+	    sscanf(optarg, "%d", &muxConnections);
+	    if (muxConnections < 0) muxConnections = 0;
+	    if (muxConnections > 64) muxConnections = 64;
+	    break;
+	case 'l':
+	    sscanf(optarg, "%d", &LeaseTTL);
+	    if (LeaseTTL < 0) LeaseTTL = 0;
+	    if (LeaseTTL > 3600) LeaseTTL = 3600;
+	    break;
 
 	case 'v':
 	    printf("mimedefang version %s\n", VERSION);
@@ -2623,6 +2692,11 @@ main(int argc, char **argv)
 	exit(EXIT_FAILURE);
     }
 
+    if (MXPoolInit(muxConnections) < 0) {
+	fprintf(stderr, "%s: Out of memory\n", argv[0]);
+	exit(EXIT_FAILURE);
+    }
+
     /* Open the pidfile as root.  We'll write the pid later on in the grandchild */
     if (pidfile) {
 	pidfile_fd = open(pidfile, O_RDWR|O_CREAT, 0666);
@@ -30,19 +30,85 @@ extern int percent_encode(char const *in, char *out, int outlen);
 extern void percent_decode(char *buf);
 
 extern int MXCheckFreeWorkers(char const *sockname, char const *qid);
-extern int MXScanDir(char const *sockname, char const *qid, char const *dir);
+extern int MXScanDir(char const *sockname, unsigned int lease, char const *qid, char const *dir);
 extern int MXCommand(char const *sockname, char const *cmd, char *buf, int len, char const *qid);
-extern int MXRelayOK(char const *sockname, char *msg,
+extern int (*MXCommandHook)(char const *sockname, char const *cmd, char *buf, int len, char const *qid);
+extern int MXPoolInit(int n);
+extern int MXLease(char const *sockname, int ttl, int required, unsigned int *lease, char const *qid);
+extern int MXUnlease(char const *sockname, unsigned int lease, char const *qid);
+
+/* Binary framed requests on a persistent multiplexor connection.  A
+   frame is a four-byte big-endian length followed by that many bytes.
+   A request frame holds the request ID (4 bytes), the opcode (1), a
+   lease ID (4) and the number of fields (1), then the fields; a
+   string field is 's', a two-byte length and the bytes, and a number
+   field is 'u' and four bytes.  A reply frame holds the request ID, a
+   status byte (0) and the reply text.  All numbers are big-endian. */
+#define MXOP_TEXT     0		/* A text command, as one string        */
+#define MXOP_FREE     1
+#define MXOP_SCAN     2		/* qid dir                              */
+#define MXOP_RELAYOK  3		/* ip name port myip daemon_port qid    */
+#define MXOP_HELOOK   4		/* ip name helo port myip daemon_port qid */
+#define MXOP_SENDEROK 5		/* sender ip name helo dir qid esmtp... */
+#define MXOP_RECIPOK  6		/* recipient sender ip name firstrecip helo
+				   dir qid mailer host addr esmtp...    */
+#define MXOP_LEASE    7		/* ttl required                         */
+#define MXOP_UNLEASE  8		/* (lease ID in the header)             */
+#define MXOP_MAX      8
+
+#define MX_FRAME_MAX    65536	/* Longest frame either side accepts    */
+#define MX_FRAME_FIELDS 255	/* Most fields in a request             */
+
+/* A request field: a string, or a number if str is NULL */
+typedef struct {
+    char const *str;
+    unsigned int num;
+} MXField;
+
+/* Request fields decoded by decode_frame_fields */
+typedef struct {
+    int nfields;
+    char *str[MX_FRAME_FIELDS];	/* Fields as strings; numbers in decimal */
+    unsigned int num[MX_FRAME_FIELDS];
+    unsigned char isnum[MX_FRAME_FIELDS];
+} MXFrameFields;
+
+/* Room decode_frame_fields may need for the text of one frame */
+#define MX_FRAME_TEXT (MX_FRAME_MAX + MX_FRAME_FIELDS * 12)
+
+extern int decode_frame_fields(unsigned char const *p,
+			       unsigned char const *end,
+			       MXFrameFields *f, char *text);
+extern int (*MXFrameHook)(char const *sockname, int op, unsigned int lease,
+			  MXField const *fields, int nfields,
+			  char *buf, int len, char const *qid);
+
+/* Worker counts published by the multiplexor in its shared gauge */
+typedef struct {
+    int idle;
+    int busy;
+    int stopped;
+    int killed;
+    int queued;
+    int leased;
+    unsigned int generation;
+} MXGaugeValues;
+
+extern int MXGaugeCreate(char const *path);
+extern void MXGaugeUpdate(MXGaugeValues const *v);
+extern void MXGaugeClose(void);
+extern int MXGaugeRead(char const *sockname, MXGaugeValues *v);
+extern int MXRelayOK(char const *sockname, unsigned int lease, char *msg,
 		     char const *ip, char const *name, unsigned int port,
 		     char const *myip, unsigned int daemon_port, char const *qid);
-extern int MXHeloOK(char const *sockname, char *msg,
+extern int MXHeloOK(char const *sockname, unsigned int lease, char *msg,
 		    char const *ip, char const *name, char const *helo,
 		    unsigned int port, char const *myip, unsigned int daemon_port, char const *qid);
 
-extern int MXSenderOK(char const *sockname, char *msg,
+extern int MXSenderOK(char const *sockname, unsigned int lease, char *msg,
 		      char const **sender_argv, char const *ip, char const *name,
 		      char const *helo, char const *dir, char const *qid);
-extern int MXRecipientOK(char const *sockname, char *msg,
+extern int MXRecipientOK(char const *sockname, unsigned int lease, char *msg,
 			 char const **recip_argv,
 			 char const *sender, char const *ip, char const *name,
 			 char const *firstRecip, char const *helo,
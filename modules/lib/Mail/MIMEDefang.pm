@@ -40,6 +40,7 @@ require Exporter;
 
 use Carp;
 use Errno qw(ENOENT EACCES);
+use Fcntl qw(SEEK_SET SEEK_CUR);
 use File::Spec;
 use IO::File;
 use MIME::Entity;
@@ -61,7 +62,7 @@ our $VERSION = '3.7.1';
       $QuarantineSubdir $QueueID $MsgID $MIMEDefangID
       $RelayAddr $WasResent $RelayHostname
       $RealRelayAddr $RealRelayHostname
-      $ReplacementEntity $Sender $ServerMode $Subject $SubjectCount
+      $ReplacementEntity $Sender $ServerMode $Subject $SubjectCount $WarmUp
       $ClamdSock $SophieSock $TrophieSock
       $Helo @ESMTPArgs
       @SenderESMTPArgs %RecipientESMTPArgs
@@ -645,6 +646,10 @@ Open the status file descriptor
 
 =cut
 
+# Where our slot on the multiplexor's status board is, if the status
+# descriptor is the board rather than a pipe
+my ($StatusOffset, $StatusSeq);
+
 # Try to open the status descriptor
 sub init_status_tag
 {
@@ -652,6 +657,10 @@ sub init_status_tag
 
 	if(open(STATUS_HANDLE, ">&=", 3)) { ## no critic
 		STATUS_HANDLE->autoflush(1);
+		if(-f STATUS_HANDLE) {
+			$StatusOffset = sysseek(STATUS_HANDLE, 0, SEEK_CUR);
+			$StatusSeq = 0;
+		}
 	} else {
 		$DoStatusTags = 0;
 	}
@@ -681,11 +690,22 @@ sub set_status_tag
 	$tag ||= '';
 
 	if($tag eq '') {
-		print STATUS_HANDLE "\n";
+		print STATUS_HANDLE "\n" unless defined($StatusOffset);
 		return;
 	}
 	$tag =~ s/[^[:graph:]]/ /g;
 
+	if(defined($StatusOffset)) {
+		# One write of sequence number, tag and sequence number
+		# again, so the multiplexor can tell a torn read
+		$tag = "$depth: $tag";
+		$tag .= " $MsgID" if(defined($MsgID) and ($MsgID ne "NOQUEUE"));
+		$StatusSeq = ($StatusSeq % 0xFFFFFFFF) + 1;
+		sysseek(STATUS_HANDLE, $StatusOffset, SEEK_SET);
+		syswrite(STATUS_HANDLE, pack("N Z64 N", $StatusSeq, $tag, $StatusSeq));
+		return;
+	}
+
 	if(defined($MsgID) and ($MsgID ne "NOQUEUE")) {
 		print STATUS_HANDLE percent_encode("$depth: $tag $MsgID") . "\n";
 	} else {
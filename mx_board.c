@@ -0,0 +1,372 @@
+/***********************************************************************
+*
+* mx_board.c
+*
+* Shared-memory worker status board.
+*
+* The multiplexor keeps one fixed-size slot per worker in a file next
+* to its socket, which it maps shared.  Each slot has two halves:
+*
+* - The multiplexor's half holds the worker's state, process-ID,
+*   counters and current command.  It is guarded by a sequence lock
+*   just like the gauge in mx_gauge.c, so md-mx-ctrl can map the file
+*   read-only and take a consistent snapshot without asking the
+*   multiplexor.
+*
+* - The worker's half holds its status tag.  Instead of a status pipe,
+*   each worker gets its own descriptor for the board file on fd 3,
+*   positioned at its half of its slot.  The worker updates its tag with
+*   a single write of a big-endian sequence number, the NUL-padded tag
+*   and the sequence number again.  A reader that sees two different
+*   sequence numbers caught the write half-way and retries.  The
+*   multiplexor only looks at tags when somebody asks for them, so a
+*   status update costs the worker one write and the multiplexor
+*   nothing.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+***********************************************************************/
+
+#include "config.h"
+#include "mx_board.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define BOARD_MAGIC   0x4d444231	/* "MDB1" */
+
+typedef struct {
+    atomic_uint magic;		/* BOARD_MAGIC once initialized; 0 on exit */
+    atomic_uint nslots;		/* Number of slots                         */
+    atomic_uint slotSize;	/* sizeof(BoardSlot)                       */
+    atomic_uint tagOffset;	/* Offset of the worker's half of a slot   */
+    char pad[48];
+} BoardHeader;
+
+typedef struct {
+    /* Written by the multiplexor */
+    atomic_uint seq;		/* Odd while an update is in progress */
+    atomic_int state;
+    atomic_long pid;
+    atomic_int generation;
+    atomic_int numRequests;
+    atomic_int numScans;
+    atomic_long stateChange;
+    atomic_long started;
+    atomic_uint tagSeq;
+    char command[MX_BOARD_TAG_LEN];
+
+    /* Written by the worker */
+    unsigned char wseq[4];
+    char tag[MX_BOARD_TAG_LEN];
+    unsigned char wseq2[4];
+} BoardSlot;
+
+static BoardHeader *Board = NULL;
+static size_t BoardSize = 0;
+static int BoardSlots = 0;
+static char *BoardPath = NULL;
+
+#define SLOT(i) (((BoardSlot *) (Board + 1)) + (i))
+
+static unsigned int
+get_be32(unsigned char const *p)
+{
+    return ((unsigned int) p[0] << 24) | ((unsigned int) p[1] << 16) |
+	((unsigned int) p[2] << 8) | (unsigned int) p[3];
+}
+
+/**********************************************************************
+* %FUNCTION: MXBoardCreate
+* %ARGUMENTS:
+*  path -- file to hold the board
+*  nslots -- number of workers
+* %RETURNS:
+*  0 on success, -1 on failure.
+* %DESCRIPTION:
+*  Creates and maps the board for writing, with every slot cleared.
+***********************************************************************/
+int
+MXBoardCreate(char const *path, int nslots)
+{
+    size_t size = sizeof(BoardHeader) + (size_t) nslots * sizeof(BoardSlot);
+    int fd;
+    void *m;
+
+    BoardPath = strdup(path);
+    if (!BoardPath) {
+	syslog(LOG_ERR, "Could not create status board: Out of memory");
+	return -1;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+	syslog(LOG_ERR, "Could not open status board %s: %m", path);
+	return -1;
+    }
+
+    /* Truncate first so stale slots read back as zeroes */
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t) size) < 0) {
+	syslog(LOG_ERR, "Could not size status board %s: %m", path);
+	close(fd);
+	return -1;
+    }
+    m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+	syslog(LOG_ERR, "Could not map status board %s: %m", path);
+	return -1;
+    }
+    Board = (BoardHeader *) m;
+    BoardSize = size;
+    BoardSlots = nslots;
+
+    atomic_store(&Board->nslots, (unsigned int) nslots);
+    atomic_store(&Board->slotSize, (unsigned int) sizeof(BoardSlot));
+    atomic_store(&Board->tagOffset, (unsigned int) offsetof(BoardSlot, wseq));
+    atomic_store(&Board->magic, BOARD_MAGIC);
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: MXBoardWorkerFD
+* %ARGUMENTS:
+*  slot -- worker number
+* %RETURNS:
+*  A new write-only descriptor for the board positioned at the worker's
+*  half of the slot, or -1 on failure.
+* %DESCRIPTION:
+*  Each worker needs its own open file so that its file position is not
+*  shared with any other worker.
+***********************************************************************/
+int
+MXBoardWorkerFD(int slot)
+{
+    off_t off;
+    int fd;
+
+    if (!Board || slot < 0 || slot >= BoardSlots) return -1;
+
+    fd = open(BoardPath, O_WRONLY);
+    if (fd < 0) return -1;
+    off = (off_t) ((char *) SLOT(slot) - (char *) Board) +
+	(off_t) offsetof(BoardSlot, wseq);
+    if (lseek(fd, off, SEEK_SET) != off) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/**********************************************************************
+* %FUNCTION: MXBoardResetTag
+* %ARGUMENTS:
+*  slot -- worker number
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Clears the worker's half of the slot.  Call it only while no process
+*  holds the slot's descriptor, ie. before starting a worker.
+***********************************************************************/
+void
+MXBoardResetTag(int slot)
+{
+    BoardSlot *s;
+
+    if (!Board || slot < 0 || slot >= BoardSlots) return;
+    s = SLOT(slot);
+    memset(s->wseq, 0, sizeof(s->wseq));
+    memset(s->tag, 0, sizeof(s->tag));
+    memset(s->wseq2, 0, sizeof(s->wseq2));
+}
+
+/**********************************************************************
+* %FUNCTION: MXBoardPublish
+* %ARGUMENTS:
+*  slot -- worker number
+*  v -- worker's current values
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Publishes the multiplexor's half of a slot.  Does nothing if the
+*  board was not created.
+***********************************************************************/
+void
+MXBoardPublish(int slot, MXBoardValues const *v)
+{
+    BoardSlot *s;
+    unsigned int seq;
+
+    if (!Board || slot < 0 || slot >= BoardSlots) return;
+    s = SLOT(slot);
+
+    seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&s->state, v->state, memory_order_relaxed);
+    atomic_store_explicit(&s->pid, v->pid, memory_order_relaxed);
+    atomic_store_explicit(&s->generation, v->generation, memory_order_relaxed);
+    atomic_store_explicit(&s->numRequests, v->numRequests, memory_order_relaxed);
+    atomic_store_explicit(&s->numScans, v->numScans, memory_order_relaxed);
+    atomic_store_explicit(&s->stateChange, v->stateChange, memory_order_relaxed);
+    atomic_store_explicit(&s->started, v->started, memory_order_relaxed);
+    atomic_store_explicit(&s->tagSeq, v->tagSeq, memory_order_relaxed);
+    memcpy(s->command, v->command, MX_BOARD_TAG_LEN);
+    s->command[MX_BOARD_TAG_LEN-1] = 0;
+
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+}
+
+/**********************************************************************
+* %FUNCTION: MXBoardReadTag
+* %ARGUMENTS:
+*  slot -- worker number
+*  seq -- set to the worker's sequence number (0 if it never wrote)
+*  tag -- buffer of MX_BOARD_TAG_LEN bytes for the worker's tag
+* %RETURNS:
+*  0 on success, -1 if there is no board or the worker was writing
+*  every time we looked.
+***********************************************************************/
+int
+MXBoardReadTag(int slot, unsigned int *seq, char *tag)
+{
+    BoardSlot *s;
+    unsigned int s1, s2;
+    int tries;
+
+    if (!Board || slot < 0 || slot >= BoardSlots) return -1;
+    s = SLOT(slot);
+
+    /* The worker writes front to back, so read back to front */
+    for (tries = 0; tries < 100; tries++) {
+	s2 = get_be32(s->wseq2);
+	atomic_thread_fence(memory_order_acquire);
+	memcpy(tag, s->tag, MX_BOARD_TAG_LEN);
+	atomic_thread_fence(memory_order_acquire);
+	s1 = get_be32(s->wseq);
+	if (s1 == s2) {
+	    tag[MX_BOARD_TAG_LEN-1] = 0;
+	    *seq = s1;
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+/**********************************************************************
+* %FUNCTION: MXBoardClose
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Marks the board invalid so readers stop trusting it, and unmaps it.
+***********************************************************************/
+void
+MXBoardClose(void)
+{
+    if (!Board) return;
+    atomic_store(&Board->magic, 0);
+    munmap((void *) Board, BoardSize);
+    Board = NULL;
+}
+
+/**********************************************************************
+* %FUNCTION: MXBoardOpen
+* %ARGUMENTS:
+*  path -- board file
+* %RETURNS:
+*  The number of slots, or -1 if there is no valid board.
+* %DESCRIPTION:
+*  Maps the board read-only.
+***********************************************************************/
+int
+MXBoardOpen(char const *path)
+{
+    struct stat sbuf;
+    BoardHeader *h;
+    size_t size;
+    int fd;
+    void *m;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &sbuf) < 0 || sbuf.st_size < (off_t) sizeof(BoardHeader)) {
+	close(fd);
+	return -1;
+    }
+    m = mmap(NULL, (size_t) sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+
+    h = (BoardHeader *) m;
+    size = sizeof(BoardHeader) +
+	(size_t) atomic_load(&h->nslots) * sizeof(BoardSlot);
+    if (atomic_load(&h->magic) != BOARD_MAGIC ||
+	atomic_load(&h->slotSize) != sizeof(BoardSlot) ||
+	size > (size_t) sbuf.st_size) {
+	munmap(m, (size_t) sbuf.st_size);
+	return -1;
+    }
+    Board = h;
+    BoardSize = (size_t) sbuf.st_size;
+    BoardSlots = (int) atomic_load(&h->nslots);
+    return BoardSlots;
+}
+
+/**********************************************************************
+* %FUNCTION: MXBoardRead
+* %ARGUMENTS:
+*  slot -- worker number
+*  v -- filled in with the multiplexor's half of the slot
+* %RETURNS:
+*  0 if v holds a consistent snapshot; -1 if the board has gone away or
+*  the multiplexor is wedged mid-update.
+***********************************************************************/
+int
+MXBoardRead(int slot, MXBoardValues *v)
+{
+    BoardSlot *s;
+    unsigned int s1, s2;
+    int tries;
+
+    if (!Board || slot < 0 || slot >= BoardSlots) return -1;
+    s = SLOT(slot);
+
+    for (tries = 0; tries < 100; tries++) {
+	if (atomic_load_explicit(&Board->magic, memory_order_relaxed) != BOARD_MAGIC) {
+	    return -1;
+	}
+	s1 = atomic_load_explicit(&s->seq, memory_order_acquire);
+	if (s1 & 1) continue;
+
+	v->state = atomic_load_explicit(&s->state, memory_order_relaxed);
+	v->pid = atomic_load_explicit(&s->pid, memory_order_relaxed);
+	v->generation = atomic_load_explicit(&s->generation, memory_order_relaxed);
+	v->numRequests = atomic_load_explicit(&s->numRequests, memory_order_relaxed);
+	v->numScans = atomic_load_explicit(&s->numScans, memory_order_relaxed);
+	v->stateChange = atomic_load_explicit(&s->stateChange, memory_order_relaxed);
+	v->started = atomic_load_explicit(&s->started, memory_order_relaxed);
+	v->tagSeq = atomic_load_explicit(&s->tagSeq, memory_order_relaxed);
+	memcpy(v->command, s->command, MX_BOARD_TAG_LEN);
+
+	atomic_thread_fence(memory_order_acquire);
+	s2 = atomic_load_explicit(&s->seq, memory_order_relaxed);
+	if (s1 != s2) continue;
+
+	v->command[MX_BOARD_TAG_LEN-1] = 0;
+	return 0;
+    }
+    return -1;
+}
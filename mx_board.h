@@ -0,0 +1,44 @@
+/***********************************************************************
+*
+* mx_board.h
+*
+* Shared-memory worker status board.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+***********************************************************************/
+
+#ifndef INCLUDE_MX_BOARD_H
+#define INCLUDE_MX_BOARD_H 1
+
+#define MX_BOARD_TAG_LEN 64	/* Same as the multiplexor's status tag */
+
+/* What the multiplexor publishes about a worker */
+typedef struct {
+    int state;			/* 'I', 'B', 'S' or 'K'                  */
+    long pid;			/* Process-ID, or -1 if stopped          */
+    int generation;		/* Filter generation                     */
+    int numRequests;		/* Requests handled by this process      */
+    int numScans;		/* Scans handled by this process         */
+    long stateChange;		/* Time of last state change             */
+    long started;		/* Time the worker process started       */
+    unsigned int tagSeq;	/* Tag sequence at last state change     */
+    char command[MX_BOARD_TAG_LEN]; /* Current command, if busy          */
+} MXBoardValues;
+
+/* Multiplexor side */
+extern int MXBoardCreate(char const *path, int nslots);
+extern int MXBoardWorkerFD(int slot);
+extern void MXBoardResetTag(int slot);
+extern void MXBoardPublish(int slot, MXBoardValues const *v);
+extern void MXBoardClose(void);
+
+/* Reader side (md-mx-ctrl) */
+extern int MXBoardOpen(char const *path);
+extern int MXBoardRead(int slot, MXBoardValues *v);
+
+/* Both */
+extern int MXBoardReadTag(int slot, unsigned int *seq, char *tag);
+
+#endif
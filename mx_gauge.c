@@ -0,0 +1,262 @@
+/***********************************************************************
+*
+* mx_gauge.c
+*
+* Free-worker gauge shared between the multiplexor and mimedefang.
+*
+* The multiplexor publishes its worker counts in a small file which it
+* maps shared; mimedefang maps the same file read-only.  Updates are
+* guarded by a sequence lock: the writer makes the sequence number odd,
+* updates the counts and makes it even again, and a reader retries if
+* the number was odd or changed while it was reading.  Readers never
+* block the writer and never make a system call.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+***********************************************************************/
+
+#include "config.h"
+#include "mimedefang.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define GAUGE_MAGIC   0x4d444731	/* "MDG1" */
+
+/* A reader treats a gauge whose heartbeat is older than this many
+   seconds as stale.  The multiplexor beats once a second. */
+#define GAUGE_STALE   5
+
+/* Don't look for a missing gauge file more often than this */
+#define GAUGE_RETRY   10
+
+typedef struct {
+    atomic_uint magic;		/* GAUGE_MAGIC once initialized; 0 on exit */
+    atomic_uint seq;		/* Odd while an update is in progress      */
+    atomic_long heartbeat;	/* CLOCK_MONOTONIC seconds of last update  */
+    atomic_int idle;
+    atomic_int busy;
+    atomic_int stopped;
+    atomic_int killed;
+    atomic_int queued;
+    atomic_int leased;
+    atomic_uint generation;
+} MXGauge;
+
+/* Writer side: the multiplexor's mapping */
+static MXGauge *Gauge = NULL;
+
+/* Reader side: mimedefang's mapping, and when we last failed to get it */
+static _Atomic(MXGauge *) ReadGauge = NULL;
+static atomic_long ReadGaugeFailed = 0;
+
+static long
+gauge_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long) ts.tv_sec;
+}
+
+/**********************************************************************
+* %FUNCTION: MXGaugeCreate
+* %ARGUMENTS:
+*  path -- file to hold the gauge
+* %RETURNS:
+*  0 on success, -1 on failure.
+* %DESCRIPTION:
+*  Creates and maps the gauge for writing.  An existing file is reused
+*  rather than replaced, so a reader that mapped it under a previous
+*  multiplexor sees our updates.
+***********************************************************************/
+int
+MXGaugeCreate(char const *path)
+{
+    int fd;
+    void *m;
+
+    fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+	syslog(LOG_ERR, "Could not open gauge file %s: %m", path);
+	return -1;
+    }
+    if (ftruncate(fd, sizeof(MXGauge)) < 0) {
+	syslog(LOG_ERR, "Could not size gauge file %s: %m", path);
+	close(fd);
+	return -1;
+    }
+    m = mmap(NULL, sizeof(MXGauge), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+	syslog(LOG_ERR, "Could not map gauge file %s: %m", path);
+	return -1;
+    }
+    Gauge = (MXGauge *) m;
+
+    /* A previous multiplexor may have died mid-update */
+    if (atomic_load(&Gauge->seq) & 1) {
+	atomic_fetch_add(&Gauge->seq, 1);
+    }
+    atomic_store(&Gauge->magic, GAUGE_MAGIC);
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: MXGaugeUpdate
+* %ARGUMENTS:
+*  v -- current counts
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Publishes v and refreshes the heartbeat.  Does nothing if the gauge
+*  was not created.
+***********************************************************************/
+void
+MXGaugeUpdate(MXGaugeValues const *v)
+{
+    unsigned int seq;
+
+    if (!Gauge) return;
+
+    seq = atomic_load_explicit(&Gauge->seq, memory_order_relaxed);
+    atomic_store_explicit(&Gauge->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&Gauge->idle, v->idle, memory_order_relaxed);
+    atomic_store_explicit(&Gauge->busy, v->busy, memory_order_relaxed);
+    atomic_store_explicit(&Gauge->stopped, v->stopped, memory_order_relaxed);
+    atomic_store_explicit(&Gauge->killed, v->killed, memory_order_relaxed);
+    atomic_store_explicit(&Gauge->queued, v->queued, memory_order_relaxed);
+    atomic_store_explicit(&Gauge->leased, v->leased, memory_order_relaxed);
+    atomic_store_explicit(&Gauge->generation, v->generation, memory_order_relaxed);
+    atomic_store_explicit(&Gauge->heartbeat, gauge_now(), memory_order_relaxed);
+
+    atomic_store_explicit(&Gauge->seq, seq + 2, memory_order_release);
+}
+
+/**********************************************************************
+* %FUNCTION: MXGaugeClose
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Marks the gauge invalid so readers stop trusting it, and unmaps it.
+***********************************************************************/
+void
+MXGaugeClose(void)
+{
+    if (!Gauge) return;
+    atomic_store(&Gauge->magic, 0);
+    munmap((void *) Gauge, sizeof(MXGauge));
+    Gauge = NULL;
+}
+
+/**********************************************************************
+* %FUNCTION: open_read_gauge
+* %ARGUMENTS:
+*  sockname -- multiplexor socket name
+* %RETURNS:
+*  The reader's mapping, or NULL if there is no gauge file.
+* %DESCRIPTION:
+*  Maps sockname.gauge read-only the first time it is needed.  Threads
+*  race to install the mapping; losers unmap theirs.
+***********************************************************************/
+static MXGauge *
+open_read_gauge(char const *sockname)
+{
+    MXGauge *g = atomic_load_explicit(&ReadGauge, memory_order_acquire);
+    MXGauge *expected = NULL;
+    char path[SMALLBUF];
+    struct stat sbuf;
+    long now, failed;
+    void *m;
+    int fd;
+
+    if (g) return g;
+
+    now = gauge_now();
+    failed = atomic_load_explicit(&ReadGaugeFailed, memory_order_relaxed);
+    if (failed && now < failed + GAUGE_RETRY) return NULL;
+
+    snprintf(path, sizeof(path), "%s.gauge", sockname);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+	atomic_store_explicit(&ReadGaugeFailed, now, memory_order_relaxed);
+	return NULL;
+    }
+    if (fstat(fd, &sbuf) < 0 || sbuf.st_size < (off_t) sizeof(MXGauge)) {
+	close(fd);
+	atomic_store_explicit(&ReadGaugeFailed, now, memory_order_relaxed);
+	return NULL;
+    }
+    m = mmap(NULL, sizeof(MXGauge), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+	atomic_store_explicit(&ReadGaugeFailed, now, memory_order_relaxed);
+	return NULL;
+    }
+
+    if (!atomic_compare_exchange_strong(&ReadGauge, &expected, (MXGauge *) m)) {
+	munmap(m, sizeof(MXGauge));
+	return expected;
+    }
+    return (MXGauge *) m;
+}
+
+/**********************************************************************
+* %FUNCTION: MXGaugeRead
+* %ARGUMENTS:
+*  sockname -- multiplexor socket name
+*  v -- filled in with the multiplexor's counts
+* %RETURNS:
+*  0 if v holds a consistent, current snapshot; -1 if there is no
+*  gauge or it is stale, in which case the caller should ask the
+*  multiplexor over its socket.
+***********************************************************************/
+int
+MXGaugeRead(char const *sockname, MXGaugeValues *v)
+{
+    MXGauge *g = open_read_gauge(sockname);
+    unsigned int s1, s2;
+    long beat;
+    int tries;
+
+    if (!g) return -1;
+
+    for (tries = 0; tries < 100; tries++) {
+	if (atomic_load_explicit(&g->magic, memory_order_relaxed) != GAUGE_MAGIC) {
+	    return -1;
+	}
+	s1 = atomic_load_explicit(&g->seq, memory_order_acquire);
+	if (s1 & 1) continue;
+
+	v->idle = atomic_load_explicit(&g->idle, memory_order_relaxed);
+	v->busy = atomic_load_explicit(&g->busy, memory_order_relaxed);
+	v->stopped = atomic_load_explicit(&g->stopped, memory_order_relaxed);
+	v->killed = atomic_load_explicit(&g->killed, memory_order_relaxed);
+	v->queued = atomic_load_explicit(&g->queued, memory_order_relaxed);
+	v->leased = atomic_load_explicit(&g->leased, memory_order_relaxed);
+	v->generation = atomic_load_explicit(&g->generation, memory_order_relaxed);
+	beat = atomic_load_explicit(&g->heartbeat, memory_order_relaxed);
+
+	atomic_thread_fence(memory_order_acquire);
+	s2 = atomic_load_explicit(&g->seq, memory_order_relaxed);
+	if (s1 != s2) continue;
+
+	if (gauge_now() - beat > GAUGE_STALE) return -1;
+	return 0;
+    }
+    /* Writer is wedged mid-update */
+    return -1;
+}
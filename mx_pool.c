@@ -0,0 +1,647 @@
+/***********************************************************************
+*
+* mx_pool.c
+*
+* Persistent, multiplexed connections from mimedefang to the
+* multiplexor.
+*
+* Instead of connecting to the multiplexor for every command, the
+* milter keeps a few connections open and switches each one into
+* "mux" mode.  Any number of threads can then have requests
+* outstanding on one connection; requests and replies are tagged with
+* a request ID, so replies may come back in any order.
+*
+* We ask for binary framing ("mux binary"), in which requests carry an
+* opcode and raw fields and need no percent-encoding.  A multiplexor
+* which does not offer it gets netstrings of text commands instead.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+***********************************************************************/
+
+#include "config.h"
+#include "mimedefang.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifndef AF_LOCAL
+#define AF_LOCAL AF_UNIX
+#endif
+
+/* Longest reply we accept from the multiplexor */
+#define MAX_MUX_REPLY 65536
+
+/* A thread waiting for its reply */
+typedef struct MXWaiter_t {
+    struct MXWaiter_t *next;
+    unsigned long id;		/* Request ID                              */
+    char *buf;			/* Caller's reply buffer                   */
+    int len;			/* Size of buf                             */
+    int done;			/* 0 = waiting; 1 = got reply; -1 = failed */
+} MXWaiter;
+
+typedef struct {
+    pthread_mutex_t mutex;	/* Protects everything except the reader  */
+    pthread_cond_t cond;	/* Signalled when a waiter is done        */
+    int fd;			/* Connection, or -1                      */
+    int broken;			/* Connection failed; close when idle     */
+    int binary;			/* Connection uses binary frames          */
+    int reading;		/* A thread is reading replies            */
+    unsigned long nextId;	/* Next request ID                        */
+    MXWaiter *waiters;		/* Threads with requests in flight        */
+    char rbuf[4096];		/* Read buffer, owned by the reader       */
+    int rpos, rlen;
+} MXPoolConn;
+
+static MXPoolConn *Pool = NULL;
+static int PoolSize = 0;
+static unsigned int NextConn = 0;
+static pthread_mutex_t NextConnMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set if the multiplexor does not understand "mux" */
+static int PoolDisabled = 0;
+
+/* Set if it understands "mux" but not "mux binary" */
+static int PoolTextOnly = 0;
+
+static void
+put_u32(unsigned char *p, unsigned long v)
+{
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+static unsigned long
+get_u32(unsigned char const *p)
+{
+    return ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16) |
+	((unsigned long) p[2] << 8) | (unsigned long) p[3];
+}
+
+/**********************************************************************
+* %FUNCTION: pool_getc
+* %ARGUMENTS:
+*  c -- a pool connection
+* %RETURNS:
+*  The next byte from the connection, or -1 on error or EOF.
+* %DESCRIPTION:
+*  Buffered read.  Only the thread reading replies may call this.
+***********************************************************************/
+static int
+pool_getc(MXPoolConn *c)
+{
+    if (c->rpos >= c->rlen) {
+	int n;
+	do {
+	    n = read(c->fd, c->rbuf, sizeof(c->rbuf));
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0) return -1;
+	c->rpos = 0;
+	c->rlen = n;
+    }
+    return (unsigned char) c->rbuf[c->rpos++];
+}
+
+/**********************************************************************
+* %FUNCTION: pool_read_netstring
+* %ARGUMENTS:
+*  c -- a pool connection
+*  buf -- buffer of MAX_MUX_REPLY bytes
+* %RETURNS:
+*  Length of the netstring contents, or -1 on error.
+***********************************************************************/
+static int
+pool_read_netstring(MXPoolConn *c, char *buf)
+{
+    int len = 0;
+    int ch;
+    int i;
+
+    while ((ch = pool_getc(c)) != ':') {
+	if (ch < '0' || ch > '9') return -1;
+	len = len * 10 + (ch - '0');
+	if (len >= MAX_MUX_REPLY) return -1;
+    }
+    for (i=0; i<len; i++) {
+	if ((ch = pool_getc(c)) < 0) return -1;
+	buf[i] = (char) ch;
+    }
+    if (pool_getc(c) != ',') return -1;
+    return len;
+}
+
+/**********************************************************************
+* %FUNCTION: pool_read_frame
+* %ARGUMENTS:
+*  c -- a pool connection
+*  buf -- buffer of MAX_MUX_REPLY bytes
+* %RETURNS:
+*  Length of the frame after its length word, or -1 on error.
+***********************************************************************/
+static int
+pool_read_frame(MXPoolConn *c, char *buf)
+{
+    unsigned char hdr[4];
+    unsigned long len;
+    unsigned long i;
+    int ch;
+
+    for (i=0; i<4; i++) {
+	if ((ch = pool_getc(c)) < 0) return -1;
+	hdr[i] = (unsigned char) ch;
+    }
+    len = get_u32(hdr);
+    if (len < 5 || len >= MAX_MUX_REPLY) return -1;
+    for (i=0; i<len; i++) {
+	if ((ch = pool_getc(c)) < 0) return -1;
+	buf[i] = (char) ch;
+    }
+    return (int) len;
+}
+
+/**********************************************************************
+* %FUNCTION: pool_fail
+* %ARGUMENTS:
+*  c -- a pool connection; its mutex must be held
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Fails every request in flight on c and shuts it down.  The
+*  descriptor is closed right away unless a thread is blocked reading
+*  it; in that case the reader closes it.
+***********************************************************************/
+static void
+pool_fail(MXPoolConn *c)
+{
+    MXWaiter *w;
+
+    for (w = c->waiters; w; w = w->next) {
+	w->done = -1;
+    }
+    c->waiters = NULL;
+    pthread_cond_broadcast(&c->cond);
+
+    if (c->fd < 0) return;
+    if (c->reading) {
+	c->broken = 1;
+	shutdown(c->fd, SHUT_RDWR);
+    } else {
+	close(c->fd);
+	c->fd = -1;
+	c->broken = 0;
+	c->rpos = c->rlen = 0;
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: pool_connect
+* %ARGUMENTS:
+*  c -- a pool connection; its mutex must be held
+*  sockname -- multiplexor socket
+*  qid -- queue ID for logging
+* %RETURNS:
+*  0 if c is connected in mux mode; 1 if the caller should fall back
+*  to a one-shot connection.
+***********************************************************************/
+static int
+pool_connect(MXPoolConn *c, char const *sockname, char const *qid)
+{
+    struct sockaddr_un addr;
+    char line[SMALLBUF];
+    int binary = !PoolTextOnly;
+    int i, ch;
+
+    c->fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+    if (c->fd < 0) return 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_LOCAL;
+    strncpy(addr.sun_path, sockname, sizeof(addr.sun_path) - 1);
+    if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	writestr(c->fd, binary ? "mux binary\n" : "mux\n") < 0) {
+	close(c->fd);
+	c->fd = -1;
+	return 1;
+    }
+
+    /* Handshake reply is a plain line */
+    c->rpos = c->rlen = 0;
+    for (i=0; i<SMALLBUF-1; i++) {
+	ch = pool_getc(c);
+	if (ch < 0 || ch == '\n') break;
+	line[i] = (char) ch;
+    }
+    line[i] = 0;
+
+    /* EOF, a read error or an empty line says nothing about what the
+       multiplexor supports (it may be restarting); just fail this time */
+    if (ch < 0 || i == 0) {
+	close(c->fd);
+	c->fd = -1;
+	c->rpos = c->rlen = 0;
+	return 1;
+    }
+
+    /* Only an explicit error reply means an older multiplexor */
+    if (strncmp(line, "ok mux", 6) && strncmp(line, "error:", 6)) {
+	close(c->fd);
+	c->fd = -1;
+	c->rpos = c->rlen = 0;
+	return 1;
+    }
+    if (binary && strcmp(line, "ok mux binary")) {
+	/* An older multiplexor treats "mux binary" as a worker command
+	   and closes the connection after replying.  Try plain mux. */
+	PoolTextOnly = 1;
+	close(c->fd);
+	c->fd = -1;
+	return pool_connect(c, sockname, qid);
+    }
+    if (!binary && strcmp(line, "ok mux")) {
+	syslog(LOG_WARNING, "%s: Multiplexor does not support persistent connections (%s); using one connection per command", qid, line);
+	PoolDisabled = 1;
+	close(c->fd);
+	c->fd = -1;
+	return 1;
+    }
+    c->nextId = 0;
+    c->broken = 0;
+    c->binary = binary;
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: pool_alive
+* %ARGUMENTS:
+*  c -- an idle pool connection; its mutex must be held
+* %RETURNS:
+*  1 if the connection still looks usable; 0 if the multiplexor has
+*  closed it.
+***********************************************************************/
+static int
+pool_alive(MXPoolConn *c)
+{
+    char ch;
+    int n = recv(c->fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+	return 1;
+    }
+    /* Nothing is in flight, so there should be nothing to read */
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: pool_dispatch
+* %ARGUMENTS:
+*  c -- a pool connection; its mutex must be held
+*  buf -- reply netstring contents ("id reply") or frame contents
+*  len -- length of buf
+*  qid -- queue ID for logging
+* %RETURNS:
+*  0 if the reply was handed to its waiter, -1 if it was garbage.
+***********************************************************************/
+static int
+pool_dispatch(MXPoolConn *c, char *buf, int len, char const *qid)
+{
+    MXWaiter **pw, *w;
+    unsigned long id;
+    char *ptr;
+    int n;
+
+    if (c->binary) {
+	/* Request ID, status byte, reply */
+	id = get_u32((unsigned char *) buf);
+	ptr = buf + 5;
+    } else {
+	buf[len] = 0;
+	id = strtoul(buf, &ptr, 10);
+	if (ptr == buf || *ptr != ' ') return -1;
+	ptr++;
+    }
+    n = len - (ptr - buf);
+
+    for (pw = &c->waiters; *pw; pw = &(*pw)->next) {
+	if ((*pw)->id == id) break;
+    }
+    if (!*pw) return -1;
+    w = *pw;
+    *pw = w->next;
+
+    if (n > w->len - 1) {
+	syslog(LOG_WARNING, "%s: MXCommand: Overlong reply from multiplexor was truncated!", qid);
+	n = w->len - 1;
+    }
+    memcpy(w->buf, ptr, n);
+    w->buf[n] = 0;
+    w->done = 1;
+    pthread_cond_broadcast(&c->cond);
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: pool_encode
+* %ARGUMENTS:
+*  c -- a pool connection; its mutex must be held
+*  id -- request ID
+*  op, lease, fields, nfields -- binary request
+*  cmd -- text command, or NULL for a binary request
+*  outlen -- set to the length of the encoded request
+* %RETURNS:
+*  A malloc'd request, or NULL if it cannot be sent on c (a binary
+*  request on a text connection, or one too big for a frame) or we are
+*  out of memory.
+* %DESCRIPTION:
+*  A text command is sent as a netstring on a text connection and as
+*  an MXOP_TEXT frame on a binary one.
+***********************************************************************/
+static char *
+pool_encode(MXPoolConn *c,
+	    unsigned long id,
+	    int op,
+	    unsigned int lease,
+	    MXField const *fields,
+	    int nfields,
+	    char const *cmd,
+	    int *outlen)
+{
+    MXField text;
+    unsigned char *req, *p;
+    size_t size, flen;
+    int clen = 0;
+    int i;
+
+    if (cmd) {
+	/* Strip the newline; the multiplexor supplies its own */
+	clen = strlen(cmd);
+	if (clen && cmd[clen-1] == '\n') clen--;
+    }
+
+    if (!c->binary) {
+	int n;
+	if (!cmd) return NULL;
+	req = malloc(clen + 32);
+	if (!req) return NULL;
+	n = snprintf((char *) req, 32, "%d:%lu ", (int) (clen + 1 + snprintf(NULL, 0, "%lu", id)), id);
+	memcpy(req + n, cmd, clen);
+	req[n + clen] = ',';
+	*outlen = n + clen + 1;
+	return (char *) req;
+    }
+
+    if (cmd) {
+	op = MXOP_TEXT;
+	lease = 0;
+	text.str = cmd;
+	text.num = 0;
+	fields = &text;
+	nfields = 1;
+    }
+    if (nfields > MX_FRAME_FIELDS) return NULL;
+
+    /* Length, ID, opcode, lease, field count */
+    size = 4 + 4 + 1 + 4 + 1;
+    for (i=0; i<nfields; i++) {
+	if (!fields[i].str) {
+	    size += 5;
+	} else {
+	    flen = (cmd) ? (size_t) clen : strlen(fields[i].str);
+	    if (flen > 0xFFFF) return NULL;
+	    size += 3 + flen;
+	}
+    }
+    if (size - 4 > MX_FRAME_MAX) return NULL;
+
+    req = malloc(size);
+    if (!req) return NULL;
+    put_u32(req, size - 4);
+    put_u32(req + 4, id);
+    req[8] = (unsigned char) op;
+    put_u32(req + 9, lease);
+    req[13] = (unsigned char) nfields;
+    p = req + 14;
+    for (i=0; i<nfields; i++) {
+	if (!fields[i].str) {
+	    *p++ = 'u';
+	    put_u32(p, fields[i].num);
+	    p += 4;
+	} else {
+	    flen = (cmd) ? (size_t) clen : strlen(fields[i].str);
+	    *p++ = 's';
+	    *p++ = (unsigned char) (flen >> 8);
+	    *p++ = (unsigned char) flen;
+	    memcpy(p, fields[i].str, flen);
+	    p += flen;
+	}
+    }
+    *outlen = (int) size;
+    return (char *) req;
+}
+
+/**********************************************************************
+* %FUNCTION: pool_request
+* %ARGUMENTS:
+*  sockname -- multiplexor socket name
+*  op, lease, fields, nfields -- binary request
+*  cmd -- text command, or NULL for a binary request
+*  buf -- buffer for reply
+*  len -- length of buffer
+*  qid -- Sendmail queue identifier
+* %RETURNS:
+*  0 if all went well, MD_TEMPFAIL on error, or 1 if the pool cannot
+*  be used for this request.
+* %DESCRIPTION:
+*  Sends a request over a pooled connection and waits for the reply.
+*  The thread that finds nobody reading replies becomes the reader and
+*  hands out replies to the other waiters until its own reply arrives.
+***********************************************************************/
+static int
+pool_request(char const *sockname,
+	     int op,
+	     unsigned int lease,
+	     MXField const *fields,
+	     int nfields,
+	     char const *cmd,
+	     char *buf,
+	     int len,
+	     char const *qid)
+{
+    MXPoolConn *c;
+    MXWaiter w;
+    char *req, *reply;
+    int reqlen, rlen;
+
+    if (PoolDisabled) return 1;
+
+    pthread_mutex_lock(&NextConnMutex);
+    c = &Pool[NextConn++ % PoolSize];
+    pthread_mutex_unlock(&NextConnMutex);
+
+    pthread_mutex_lock(&c->mutex);
+    if (PoolDisabled || c->broken) {
+	/* Pool is off, or the old connection is still being torn
+	   down by its reader */
+	pthread_mutex_unlock(&c->mutex);
+	return 1;
+    }
+    if (c->fd >= 0 && !c->waiters && !pool_alive(c)) {
+	/* Multiplexor went away while the connection was idle */
+	pool_fail(c);
+    }
+    if (c->fd < 0 && pool_connect(c, sockname, qid)) {
+	pthread_mutex_unlock(&c->mutex);
+	return 1;
+    }
+
+    /* Binary replies carry a 32-bit ID */
+    w.id = c->nextId++ & 0xFFFFFFFFUL;
+    w.buf = buf;
+    w.len = len;
+    w.done = 0;
+    req = pool_encode(c, w.id, op, lease, fields, nfields, cmd, &reqlen);
+    if (!req) {
+	pthread_mutex_unlock(&c->mutex);
+	return 1;
+    }
+    if (writen(c->fd, req, reqlen) < 0) {
+	syslog(LOG_ERR, "%s: MXCommand: write: %m: Is multiplexor running?", qid);
+	pool_fail(c);
+	pthread_mutex_unlock(&c->mutex);
+	free(req);
+	return MD_TEMPFAIL;
+    }
+    free(req);
+    w.next = c->waiters;
+    c->waiters = &w;
+
+    while (!w.done) {
+	if (c->reading) {
+	    pthread_cond_wait(&c->cond, &c->mutex);
+	    continue;
+	}
+
+	/* Nobody is reading; it's our turn */
+	c->reading = 1;
+	pthread_mutex_unlock(&c->mutex);
+	reply = malloc(MAX_MUX_REPLY);
+	if (!reply) {
+	    rlen = -1;
+	} else if (c->binary) {
+	    rlen = pool_read_frame(c, reply);
+	} else {
+	    rlen = pool_read_netstring(c, reply);
+	}
+	pthread_mutex_lock(&c->mutex);
+	c->reading = 0;
+
+	if (c->broken || rlen < 0 || pool_dispatch(c, reply, rlen, qid) < 0) {
+	    if (!c->broken) {
+		syslog(LOG_ERR, "%s: MXCommand: read: %m: Is multiplexor running?", qid);
+	    }
+	    pool_fail(c);
+	} else {
+	    /* Let a waiter take over reading */
+	    pthread_cond_broadcast(&c->cond);
+	}
+	free(reply);
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    return (w.done > 0) ? 0 : MD_TEMPFAIL;
+}
+
+/**********************************************************************
+* %FUNCTION: MXPoolCommand
+* %ARGUMENTS:
+*  sockname -- multiplexor socket name
+*  cmd -- command to send
+*  buf -- buffer for reply
+*  len -- length of buffer
+*  qid -- Sendmail queue identifier
+* %RETURNS:
+*  0 if all went well, MD_TEMPFAIL on error, or 1 if the pool cannot
+*  be used and MXCommand should make a one-shot connection instead.
+* %DESCRIPTION:
+*  MXCommandHook which sends cmd over a pooled connection.
+***********************************************************************/
+static int
+MXPoolCommand(char const *sockname,
+	      char const *cmd,
+	      char *buf,
+	      int len,
+	      char const *qid)
+{
+    return pool_request(sockname, MXOP_TEXT, 0, NULL, 0, cmd, buf, len, qid);
+}
+
+/**********************************************************************
+* %FUNCTION: MXPoolFrame
+* %ARGUMENTS:
+*  sockname -- multiplexor socket name
+*  op -- MXOP_* opcode
+*  lease -- lease to run the request under, or 0
+*  fields -- request fields
+*  nfields -- number of fields
+*  buf -- buffer for reply
+*  len -- length of buffer
+*  qid -- Sendmail queue identifier
+* %RETURNS:
+*  0 if all went well, MD_TEMPFAIL on error, or 1 if the caller should
+*  send a text command instead.
+* %DESCRIPTION:
+*  MXFrameHook which sends a binary request over a pooled connection.
+***********************************************************************/
+static int
+MXPoolFrame(char const *sockname,
+	    int op,
+	    unsigned int lease,
+	    MXField const *fields,
+	    int nfields,
+	    char *buf,
+	    int len,
+	    char const *qid)
+{
+    if (PoolTextOnly) return 1;
+    return pool_request(sockname, op, lease, fields, nfields, NULL, buf, len, qid);
+}
+
+/**********************************************************************
+* %FUNCTION: MXPoolInit
+* %ARGUMENTS:
+*  n -- number of persistent connections
+* %RETURNS:
+*  0 on success, -1 if out of memory.
+* %DESCRIPTION:
+*  Sets up the pool and routes MXCommand through it.  Connections are
+*  opened on first use.
+***********************************************************************/
+int
+MXPoolInit(int n)
+{
+    int i;
+
+    if (n <= 0) return 0;
+    Pool = calloc(n, sizeof(MXPoolConn));
+    if (!Pool) return -1;
+    for (i=0; i<n; i++) {
+	pthread_mutex_init(&Pool[i].mutex, NULL);
+	pthread_cond_init(&Pool[i].cond, NULL);
+	Pool[i].fd = -1;
+    }
+    PoolSize = n;
+    MXCommandHook = MXPoolCommand;
+    MXFrameHook = MXPoolFrame;
+    return 0;
+}
@@ -0,0 +1,269 @@
+/***********************************************************************
+*
+* mx_state.c
+*
+* State file that carries multiplexor statistics across restarts.
+*
+* The file is mapped shared and holds a header followed by two images
+* of the caller's state.  Saves alternate between the images, and an
+* image only counts once its sequence number and checksum are written,
+* so if the multiplexor dies half-way through a save the other image is
+* still good.  The header records a version number and the size of the
+* state; a file written with a different layout is ignored and
+* overwritten.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+***********************************************************************/
+
+#include "config.h"
+#include "mx_state.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define STATE_MAGIC   0x4d445332	/* "MDS2" */
+
+/* Multipliers of the checksum, from xxHash32 */
+#define PRIME1 2654435761U
+#define PRIME2 2246822519U
+#define PRIME3 3266489917U
+#define PRIME4  668265263U
+#define PRIME5  374761393U
+
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+typedef struct {
+    unsigned int magic;		/* STATE_MAGIC once initialized         */
+    unsigned int version;	/* Caller's layout version              */
+    unsigned int size;		/* Size of the caller's state           */
+    unsigned int imageSize;	/* Size of an image, header included    */
+    char pad[48];
+} StateHeader;
+
+typedef struct {
+    unsigned int seq;		/* 0 while being written                */
+    unsigned int checksum;	/* Of seq and the state                 */
+    char pad[8];
+} ImageHeader;
+
+static StateHeader *State = NULL;
+static size_t StateMapSize = 0;
+static size_t StateSize = 0;
+static unsigned int StateSeq = 0;
+
+#define IMAGE(i) ((ImageHeader *) ((char *) (State + 1) + (i) * State->imageSize))
+#define IMAGE_DATA(img) ((void *) ((img) + 1))
+
+/**********************************************************************
+* %FUNCTION: checksum
+* %ARGUMENTS:
+*  seq -- image sequence number
+*  data -- state
+*  len -- length of state
+* %RETURNS:
+*  32-bit hash of seq and data
+* %DESCRIPTION:
+*  xxHash32 seeded with seq.  The state is hashed on every save, so it
+*  is taken a word at a time in four independent lanes rather than a
+*  byte at a time.
+***********************************************************************/
+static unsigned int
+checksum(unsigned int seq, void const *data, size_t len)
+{
+    unsigned char const *p = (unsigned char const *) data;
+    unsigned char const *end = p + len;
+    unsigned int v1 = seq + PRIME1 + PRIME2;
+    unsigned int v2 = seq + PRIME2;
+    unsigned int v3 = seq;
+    unsigned int v4 = seq - PRIME1;
+    unsigned int h, w;
+
+    if (len >= 16) {
+	do {
+	    memcpy(&w, p, 4);
+	    v1 = ROTL(v1 + w * PRIME2, 13) * PRIME1;
+	    memcpy(&w, p + 4, 4);
+	    v2 = ROTL(v2 + w * PRIME2, 13) * PRIME1;
+	    memcpy(&w, p + 8, 4);
+	    v3 = ROTL(v3 + w * PRIME2, 13) * PRIME1;
+	    memcpy(&w, p + 12, 4);
+	    v4 = ROTL(v4 + w * PRIME2, 13) * PRIME1;
+	    p += 16;
+	} while (end - p >= 16);
+	h = ROTL(v1, 1) + ROTL(v2, 7) + ROTL(v3, 12) + ROTL(v4, 18);
+    } else {
+	h = seq + PRIME5;
+    }
+    h += (unsigned int) len;
+
+    while (end - p >= 4) {
+	memcpy(&w, p, 4);
+	h = ROTL(h + w * PRIME3, 17) * PRIME4;
+	p += 4;
+    }
+    while (p < end) {
+	h = ROTL(h + *p * PRIME5, 11) * PRIME1;
+	p++;
+    }
+
+    h ^= h >> 15;
+    h *= PRIME2;
+    h ^= h >> 13;
+    h *= PRIME3;
+    h ^= h >> 16;
+    return h;
+}
+
+/**********************************************************************
+* %FUNCTION: image_ok
+* %ARGUMENTS:
+*  img -- an image
+* %RETURNS:
+*  1 if img holds a complete save; 0 otherwise
+***********************************************************************/
+static int
+image_ok(ImageHeader const *img)
+{
+    return img->seq != 0 &&
+	img->checksum == checksum(img->seq, IMAGE_DATA(img), StateSize);
+}
+
+/**********************************************************************
+* %FUNCTION: MXStateOpen
+* %ARGUMENTS:
+*  path -- state file
+*  version -- layout version of the state
+*  size -- size of the state
+*  buf -- filled in with the saved state, if there is one
+* %RETURNS:
+*  1 if buf was filled in from the file; 0 if the file was new, empty,
+*  damaged or written with a different layout; -1 on error.
+* %DESCRIPTION:
+*  Opens and maps the state file, creating it if needed, and reads back
+*  the newest complete save.
+***********************************************************************/
+int
+MXStateOpen(char const *path, unsigned int version, size_t size, void *buf)
+{
+    size_t imageSize = (sizeof(ImageHeader) + size + 63) & ~((size_t) 63);
+    size_t mapSize = sizeof(StateHeader) + 2 * imageSize;
+    struct stat sbuf;
+    int fd, fresh, i;
+    ImageHeader *best;
+    void *m;
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+	syslog(LOG_ERR, "Could not open state file %s: %m", path);
+	return -1;
+    }
+    if (fstat(fd, &sbuf) < 0) {
+	syslog(LOG_ERR, "Could not stat state file %s: %m", path);
+	close(fd);
+	return -1;
+    }
+    fresh = (sbuf.st_size != (off_t) mapSize);
+    if (fresh && (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t) mapSize) < 0)) {
+	syslog(LOG_ERR, "Could not size state file %s: %m", path);
+	close(fd);
+	return -1;
+    }
+    m = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+	syslog(LOG_ERR, "Could not map state file %s: %m", path);
+	return -1;
+    }
+    State = (StateHeader *) m;
+    StateMapSize = mapSize;
+    StateSize = size;
+
+    if (!fresh &&
+	(State->magic != STATE_MAGIC || State->version != version ||
+	 State->size != (unsigned int) size ||
+	 State->imageSize != (unsigned int) imageSize)) {
+	syslog(LOG_WARNING, "State file %s has a different layout; starting afresh", path);
+	fresh = 1;
+    }
+    if (fresh) {
+	memset(State, 0, mapSize);
+	State->version = version;
+	State->size = (unsigned int) size;
+	State->imageSize = (unsigned int) imageSize;
+	State->magic = STATE_MAGIC;
+	return 0;
+    }
+
+    best = NULL;
+    for (i=0; i<2; i++) {
+	ImageHeader *img = IMAGE(i);
+	if (!image_ok(img)) continue;
+	if (!best || (int) (img->seq - best->seq) > 0) best = img;
+    }
+    if (!best) {
+	syslog(LOG_WARNING, "State file %s holds no complete save; starting afresh", path);
+	return 0;
+    }
+    StateSeq = best->seq;
+    memcpy(buf, IMAGE_DATA(best), size);
+    return 1;
+}
+
+/**********************************************************************
+* %FUNCTION: MXStateSave
+* %ARGUMENTS:
+*  buf -- state to save
+* %RETURNS:
+*  0 on success, -1 if no state file is open.
+* %DESCRIPTION:
+*  Writes buf over the older image and asks for it to be flushed to
+*  disk in the background.
+***********************************************************************/
+int
+MXStateSave(void const *buf)
+{
+    ImageHeader *img;
+    unsigned int seq;
+
+    if (!State) return -1;
+
+    seq = StateSeq + 1;
+    if (!seq) seq = 1;
+    img = IMAGE(seq & 1);
+
+    img->seq = 0;
+    memcpy(IMAGE_DATA(img), buf, StateSize);
+    img->checksum = checksum(seq, buf, StateSize);
+    img->seq = seq;
+    StateSeq = seq;
+
+    (void) msync((void *) State, StateMapSize, MS_ASYNC);
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: MXStateClose
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Unmaps the state file.  The file is kept for the next start.
+***********************************************************************/
+void
+MXStateClose(void)
+{
+    if (!State) return;
+    (void) msync((void *) State, StateMapSize, MS_SYNC);
+    munmap((void *) State, StateMapSize);
+    State = NULL;
+}
@@ -0,0 +1,22 @@
+/***********************************************************************
+*
+* mx_state.h
+*
+* State file that carries multiplexor statistics across restarts.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+***********************************************************************/
+
+#ifndef INCLUDE_MX_STATE_H
+#define INCLUDE_MX_STATE_H 1
+
+#include <stddef.h>
+
+extern int MXStateOpen(char const *path, unsigned int version,
+		       size_t size, void *buf);
+extern int MXStateSave(void const *buf);
+extern void MXStateClose(void);
+
+#endif
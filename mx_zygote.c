@@ -0,0 +1,539 @@
+/***********************************************************************
+*
+* mx_zygote.c
+*
+* Helper process that builds an embedded Perl interpreter away from
+* the multiplexor and forks workers from it.
+*
+* The multiplexor forks the zygote, which closes every descriptor it
+* inherited and builds the interpreter while the multiplexor carries on
+* serving requests.  It talks to the multiplexor over two socket pairs:
+* on "ctl" the multiplexor passes the pipes of a new worker (with
+* SCM_RIGHTS) and waits for the worker's process-ID; on "events" the
+* zygote reports that it is ready and, since workers are its children,
+* the wait() status of every worker that exits.  Once the multiplexor
+* closes "ctl" the zygote exits as soon as its last worker has gone.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+***********************************************************************/
+
+#include "config.h"
+#include "mx_zygote.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+/* Descriptors a process might have open when the zygote is forked */
+#define MAX_INHERITED_FDS 1024
+
+/* Milliseconds to wait for the rest of a partly-read record */
+#define RECORD_TIMEOUT_MS 250
+
+typedef struct {
+    int nfds;			/* Descriptors passed with the request      */
+} SpawnRequest;
+
+typedef struct {
+    pid_t pid;			/* The new worker, or -1                    */
+    int err;			/* errno if the fork failed                 */
+} SpawnReply;
+
+static int ChildPipe[2] = {-1, -1};
+
+/**********************************************************************
+* %FUNCTION: childHandler
+* %ARGUMENTS:
+*  sig -- signal number
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  SIGCHLD handler in the zygote.  Wakes up the main loop.
+***********************************************************************/
+static void
+childHandler(int sig)
+{
+    int errno_save = errno;
+    char byte = 'C';
+
+    (void) write(ChildPipe[1], &byte, 1);
+    errno = errno_save;
+}
+
+/**********************************************************************
+* %FUNCTION: set_child_handler
+* %ARGUMENTS:
+*  None
+* %RETURNS:
+*  Nothing
+***********************************************************************/
+static void
+set_child_handler(void)
+{
+    struct sigaction act;
+
+    act.sa_handler = childHandler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_NOCLDSTOP | SA_RESTART;
+    sigaction(SIGCHLD, &act, NULL);
+}
+
+/**********************************************************************
+* %FUNCTION: wait_readable
+* %ARGUMENTS:
+*  fd -- a descriptor
+*  timeout_ms -- milliseconds to wait
+* %RETURNS:
+*  1 if fd is readable; 0 on timeout; -1 on error
+***********************************************************************/
+static int
+wait_readable(int fd, int timeout_ms)
+{
+    fd_set readfds;
+    struct timeval t;
+    int n;
+
+    for (;;) {
+	FD_ZERO(&readfds);
+	FD_SET(fd, &readfds);
+	t.tv_sec = timeout_ms / 1000;
+	t.tv_usec = (timeout_ms % 1000) * 1000;
+	n = select(fd + 1, &readfds, NULL, NULL, &t);
+	if (n >= 0 || errno != EINTR) return n;
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: read_rest
+* %ARGUMENTS:
+*  fd -- a descriptor
+*  buf -- buffer
+*  len -- bytes wanted
+*  got -- bytes already in buf
+* %RETURNS:
+*  len on success; got if EOF comes first; -1 on error or timeout
+* %DESCRIPTION:
+*  Reads a fixed-size record, waiting for the rest of it if need be.
+***********************************************************************/
+static int
+read_rest(int fd, void *buf, int len, int got)
+{
+    int n;
+
+    while (got < len) {
+	n = read(fd, (char *) buf + got, len - got);
+	if (n > 0) {
+	    got += n;
+	    continue;
+	}
+	if (n == 0) return got;
+	if (errno == EINTR) continue;
+	if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+	if (wait_readable(fd, RECORD_TIMEOUT_MS) <= 0) {
+	    errno = ETIMEDOUT;
+	    return -1;
+	}
+    }
+    return got;
+}
+
+/**********************************************************************
+* %FUNCTION: write_all
+* %ARGUMENTS:
+*  fd -- a descriptor
+*  buf -- data
+*  len -- length of data
+* %RETURNS:
+*  0 on success; -1 on error
+***********************************************************************/
+static int
+write_all(int fd, void const *buf, int len)
+{
+    int n;
+
+    while (len > 0) {
+	n = write(fd, buf, len);
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    return -1;
+	}
+	buf = (char const *) buf + n;
+	len -= n;
+    }
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: send_event
+* %ARGUMENTS:
+*  events -- events socket
+*  pid -- worker, or 0
+*  status -- wait() status
+*  usage -- resource usage, or NULL
+* %RETURNS:
+*  Nothing
+***********************************************************************/
+static void
+send_event(int events, pid_t pid, int status, struct rusage const *usage)
+{
+    MXZygoteEvent ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.pid = pid;
+    ev.status = status;
+    if (usage) ev.usage = *usage;
+
+    /* If the multiplexor has gone, the workers see EOF and exit too */
+    (void) write_all(events, &ev, sizeof(ev));
+}
+
+/**********************************************************************
+* %FUNCTION: reap_workers
+* %ARGUMENTS:
+*  events -- events socket
+*  nkids -- number of running workers; decremented for each one reaped
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Reaps exited workers and reports them to the multiplexor.
+***********************************************************************/
+static void
+reap_workers(int events, int *nkids)
+{
+    struct rusage usage;
+    pid_t pid;
+    int status;
+
+    for (;;) {
+	memset(&usage, 0, sizeof(usage));
+#ifdef HAVE_WAIT3
+	pid = wait3(&status, WNOHANG, &usage);
+#else
+	pid = waitpid(-1, &status, WNOHANG);
+#endif
+	if (pid <= 0) break;
+	(*nkids)--;
+	send_event(events, pid, status, &usage);
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: spawn_worker
+* %ARGUMENTS:
+*  ctl -- control socket
+*  run -- function that runs a worker on the passed descriptors
+*  nkids -- number of running workers
+* %RETURNS:
+*  0 if a request was handled; -1 on EOF or error
+* %DESCRIPTION:
+*  Receives a worker's descriptors, forks the worker and replies with
+*  its process-ID.
+***********************************************************************/
+static int
+spawn_worker(int ctl, void (*run)(int const fds[MX_ZYGOTE_FDS]), int *nkids)
+{
+    SpawnRequest req;
+    SpawnReply reply;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int) * MX_ZYGOTE_FDS)];
+    } u;
+    int fds[MX_ZYGOTE_FDS];
+    int i, n, got;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *) &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+
+    do {
+	n = recvmsg(ctl, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return -1;
+
+    for (i=0; i<MX_ZYGOTE_FDS; i++) fds[i] = -1;
+    got = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+	    got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	    if (got > MX_ZYGOTE_FDS) got = MX_ZYGOTE_FDS;
+	    memcpy(fds, CMSG_DATA(cmsg), got * sizeof(int));
+	}
+    }
+    if (n < (int) sizeof(req) &&
+	read_rest(ctl, &req, sizeof(req), n) != (int) sizeof(req)) {
+	for (i=0; i<got; i++) close(fds[i]);
+	return -1;
+    }
+
+    if (got < 3 || got != req.nfds) {
+	for (i=0; i<got; i++) close(fds[i]);
+	reply.pid = -1;
+	reply.err = EINVAL;
+	return write_all(ctl, &reply, sizeof(reply));
+    }
+
+    reply.pid = fork();
+    reply.err = errno;
+    if (reply.pid == 0) {
+	/* In the worker */
+	signal(SIGCHLD, SIG_DFL);
+	close(ctl);
+	close(ChildPipe[0]);
+	close(ChildPipe[1]);
+	run(fds);
+	_exit(EXIT_FAILURE);
+    }
+
+    for (i=0; i<got; i++) close(fds[i]);
+    if (reply.pid > 0) (*nkids)++;
+    return write_all(ctl, &reply, sizeof(reply));
+}
+
+/**********************************************************************
+* %FUNCTION: zygote_main
+* %ARGUMENTS:
+*  ctl -- control socket
+*  events -- events socket
+*  build -- function that builds the interpreter; returns -1 on failure
+*  run -- function that runs a worker on the passed descriptors
+* %RETURNS:
+*  Does not return
+***********************************************************************/
+static void
+zygote_main(int ctl, int events,
+	    int (*build)(void),
+	    void (*run)(int const fds[MX_ZYGOTE_FDS]))
+{
+    fd_set readfds;
+    sigset_t sigs;
+    char buf[64];
+    int nkids = 0;
+    int i, maxfd;
+
+    /* The multiplexor decides when we go: we exit once it closes ctl
+       and our workers have exited */
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&sigs);
+    sigprocmask(SIG_SETMASK, &sigs, NULL);
+
+    /* Drop listening sockets, client connections and workers' pipes */
+    closelog();
+    for (i=STDERR_FILENO+1; i<MAX_INHERITED_FDS; i++) {
+	if (i != ctl && i != events) (void) close(i);
+    }
+
+    if (pipe(ChildPipe) < 0) {
+	send_event(events, 0, -1, NULL);
+	_exit(EXIT_FAILURE);
+    }
+    fcntl(ChildPipe[0], F_SETFL, fcntl(ChildPipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(ChildPipe[1], F_SETFL, fcntl(ChildPipe[1], F_GETFL) | O_NONBLOCK);
+
+    if (build() < 0) {
+	send_event(events, 0, -1, NULL);
+	_exit(EXIT_FAILURE);
+    }
+
+    /* Set after building in case some Perl code has monkeyed with it */
+    set_child_handler();
+    send_event(events, 0, 0, NULL);
+
+    for (;;) {
+	if (ctl < 0 && nkids <= 0) _exit(EXIT_SUCCESS);
+
+	FD_ZERO(&readfds);
+	FD_SET(ChildPipe[0], &readfds);
+	maxfd = ChildPipe[0];
+	if (ctl >= 0) {
+	    FD_SET(ctl, &readfds);
+	    if (ctl > maxfd) maxfd = ctl;
+	}
+	if (select(maxfd + 1, &readfds, NULL, NULL, NULL) < 0) {
+	    if (errno == EINTR) continue;
+	    syslog(LOG_ERR, "Zygote: select failed: %m");
+	    _exit(EXIT_FAILURE);
+	}
+	if (FD_ISSET(ChildPipe[0], &readfds)) {
+	    while (read(ChildPipe[0], buf, sizeof(buf)) > 0) {
+		continue;
+	    }
+	    reap_workers(events, &nkids);
+	}
+	if (ctl >= 0 && FD_ISSET(ctl, &readfds)) {
+	    if (spawn_worker(ctl, run, &nkids) < 0) {
+		close(ctl);
+		ctl = -1;
+	    }
+	}
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: MXZygoteStart
+* %ARGUMENTS:
+*  ctl -- set to the control socket
+*  events -- set to the events socket (non-blocking)
+*  build -- called in the zygote to build the interpreter; returns -1
+*           on failure
+*  run -- called in each worker with its stdin, stdout, stderr and status
+*         descriptors (the last may be -1); must not return
+* %RETURNS:
+*  The zygote's process-ID, or -1 on failure
+* %DESCRIPTION:
+*  Forks a zygote.  It reports on the events socket when the build is
+*  done.
+***********************************************************************/
+pid_t
+MXZygoteStart(int *ctl, int *events,
+	      int (*build)(void),
+	      void (*run)(int const fds[MX_ZYGOTE_FDS]))
+{
+    int c[2], e[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, c) < 0) {
+	return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, e) < 0) {
+	close(c[0]);
+	close(c[1]);
+	return -1;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+	close(c[0]);
+	close(e[0]);
+	zygote_main(c[1], e[1], build, run);
+    }
+
+    close(c[1]);
+    close(e[1]);
+    if (pid < 0) {
+	close(c[0]);
+	close(e[0]);
+	return -1;
+    }
+    fcntl(e[0], F_SETFL, fcntl(e[0], F_GETFL) | O_NONBLOCK);
+    *ctl = c[0];
+    *events = e[0];
+    return pid;
+}
+
+/**********************************************************************
+* %FUNCTION: MXZygoteSpawn
+* %ARGUMENTS:
+*  ctl -- control socket of a ready zygote
+*  fds -- worker's stdin, stdout, stderr and status descriptors; the
+*         status descriptor may be -1
+*  timeout_ms -- milliseconds to wait for the reply
+* %RETURNS:
+*  The process-ID of the new worker, or -1 with errno set
+* %DESCRIPTION:
+*  Asks the zygote to fork a worker.  fds stay open in the caller.
+*  After a failure, the reply to this request may still arrive, so the
+*  caller must stop using ctl.
+***********************************************************************/
+pid_t
+MXZygoteSpawn(int ctl, int const fds[MX_ZYGOTE_FDS], int timeout_ms)
+{
+    SpawnRequest req;
+    SpawnReply reply;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int) * MX_ZYGOTE_FDS)];
+    } u;
+    int n;
+
+    req.nfds = (fds[MX_ZYGOTE_FDS-1] >= 0) ? MX_ZYGOTE_FDS : MX_ZYGOTE_FDS-1;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&u, 0, sizeof(u));
+    iov.iov_base = (void *) &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * req.nfds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * req.nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * req.nfds);
+
+    do {
+	n = sendmsg(ctl, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n != (int) sizeof(req)) {
+	if (n >= 0) errno = EIO;
+	return -1;
+    }
+
+    n = wait_readable(ctl, timeout_ms);
+    if (n <= 0) {
+	if (n == 0) errno = ETIMEDOUT;
+	return -1;
+    }
+    if (read_rest(ctl, &reply, sizeof(reply), 0) != (int) sizeof(reply)) {
+	errno = EPIPE;
+	return -1;
+    }
+    if (reply.pid < 0) {
+	errno = reply.err;
+	return -1;
+    }
+    return reply.pid;
+}
+
+/**********************************************************************
+* %FUNCTION: MXZygoteReadEvent
+* %ARGUMENTS:
+*  events -- events socket
+*  ev -- filled in with the event
+* %RETURNS:
+*  1 if an event was read; 0 if there is none; -1 once the zygote has
+*  closed the socket, i.e. exited
+***********************************************************************/
+int
+MXZygoteReadEvent(int events, MXZygoteEvent *ev)
+{
+    int n;
+
+    do {
+	n = read(events, ev, sizeof(*ev));
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+	return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    if (n == 0) return -1;
+    if (n < (int) sizeof(*ev) &&
+	read_rest(events, ev, sizeof(*ev), n) != (int) sizeof(*ev)) {
+	return -1;
+    }
+    return 1;
+}
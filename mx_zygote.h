@@ -0,0 +1,37 @@
+/***********************************************************************
+*
+* mx_zygote.h
+*
+* Helper process that builds an embedded Perl interpreter away from
+* the multiplexor and forks workers from it.
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+***********************************************************************/
+
+#ifndef INCLUDE_MX_ZYGOTE_H
+#define INCLUDE_MX_ZYGOTE_H 1
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/* A worker's stdin, stdout, stderr and status descriptor */
+#define MX_ZYGOTE_FDS 4
+
+/* Something that happened in a zygote */
+typedef struct {
+    pid_t pid;			/* Worker that exited, or 0 for readiness   */
+    int status;			/* wait() status; for readiness 0 or -1     */
+    struct rusage usage;	/* Resource usage of the worker             */
+} MXZygoteEvent;
+
+extern pid_t MXZygoteStart(int *ctl, int *events,
+			   int (*build)(void),
+			   void (*run)(int const fds[MX_ZYGOTE_FDS]));
+extern pid_t MXZygoteSpawn(int ctl, int const fds[MX_ZYGOTE_FDS],
+			   int timeout_ms);
+extern int MXZygoteReadEvent(int events, MXZygoteEvent *ev);
+
+#endif
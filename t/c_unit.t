@@ -4,7 +4,7 @@ use warnings;
 
 my $cc     = $ENV{MD_CC} || $ENV{CC} || 'cc';
 my $cflags = '-I. -std=c89 -D_BSD_SOURCE -D_DEFAULT_SOURCE';
-my $libs   = 'utils.c dynbuf.c';
+my $libs   = 'utils.c dynbuf.c event.c event_tcp.c mx_zygote.c mx_state.c';
 
 my @sources = sort glob 't/test_*.c';
 
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../event_tcp.h"
+#include "../mimedefang.h"
+
+#define NUM_TESTS 14
+
+static int test_num = 0;
+
+static void
+ok(int passed, const char *label)
+{
+    test_num++;
+    printf("%s %d - %s\n", passed ? "ok" : "not ok", test_num, label);
+}
+
+static int write_flag = -99;
+static int write_len = -1;
+
+static void
+write_done(EventSelector *es, int fd, char *buf, int len, int flag, void *data)
+{
+    write_flag = flag;
+    write_len = len;
+}
+
+static int read_flag = -99;
+static int read_len = -1;
+static char read_buf[64];
+
+static void
+read_done(EventSelector *es, int fd, char *buf, int len, int flag, void *data)
+{
+    read_flag = flag;
+    read_len = len;
+    if (len > 0 && len < (int) sizeof(read_buf)) {
+	memcpy(read_buf, buf, len);
+    }
+}
+
+/* Writes raw bytes to wr (closing it if close_wr is set) and reads
+   one frame of at most maxlen bytes from rd; returns the read flag */
+static int
+read_frame(EventSelector *es, int rd, int wr, char const *bytes, int n,
+	   int close_wr, int maxlen)
+{
+    read_flag = -99;
+    read_len = -1;
+    if (n > 0 && write(wr, bytes, n) != n) return -99;
+    if (close_wr) close(wr);
+    if (!EventTcp_ReadFrame(es, rd, maxlen, read_done, 5, NULL)) return -99;
+    while (read_flag == -99) {
+	if (Event_HandleEvent(es) < 0) return -99;
+    }
+    return read_flag;
+}
+
+/* Decodes a frame's fields, as the multiplexor does */
+static int
+decode(char const *bytes, int n, int nfields, MXFrameFields *f)
+{
+    static char text[MX_FRAME_TEXT];
+    unsigned char const *p = (unsigned char const *) bytes;
+
+    f->nfields = nfields;
+    return decode_frame_fields(p, p + n, f, text);
+}
+
+/* Runs the selector until the pending write completes, then reads
+   back what arrived on the other end of the socket pair */
+static int
+drain(EventSelector *es, int fd, char *out, int outlen)
+{
+    int n, got = 0;
+
+    while (write_flag == -99) {
+	if (Event_HandleEvent(es) < 0) return -1;
+    }
+    while (got < outlen - 1) {
+	n = read(fd, out + got, outlen - 1 - got);
+	if (n <= 0) break;
+	got += n;
+	if (got >= write_len) break;
+    }
+    out[got] = 0;
+    return got;
+}
+
+int
+main(void)
+{
+    EventSelector *es = Event_CreateSelector();
+    int sv[2];
+    char out[256];
+    char *owned;
+    struct iovec iov[3];
+
+    printf("1..%d\n", NUM_TESTS);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+	perror("socketpair");
+	return 1;
+    }
+
+    owned = strdup("handed over\n");
+    write_flag = -99;
+    EventTcp_WriteBufOwned(es, sv[0], owned, strlen(owned), write_done, 0, NULL);
+    drain(es, sv[1], out, sizeof(out));
+    ok(write_flag == EVENT_TCP_FLAG_COMPLETE && !strcmp(out, "handed over\n"),
+       "EventTcp_WriteBufOwned writes and releases the buffer");
+
+    iov[0].iov_base = "scan ";
+    iov[0].iov_len = 5;
+    iov[1].iov_base = "qid";
+    iov[1].iov_len = 3;
+    iov[2].iov_base = " /dir\n";
+    iov[2].iov_len = 6;
+    write_flag = -99;
+    EventTcp_WriteV(es, sv[0], iov, 3, write_done, 0, NULL);
+    drain(es, sv[1], out, sizeof(out));
+    ok(write_flag == EVENT_TCP_FLAG_COMPLETE && write_len == 14 &&
+       !strcmp(out, "scan qid /dir\n"),
+       "EventTcp_WriteV gathers segments in order");
+
+    ok(EventTcp_WriteV(es, sv[0], iov, 0, write_done, 0, NULL) == NULL,
+       "EventTcp_WriteV rejects an empty segment list");
+
+    ok(read_frame(es, sv[1], sv[0], "\0\0\0\5hello", 9, 0, 16) ==
+       EVENT_TCP_FLAG_COMPLETE && read_len == 5 &&
+       !memcmp(read_buf, "hello", 5),
+       "EventTcp_ReadFrame reads a frame");
+
+    ok(read_frame(es, sv[1], sv[0], "\0\0\0\21", 4, 0, 16) ==
+       EVENT_TCP_FLAG_IOERROR && read_len == 0,
+       "EventTcp_ReadFrame rejects a frame longer than maxlen");
+
+    ok(read_frame(es, sv[1], sv[0], "\0\0\0\0", 4, 0, 16) ==
+       EVENT_TCP_FLAG_IOERROR,
+       "EventTcp_ReadFrame rejects an empty frame");
+
+    Event_DestroySelector(es);
+    close(sv[0]);
+    close(sv[1]);
+
+    /* Each truncated read needs a fresh pair: the writer is closed */
+    es = Event_CreateSelector();
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+	perror("socketpair");
+	return 1;
+    }
+    ok(read_frame(es, sv[1], sv[0], "\0\0", 2, 1, 16) ==
+       EVENT_TCP_FLAG_EOF,
+       "EventTcp_ReadFrame reports a truncated length as EOF");
+    close(sv[1]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+	perror("socketpair");
+	return 1;
+    }
+    ok(read_frame(es, sv[1], sv[0], "\0\0\0\10abc", 7, 1, 16) ==
+       EVENT_TCP_FLAG_EOF,
+       "EventTcp_ReadFrame reports a truncated body as EOF");
+    close(sv[1]);
+    Event_DestroySelector(es);
+
+    {
+	MXFrameFields f;
+
+	ok(decode("s\0\2hiu\0\0\1\0", 10, 2, &f) == 0 &&
+	   !f.isnum[0] && !strcmp(f.str[0], "hi") &&
+	   f.isnum[1] && f.num[1] == 256 && !strcmp(f.str[1], "256"),
+	   "decode_frame_fields decodes a string and a number");
+
+	ok(decode("s\0\2hi", 5, MX_FRAME_FIELDS + 1, &f) < 0,
+	   "decode_frame_fields rejects more than MX_FRAME_FIELDS fields");
+
+	ok(decode("s\0\2hi", 5, 2, &f) < 0,
+	   "decode_frame_fields rejects a field count above what is there");
+
+	ok(decode("s\0\11hi", 5, 1, &f) < 0,
+	   "decode_frame_fields rejects a string running past the end");
+
+	ok(decode("x\0\2hi", 5, 1, &f) < 0,
+	   "decode_frame_fields rejects an unknown field type");
+
+	ok(decode("s\0\2hiu\0\0\1\0", 10, 1, &f) < 0,
+	   "decode_frame_fields rejects bytes after the last field");
+    }
+
+    return 0;
+}
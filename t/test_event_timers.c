@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../event.h"
+
+#define NUM_TESTS 7
+
+static int test_num = 0;
+
+static void
+ok(int passed, const char *label)
+{
+    test_num++;
+    printf("%s %d - %s\n", passed ? "ok" : "not ok", test_num, label);
+}
+
+static long
+usec_between(struct timeval const *a, struct timeval const *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_usec - a->tv_usec);
+}
+
+/* Records the order in which timers fire */
+static int fired[100];
+static int num_fired = 0;
+
+static void
+record_timer(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    fired[num_fired++] = (int) (long) data;
+}
+
+static void
+count_timer(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    (*(int *) data)++;
+}
+
+static EventHandler *victim = NULL;
+
+static void
+delete_victim(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    (*(int *) data)++;
+    if (victim) Event_DelHandler(es, victim);
+    victim = NULL;
+}
+
+static EventHandler *pair[2];
+
+static void
+delete_pair(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    int i;
+
+    (*(int *) data)++;
+    for (i=0; i<2; i++) {
+        if (pair[i]) Event_DelHandler(es, pair[i]);
+        pair[i] = NULL;
+    }
+}
+
+static int timeout_calls = 0;
+
+static void
+timeout_until_third(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    if (flags & EVENT_FLAG_TIMEOUT) timeout_calls++;
+    if (timeout_calls == 3) Event_DelHandler(es, *(EventHandler **) data);
+}
+
+static void
+test_order(void)
+{
+    EventSelector *es = Event_CreateSelector();
+    struct timeval t;
+    int i, sorted = 1;
+
+    num_fired = 0;
+    for (i=0; i<100; i++) {
+        /* Deadlines 0..99 msec, inserted in scrambled order */
+        int slot = (i * 37) % 100;
+        t.tv_sec = 0;
+        t.tv_usec = slot * 1000;
+        Event_AddTimerHandler(es, t, record_timer, (void *) (long) slot);
+    }
+    while (num_fired < 100) {
+        if (Event_HandleEvent(es) < 0) break;
+    }
+    for (i=1; i<num_fired; i++) {
+        if (fired[i] < fired[i-1]) sorted = 0;
+    }
+    ok(num_fired == 100 && sorted, "timers fire once each, in deadline order");
+    Event_DestroySelector(es);
+}
+
+static void
+test_delete(void)
+{
+    EventSelector *es = Event_CreateSelector();
+    EventHandler *eh[100];
+    struct timeval t;
+    int count = 0, victim_count = 0;
+    int i;
+
+    t.tv_sec = 0;
+    t.tv_usec = 0;
+    for (i=0; i<100; i++) {
+        eh[i] = Event_AddTimerHandler(es, t, count_timer, &count);
+    }
+    for (i=0; i<100; i+=2) {
+        Event_DelHandler(es, eh[i]);
+    }
+    Event_HandleEvent(es);
+    ok(count == 50, "deleted timers do not fire");
+
+    /* A callback deleting a timer which expired at the same time */
+    t.tv_usec = 1000;
+    Event_AddTimerHandler(es, t, delete_victim, &victim_count);
+    victim = Event_AddTimerHandler(es, t, delete_victim, &victim_count);
+    usleep(2000);
+    Event_HandleEvent(es);
+    ok(victim_count == 1, "timer deleted by a callback in the same round does not fire");
+    Event_DestroySelector(es);
+}
+
+static void
+test_delete_fd(void)
+{
+    EventSelector *es = Event_CreateSelector();
+    EventHandler *eh[3];
+    int count = 0, victim_count = 0;
+    int fds[2];
+    int i;
+
+    if (pipe(fds) < 0 || write(fds[1], "x", 1) != 1) {
+        ok(0, "deleted read handlers do not fire");
+        ok(0, "read handler deleted by a callback in the same round does not fire");
+        return;
+    }
+    for (i=0; i<3; i++) {
+        eh[i] = Event_AddHandler(es, fds[0], EVENT_FLAG_READABLE,
+                                 count_timer, &count);
+    }
+    Event_DelHandler(es, eh[1]);
+    Event_HandleEvent(es);
+    ok(count == 2, "deleted read handlers do not fire");
+    Event_DelHandler(es, eh[0]);
+    Event_DelHandler(es, eh[2]);
+
+    /* Whichever runs first deletes both */
+    for (i=0; i<2; i++) {
+        pair[i] = Event_AddHandler(es, fds[0], EVENT_FLAG_READABLE,
+                                   delete_pair, &victim_count);
+    }
+    Event_HandleEvent(es);
+    ok(victim_count == 1, "read handler deleted by a callback in the same round does not fire");
+    Event_DestroySelector(es);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void
+test_timeout(void)
+{
+    EventSelector *es = Event_CreateSelector();
+    EventHandler *eh;
+    struct timeval t;
+    int fds[2];
+    int i;
+
+    if (pipe(fds) < 0) {
+        ok(0, "read handler timeout repeats until deleted");
+        return;
+    }
+    t.tv_sec = 0;
+    t.tv_usec = 0;
+    eh = Event_AddHandlerWithTimeout(es, fds[0], EVENT_FLAG_READABLE, t,
+                                     timeout_until_third, &eh);
+    for (i=0; i<10; i++) {
+        Event_HandleEvent(es);
+    }
+    ok(timeout_calls == 3, "read handler timeout repeats until deleted");
+    Event_DestroySelector(es);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* Cost of one wakeup that fires a single timer, with "pending"
+   far-future timeouts outstanding */
+static double
+wakeup_cost(int pending)
+{
+    EventSelector *es = Event_CreateSelector();
+    struct timeval t, start, end;
+    int count = 0;
+    int i;
+
+    for (i=0; i<pending; i++) {
+        t.tv_sec = 3600 + (i % 977);
+        t.tv_usec = (i * 7919) % 1000000;
+        Event_AddTimerHandler(es, t, count_timer, &count);
+    }
+    t.tv_sec = 0;
+    t.tv_usec = 0;
+    gettimeofday(&start, NULL);
+    for (i=0; i<2000; i++) {
+        Event_AddTimerHandler(es, t, count_timer, &count);
+        Event_HandleEvent(es);
+    }
+    gettimeofday(&end, NULL);
+    Event_DestroySelector(es);
+    return (double) usec_between(&start, &end) / 2000.0;
+}
+
+int
+main(void)
+{
+    double small, large;
+
+    printf("1..%d\n", NUM_TESTS);
+
+    test_order();
+    test_delete();
+    test_delete_fd();
+    test_timeout();
+
+    small = wakeup_cost(1000);
+    large = wakeup_cost(50000);
+    printf("# wakeup with  1000 pending timers: %.2f usec\n", small);
+    printf("# wakeup with 50000 pending timers: %.2f usec\n", large);
+
+    /* A linear scan would be ~50 times slower; allow for noise */
+    ok(large < 10.0 * small + 5.0, "wakeup cost does not grow linearly with pending timers");
+
+    return 0;
+}
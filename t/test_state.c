@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../mx_state.h"
+
+#define NUM_TESTS 9
+
+typedef struct {
+    int counter;
+    char name[100];
+} TestState;
+
+static int test_num = 0;
+
+static void
+ok(int passed, const char *label)
+{
+    test_num++;
+    printf("%s %d - %s\n", passed ? "ok" : "not ok", test_num, label);
+}
+
+static void
+fill(TestState *st, int counter, char const *name)
+{
+    memset(st, 0, sizeof(*st));
+    st->counter = counter;
+    strcpy(st->name, name);
+}
+
+/* Flips one byte of the state in the given image.  The file holds a
+   64-byte header, then two images of a 16-byte header and the state,
+   each rounded up to 64 bytes. */
+static int
+corrupt_image(char const *path, int image)
+{
+    off_t off = 64 + image * ((16 + sizeof(TestState) + 63) & ~63) + 16;
+    unsigned char c;
+    int fd = open(path, O_RDWR);
+
+    if (fd < 0) return -1;
+    if (pread(fd, &c, 1, off) != 1) {
+        close(fd);
+        return -1;
+    }
+    c ^= 0xFF;
+    if (pwrite(fd, &c, 1, off) != 1) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+int
+main(void)
+{
+    char dir[] = "/tmp/test_state.XXXXXX";
+    char path[64];
+    TestState st, got;
+
+    printf("1..%d\n", NUM_TESTS);
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    sprintf(path, "%s/state", dir);
+
+    fill(&st, 1, "first");
+    ok(MXStateSave(&st) == -1, "MXStateSave fails with no state file open");
+
+    memset(&got, 0, sizeof(got));
+    ok(MXStateOpen(path, 1, sizeof(TestState), &got) == 0,
+       "a new state file holds nothing");
+
+    /* Saves alternate: seq 1 goes to image 1, seq 2 to image 0 */
+    MXStateSave(&st);
+    fill(&st, 2, "second");
+    MXStateSave(&st);
+    MXStateClose();
+
+    memset(&got, 0, sizeof(got));
+    ok(MXStateOpen(path, 1, sizeof(TestState), &got) == 1 &&
+       got.counter == 2 && !strcmp(got.name, "second"),
+       "reopening reads back the newest save");
+    MXStateClose();
+
+    corrupt_image(path, 0);
+    memset(&got, 0, sizeof(got));
+    ok(MXStateOpen(path, 1, sizeof(TestState), &got) == 1 &&
+       got.counter == 1 && !strcmp(got.name, "first"),
+       "a damaged newest image falls back to the older one");
+
+    /* The next save goes over the damaged image */
+    fill(&st, 3, "third");
+    MXStateSave(&st);
+    MXStateClose();
+    memset(&got, 0, sizeof(got));
+    ok(MXStateOpen(path, 1, sizeof(TestState), &got) == 1 &&
+       got.counter == 3 && !strcmp(got.name, "third"),
+       "a save after the fallback is read back");
+    MXStateClose();
+
+    corrupt_image(path, 0);
+    corrupt_image(path, 1);
+    ok(MXStateOpen(path, 1, sizeof(TestState), &got) == 0,
+       "a file with no good image starts afresh");
+    MXStateSave(&st);
+    MXStateClose();
+
+    memset(&got, 0, sizeof(got));
+    ok(MXStateOpen(path, 2, sizeof(TestState), &got) == 0 &&
+       got.counter == 0,
+       "a version mismatch starts afresh");
+    MXStateSave(&st);
+    MXStateClose();
+
+    ok(MXStateOpen(path, 2, sizeof(TestState) - 4, &got) == 0,
+       "a size mismatch starts afresh");
+    MXStateClose();
+
+    ok(MXStateOpen(path, 2, sizeof(TestState), &got) == 0,
+       "the old layout is gone after starting afresh");
+    MXStateClose();
+
+    unlink(path);
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include "../mx_zygote.h"
+
+#define NUM_TESTS 9
+
+static int test_num = 0;
+
+static void
+ok(int passed, const char *label)
+{
+    test_num++;
+    printf("%s %d - %s\n", passed ? "ok" : "not ok", test_num, label);
+    fflush(stdout);
+}
+
+static int
+build_ok(void)
+{
+    return 0;
+}
+
+static int
+build_fail(void)
+{
+    return -1;
+}
+
+/* Answers one line on stdout and exits with status 7 */
+static void
+run_echo(int const fds[MX_ZYGOTE_FDS])
+{
+    char buf[64];
+    int n;
+
+    n = read(fds[0], buf, sizeof(buf));
+    if (n > 0) {
+        (void) write(fds[1], "pong\n", 5);
+    }
+    _exit(7);
+}
+
+/* Waits up to 5 seconds for the next event; 1, or -1 on EOF/timeout */
+static int
+next_event(int events, MXZygoteEvent *ev)
+{
+    fd_set readfds;
+    struct timeval t;
+    int n;
+
+    for (;;) {
+        n = MXZygoteReadEvent(events, ev);
+        if (n != 0) return n;
+        FD_ZERO(&readfds);
+        FD_SET(events, &readfds);
+        t.tv_sec = 5;
+        t.tv_usec = 0;
+        if (select(events + 1, &readfds, NULL, NULL, &t) <= 0) return -1;
+    }
+}
+
+int
+main(void)
+{
+    int ctl, events;
+    int pin[2], pout[2], perr[2];
+    int fds[MX_ZYGOTE_FDS];
+    MXZygoteEvent ev;
+    pid_t zygote, worker;
+    char buf[64];
+    int n;
+
+    printf("1..%d\n", NUM_TESTS);
+    fflush(stdout);
+
+    zygote = MXZygoteStart(&ctl, &events, build_ok, run_echo);
+    ok(zygote > 0, "zygote started");
+    ok(next_event(events, &ev) == 1 && ev.pid == 0 && ev.status == 0,
+       "zygote reports it is ready");
+
+    if (pipe(pin) < 0 || pipe(pout) < 0 || pipe(perr) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    fds[0] = pin[0];
+    fds[1] = pout[1];
+    fds[2] = perr[1];
+    fds[3] = -1;
+    worker = MXZygoteSpawn(ctl, fds, 5000);
+    ok(worker > 0 && worker != zygote, "spawn returns the worker's pid");
+    close(pin[0]);
+    close(pout[1]);
+    close(perr[1]);
+
+    (void) write(pin[1], "ping\n", 5);
+    n = read(pout[0], buf, sizeof(buf) - 1);
+    buf[n > 0 ? n : 0] = 0;
+    ok(!strcmp(buf, "pong\n"), "worker runs on the passed descriptors");
+
+    ok(next_event(events, &ev) == 1 && ev.pid == worker,
+       "worker exit is forwarded");
+    ok(WIFEXITED(ev.status) && WEXITSTATUS(ev.status) == 7,
+       "forwarded status is the worker's wait() status");
+    close(pin[1]);
+    close(pout[0]);
+    close(perr[0]);
+
+    /* Without ctl and workers, the zygote exits */
+    close(ctl);
+    ok(next_event(events, &ev) == -1 && waitpid(zygote, NULL, 0) == zygote,
+       "zygote exits once ctl is closed");
+    close(events);
+
+    zygote = MXZygoteStart(&ctl, &events, build_fail, run_echo);
+    ok(next_event(events, &ev) == 1 && ev.pid == 0 && ev.status == -1,
+       "failed build is reported");
+    ok(next_event(events, &ev) == -1 && waitpid(zygote, NULL, 0) == zygote,
+       "zygote exits after a failed build");
+    close(ctl);
+    close(events);
+
+    return 0;
+}
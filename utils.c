@@ -236,6 +236,130 @@ chomp(char *str)
     *s = 0;
 }
 
+/* If set, MXCommand tries this first.  It returns 0 or MD_TEMPFAIL
+   like MXCommand, or 1 to have MXCommand make its own connection. */
+int (*MXCommandHook)(char const *sockname, char const *cmd,
+		     char *buf, int len, char const *qid) = NULL;
+
+/* If set, the MX* functions try this before building a text command.
+   It sends a binary request with the given opcode and fields and
+   returns like MXCommandHook. */
+int (*MXFrameHook)(char const *sockname, int op, unsigned int lease,
+		   MXField const *fields, int nfields,
+		   char *buf, int len, char const *qid) = NULL;
+
+/**********************************************************************
+* %FUNCTION: frame_command
+* %ARGUMENTS:
+*  sockname -- multiplexor socket name
+*  op -- MXOP_* opcode
+*  lease -- lease to run the request under, or 0
+*  fields -- request fields
+*  nfields -- number of fields
+*  buf -- buffer for reply
+*  len -- length of buffer
+*  qid -- Sendmail queue identifier
+* %RETURNS:
+*  0 if the reply is in buf, MD_TEMPFAIL on error, or 1 if the caller
+*  should send a text command instead.
+***********************************************************************/
+static int
+frame_command(char const *sockname,
+	      int op,
+	      unsigned int lease,
+	      MXField const *fields,
+	      int nfields,
+	      char *buf,
+	      int len,
+	      char const *qid)
+{
+    if (!MXFrameHook) return 1;
+    if (!qid || !*qid) {
+	qid = "NOQUEUE";
+    }
+    return MXFrameHook(sockname, op, lease, fields, nfields, buf, len, qid);
+}
+
+/**********************************************************************
+* %FUNCTION: set_str, set_num
+* %ARGUMENTS:
+*  f -- field to set
+*  str, num -- value
+* %RETURNS:
+*  Nothing
+* %DESCRIPTION:
+*  Fill in a request field.  A null string is sent as an empty one.
+***********************************************************************/
+static void
+set_str(MXField *f, char const *str)
+{
+    f->str = str ? str : "";
+    f->num = 0;
+}
+
+static void
+set_num(MXField *f, unsigned int num)
+{
+    f->str = NULL;
+    f->num = num;
+}
+
+/**********************************************************************
+* %FUNCTION: decode_frame_fields
+* %ARGUMENTS:
+*  p -- start of the fields of a request frame
+*  end -- end of the frame
+*  f -- filled in with the fields; f->nfields must be set
+*  text -- at least MX_FRAME_TEXT bytes for the decoded fields
+* %RETURNS:
+*  0 if the fields are well-formed and fill the frame exactly; -1
+*  otherwise.
+* %DESCRIPTION:
+*  Copies string fields to text, NUL-terminated, and formats number
+*  fields there in decimal as well.  See mimedefang.h for the layout.
+***********************************************************************/
+int
+decode_frame_fields(unsigned char const *p, unsigned char const *end,
+		    MXFrameFields *f, char *text)
+{
+    char *out = text;
+    unsigned int flen;
+    int i;
+
+    if (f->nfields < 0 || f->nfields > MX_FRAME_FIELDS) return -1;
+    for (i=0; i<f->nfields; i++) {
+	if (p >= end) return -1;
+	switch(*p++) {
+	case 's':
+	    if (end - p < 2) return -1;
+	    flen = ((unsigned int) p[0] << 8) | p[1];
+	    p += 2;
+	    if ((unsigned int) (end - p) < flen) return -1;
+	    memcpy(out, p, flen);
+	    out[flen] = 0;
+	    f->str[i] = out;
+	    f->num[i] = 0;
+	    f->isnum[i] = 0;
+	    out += flen + 1;
+	    p += flen;
+	    break;
+	case 'u':
+	    if (end - p < 4) return -1;
+	    f->num[i] = ((unsigned int) p[0] << 24) |
+		((unsigned int) p[1] << 16) |
+		((unsigned int) p[2] << 8) | (unsigned int) p[3];
+	    f->str[i] = out;
+	    f->isnum[i] = 1;
+	    out += sprintf(out, "%u", f->num[i]) + 1;
+	    p += 4;
+	    break;
+	default:
+	    return -1;
+	}
+    }
+    return (p == end) ? 0 : -1;
+}
+
 /**********************************************************************
 * %FUNCTION: MXCommand
 * %ARGUMENTS:
@@ -265,6 +389,11 @@ MXCommand(char const *sockname,
 	qid = "NOQUEUE";
     }
 
+    if (MXCommandHook) {
+	n = MXCommandHook(sockname, cmd, buf, len, qid);
+	if (n <= 0) return n;
+    }
+
     fd = socket(AF_LOCAL, SOCK_STREAM, 0);
     if (fd < 0) {
 	syslog(LOG_ERR, "%s: MXCommand: socket: %m", qid);
@@ -324,17 +453,123 @@ MXCheckFreeWorkers(char const *sockname, char const *qid)
 {
     char ans[SMALLBUF];
     int workers;
+    int n;
 
-    if (MXCommand(sockname, "free\n", ans, SMALLBUF-1, qid) < 0) return MD_TEMPFAIL;
+    n = frame_command(sockname, MXOP_FREE, 0, NULL, 0, ans, SMALLBUF-1, qid);
+    if (n > 0) {
+	n = MXCommand(sockname, "free\n", ans, SMALLBUF-1, qid);
+    }
+    if (n < 0) return MD_TEMPFAIL;
 
     if (sscanf(ans, "%d", &workers) != 1) return MD_TEMPFAIL;
     return workers;
 }
 
+/**********************************************************************
+* %FUNCTION: MXLease
+* %ARGUMENTS:
+*  sockname -- MX socket name
+*  ttl -- seconds the lease lasts unless consumed or released
+*  required -- number of free workers which must remain unleased
+*  lease -- set to the lease ID, or 0 if no lease was granted
+*  qid -- Sendmail queue identifier
+* %RETURNS:
+*  The number of free workers not held by leases before the request,
+*  or -1 if there was an error.
+* %DESCRIPTION:
+*  Asks the multiplexor to hold back a free worker for us.  A scan
+*  issued under the lease consumes it; MXUnlease releases it early.
+***********************************************************************/
+int
+MXLease(char const *sockname,
+	int ttl,
+	int required,
+	unsigned int *lease,
+	char const *qid)
+{
+    char cmd[SMALLBUF];
+    char ans[SMALLBUF];
+    MXField f[2];
+    int avail;
+    int n;
+
+    *lease = 0;
+    set_num(&f[0], (unsigned int) ttl);
+    set_num(&f[1], (unsigned int) required);
+    n = frame_command(sockname, MXOP_LEASE, 0, f, 2, ans, SMALLBUF-1, qid);
+    if (n > 0) {
+	snprintf(cmd, sizeof(cmd), "lease %d %d\n", ttl, required);
+	n = MXCommand(sockname, cmd, ans, SMALLBUF-1, qid);
+    }
+    if (n < 0) return MD_TEMPFAIL;
+
+    if (sscanf(ans, "ok %u %d", lease, &avail) == 2) return avail;
+    *lease = 0;
+    if (sscanf(ans, "none %d", &avail) == 1) return avail;
+    return MD_TEMPFAIL;
+}
+
+/**********************************************************************
+* %FUNCTION: MXUnlease
+* %ARGUMENTS:
+*  sockname -- MX socket name
+*  lease -- lease ID from MXLease
+*  qid -- Sendmail queue identifier
+* %RETURNS:
+*  0 if all went well, -1 on error.
+* %DESCRIPTION:
+*  Releases a lease which was not consumed by a scan.
+***********************************************************************/
+int
+MXUnlease(char const *sockname,
+	  unsigned int lease,
+	  char const *qid)
+{
+    char cmd[SMALLBUF];
+    char ans[SMALLBUF];
+    int n;
+
+    n = frame_command(sockname, MXOP_UNLEASE, lease, NULL, 0, ans, SMALLBUF-1, qid);
+    if (n <= 0) return n;
+    snprintf(cmd, sizeof(cmd), "unlease %u\n", lease);
+    return MXCommand(sockname, cmd, ans, SMALLBUF-1, qid);
+}
+
+/**********************************************************************
+* %FUNCTION: lease_command
+* %ARGUMENTS:
+*  sockname -- MX socket name
+*  lease -- lease to run the command under, or 0
+*  cmd -- command to send
+*  buf -- buffer for reply
+*  len -- length of buffer
+*  qid -- Sendmail queue identifier
+* %RETURNS:
+*  As MXCommand
+* %DESCRIPTION:
+*  Sends cmd prefixed with "@lease " so the multiplexor runs it on the
+*  worker the lease holds back.
+***********************************************************************/
+static int
+lease_command(char const *sockname,
+	      unsigned int lease,
+	      char const *cmd,
+	      char *buf,
+	      int len,
+	      char const *qid)
+{
+    char leased[SMALLBUF + 16];
+
+    if (!lease) return MXCommand(sockname, cmd, buf, len, qid);
+    snprintf(leased, sizeof(leased), "@%u %s", lease, cmd);
+    return MXCommand(sockname, leased, buf, len, qid);
+}
+
 /**********************************************************************
 * %FUNCTION: MXScanDir
 * %ARGUMENTS:
 *  sockname -- MX socket name
+*  lease -- lease to consume, or 0
 *  qid -- Sendmail queue ID
 *  dir -- directory to scan
 * %RETURNS:
@@ -344,22 +579,30 @@ MXCheckFreeWorkers(char const *sockname, char const *qid)
 ***********************************************************************/
 int
 MXScanDir(char const *sockname,
+	  unsigned int lease,
 	  char const *qid,
 	  char const *dir)
 {
     char cmd[SMALLBUF];
     char ans[SMALLBUF];
+    MXField f[2];
     int len;
+    int n;
 
     if (!qid || !*qid) {
 	qid = "NOQUEUE";
     }
 
-    if (percent_encode_command(1, cmd, sizeof(cmd), "scan", qid, dir, NULL) < 0) {
-	return MD_TEMPFAIL;
+    set_str(&f[0], qid);
+    set_str(&f[1], dir);
+    n = frame_command(sockname, MXOP_SCAN, lease, f, 2, ans, SMALLBUF-1, qid);
+    if (n > 0) {
+	if (percent_encode_command(1, cmd, sizeof(cmd), "scan", qid, dir, NULL) < 0) {
+	    return MD_TEMPFAIL;
+	}
+	n = lease_command(sockname, lease, cmd, ans, SMALLBUF-1, qid);
     }
-
-    if (MXCommand(sockname, cmd, ans, SMALLBUF-1, qid) < 0) return MD_TEMPFAIL;
+    if (n < 0) return MD_TEMPFAIL;
 
     if (!strcmp(ans, "ok\n")) return 0;
 
@@ -568,6 +811,7 @@ munch_mx_return(char *ans, char *msg, char const *qid)
 * %FUNCTION: MXRelayOK
 * %ARGUMENTS:
 *  sockname -- multiplexor socket name
+*  lease -- lease to run the command under, or 0
 *  msg -- buffer for holding error message, at least SMALLBUF chars
 *  ip -- relay IP address
 *  name -- relay name
@@ -581,6 +825,7 @@ munch_mx_return(char *ans, char *msg, char const *qid)
 ***********************************************************************/
 int
 MXRelayOK(char const *sockname,
+	  unsigned int lease,
 	  char *msg,
 	  char const *ip,
 	  char const *name,
@@ -594,6 +839,8 @@ MXRelayOK(char const *sockname,
 
     char port_string[65];
     char daemon_port_string[65];
+    MXField f[7];
+    int n;
 
     snprintf(port_string, sizeof(port_string), "%u", port);
     snprintf(daemon_port_string, sizeof(daemon_port_string), "%u", daemon_port);
@@ -613,10 +860,21 @@ MXRelayOK(char const *sockname,
     if (!qid || !*qid) {
         qid = "NOQUEUE";
     }
-    if (percent_encode_command(1, cmd, sizeof(cmd), "relayok", ip, name, port_string, myip, daemon_port_string, qid, NULL) < 0) {
-	return MD_TEMPFAIL;
+
+    set_str(&f[0], ip);
+    set_str(&f[1], name);
+    set_num(&f[2], port);
+    set_str(&f[3], myip);
+    set_num(&f[4], daemon_port);
+    set_str(&f[5], qid);
+    n = frame_command(sockname, MXOP_RELAYOK, lease, f, 6, ans, SMALLBUF-1, NULL);
+    if (n > 0) {
+	if (percent_encode_command(1, cmd, sizeof(cmd), "relayok", ip, name, port_string, myip, daemon_port_string, qid, NULL) < 0) {
+	    return MD_TEMPFAIL;
+	}
+	n = lease_command(sockname, lease, cmd, ans, SMALLBUF-1, NULL);
     }
-    if (MXCommand(sockname, cmd, ans, SMALLBUF-1, NULL) < 0) return MD_TEMPFAIL;
+    if (n < 0) return MD_TEMPFAIL;
     return munch_mx_return(ans, msg, NULL);
 }
 
@@ -624,6 +882,7 @@ MXRelayOK(char const *sockname,
 * %FUNCTION: MXHeloOK
 * %ARGUMENTS:
 *  sockname -- multiplexor socket name
+*  lease -- lease to run the command under, or 0
 *  msg -- buffer for holding error message, at least SMALLBUF chars
 *  ip -- IP address of client
 *  name -- resolved name of client
@@ -638,6 +897,7 @@ MXRelayOK(char const *sockname,
 ***********************************************************************/
 int
 MXHeloOK(char const *sockname,
+	 unsigned int lease,
 	 char *msg,
 	 char const *ip,
 	 char const *name,
@@ -652,6 +912,8 @@ MXHeloOK(char const *sockname,
 
     char port_string[65];
     char daemon_port_string[65];
+    MXField f[7];
+    int n;
 
     snprintf(port_string, sizeof(port_string), "%u", port);
     snprintf(daemon_port_string, sizeof(daemon_port_string), "%u", daemon_port);
@@ -676,10 +938,21 @@ MXHeloOK(char const *sockname,
         qid = "NOQUEUE";
     }
 
-    if (percent_encode_command(1, cmd, sizeof(cmd), "helook", ip, name, helo, port_string, myip, daemon_port_string, qid, NULL) < 0) {
-	return MD_TEMPFAIL;
+    set_str(&f[0], ip);
+    set_str(&f[1], name);
+    set_str(&f[2], helo);
+    set_num(&f[3], port);
+    set_str(&f[4], myip);
+    set_num(&f[5], daemon_port);
+    set_str(&f[6], qid);
+    n = frame_command(sockname, MXOP_HELOOK, lease, f, 7, ans, SMALLBUF-1, NULL);
+    if (n > 0) {
+	if (percent_encode_command(1, cmd, sizeof(cmd), "helook", ip, name, helo, port_string, myip, daemon_port_string, qid, NULL) < 0) {
+	    return MD_TEMPFAIL;
+	}
+	n = lease_command(sockname, lease, cmd, ans, SMALLBUF-1, NULL);
     }
-    if (MXCommand(sockname, cmd, ans, SMALLBUF-1, NULL) < 0) return MD_TEMPFAIL;
+    if (n < 0) return MD_TEMPFAIL;
     return munch_mx_return(ans, msg, NULL);
 }
 
@@ -688,6 +961,7 @@ MXHeloOK(char const *sockname,
 * %FUNCTION: MXSenderOK
 * %ARGUMENTS:
 *  sockname -- socket name
+*  lease -- lease to run the command under, or 0
 *  msg -- buffer of at least SMALLBUF size for error message
 *  sender_argv -- args from sendmail.  sender_argv[0] is sender; rest are
 *                 ESMTP args.
@@ -703,6 +977,7 @@ MXHeloOK(char const *sockname,
 ***********************************************************************/
 int
 MXSenderOK(char const *sockname,
+	   unsigned int lease,
 	   char *msg,
 	   char const **sender_argv,
 	   char const *ip,
@@ -713,7 +988,9 @@ MXSenderOK(char const *sockname,
 {
     char cmd[SMALLBUF];
     char ans[SMALLBUF];
+    MXField f[MX_FRAME_FIELDS];
     size_t l, l2, i;
+    int nf, n;
 
     char const *sender = sender_argv[0];
 
@@ -733,6 +1010,19 @@ MXSenderOK(char const *sockname,
 	helo = "UNKNOWN";
     }
 
+    set_str(&f[0], sender);
+    set_str(&f[1], ip);
+    set_str(&f[2], name);
+    set_str(&f[3], helo);
+    set_str(&f[4], dir);
+    set_str(&f[5], qid);
+    for (i=1, nf=6; sender_argv[i] && nf < MX_FRAME_FIELDS; i++, nf++) {
+	set_str(&f[nf], sender_argv[i]);
+    }
+    n = frame_command(sockname, MXOP_SENDEROK, lease, f, nf, ans, SMALLBUF-1, qid);
+    if (n == 0) return munch_mx_return(ans, msg, qid);
+    if (n < 0) return MD_TEMPFAIL;
+
     if (percent_encode_command(0, cmd, sizeof(cmd)-1, "senderok", sender, ip,
 			       name,
 			       helo, dir, qid, NULL) < 0) {
@@ -758,7 +1048,7 @@ MXSenderOK(char const *sockname,
     /* Add newline */
     strcat(cmd, "\n");
 
-    if (MXCommand(sockname, cmd, ans, SMALLBUF-1, qid) < 0) return MD_TEMPFAIL;
+    if (lease_command(sockname, lease, cmd, ans, SMALLBUF-1, qid) < 0) return MD_TEMPFAIL;
     return munch_mx_return(ans, msg, qid);
 }
 
@@ -766,6 +1056,7 @@ MXSenderOK(char const *sockname,
 * %FUNCTION: MXRecipientOK
 * %ARGUMENTS:
 *  sockname -- multiplexor socket name
+*  lease -- lease to run the command under, or 0
 *  msg -- buffer of at least SMALLBUF size for error messages
 *  recip_argv -- recipient e-mail address and ESMTP args
 *  sender -- sender's e-mail address
@@ -784,6 +1075,7 @@ MXSenderOK(char const *sockname,
 ***********************************************************************/
 int
 MXRecipientOK(char const *sockname,
+	      unsigned int lease,
 	      char *msg,
 	      char const **recip_argv,
 	      char const *sender,
@@ -800,7 +1092,9 @@ MXRecipientOK(char const *sockname,
 {
     char cmd[SMALLBUF];
     char ans[SMALLBUF];
+    MXField f[MX_FRAME_FIELDS];
     size_t i, l, l2;
+    int nf, n;
     char const *recipient = recip_argv[0];
 
     *msg = 0;
@@ -827,6 +1121,24 @@ MXRecipientOK(char const *sockname,
 	helo = "UNKNOWN";
     }
 
+    set_str(&f[0], recipient);
+    set_str(&f[1], sender);
+    set_str(&f[2], ip);
+    set_str(&f[3], name);
+    set_str(&f[4], firstRecip);
+    set_str(&f[5], helo);
+    set_str(&f[6], dir);
+    set_str(&f[7], qid);
+    set_str(&f[8], rcpt_mailer);
+    set_str(&f[9], rcpt_host);
+    set_str(&f[10], rcpt_addr);
+    for (i=1, nf=11; recip_argv[i] && nf < MX_FRAME_FIELDS; i++, nf++) {
+	set_str(&f[nf], recip_argv[i]);
+    }
+    n = frame_command(sockname, MXOP_RECIPOK, lease, f, nf, ans, SMALLBUF-1, qid);
+    if (n == 0) return munch_mx_return(ans, msg, qid);
+    if (n < 0) return MD_TEMPFAIL;
+
     if (percent_encode_command(0, cmd, sizeof(cmd),
 			       "recipok", recipient, sender, ip, name, firstRecip,
 			       helo, dir, qid, rcpt_mailer, rcpt_host, rcpt_addr,
@@ -853,7 +1165,7 @@ MXRecipientOK(char const *sockname,
     /* Add newline */
     strcat(cmd, "\n");
 
-    if (MXCommand(sockname, cmd, ans, SMALLBUF-1, qid) < 0) return MD_TEMPFAIL;
+    if (lease_command(sockname, lease, cmd, ans, SMALLBUF-1, qid) < 0) return MD_TEMPFAIL;
     return munch_mx_return(ans, msg, qid);
 }
 